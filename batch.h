@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "bitmap.h"
+#include "expr.h"
+#include "file.h"
+
+namespace qmellow {
+
+/* Evaluates an expression over a batch of files at once, finding only
+   which files match, not why.  Rather than walking the tree once per file,
+   we walk it once per batch: each leaf is matched against every file it
+   must decide, giving a column of bits, and the ands, ors, and nots combine
+   whole columns a word at a time.
+
+   Each operand is only evaluated on the files which could still change
+   the outcome: an and's second operand on the files its first one matched,
+   an or's on those its first one didn't.  A leaf's column remembers which
+   files it has already been matched against, so a leaf which appears more
+   than once, or in another query run on the same batch, is matched at most
+   once per file.  Columns are keyed by the leaf's description, so they can
+   be kept and handed to later batches of the same files. */
+class batch_t final {
+  public:
+
+  /* What we know of a leaf across the batch. */
+  struct column_t {
+
+    /* Know nothing about a batch of the given size. */
+    explicit column_t(std::size_t size = 0)
+        : known(size), matched(size) {}
+
+    /* The files we've matched the leaf against. */
+    bitmap_t known;
+
+    /* Those of the known files which the leaf matched. */
+    bitmap_t matched;
+
+  };  // batch_t::column_t
+
+  /* Columns, by the description of their leaves. */
+  using columns_t = std::map<std::string, column_t>;
+
+  /* Returns the file at the given position in the batch.  It's only called
+     for files a leaf must be matched against, so files can be loaded
+     lazily.  The file must stay put until the batch is done with. */
+  using get_file_t = std::function<const file_t &(std::size_t)>;
+
+  /* A batch of the given number of files, starting with the given columns.
+     Columns of the wrong size are ignored. */
+  batch_t(
+      std::size_t size, get_file_t get_file,
+      columns_t &&columns = columns_t())
+      : size(size), get_file(std::move(get_file)),
+        columns(std::move(columns)) {}
+
+  /* The number of files in the batch. */
+  std::size_t get_size() const noexcept {
+    return size;
+  }
+
+  /* Which of the given candidate files the expression matches. */
+  bitmap_t eval(const expr_t *expr, const bitmap_t &candidates) {
+    return walker_t(*this).eval(expr, candidates);
+  }
+
+  /* Which of the files the expression matches. */
+  bitmap_t eval(const expr_t *expr) {
+    return eval(expr, bitmap_t::make_full(size));
+  }
+
+  /* Give up our columns, so they can be kept for a later batch of the same
+     files. */
+  columns_t release_columns() {
+    return std::move(columns);
+  }
+
+  private:
+
+  /* Walks the tree, combining columns. */
+  class walker_t final
+      : public qmellow::visitor_t {
+    public:
+
+    /* Evaluate within the given batch. */
+    explicit walker_t(batch_t &batch)
+        : batch(batch), candidates(nullptr) {}
+
+    /* Which of the given candidates the expression matches. */
+    bitmap_t eval(const expr_t *expr, const bitmap_t &candidates) {
+      if (candidates.is_empty()) {
+        return bitmap_t(batch.size);
+      }
+      auto *were_candidates = this->candidates;
+      this->candidates = &candidates;
+      expr->accept(*this);
+      this->candidates = were_candidates;
+      return std::move(result);
+    }
+
+    /* Match the leaf against the candidates it hasn't seen yet. */
+    virtual void visit(const leaf_t *leaf) override {
+      result = batch.eval_leaf(leaf, *candidates);
+    }
+
+    /* The candidates the operand doesn't match. */
+    virtual void visit(const not_t *expr) override {
+      auto matched = eval(expr->get_subexpr(), *candidates);
+      result = *candidates;
+      result.subtract(matched);
+    }
+
+    /* Groups are only syntax. */
+    virtual void visit(const group_t *expr) override {
+      result = eval(expr->get_subexpr(), *candidates);
+    }
+
+    /* The second operand need only decide the files the first matched. */
+    virtual void visit(const and_t *expr) override {
+      auto plan = expr->get_plan();
+      auto first = eval(expr->get_first_subexpr(plan), *candidates);
+      result = eval(expr->get_second_subexpr(plan), first);
+    }
+
+    /* The second operand need only decide the files the first didn't
+       match. */
+    virtual void visit(const or_t *expr) override {
+      auto plan = expr->get_plan();
+      auto first = eval(expr->get_first_subexpr(plan), *candidates);
+      auto rest = *candidates;
+      rest.subtract(first);
+      first |= eval(expr->get_second_subexpr(plan), rest);
+      result = std::move(first);
+    }
+
+    private:
+
+    /* See constructor. */
+    batch_t &batch;
+
+    /* The files the node we're visiting must decide. */
+    const bitmap_t *candidates;
+
+    /* Which of the candidates the node we most recently visited
+       matched. */
+    bitmap_t result;
+
+  };  // batch_t::walker_t
+
+  /* Which of the given candidates the leaf matches, matching it against
+     those it hasn't been already. */
+  bitmap_t eval_leaf(const leaf_t *leaf, const bitmap_t &candidates) {
+    auto &column = columns[leaf->get_canon()->get_desc()];
+    if (column.known.get_size() != size) {
+      column = column_t(size);
+    }
+    auto todo = candidates;
+    todo.subtract(column.known);
+    todo.for_each([&](std::size_t i) {
+      if (leaf->is_match(get_file(i))) {
+        column.matched.set(i);
+      }
+    });
+    column.known |= todo;
+    auto result = column.matched;
+    result &= candidates;
+    return std::move(result);
+  }
+
+  /* See accessor. */
+  std::size_t size;
+
+  /* See constructor. */
+  get_file_t get_file;
+
+  /* Our columns. */
+  columns_t columns;
+
+};  // batch_t
+
+
+/* The leaf columns computed by queries over batches of an index's files
+   (see batch_t), by batch, so later queries needn't compute them again.
+   Columns only hold for the generation of the index they were computed
+   from; when the index moves on, or we're full, we start over. */
+class leaf_tables_t final {
+  public:
+
+  /* Hold at most the given number of columns. */
+  explicit leaf_tables_t(std::size_t capacity)
+      : capacity(capacity ? capacity : 1), generation(0), column_count(0) {}
+
+  /* Take out the columns of the given batch, if we have any of the given
+     generation.  While they're out, other queries of the same batch start
+     without them.  A query of an older generation than ours starts
+     without any, since ours were built over different files. */
+  batch_t::columns_t take(std::size_t generation, std::size_t batch_index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    start_generation(generation);
+    if (generation != this->generation) {
+      return batch_t::columns_t();
+    }
+    auto iter = tables.find(batch_index);
+    if (iter == tables.end()) {
+      return batch_t::columns_t();
+    }
+    auto columns = std::move(iter->second);
+    tables.erase(iter);
+    column_count -= columns.size();
+    return columns;
+  }
+
+  /* Put back the columns of the given batch. */
+  void put(
+      std::size_t generation, std::size_t batch_index,
+      batch_t::columns_t &&columns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    start_generation(generation);
+    if (generation != this->generation) {
+      return;
+    }
+    if (column_count + columns.size() > capacity) {
+      tables.clear();
+      column_count = 0;
+    }
+    auto &table = tables[batch_index];
+    column_count += columns.size() - table.size();
+    table = std::move(columns);
+  }
+
+  private:
+
+  /* If the given generation is newer than ours, forget what we have and
+     take it up.  The caller holds the lock. */
+  void start_generation(std::size_t generation) {
+    if (generation > this->generation) {
+      tables.clear();
+      column_count = 0;
+      this->generation = generation;
+    }
+  }
+
+  /* See constructor. */
+  std::size_t capacity;
+
+  /* Covers the members below. */
+  std::mutex mutex_;
+
+  /* The generation of the index our columns hold for. */
+  std::size_t generation;
+
+  /* The number of columns in tables. */
+  std::size_t column_count;
+
+  /* The columns we hold, by batch. */
+  std::map<std::size_t, batch_t::columns_t> tables;
+
+};  // leaf_tables_t
+
+}  // qmellow
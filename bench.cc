@@ -0,0 +1,285 @@
+/* Microbenchmarks for the hot paths: lexing, parsing, merging results,
+   matching each kind of leaf against a file, and evaluating a query
+   translated each time, interpreted, and written with the template front
+   end (see dsl.h).  Each benchmark writes one line of JSON to stdout, so
+   runs can be compared by machine.  Give a substring as the only argument
+   to run only the benchmarks whose names contain it. */
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "dsl.h"
+#include "expr.h"
+#include "file.h"
+#include "lexer.h"
+#include "parser.h"
+#include "result.h"
+#include "synth.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* The least time we spend on each benchmark. */
+const chrono::milliseconds min_time(200);
+
+/* Results are folded into this so the optimizer can't drop the work. */
+volatile size_t sink;
+
+/* Run the given function until min_time has passed and write a JSON line
+   reporting the time per run.  If bytes isn't zero, we also report
+   throughput, taking each run to have processed that many bytes. */
+template <typename fn_t>
+void run(
+    const char *filter, const string &name, const string &param,
+    size_t bytes, const fn_t &fn) {
+  if (filter && name.find(filter) == string::npos) {
+    return;
+  }
+  using clock = chrono::steady_clock;
+  size_t iters = 0;
+  auto start = clock::now();
+  clock::duration elapsed;
+  do {
+    sink = sink + fn();
+    ++iters;
+    elapsed = clock::now() - start;
+  } while (elapsed < min_time);
+  double ns = chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+  double ns_per_op = ns / iters;
+  cout
+      << "{\"bench\":\"" << name << "\",\"param\":\"" << param
+      << "\",\"iters\":" << iters << ",\"ns_per_op\":" << ns_per_op;
+  if (bytes) {
+    cout << ",\"mb_per_sec\":" << (bytes / ns_per_op) * 1e9 / 1e6;
+  }
+  cout << "}\n";
+}
+
+/* A cause for the matches we make up when benchmarking results. */
+class bench_cause_t final
+    : public match_t::cause_t {
+  public:
+
+  /* Describe ourselves by the given name. */
+  explicit bench_cause_t(const char *desc)
+      : desc(desc) {}
+
+  /* The name we were given. */
+  virtual const string &get_desc() const override {
+    return desc;
+  }
+
+  private:
+
+  /* See accessor. */
+  string desc;
+
+};  // bench_cause_t
+
+/* A source whose every line reads the same. */
+class bench_source_t final
+    : public match_t::source_t {
+  public:
+
+  /* The same text, whatever the line. */
+  virtual string get_line_text(int) const override {
+    return "<div class=\"x\">text</div>";
+  }
+
+};  // bench_source_t
+
+/* A successful result with the given number of matches.  The first
+   overlap * size of them are on the same lines as those of any other result
+   made this way; the rest are offset by the given base. */
+result_t make_result(
+    const bench_cause_t *cause, size_t size, double overlap, int base) {
+  result_t result;
+  auto shared = static_cast<size_t>(size * overlap);
+  for (size_t i = 0; i < size; ++i) {
+    int line_number = static_cast<int>(i < shared ? i : base + i);
+    result.add(match_t(cause, line_number, "<div class=\"x\">text</div>"));
+  }
+  return result;
+}
+
+/* As make_result(), but keeping the matches as compressed line numbers,
+   if there are enough of them. */
+result_t make_line_result(
+    const bench_cause_t *cause, const bench_source_t *source, size_t size,
+    double overlap, int base) {
+  result_t result;
+  auto shared = static_cast<size_t>(size * overlap);
+  for (size_t i = 0; i < size; ++i) {
+    int line_number = static_cast<int>(i < shared ? i : base + i);
+    result.add_line(cause, string(), source, line_number + 1);
+  }
+  result.choose_representation();
+  return result;
+}
+
+/* The number of matches of the given result, expanded, as a caller
+   reading its matches would. */
+size_t count_matches(result_t &&result) {
+  result.expand();
+  return result.get_matches().size();
+}
+
+/* A pack of rules of about 8 leaves each, one per line, totalling the
+   given number of leaves. */
+string make_rule_pack(size_t leaf_count) {
+  synth_t synth(leaf_count);
+  string pack;
+  for (size_t n = 0; n < leaf_count; n += 8) {
+    pack += synth.make_rule(8, 100);
+    pack += '\n';
+  }
+  return pack;
+}
+
+/* Split a rule pack into its rules. */
+vector<string> split_lines(const string &text) {
+  vector<string> lines;
+  size_t start = 0, end;
+  while ((end = text.find('\n', start)) != string::npos) {
+    lines.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  return lines;
+}
+
+/* Benchmark the lexer and parser on rule packs of growing size. */
+void bench_translate(const char *filter) {
+  for (size_t leaf_count: { 8, 64, 512, 4096 }) {
+    auto rules = split_lines(make_rule_pack(leaf_count));
+    size_t bytes = 0;
+    for (const auto &rule: rules) {
+      bytes += rule.size();
+    }
+    auto param = to_string(leaf_count) + " leaves";
+    run(filter, "lex", param, bytes, [&rules]() {
+      size_t n = 0;
+      for (const auto &rule: rules) {
+        n += lexer_t::lex(rule).size();
+      }
+      return n;
+    });
+    vector<vector<token_t>> token_lists;
+    for (const auto &rule: rules) {
+      token_lists.push_back(lexer_t::lex(rule));
+    }
+    run(filter, "parse", param, bytes, [&token_lists]() {
+      size_t n = 0;
+      for (const auto &tokens: token_lists) {
+        n += parser_t::parse(tokens.data()) ? 1 : 0;
+      }
+      return n;
+    });
+  }
+}
+
+/* Benchmark the result operators on match sets of varying size and
+   overlap, kept both as match_t objects and as compressed line numbers.
+   The result_lines benchmarks don't expand their results, as evaluation
+   mostly doesn't. */
+void bench_result(const char *filter) {
+  bench_cause_t cause("bench");
+  bench_source_t source;
+  for (size_t size: { 10, 1000, 100000 }) {
+    for (double overlap: { 0.0, 0.5, 1.0 }) {
+      auto lhs = make_result(&cause, size, overlap, 0);
+      auto rhs = make_result(&cause, size, overlap, size);
+      auto param = to_string(size) + " matches, "
+          + to_string(static_cast<int>(overlap * 100)) + "% overlap";
+      run(filter, "result_and", param, 0, [&lhs, &rhs]() {
+        return (lhs && rhs).get_matches().size();
+      });
+      run(filter, "result_or", param, 0, [&lhs, &rhs]() {
+        return (lhs || rhs).get_matches().size();
+      });
+      auto lhs_lines = make_line_result(&cause, &source, size, overlap, 0);
+      auto rhs_lines = make_line_result(
+          &cause, &source, size, overlap, size);
+      run(filter, "result_lines_and", param, 0, [&lhs_lines, &rhs_lines]() {
+        return (lhs_lines && rhs_lines).is_match();
+      });
+      run(filter, "result_lines_or", param, 0, [&lhs_lines, &rhs_lines]() {
+        return (lhs_lines || rhs_lines).is_match();
+      });
+    }
+    auto lhs = make_result(&cause, size, 0, 0);
+    run(filter, "result_not", to_string(size) + " matches", 0, [&lhs]() {
+      return (!lhs).get_matches().size();
+    });
+  }
+}
+
+/* Benchmark scanning synthetic HTML and each kind of leaf against it. */
+void bench_file(const char *filter) {
+  for (size_t line_count: { 100, 10000 }) {
+    synth_t synth(line_count);
+    synth_t::html_params_t params;
+    params.line_count = line_count;
+    auto html = synth.make_html(params);
+    auto param = to_string(line_count) + " lines";
+    run(filter, "file_scan", param, html.size(), [&html]() {
+      file_t file{ string(html) };
+      return file.get_text().size();
+    });
+    file_t file{ string(html) };
+    static const char *const queries[][2] = {
+      { "match_anchor", "/pages/p7.html" },
+      { "match_case_insensitive_string", "'word7'" },
+      { "match_case_sensitive_string", "\"Word7\"" },
+      { "match_class_names", ".c7" },
+      { "match_css", "/static/s7.css" },
+      { "match_css_id", "#d7" },
+      { "match_image", "/static/s7.png" },
+      { "match_js", "/static/s7.js" },
+      { "match_regex", "`[Ww]ord7[0-9]`" },
+      { "match_regex_prefix", "`word7[0-9]+ [Ww]`" }
+    };
+    for (const auto &query: queries) {
+      auto expr = parser_t::parse(lexer_t::lex(query[1]).data());
+      run(filter, query[0], param, html.size(), [&expr, &file]() {
+        return count_matches(expr->eval(file));
+      });
+    }
+    static const char *compound =
+        "(\"word7\" or 'word8') and not .c7 and /static/s7.css";
+    run(filter, "eval_translated", param, html.size(), [&file]() {
+      auto expr = parser_t::parse(lexer_t::lex(compound).data());
+      return count_matches(expr->eval(file));
+    });
+    auto expr = parser_t::parse(lexer_t::lex(compound).data());
+    run(filter, "eval_interpreted", param, html.size(), [&expr, &file]() {
+      return count_matches(expr->eval(file));
+    });
+    auto query = dsl::make_query(
+        (dsl::text("word7") || dsl::itext("word8")) && !dsl::classes({ "c7" })
+        && dsl::css("/static/s7.css"));
+    run(filter, "eval_dsl", param, html.size(), [&query, &file]() {
+      return count_matches(query.eval(file));
+    });
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const char *filter = (argc > 1) ? argv[1] : nullptr;
+  try {
+    bench_translate(filter);
+    bench_result(filter);
+    bench_file(filter);
+  } catch (const exception &ex) {
+    cerr << "error: " << ex.what() << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace qmellow {
+
+/* A set of small integers, such as the positions of files within a batch,
+   kept as one bit apiece.  The set operations work a 64-bit word at a
+   time, in plain loops the compiler can vectorize.  Bits at or beyond the
+   size are always clear. */
+class bitmap_t final {
+  public:
+
+  /* An empty set of the given size. */
+  explicit bitmap_t(std::size_t size = 0)
+      : size(size), words((size + 63) / 64, 0) {}
+
+  /* A set of the given size holding everything. */
+  static bitmap_t make_full(std::size_t size) {
+    bitmap_t bitmap(size);
+    bitmap.flip();
+    return bitmap;
+  }
+
+  /* The number of members we may hold. */
+  std::size_t get_size() const noexcept {
+    return size;
+  }
+
+  /* True iff. the given position is a member. */
+  bool test(std::size_t i) const noexcept {
+    return (words[i / 64] >> (i % 64)) & 1;
+  }
+
+  /* Make the given position a member. */
+  void set(std::size_t i) noexcept {
+    words[i / 64] |= std::uint64_t(1) << (i % 64);
+  }
+
+  /* The number of members. */
+  std::size_t count() const noexcept {
+    std::size_t result = 0;
+    for (auto word: words) {
+      result += __builtin_popcountll(word);
+    }
+    return result;
+  }
+
+  /* True iff. we have no members. */
+  bool is_empty() const noexcept {
+    std::uint64_t any = 0;
+    for (auto word: words) {
+      any |= word;
+    }
+    return !any;
+  }
+
+  /* Keep only the members we share with that set, which must be the same
+     size. */
+  bitmap_t &operator&=(const bitmap_t &that) noexcept {
+    auto *lhs = words.data();
+    const auto *rhs = that.words.data();
+    for (std::size_t i = 0, n = words.size(); i < n; ++i) {
+      lhs[i] &= rhs[i];
+    }
+    return *this;
+  }
+
+  /* Add the members of that set, which must be the same size. */
+  bitmap_t &operator|=(const bitmap_t &that) noexcept {
+    auto *lhs = words.data();
+    const auto *rhs = that.words.data();
+    for (std::size_t i = 0, n = words.size(); i < n; ++i) {
+      lhs[i] |= rhs[i];
+    }
+    return *this;
+  }
+
+  /* Drop the members of that set, which must be the same size. */
+  bitmap_t &subtract(const bitmap_t &that) noexcept {
+    auto *lhs = words.data();
+    const auto *rhs = that.words.data();
+    for (std::size_t i = 0, n = words.size(); i < n; ++i) {
+      lhs[i] &= ~rhs[i];
+    }
+    return *this;
+  }
+
+  /* Swap members for non-members. */
+  bitmap_t &flip() noexcept {
+    for (auto &word: words) {
+      word = ~word;
+    }
+    if (size % 64) {
+      words.back() &= (std::uint64_t(1) << (size % 64)) - 1;
+    }
+    return *this;
+  }
+
+  /* Call fn(i) for each member, in order. */
+  template <typename fn_t>
+  void for_each(const fn_t &fn) const {
+    for (std::size_t w = 0; w < words.size(); ++w) {
+      for (auto word = words[w]; word; word &= word - 1) {
+        fn(w * 64 + __builtin_ctzll(word));
+      }
+    }
+  }
+
+  private:
+
+  /* See accessor. */
+  std::size_t size;
+
+  /* Our bits, 64 to a word, lowest first. */
+  std::vector<std::uint64_t> words;
+
+};  // bitmap_t
+
+}  // qmellow
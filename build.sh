@@ -1,3 +1,17 @@
 #!/bin/sh
 
 g++ -std=c++11 -c translate.cc
+g++ -std=c++11 -O2 -o bench bench.cc
+g++ -std=c++11 -O2 -o gencorpus gencorpus.cc
+g++ -std=c++11 -O2 -pthread -rdynamic -o sweepbench sweepbench.cc -lz -ldl
+g++ -std=c++11 -O2 -pthread -rdynamic -DQMELLOW_METRICS -DQMELLOW_TRACE \
+    -o sweepbench-instrumented sweepbench.cc -lz -ldl
+g++ -std=c++11 -O2 -pthread -o qmellowd qmellowd.cc -lz
+g++ -std=c++11 -O2 -o qmellowq qmellowq.cc
+g++ -std=c++11 -O2 -pthread -o qmellowwatch qmellowwatch.cc -lz
+g++ -std=c++11 -O2 -pthread -o qmellowsweep qmellowsweep.cc -lz
+g++ -std=c++11 -O2 -rdynamic -o qmellowgen qmellowgen.cc -ldl
+g++ -std=c++11 -O2 -pthread -rdynamic -o tests tests.cc -lz -ldl
+if echo '#include <zstd.h>' | g++ -E -x c++ - > /dev/null 2>&1; then
+  g++ -std=c++11 -fsyntax-only -DQMELLOW_ZSTD sweepbench.cc
+fi
@@ -0,0 +1,362 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "context.h"
+#include "expr.h"
+#include "pack.h"
+#include "selector.h"
+
+namespace qmellow {
+
+/* Generates the C++ source of evaluators for the rules of a pack, to be
+   built into a shared object and loaded with native_pack_t.  Each rule
+   gets a function of its own, in which:
+
+     - leaves which match literals are inlined as calls to the file's match
+       functions, with their symbols interned once, when the module loads,
+       and their strings searched for with find_literal(), specialized to
+       the literal's size and to its rarest byte;
+
+     - leaves we can't inline, such as regular expressions and containment,
+       are evaluated through the rule's own leaves;
+
+     - the ands, ors, and nots are flattened into a sequence of statements,
+       in the order and with the short-circuiting the expression has been
+       planned with, with no tree to walk and no virtual calls.
+
+   Leaves which occur more than once are memoized in the context, as the
+   interpreter does, so an evaluator gives what the expression would, match
+   for match. */
+class codegen_t final
+    : public visitor_t {
+  public:
+
+  /* Write to the given stream the source of a module of evaluators for the
+     given pack (see native_module_t). */
+  static void generate(std::ostream &strm, const pack_t &pack) {
+    codegen_t codegen;
+    const auto &rules = pack.get_rules();
+    for (std::size_t i = 0; i < rules.size(); ++i) {
+      codegen.add_rule(i, rules[i].get_expr());
+    }
+    strm
+        << "/* Evaluators generated by qmellowgen.  Don't edit; generate\n"
+        << "   them again.  Build with:\n\n"
+        << "     g++ -std=c++11 -O2 -fPIC -shared -I<qmellow> "
+        << "-o rules.so rules.cc\n\n"
+        << "   and load with native_pack_t. */\n\n"
+        << "#include <string>\n"
+        << "#include <vector>\n"
+        << "#include \"native.h\"\n\n"
+        << "using namespace qmellow;\n\n"
+        << "namespace {\n\n"
+        << codegen.globals.str()
+        << codegen.functions.str()
+        << "const char *const rule_texts[] = {\n";
+    for (const auto &rule: rules) {
+      strm << "  " << get_literal(rule.get_text()) << ",\n";
+    }
+    strm
+        << "  nullptr\n"
+        << "};\n\n"
+        << "const native_module_t::eval_t evals[] = {\n";
+    for (std::size_t i = 0; i < rules.size(); ++i) {
+      strm << "  eval_rule_" << i << ",\n";
+    }
+    strm
+        << "  nullptr\n"
+        << "};\n\n"
+        << "}  // namespace\n\n"
+        << "extern \"C\" const native_module_t qmellow_native_module = {\n"
+        << "  native_module_t::get_abi_stamp(), " << rules.size()
+        << ", rule_texts, evals,\n"
+        << "  &symbol_table_t::get\n"
+        << "};\n";
+  }
+
+  /* Write a statement evaluating the leaf into a value of its own. */
+  virtual void visit(const leaf_t *leaf) override {
+    auto id = leaf->get_id();
+    if (id == context_t::get_no_id()) {
+      throw std::runtime_error("a leaf was never canonicalized");
+    }
+    std::string match;
+    selector_t selector;
+    if (leaf->get_selector(selector)) {
+      match = get_match(selector, id);
+    }
+    value = make_value();
+    is_owned = match.empty() || !leaf->is_shared();
+    if (match.empty()) {
+      begin_line()
+          << "auto " << value << " = leaves[" << id
+          << "]->eval(file, context);\n";
+      return;
+    }
+    if (is_owned) {
+      begin_line() << "auto " << value << " = " << match << ";\n";
+      return;
+    }
+    begin_line()
+        << "const result_t &" << value << " = context.memoize(" << id
+        << ", [&]() {\n";
+    ++depth;
+    begin_line() << "return " << match << ";\n";
+    --depth;
+    begin_line() << "});\n";
+  }
+
+  /* Write the operand, then its negation. */
+  virtual void visit(const not_t *expr) override {
+    expr->get_subexpr()->accept(*this);
+    auto operand = value;
+    value = make_value();
+    is_owned = true;
+    begin_line() << "auto " << value << " = !" << operand << ";\n";
+  }
+
+  /* A group is transparent. */
+  virtual void visit(const group_t *expr) override {
+    expr->get_subexpr()->accept(*this);
+  }
+
+  /* Write a logical-and, short-circuiting on a non-match. */
+  virtual void visit(const and_t *expr) override {
+    write_infix(expr, "!", " && ");
+  }
+
+  /* Write a logical-or, short-circuiting on a match. */
+  virtual void visit(const or_t *expr) override {
+    write_infix(expr, "", " || ");
+  }
+
+  private:
+
+  /* Start with nothing generated. */
+  codegen_t()
+      : value_count(0), literal_count(0), is_owned(false), depth(0) {}
+
+  /* Write the evaluator of the given rule, which is the given one of its
+     pack. */
+  void add_rule(std::size_t rule_index, const expr_t *expr) {
+    body.str(std::string());
+    value_count = 0;
+    depth = 1;
+    expr->accept(*this);
+    functions
+        << "result_t eval_rule_" << rule_index << "(\n"
+        << "    const file_t &file, context_t &context,\n"
+        << "    const leaf_t *const *leaves) {\n"
+        << body.str()
+        << "  return " << value << ";\n"
+        << "}\n\n";
+  }
+
+  /* Write an and or an or, whose first operand decides it alone if it
+     matches, or doesn't, as test says: "" or "!". */
+  void write_infix(
+      const infix_t *expr, const char *test, const char *op) {
+    auto plan = expr->get_plan();
+    expr->get_first_subexpr(plan)->accept(*this);
+    auto first = value;
+    bool is_first_owned = is_owned;
+    auto result = make_value();
+    if (!plan.may_short_circuit()) {
+      expr->get_second_subexpr(plan)->accept(*this);
+      begin_line()
+          << "auto " << result << " = " << first << op << value << ";\n";
+    } else {
+      begin_line() << "result_t " << result << ";\n";
+      begin_line() << "if (" << test << first << ".is_match()) {\n";
+      ++depth;
+      begin_line()
+          << result << " = " << get_moved(first, is_first_owned) << ";\n";
+      --depth;
+      begin_line() << "} else {\n";
+      ++depth;
+      expr->get_second_subexpr(plan)->accept(*this);
+      begin_line()
+          << result << " = " << first << op << value << ";\n";
+      --depth;
+      begin_line() << "}\n";
+    }
+    value = result;
+    is_owned = true;
+  }
+
+  /* The expression which calls the file's match function for what the
+     given selector selects, attributed to the leaf with the given id, or
+     empty if there's no such function. */
+  std::string get_match(const selector_t &selector, std::size_t id) {
+    const char *function = nullptr;
+    std::string arg;
+    switch (selector.kind) {
+      case selector_t::anchor: function = "match_anchor"; break;
+      case selector_t::css: function = "match_css"; break;
+      case selector_t::image: function = "match_image"; break;
+      case selector_t::js: function = "match_js"; break;
+      case selector_t::id: function = "match_css_id"; break;
+      case selector_t::class_names: {
+        function = "match_class_names";
+        arg = add_symbols(selector.texts, true);
+        break;
+      }
+      case selector_t::exact_text:
+      case selector_t::folded_text: {
+        if (selector.texts.front().empty()) {
+          return std::string();
+        }
+        function = "match_searched";
+        arg = (selector.kind == selector_t::folded_text) ? "true" : "false";
+        arg += ", " + add_search(selector.texts.front()) + "()";
+        break;
+      }
+    }  // switch
+    if (arg.empty()) {
+      arg = add_symbols(selector.texts, false);
+    }
+    return std::string("file.") + function + "(leaves["
+        + std::to_string(id) + "], " + arg + ", context.get_limit())";
+  }
+
+  /* Declare, among the globals, a search (see file_t::match_searched())
+     for the given literal, which mustn't be empty, and return its type. */
+  std::string add_search(const std::string &literal) {
+    auto name = "search_" + std::to_string(literal_count++) + "_t";
+    globals
+        << "struct " << name << " {\n"
+        << "  std::size_t operator()(\n"
+        << "      const std::string &haystack, std::size_t offset) const {\n"
+        << "    return find_literal<" << literal.size() << ", "
+        << get_pivot(literal) << ">(\n"
+        << "        haystack, offset, " << get_literal(literal) << ");\n"
+        << "  }\n"
+        << "};\n\n";
+    return name;
+  }
+
+  /* Declare, among the globals, the symbols of the given texts, interned
+     when the module loads, and return the name of the declaration: of one
+     symbol, or, if as_vector, of a vector of them. */
+  std::string add_symbols(
+      const std::vector<std::string> &texts, bool as_vector) {
+    auto name = "literal_" + std::to_string(literal_count++);
+    if (!as_vector) {
+      globals
+          << "const symbol_table_t::symbol_t " << name
+          << " = symbol_table_t::get().intern(\n"
+          << "    " << get_literal(texts.front()) << ", "
+          << texts.front().size() << ");\n\n";
+      return name;
+    }
+    globals
+        << "const std::vector<symbol_table_t::symbol_t> " << name
+        << " = {\n";
+    for (const auto &text: texts) {
+      globals
+          << "  symbol_table_t::get().intern(" << get_literal(text) << ", "
+          << text.size() << "),\n";
+    }
+    globals << "};\n\n";
+    return name;
+  }
+
+  /* The name of a new value. */
+  std::string make_value() {
+    return "value_" + std::to_string(value_count++);
+  }
+
+  /* Write the indentation of the current depth to the body and return
+     it. */
+  std::ostream &begin_line() {
+    return body << std::string(depth * 2, ' ');
+  }
+
+  /* The given value, moved from if it's ours to move. */
+  static std::string get_moved(const std::string &value, bool is_owned) {
+    return is_owned ? "std::move(" + value + ")" : value;
+  }
+
+  /* The position in the given literal of the byte we'd expect to appear
+     least often in HTML, so find_literal() stops at as few false starts as
+     can be.  Bytes not in our list of common ones are taken to be rare. */
+  static std::size_t get_pivot(const std::string &literal) {
+    static const std::string common =
+        "etaoinsrhldcumfpgwybvkxjqz0123456789";
+    static const std::string very_common = " <>=\"/\n\t-.:;";
+    auto get_rank = [](char c) {
+      auto pos = very_common.find(c);
+      if (pos != std::string::npos) {
+        return pos;
+      }
+      pos = common.find(c);
+      return (pos != std::string::npos)
+          ? very_common.size() + pos
+          : very_common.size() + common.size();
+    };
+    std::size_t pivot = 0;
+    for (std::size_t i = 1; i < literal.size(); ++i) {
+      if (get_rank(literal[i]) > get_rank(literal[pivot])) {
+        pivot = i;
+      }
+    }
+    return pivot;
+  }
+
+  /* The given text as a C++ string literal.  Bytes which aren't printable
+     ASCII are written as octal escapes, and question marks are escaped, so
+     nothing is taken for a trigraph. */
+  static std::string get_literal(const std::string &text) {
+    static const char *octal = "01234567";
+    std::string result = "\"";
+    for (auto c: text) {
+      auto byte = static_cast<unsigned char>(c);
+      if (c == '"' || c == '\\' || c == '?') {
+        result += '\\';
+        result += c;
+      } else if (byte < 0x20 || byte >= 0x7f) {
+        result += '\\';
+        result += octal[byte >> 6];
+        result += octal[(byte >> 3) & 7];
+        result += octal[byte & 7];
+      } else {
+        result += c;
+      }
+    }
+    result += '"';
+    return result;
+  }
+
+  /* Declarations of the symbols the evaluators use. */
+  std::ostringstream globals;
+
+  /* The evaluators written so far. */
+  std::ostringstream functions;
+
+  /* The body of the evaluator being written. */
+  std::ostringstream body;
+
+  /* The number of values in the evaluator being written. */
+  std::size_t value_count;
+
+  /* The number of globals declared, which we number them by. */
+  std::size_t literal_count;
+
+  /* The name of the value holding the result of the node last visited. */
+  std::string value;
+
+  /* True iff. value is a result of its own, rather than a reference to a
+     memoized one, so we may move from it. */
+  bool is_owned;
+
+  /* The indentation of the statements being written, in levels. */
+  int depth;
+
+};  // codegen_t
+
+}  // qmellow
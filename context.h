@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "metrics.h"
+#include "profile.h"
+#include "result.h"
+#include "stats.h"
+#include "utils.h"
+
+namespace qmellow {
+
+/* The state of a single evaluation of an expression against a subject file.
+   An expression may contain the same leaf more than once, so we keep a memo
+   table, indexed by canonical leaf id, of the results we've already
+   computed.  Each distinct leaf therefore matches against the file at most
+   once per evaluation.  Copies of a memoized result share its matches
+   (see result_t), so reusing one is cheap, and leaves which occur only
+   once aren't memoized at all, as nothing would reuse them.  If we're
+   given statistics, the leaves we evaluate are counted and timed into
+   them.  If we're given a profile, every node we evaluate is counted and
+   timed into it.  If we're given a limit, each result keeps at most that
+   many matches, the first in order, and leaves stop looking once they've
+   found them (see result_t). */
+class context_t final {
+  public:
+
+  /* The id of a leaf which was never canonicalized.  Such leaves are not
+     memoized. */
+  static std::size_t get_no_id() noexcept {
+    return match_t::cause_t::get_no_id();
+  }
+
+  /* Start with an empty memo table.  If stats isn't null, leaf evaluations
+     will be recorded there.  If profile isn't null, node evaluations will
+     be recorded there.  The limit must be at least 1. */
+  explicit context_t(
+      stats_t *stats = nullptr, profile_t *profile = nullptr,
+      std::size_t limit = result_t::get_no_limit())
+      : stats(stats), profile(profile), limit(limit) {}
+
+  /* The most matches a result may keep. */
+  std::size_t get_limit() const noexcept {
+    return limit;
+  }
+
+  /* The profile into which node evaluations are recorded, if any. */
+  profile_t *get_profile() const noexcept {
+    return profile;
+  }
+
+  /* The statistics into which leaf evaluations are recorded, if any. */
+  stats_t *get_stats() const noexcept {
+    return stats;
+  }
+
+  /* Return the result of the leaf with the given id.  If we haven't seen
+     this id before, we call the given function to compute the result and
+     remember it for next time. */
+  template <typename compute_t>
+  const result_t &memoize(std::size_t leaf_id, const compute_t &compute) {
+    if (leaf_id == get_no_id()) {
+      uncached = compute();
+      return uncached;
+    }
+    if (leaf_id >= memo.size()) {
+      memo.resize(leaf_id + 1);
+    }
+    auto &slot = memo[leaf_id];
+    if (!slot) {
+      QMELLOW_METRICS_ADD(memo_misses, 1);
+      slot = make_unique<result_t>(compute());
+    } else {
+      QMELLOW_METRICS_ADD(memo_hits, 1);
+    }
+    return *slot;
+  }
+
+  private:
+
+  /* See accessor. */
+  stats_t *stats;
+
+  /* See accessor. */
+  profile_t *profile;
+
+  /* See accessor. */
+  std::size_t limit;
+
+  /* Our memo table, indexed by canonical leaf id.  A null pointer marks a
+     leaf we haven't evaluated yet. */
+  std::vector<std::unique_ptr<result_t>> memo;
+
+  /* Holds the most recent result of a leaf which had no id. */
+  result_t uncached;
+
+};  // context_t
+
+}  // qmellow
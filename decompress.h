@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <zlib.h>
+#ifdef QMELLOW_ZSTD
+#include <zstd.h>
+#endif
+#include "utils.h"
+
+namespace qmellow {
+
+/* Decompresses subject files stored as gzip or zstd, straight into memory,
+   with no temporary files.  We tell formats apart by their magic numbers,
+   not by the file name.  A decompressor keeps its decompression contexts
+   between calls, so each worker should keep one of its own and reuse it.
+
+   We inflate a whole file into one buffer rather than streaming it into
+   the scanner, since file_t keeps a file's whole text, and indexes its
+   lines and elements within it, for as long as rules are evaluated
+   against it.  The buffer is reused from file to file, and its size is
+   capped (see get_default_max_size()).
+
+   zstd support needs libzstd, so it's only built if QMELLOW_ZSTD is
+   defined; otherwise zstd input is an error. */
+class decompressor_t final {
+  public:
+
+  /* The formats we know. */
+  enum format_t { plain, gzip, zstd };
+
+  /* The largest size we'll decompress to by default, which keeps a
+     corrupt or malicious input from eating all of memory. */
+  static std::size_t get_default_max_size() noexcept {
+    return std::size_t(1) << 30;
+  }
+
+  /* The format of the given data. */
+  static format_t get_format(const std::string &data) noexcept {
+    if (data.size() >= 2 && data[0] == '\x1f' && data[1] == '\x8b') {
+      return gzip;
+    }
+    if (data.size() >= 4 && data.compare(0, 4, "\x28\xb5\x2f\xfd") == 0) {
+      return zstd;
+    }
+    return plain;
+  }
+
+  /* Make our contexts.  Input which would decompress to more than the
+     given size throws. */
+  explicit decompressor_t(std::size_t max_size = get_default_max_size())
+      : max_size(max_size) {
+    std::memset(&gzip_stream, 0, sizeof(gzip_stream));
+    if (inflateInit2(&gzip_stream, 15 + 32) != Z_OK) {
+      throw std::runtime_error("could not initialize zlib");
+    }
+#ifdef QMELLOW_ZSTD
+    zstd_ctx = ZSTD_createDCtx();
+    if (!zstd_ctx) {
+      inflateEnd(&gzip_stream);
+      throw std::runtime_error("could not initialize zstd");
+    }
+#endif
+  }
+
+  /* Free our contexts. */
+  ~decompressor_t() {
+    inflateEnd(&gzip_stream);
+#ifdef QMELLOW_ZSTD
+    ZSTD_freeDCtx(zstd_ctx);
+#endif
+  }
+
+  /* Not copyable. */
+  decompressor_t(const decompressor_t &) = delete;
+  decompressor_t &operator=(const decompressor_t &) = delete;
+
+  /* If the input is compressed, decompress it into out, replacing what was
+     there but reusing its buffer, and return true.  If the input isn't
+     compressed, leave out alone and return false.  Corrupt input throws. */
+  bool decompress(const std::string &in, std::string &out) {
+    switch (get_format(in)) {
+      case plain: return false;
+      case gzip: inflate_gzip(in, out); break;
+      case zstd: inflate_zstd(in, out); break;
+    }  // switch
+    return true;
+  }
+
+  /* Read the file at the given path, decompressing it if need be. */
+  std::string load(const std::string &path) {
+    std::string text = read_whole_file(path), out;
+    if (!decompress(text, out)) {
+      return std::move(text);
+    }
+    return std::move(out);
+  }
+
+  /* A decompressor for the calling thread, for callers who don't keep
+     their own. */
+  static decompressor_t &get_for_thread() {
+    static thread_local decompressor_t decompressor;
+    return decompressor;
+  }
+
+  private:
+
+  /* Make room for more output past the given size, throwing if we'd go
+     over the limit. */
+  void grow(std::string &out, std::size_t size) const {
+    if (size >= max_size) {
+      throw std::runtime_error("decompressed file is too big");
+    }
+    auto new_size = std::max<std::size_t>(size * 2, 65536);
+    out.resize(std::min(new_size, max_size));
+  }
+
+  /* Decompress gzip data.  We accept several gzip members one after
+     another, as gzip itself does. */
+  void inflate_gzip(const std::string &in, std::string &out) {
+    inflateReset(&gzip_stream);
+    gzip_stream.next_in = reinterpret_cast<Bytef *>(
+        const_cast<char *>(in.data()));
+    gzip_stream.avail_in = static_cast<uInt>(in.size());
+    std::size_t size = 0;
+    out.resize(std::min(out.capacity(), max_size));
+    for (;;) {
+      if (size == out.size()) {
+        grow(out, size);
+      }
+      gzip_stream.next_out = reinterpret_cast<Bytef *>(&out[size]);
+      gzip_stream.avail_out = static_cast<uInt>(
+          std::min<std::size_t>(out.size() - size, 1u << 30));
+      auto avail_out = gzip_stream.avail_out;
+      int result = inflate(&gzip_stream, Z_NO_FLUSH);
+      size += avail_out - gzip_stream.avail_out;
+      if (result == Z_STREAM_END) {
+        if (gzip_stream.avail_in < 2
+            || gzip_stream.next_in[0] != 0x1f
+            || gzip_stream.next_in[1] != 0x8b) {
+          break;
+        }
+        inflateReset(&gzip_stream);
+      } else if (result == Z_BUF_ERROR && gzip_stream.avail_out) {
+        throw std::runtime_error("truncated gzip data");
+      } else if (result != Z_OK && result != Z_BUF_ERROR) {
+        throw std::runtime_error("corrupt gzip data");
+      }
+    }
+    out.resize(size);
+  }
+
+  /* Decompress zstd data. */
+  void inflate_zstd(const std::string &in, std::string &out) {
+#ifdef QMELLOW_ZSTD
+    ZSTD_DCtx_reset(zstd_ctx, ZSTD_reset_session_only);
+    ZSTD_inBuffer input = { in.data(), in.size(), 0 };
+    std::size_t size = 0;
+    out.resize(std::min(out.capacity(), max_size));
+    for (;;) {
+      if (size == out.size()) {
+        grow(out, size);
+      }
+      ZSTD_outBuffer output = { &out[size], out.size() - size, 0 };
+      auto result = ZSTD_decompressStream(zstd_ctx, &output, &input);
+      size += output.pos;
+      if (ZSTD_isError(result)) {
+        throw std::runtime_error(
+            std::string("corrupt zstd data: ") + ZSTD_getErrorName(result));
+      }
+      if (input.pos == input.size && result == 0) {
+        break;
+      }
+      if (input.pos == input.size && output.pos < output.size) {
+        throw std::runtime_error("truncated zstd data");
+      }
+    }
+    out.resize(size);
+#else
+    (void)in;
+    (void)out;
+    throw std::runtime_error("zstd support is not built in");
+#endif
+  }
+
+  /* See constructor. */
+  std::size_t max_size;
+
+  /* Our gzip context. */
+  z_stream gzip_stream;
+
+#ifdef QMELLOW_ZSTD
+  /* Our zstd context. */
+  ZSTD_DCtx *zstd_ctx;
+#endif
+
+};  // decompressor_t
+
+/* Read a subject file, decompressing it if need be. */
+inline std::string load_subject_file(const std::string &path) {
+  return decompressor_t::get_for_thread().load(path);
+}
+
+}  // qmellow
@@ -0,0 +1,779 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "error.h"
+#include "pos.h"
+#include "utils.h"
+
+namespace qmellow {
+
+/* A regular expression, compiled so that matching it against a line takes
+   time linear in the length of the line, with no backtracking.
+
+   We parse the pattern into a tree and compile the tree into an NFA.  We
+   then build a DFA from the NFA lazily, as lines are matched: each DFA state
+   is a set of NFA states, made the first time a line leads to it, and each
+   transition is worked out the first time it's taken.  The DFA is shared by
+   every thread matching with us.  Taking a known transition is one atomic
+   load; only working out a new one takes our lock.  Should the DFA grow too
+   big, we stop adding states and finish lines by simulating the NFA, which
+   is slower but still linear.  Bytes which the pattern never tells apart
+   share a class, and states have a transition per class, not per byte.
+
+   Most patterns begin with some literal text.  Finding that text is far
+   faster than stepping through the DFA, so we skip ahead to it and step
+   only from there.
+
+   We match lines, never across them.  The syntax is the usual one: literal
+   characters; '.'; bracketed classes, with ranges and negation; the escapes
+   \d, \D, \w, \W, \s, \S, \n, \r, and \t, and a backslash before any other
+   punctuation; parens; '|'; and the quantifiers '*', '+', '?', {m}, {m,},
+   and {m,n}.  A '^' at the very start or a '$' at the very end anchors the
+   pattern to the start or end of a line.  Lines end at a newline, or at a
+   carriage return and newline, so a pattern never sees the carriage
+   return of a file with DOS line endings. */
+class dfa_t final {
+  public:
+
+  /* A pattern we can't compile. */
+  class error_t final
+      : public qmellow::error_t {
+    public:
+
+    /* Report the position of the pattern in the program, where in the
+       pattern the problem is, and what it is. */
+    error_t(const pos_t &pos, std::size_t offset, const char *msg)
+        : qmellow::error_t(pos) {
+      get_strm() << msg;
+      end_section();
+      get_strm() << "at offset " << offset << " of regular expression";
+    }
+
+  };  // dfa_t::error_t
+
+  /* Compile the given pattern, which is at the given position in a
+     program. */
+  dfa_t(const std::string &pattern, const pos_t &pos)
+      : is_start_anchored(false), is_end_anchored(false),
+        class_count(0), start(nullptr), dead(nullptr) {
+    auto size = pattern.size();
+    if (size > 0 && pattern[0] == '^') {
+      is_start_anchored = true;
+    }
+    if (size > (is_start_anchored ? 1 : 0) && pattern[size - 1] == '$') {
+      std::size_t slash_count = 0;
+      while (slash_count < size - 1
+          && pattern[size - 2 - slash_count] == '\\') {
+        ++slash_count;
+      }
+      if (slash_count % 2 == 0) {
+        is_end_anchored = true;
+        --size;
+      }
+    }
+    parser_t parser(pattern, is_start_anchored ? 1 : 0, size, pos);
+    auto tree = parser.parse();
+    add_prefix(*tree);
+    nfa.push_back(nfa_node_t(nfa_node_t::accept));
+    auto nfa_start = compile(*tree, 0, parser);
+    make_classes();
+    auto start_set = close({ nfa_start });
+    if (!is_start_anchored) {
+      restart_set = start_set;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    dead = add_state(std::vector<int>());
+    start = add_state(std::move(start_set));
+  }
+
+  /* Call fn(offset) for each line of the text in which we match, in order,
+     where offset is somewhere in the line, until it returns false. */
+  template <typename fn_t>
+  void for_each_matching_line(const std::string &text, const fn_t &fn) const {
+    bool may_skip = !is_start_anchored && !prefix.empty();
+    std::size_t cursor = 0;
+    for (;;) {
+      if (may_skip) {
+        cursor = text.find(prefix, cursor);
+        if (cursor == std::string::npos) {
+          break;
+        }
+      }
+      auto line_end = text.find('\n', cursor);
+      if (line_end == std::string::npos) {
+        line_end = text.size();
+      }
+      auto match_end = line_end;
+      if (match_end > cursor && text[match_end - 1] == '\r') {
+        --match_end;
+      }
+      if (is_match(text.data() + cursor, text.data() + match_end)
+          && !fn(cursor)) {
+        break;
+      }
+      if (line_end + 1 >= text.size()) {
+        break;
+      }
+      cursor = line_end + 1;
+    }
+  }
+
+  /* The literal text with which every match begins.  This may be empty. */
+  const std::string &get_prefix() const noexcept {
+    return prefix;
+  }
+
+  private:
+
+  /* The most NFA nodes a pattern may compile to. */
+  static std::size_t get_max_nfa_size() noexcept {
+    return 65536;
+  }
+
+  /* The most times a quantifier may repeat. */
+  static int get_max_repeat() noexcept {
+    return 1000;
+  }
+
+  /* The most DFA states we'll make. */
+  static std::size_t get_max_state_count() noexcept {
+    return 4096;
+  }
+
+  /* A set of bytes. */
+  using bytes_t = std::bitset<256>;
+
+  /* A node in the tree a pattern parses into. */
+  struct tree_t {
+
+    /* The kinds of nodes. */
+    enum kind_t {
+
+      /* Matches nothing, successfully. */
+      empty,
+
+      /* Matches one byte in the set. */
+      bytes,
+
+      /* Matches its sub-trees in order. */
+      concat,
+
+      /* Matches any one of its sub-trees. */
+      alternate,
+
+      /* Matches its one sub-tree from min to max times, or, if max is
+         negative, at least min times. */
+      repeat
+
+    };
+
+    /* A node of the given kind. */
+    explicit tree_t(kind_t kind)
+        : kind(kind), min(0), max(0) {}
+
+    /* See kind_t. */
+    kind_t kind;
+
+    /* Used by bytes. */
+    bytes_t set;
+
+    /* Used by concat, alternate, and repeat. */
+    std::vector<std::unique_ptr<tree_t>> subs;
+
+    /* Used by repeat. */
+    int min, max;
+
+  };  // dfa_t::tree_t
+
+  /* Parses a pattern into a tree, by recursive descent. */
+  class parser_t final {
+    public:
+
+    /* Parse the part of the pattern from start to end. */
+    parser_t(
+        const std::string &pattern, std::size_t start, std::size_t end,
+        const pos_t &pos)
+        : pattern(pattern), cursor(start), end(end), pos(pos) {}
+
+    /* Parse the whole pattern. */
+    std::unique_ptr<tree_t> parse() {
+      auto tree = parse_alternate();
+      if (cursor < end) {
+        fail("unbalanced ')'");
+      }
+      return std::move(tree);
+    }
+
+    /* Throw an error about where we are. */
+    void fail(const char *msg) const {
+      throw error_t(pos, cursor, msg);
+    }
+
+    private:
+
+    /* Parse a series of alternatives. */
+    std::unique_ptr<tree_t> parse_alternate() {
+      auto tree = parse_concat();
+      if (cursor >= end || pattern[cursor] != '|') {
+        return std::move(tree);
+      }
+      auto alternate = make_unique<tree_t>(tree_t::alternate);
+      alternate->subs.push_back(std::move(tree));
+      while (cursor < end && pattern[cursor] == '|') {
+        ++cursor;
+        alternate->subs.push_back(parse_concat());
+      }
+      return std::move(alternate);
+    }
+
+    /* Parse a series of atoms, each possibly quantified. */
+    std::unique_ptr<tree_t> parse_concat() {
+      auto concat = make_unique<tree_t>(tree_t::concat);
+      while (cursor < end && pattern[cursor] != '|'
+          && pattern[cursor] != ')') {
+        if (pattern[cursor] == '^' || pattern[cursor] == '$') {
+          fail("anchors are allowed only at the ends");
+        }
+        auto tree = parse_atom();
+        while (cursor < end) {
+          int min = 0, max = -1;
+          auto c = pattern[cursor];
+          if (c == '{') {
+            parse_counts(min, max);
+          } else if (c == '*' || c == '+' || c == '?') {
+            ++cursor;
+            min = (c == '+') ? 1 : 0;
+            max = (c == '?') ? 1 : -1;
+          } else {
+            break;
+          }
+          auto repeat = make_unique<tree_t>(tree_t::repeat);
+          repeat->subs.push_back(std::move(tree));
+          repeat->min = min;
+          repeat->max = max;
+          tree = std::move(repeat);
+        }
+        concat->subs.push_back(std::move(tree));
+      }
+      if (concat->subs.size() == 1) {
+        return std::move(concat->subs.front());
+      }
+      return std::move(concat);
+    }
+
+    /* Parse a single byte, a class, or a group. */
+    std::unique_ptr<tree_t> parse_atom() {
+      auto c = pattern[cursor];
+      if (c == '*' || c == '+' || c == '?' || c == '{') {
+        fail("nothing to repeat");
+      }
+      ++cursor;
+      if (c == '(') {
+        auto tree = (cursor < end && pattern[cursor] == ')')
+            ? make_unique<tree_t>(tree_t::empty) : parse_alternate();
+        if (cursor >= end || pattern[cursor] != ')') {
+          fail("unbalanced '('");
+        }
+        ++cursor;
+        return std::move(tree);
+      }
+      auto tree = make_unique<tree_t>(tree_t::bytes);
+      if (c == '.') {
+        tree->set.set();
+        tree->set.reset('\n');
+      } else if (c == '[') {
+        parse_class(tree->set);
+      } else if (c == '\\') {
+        parse_escape(tree->set);
+      } else {
+        tree->set.set(static_cast<unsigned char>(c));
+      }
+      return std::move(tree);
+    }
+
+    /* Parse a bracketed class, whose open bracket we've passed. */
+    void parse_class(bytes_t &set) {
+      bool is_negated = (cursor < end && pattern[cursor] == '^');
+      if (is_negated) {
+        ++cursor;
+      }
+      bool is_first = true;
+      for (;;) {
+        if (cursor >= end) {
+          fail("unbalanced '['");
+        }
+        auto c = pattern[cursor++];
+        if (c == ']' && !is_first) {
+          break;
+        }
+        is_first = false;
+        auto lo = static_cast<unsigned char>(c);
+        if (c == '\\') {
+          bytes_t escaped;
+          if (parse_escape(escaped)) {
+            set |= escaped;
+            continue;
+          }
+          lo = get_only(escaped);
+        }
+        auto hi = lo;
+        if (cursor + 1 < end && pattern[cursor] == '-'
+            && pattern[cursor + 1] != ']') {
+          cursor += 2;
+          hi = static_cast<unsigned char>(pattern[cursor - 1]);
+          if (hi == '\\') {
+            bytes_t escaped;
+            if (parse_escape(escaped)) {
+              fail("bad range");
+            }
+            hi = get_only(escaped);
+          }
+          if (hi < lo) {
+            fail("bad range");
+          }
+        }
+        for (unsigned b = lo; b <= hi; ++b) {
+          set.set(b);
+        }
+      }
+      if (is_negated) {
+        set.flip();
+        set.reset('\n');
+      }
+    }
+
+    /* Parse an escape, whose backslash we've passed, adding what it stands
+       for to the set.  Returns true iff. it stands for a class of bytes,
+       rather than a single one. */
+    bool parse_escape(bytes_t &set) {
+      if (cursor >= end) {
+        fail("nothing to escape");
+      }
+      auto c = pattern[cursor++];
+      bool is_negated = isupper(static_cast<unsigned char>(c));
+      switch (tolower(static_cast<unsigned char>(c))) {
+        case 'd': {
+          for (unsigned b = '0'; b <= '9'; ++b) {
+            set.set(b);
+          }
+          break;
+        }
+        case 'w': {
+          for (unsigned b = 0; b < 256; ++b) {
+            if (isalnum(b) || b == '_') {
+              set.set(b);
+            }
+          }
+          break;
+        }
+        case 's': {
+          for (unsigned b: { ' ', '\t', '\n', '\r', '\f', '\v' }) {
+            set.set(b);
+          }
+          break;
+        }
+        default: {
+          if (c == 'n' || c == 'r' || c == 't') {
+            set.set(c == 'n' ? '\n' : (c == 'r' ? '\r' : '\t'));
+            return false;
+          }
+          if (isalnum(static_cast<unsigned char>(c))) {
+            --cursor;
+            fail("bad escape");
+          }
+          set.set(static_cast<unsigned char>(c));
+          return false;
+        }
+      }  // switch
+      if (is_negated) {
+        set.flip();
+        set.reset('\n');
+      }
+      return true;
+    }
+
+    /* The one byte in the set. */
+    static unsigned char get_only(const bytes_t &set) {
+      unsigned b = 0;
+      while (b < 255 && !set.test(b)) {
+        ++b;
+      }
+      return static_cast<unsigned char>(b);
+    }
+
+    /* Parse {m}, {m,}, or {m,n}. */
+    void parse_counts(int &min, int &max) {
+      ++cursor;
+      min = parse_count();
+      max = min;
+      if (cursor < end && pattern[cursor] == ',') {
+        ++cursor;
+        max = (cursor < end && pattern[cursor] == '}') ? -1 : parse_count();
+      }
+      if (cursor >= end || pattern[cursor] != '}') {
+        fail("bad repeat count");
+      }
+      ++cursor;
+      if (max >= 0 && max < min) {
+        fail("bad repeat count");
+      }
+    }
+
+    /* Parse a decimal count. */
+    int parse_count() {
+      int count = 0;
+      auto start = cursor;
+      while (cursor < end && isdigit(static_cast<unsigned char>(
+          pattern[cursor]))) {
+        count = count * 10 + (pattern[cursor++] - '0');
+        if (count > get_max_repeat()) {
+          fail("repeat count too big");
+        }
+      }
+      if (cursor == start) {
+        fail("bad repeat count");
+      }
+      return count;
+    }
+
+    /* What we're parsing. */
+    const std::string &pattern;
+
+    /* Where we are in the pattern, and where we stop. */
+    std::size_t cursor, end;
+
+    /* Where the pattern is in the program. */
+    pos_t pos;
+
+  };  // dfa_t::parser_t
+
+  /* A node in the NFA. */
+  struct nfa_node_t {
+
+    /* The kinds of nodes. */
+    enum kind_t {
+
+      /* Go on to out on a byte in the set. */
+      bytes,
+
+      /* Go on to both out and other_out, consuming nothing.  If other_out
+         is negative, only to out. */
+      split,
+
+      /* A match. */
+      accept
+
+    };
+
+    /* A node of the given kind, going nowhere yet. */
+    explicit nfa_node_t(kind_t kind)
+        : kind(kind), out(-1), other_out(-1) {}
+
+    /* See kind_t. */
+    kind_t kind;
+
+    /* Used by bytes. */
+    bytes_t set;
+
+    /* See kind_t. */
+    int out, other_out;
+
+  };  // dfa_t::nfa_node_t
+
+  /* A state of the DFA. */
+  struct state_t {
+
+    /* A state standing for the given sorted set of NFA nodes, with no
+       transitions known yet. */
+    state_t(std::vector<int> &&nfa_set, bool is_accepting,
+        std::size_t class_count)
+        : nfa_set(std::move(nfa_set)), is_accepting(is_accepting),
+          next(new std::atomic<const state_t *>[class_count]) {
+      for (std::size_t i = 0; i < class_count; ++i) {
+        next[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    /* The NFA nodes we stand for. */
+    const std::vector<int> nfa_set;
+
+    /* True iff. one of the nodes is an accept. */
+    const bool is_accepting;
+
+    /* Where each class of byte takes us, or null if we don't know yet. */
+    std::unique_ptr<std::atomic<const state_t *>[]> next;
+
+  };  // dfa_t::state_t
+
+  /* Append to our prefix the literal text with which the tree must begin.
+     Returns true iff. the whole tree is literal, so what follows it may
+     add to the prefix too. */
+  bool add_prefix(const tree_t &tree) {
+    switch (tree.kind) {
+      case tree_t::empty: return true;
+      case tree_t::bytes: {
+        if (tree.set.count() != 1) {
+          return false;
+        }
+        for (unsigned b = 0; b < 256; ++b) {
+          if (tree.set.test(b)) {
+            prefix.push_back(static_cast<char>(b));
+          }
+        }
+        return true;
+      }
+      case tree_t::concat: {
+        for (const auto &sub: tree.subs) {
+          if (!add_prefix(*sub)) {
+            return false;
+          }
+        }
+        return true;
+      }
+      case tree_t::alternate: return false;
+      case tree_t::repeat: {
+        if (tree.min > 0) {
+          add_prefix(*tree.subs.front());
+        }
+        return false;
+      }
+    }  // switch
+    return false;
+  }
+
+  /* Compile the tree into NFA nodes which go on to the given node when they
+     match, and return the first of them. */
+  int compile(const tree_t &tree, int next, const parser_t &parser) {
+    if (nfa.size() > get_max_nfa_size()) {
+      parser.fail("regular expression too big");
+    }
+    switch (tree.kind) {
+      case tree_t::empty: return next;
+      case tree_t::bytes: {
+        nfa.push_back(nfa_node_t(nfa_node_t::bytes));
+        nfa.back().set = tree.set;
+        nfa.back().out = next;
+        return static_cast<int>(nfa.size() - 1);
+      }
+      case tree_t::concat: {
+        for (auto iter = tree.subs.rbegin(); iter != tree.subs.rend();
+            ++iter) {
+          next = compile(**iter, next, parser);
+        }
+        return next;
+      }
+      case tree_t::alternate: {
+        auto first = compile(*tree.subs.back(), next, parser);
+        for (auto i = tree.subs.size() - 1; i-- > 0; ) {
+          auto out = compile(*tree.subs[i], next, parser);
+          first = add_split(out, first);
+        }
+        return first;
+      }
+      case tree_t::repeat: {
+        const auto &sub = *tree.subs.front();
+        auto first = next;
+        if (tree.max < 0) {
+          first = add_split(-1, next);
+          auto out = compile(sub, first, parser);
+          nfa[first].out = out;
+        } else {
+          for (int i = tree.min; i < tree.max; ++i) {
+            first = add_split(compile(sub, first, parser), next);
+          }
+        }
+        for (int i = 0; i < tree.min; ++i) {
+          first = compile(sub, first, parser);
+        }
+        return first;
+      }
+    }  // switch
+    return next;
+  }
+
+  /* Add a split to the NFA and return it. */
+  int add_split(int out, int other_out) {
+    nfa.push_back(nfa_node_t(nfa_node_t::split));
+    nfa.back().out = out;
+    nfa.back().other_out = other_out;
+    return static_cast<int>(nfa.size() - 1);
+  }
+
+  /* Sort bytes into classes, so that two bytes are in the same class iff.
+     every node of the NFA treats them alike, and pick a byte to stand for
+     each class. */
+  void make_classes() {
+    std::map<std::vector<bool>, std::uint8_t> class_by_sig;
+    for (unsigned b = 0; b < 256; ++b) {
+      std::vector<bool> sig;
+      for (const auto &node: nfa) {
+        if (node.kind == nfa_node_t::bytes) {
+          sig.push_back(node.set.test(b));
+        }
+      }
+      auto result = class_by_sig.insert(std::make_pair(
+          std::move(sig), static_cast<std::uint8_t>(class_by_sig.size())));
+      classes[b] = result.first->second;
+      if (result.second) {
+        class_bytes.push_back(static_cast<std::uint8_t>(b));
+      }
+    }
+    class_count = class_bytes.size();
+  }
+
+  /* The sorted set of bytes and accept nodes reachable from the given nodes
+     without consuming anything. */
+  std::vector<int> close(std::vector<int> &&todo) const {
+    std::vector<bool> is_seen(nfa.size());
+    std::vector<int> result;
+    while (!todo.empty()) {
+      auto node = todo.back();
+      todo.pop_back();
+      if (node < 0 || is_seen[node]) {
+        continue;
+      }
+      is_seen[node] = true;
+      if (nfa[node].kind == nfa_node_t::split) {
+        todo.push_back(nfa[node].other_out);
+        todo.push_back(nfa[node].out);
+      } else {
+        result.push_back(node);
+      }
+    }
+    std::sort(result.begin(), result.end());
+    return std::move(result);
+  }
+
+  /* The set of NFA nodes the given set goes to on the given byte. */
+  std::vector<int> step(const std::vector<int> &set, std::uint8_t b) const {
+    auto todo = restart_set;
+    for (auto node: set) {
+      if (nfa[node].kind == nfa_node_t::bytes && nfa[node].set.test(b)) {
+        todo.push_back(nfa[node].out);
+      }
+    }
+    return close(std::move(todo));
+  }
+
+  /* True iff. the set contains an accept node. */
+  bool is_accepting(const std::vector<int> &set) const {
+    return !set.empty() && set.front() == 0;
+  }
+
+  /* Make a state for the set and return it.  The lock must be held. */
+  const state_t *add_state(std::vector<int> &&set) const {
+    auto &state = states[set];
+    if (!state) {
+      bool is_accepting_set = is_accepting(set);
+      state.reset(new state_t(std::move(set), is_accepting_set, class_count));
+    }
+    return state.get();
+  }
+
+  /* Where the state goes on the given class of byte, working it out if need
+     be.  Returns null if that would make too many states. */
+  const state_t *get_next(const state_t *state, std::uint8_t cls) const {
+    auto *next = state->next[cls].load(std::memory_order_acquire);
+    if (next) {
+      return next;
+    }
+    auto set = step(state->nfa_set, class_bytes[cls]);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = states.find(set);
+    if (iter != states.end()) {
+      next = iter->second.get();
+    } else if (states.size() < get_max_state_count()) {
+      next = add_state(std::move(set));
+    } else {
+      return nullptr;
+    }
+    state->next[cls].store(next, std::memory_order_release);
+    return next;
+  }
+
+  /* True iff. we match in the text, which is the rest of a line from where
+     a match may first begin. */
+  bool is_match(const char *cursor, const char *end) const {
+    auto *state = start;
+    for (; cursor != end; ++cursor) {
+      if (state->is_accepting && !is_end_anchored) {
+        return true;
+      }
+      auto *next = get_next(
+          state, classes[static_cast<std::uint8_t>(*cursor)]);
+      if (!next) {
+        return is_match_slowly(state->nfa_set, cursor, end);
+      }
+      if (next == dead) {
+        return false;
+      }
+      state = next;
+    }
+    return state->is_accepting;
+  }
+
+  /* Like is_match(), but from the given set of NFA nodes, without the
+     DFA. */
+  bool is_match_slowly(
+      std::vector<int> set, const char *cursor, const char *end) const {
+    for (; cursor != end; ++cursor) {
+      if (is_accepting(set) && !is_end_anchored) {
+        return true;
+      }
+      set = step(set, static_cast<std::uint8_t>(*cursor));
+      if (set.empty()) {
+        return false;
+      }
+    }
+    return is_accepting(set);
+  }
+
+  /* True iff. the pattern began with '^' or ended with '$'. */
+  bool is_start_anchored, is_end_anchored;
+
+  /* See accessor. */
+  std::string prefix;
+
+  /* The NFA.  The first node is the accept. */
+  std::vector<nfa_node_t> nfa;
+
+  /* The class of each byte. */
+  std::uint8_t classes[256];
+
+  /* A byte of each class. */
+  std::vector<std::uint8_t> class_bytes;
+
+  /* The number of classes. */
+  std::size_t class_count;
+
+  /* Where an unanchored pattern may begin a match, which is everywhere.
+     Every step adds these nodes.  Empty if we're anchored. */
+  std::vector<int> restart_set;
+
+  /* Where we start. */
+  const state_t *start;
+
+  /* The state from which we can never match.  Unanchored patterns never
+     reach it. */
+  const state_t *dead;
+
+  /* The states made so far, by their sets.  Guarded by the mutex. */
+  mutable std::map<std::vector<int>, std::unique_ptr<state_t>> states;
+
+  /* Guards the map of states. */
+  mutable std::mutex mutex;
+
+};  // dfa_t
+
+}  // qmellow
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "hash.h"
+#include "symbols.h"
+
+namespace qmellow {
+
+/* The elements of a scanned HTML document, kept flat.  Rather than a tree
+   of objects, one per element, we keep one array per fact, indexed by the
+   element's position in document order: its tag, its parent, first child,
+   and next sibling, the line it starts on, the span of text it covers, its
+   id, its class names, and the asset path it refers to.  Tags, ids, class
+   names, and paths are symbols (see symbol_table_t), shared with every
+   other document and every query, so we keep no text of our own for them,
+   only a reference to each symbol, which we let go of when we go.
+   A whole document is thus a handful of contiguous arrays of integers,
+   built in one pass without an allocation per element, and searching it
+   walks memory in order.
+
+   Document order is pre-order, so an element's descendants are exactly the
+   elements numbered after it and before the end of its subtree, which we
+   also keep.  Whether one element is inside another is then two integer
+   comparisons, with no walking of the tree.
+
+   The text itself belongs to the caller; we keep only offsets into it. */
+class dom_t final {
+  public:
+
+  /* The position of an element in document order. */
+  using node_t = std::uint32_t;
+
+  /* Borrow this type. */
+  using symbol_t = symbol_table_t::symbol_t;
+
+  /* A run of the text, by offset and size. */
+  struct span_t {
+
+    /* An empty span. */
+    span_t() noexcept
+        : offset(0), size(0) {}
+
+    /* Cache the arguments. */
+    span_t(std::size_t offset, std::size_t size) noexcept
+        : offset(static_cast<std::uint32_t>(offset)),
+          size(static_cast<std::uint32_t>(size)) {}
+
+    /* Where the run starts. */
+    std::uint32_t offset;
+
+    /* The length of the run. */
+    std::uint32_t size;
+
+  };  // dom_t::span_t
+
+  /* Stands for no element at all, as the parent of a top-level element,
+     say. */
+  static node_t get_no_node() noexcept {
+    return static_cast<node_t>(-1);
+  }
+
+  /* Stands for no string at all, as the id of an element without one. */
+  static symbol_t get_no_symbol() noexcept {
+    return symbol_table_t::get_no_symbol();
+  }
+
+  /* An empty document. */
+  dom_t()
+      : symbol_count(0), last_top_node(get_no_node()) {}
+
+  /* The number of elements. */
+  std::size_t get_size() const noexcept {
+    return tags.size();
+  }
+
+  /* The element's tag name, folded to lower case. */
+  symbol_t get_tag(node_t node) const noexcept {
+    return tags[node];
+  }
+
+  /* The element which contains the given one. */
+  node_t get_parent(node_t node) const noexcept {
+    return parents[node];
+  }
+
+  /* The first element contained directly in the given one. */
+  node_t get_first_child(node_t node) const noexcept {
+    return first_children[node];
+  }
+
+  /* The next element contained directly in the given one's parent. */
+  node_t get_next_sibling(node_t node) const noexcept {
+    return next_siblings[node];
+  }
+
+  /* The line on which the element's start tag begins. */
+  int get_line_number(node_t node) const noexcept {
+    return line_numbers[node];
+  }
+
+  /* One past the last element inside the given one.  Its descendants are
+     those after it and before this. */
+  node_t get_subtree_end(node_t node) const noexcept {
+    return subtree_ends[node];
+  }
+
+  /* True iff. the first element is inside the second, at any depth. */
+  bool is_inside(node_t node, node_t ancestor) const noexcept {
+    return ancestor < node && node < subtree_ends[ancestor];
+  }
+
+  /* The offset in the text of the element's start tag. */
+  std::size_t get_text_start(node_t node) const noexcept {
+    return text_starts[node];
+  }
+
+  /* The offset in the text just past the element's end tag, or, if it has
+     none, just past whatever ended it. */
+  std::size_t get_text_end(node_t node) const noexcept {
+    return text_ends[node];
+  }
+
+  /* The element's id. */
+  symbol_t get_id(node_t node) const noexcept {
+    return ids[node];
+  }
+
+  /* The element's class names, in the order given, as a range. */
+  const symbol_t *get_classes_begin(node_t node) const noexcept {
+    return class_symbols.data() + class_starts[node];
+  }
+
+  /* See get_classes_begin(). */
+  const symbol_t *get_classes_end(node_t node) const noexcept {
+    return class_symbols.data() + class_starts[node + 1];
+  }
+
+  /* The symbols of the asset path the element refers to, as a range: the
+     path itself and each of its tails which starts with a slash, so
+     "/static/a.js" gives "/static/a.js" and "/a.js".  A leaf looking for
+     a path thus matches a path ending in it by comparing symbols.  Only
+     anchors and stylesheet links (by href) and images and scripts (by src)
+     refer to paths. */
+  const symbol_t *get_paths_begin(node_t node) const noexcept {
+    return path_symbols.data() + path_starts[node];
+  }
+
+  /* See get_paths_begin(). */
+  const symbol_t *get_paths_end(node_t node) const noexcept {
+    return path_symbols.data() + path_starts[node + 1];
+  }
+
+  /* Start a new element, whose start tag is at the given offset, contained
+     in the innermost open one, and return it.  If it may contain others, it
+     stays open until closed; otherwise, the caller should set its end. */
+  node_t open(
+      const char *tag_data, std::size_t tag_size, int line_number,
+      std::size_t offset, bool is_container) {
+    auto node = static_cast<node_t>(tags.size());
+    auto parent = open_nodes.empty() ? get_no_node() : open_nodes.back();
+    tags.push_back(intern(tag_data, tag_size));
+    parents.push_back(parent);
+    first_children.push_back(get_no_node());
+    next_siblings.push_back(get_no_node());
+    line_numbers.push_back(line_number);
+    subtree_ends.push_back(node + 1);
+    text_starts.push_back(static_cast<std::uint32_t>(offset));
+    text_ends.push_back(static_cast<std::uint32_t>(offset));
+    ids.push_back(get_no_symbol());
+    class_starts.push_back(static_cast<std::uint32_t>(class_symbols.size()));
+    path_starts.push_back(static_cast<std::uint32_t>(path_symbols.size()));
+    auto &last_sibling = (parent == get_no_node())
+        ? last_top_node : last_children[open_nodes.size() - 1];
+    if (last_sibling != get_no_node()) {
+      next_siblings[last_sibling] = node;
+    } else if (parent != get_no_node()) {
+      first_children[parent] = node;
+    }
+    last_sibling = node;
+    if (is_container) {
+      open_nodes.push_back(node);
+      last_children.push_back(get_no_node());
+    }
+    return node;
+  }
+
+  /* Close the innermost open element with the given tag name, and any open
+     within it, at the given offset, which is just past the end tag.  If
+     none is open, do nothing, as browsers do. */
+  void close(const char *tag_data, std::size_t tag_size, std::size_t offset) {
+    auto tag = find(tag_data, tag_size);
+    if (tag == get_no_symbol()) {
+      return;
+    }
+    for (auto i = open_nodes.size(); i-- > 0; ) {
+      if (tags[open_nodes[i]] == tag) {
+        close_from(i, offset);
+        return;
+      }
+    }
+  }
+
+  /* Set the end of the most recently opened element, which is not a
+     container, to the given offset. */
+  void set_text_end(std::size_t offset) noexcept {
+    text_ends.back() = static_cast<std::uint32_t>(offset);
+  }
+
+  /* Set the id of the most recently opened element. */
+  void set_id(const char *data, std::size_t size) {
+    ids.back() = intern(data, size);
+  }
+
+  /* Add a class name to the most recently opened element. */
+  void add_class(const char *data, std::size_t size) {
+    class_symbols.push_back(intern(data, size));
+  }
+
+  /* Set the asset path of the most recently opened element, replacing any
+     set before. */
+  void set_path(const char *data, std::size_t size) {
+    path_symbols.resize(path_starts.back());
+    for (std::size_t i = 0; i < size; ++i) {
+      if (data[i] == '/') {
+        path_symbols.push_back(intern(data + i, size - i));
+      }
+    }
+  }
+
+  /* Close everything still open, at the end of the text, which is of the
+     given size, and let go of what we needed only while building. */
+  void finish(std::size_t text_size) {
+    close_from(0, text_size);
+    class_starts.push_back(static_cast<std::uint32_t>(class_symbols.size()));
+    path_starts.push_back(static_cast<std::uint32_t>(path_symbols.size()));
+    open_nodes = std::vector<node_t>();
+    last_children = std::vector<node_t>();
+    slots = std::vector<symbol_t>();
+  }
+
+  private:
+
+  /* Close the open elements from the given depth inward at the given
+     offset. */
+  void close_from(std::size_t depth, std::size_t offset) {
+    auto end = static_cast<node_t>(tags.size());
+    for (auto i = depth; i < open_nodes.size(); ++i) {
+      subtree_ends[open_nodes[i]] = end;
+      text_ends[open_nodes[i]] = static_cast<std::uint32_t>(offset);
+    }
+    open_nodes.resize(depth);
+    last_children.resize(depth);
+  }
+
+  /* The symbol for the given string, if we've used it; otherwise, no
+     symbol. */
+  symbol_t find(const char *data, std::size_t size) const {
+    if (slots.empty()) {
+      return get_no_symbol();
+    }
+    const auto &table = symbol_table_t::get();
+    auto mask = slots.size() - 1;
+    for (auto i = hash_bytes(data, size) & mask; ; i = (i + 1) & mask) {
+      auto symbol = slots[i];
+      if (symbol == get_no_symbol() || table.is_symbol(symbol, data, size)) {
+        return symbol;
+      }
+    }
+  }
+
+  /* The symbol for the given string, interning it if need be.  We keep our
+     own table of the symbols we've used, at most half full, so a name
+     repeated through the document takes the shared table's lock only
+     once. */
+  symbol_t intern(const char *data, std::size_t size) {
+    if (symbol_count * 2 >= slots.size()) {
+      grow();
+    }
+    const auto &table = symbol_table_t::get();
+    auto hash = hash_bytes(data, size);
+    auto mask = slots.size() - 1;
+    for (auto i = hash & mask; ; i = (i + 1) & mask) {
+      auto &symbol = slots[i];
+      if (symbol == get_no_symbol()) {
+        symbol = refs.intern(data, size, hash);
+        ++symbol_count;
+        return symbol;
+      }
+      if (table.is_symbol(symbol, data, size)) {
+        return symbol;
+      }
+    }
+  }
+
+  /* Double our table of symbols, or start it, and rehash. */
+  void grow() {
+    std::vector<symbol_t> old_slots(std::max<std::size_t>(
+        slots.size() * 2, 64), get_no_symbol());
+    old_slots.swap(slots);
+    const auto &table = symbol_table_t::get();
+    auto mask = slots.size() - 1;
+    for (auto symbol: old_slots) {
+      if (symbol == get_no_symbol()) {
+        continue;
+      }
+      const auto &text = table.get_text(symbol);
+      auto i = hash_bytes(text.data(), text.size()) & mask;
+      while (slots[i] != get_no_symbol()) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = symbol;
+    }
+  }
+
+  /* See accessors. */
+  std::vector<symbol_t> tags;
+
+  /* See accessors. */
+  std::vector<node_t> parents, first_children, next_siblings;
+
+  /* See accessor. */
+  std::vector<int> line_numbers;
+
+  /* See accessor. */
+  std::vector<node_t> subtree_ends;
+
+  /* See accessors. */
+  std::vector<std::uint32_t> text_starts, text_ends;
+
+  /* See accessor. */
+  std::vector<symbol_t> ids;
+
+  /* Where each element's class names start in class_symbols.  Once we're
+     finished, there's one more, marking the end of the last element's. */
+  std::vector<std::uint32_t> class_starts;
+
+  /* The class names of every element, back to back. */
+  std::vector<symbol_t> class_symbols;
+
+  /* Where each element's paths start in path_symbols, like class_starts. */
+  std::vector<std::uint32_t> path_starts;
+
+  /* The paths of every element, back to back. */
+  std::vector<symbol_t> path_symbols;
+
+  /* Our references to the symbols we've used, one each. */
+  symbol_table_t::refs_t refs;
+
+  /* The hash table of the symbols we've used, by the hash of their text,
+     with open addressing.  Empty slots hold no symbol.  Only used while
+     building. */
+  std::vector<symbol_t> slots;
+
+  /* The number of symbols in slots. */
+  std::size_t symbol_count;
+
+  /* The elements still open, outermost first.  Only used while
+     building. */
+  std::vector<node_t> open_nodes;
+
+  /* The last child so far of each open element, in step with
+     open_nodes.  Only used while building. */
+  std::vector<node_t> last_children;
+
+  /* The last top-level element so far.  Only used while building. */
+  node_t last_top_node;
+
+};  // dom_t
+
+}  // qmellow
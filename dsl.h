@@ -0,0 +1,520 @@
+#pragma once
+
+#include <cstddef>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "context.h"
+#include "dfa.h"
+#include "file.h"
+#include "match.h"
+#include "pos.h"
+#include "result.h"
+#include "selector.h"
+#include "symbols.h"
+
+namespace qmellow {
+
+/* Queries written as C++ expressions, for checks built into our own tools,
+   which would otherwise translate the same text every time they run.  For
+   example, the query
+
+     ("word1" or 'word2') and not .c1.c2 and /static/s1.css
+
+   is written:
+
+     using namespace qmellow::dsl;
+     auto query = make_query(
+         (text("word1") || itext("word2")) && !classes({ "c1", "c2" })
+         && css("/static/s1.css"));
+
+   Each operator makes a node whose type is made of its operands' types, so
+   the whole query is one object, built without allocating a tree, and its
+   eval() is a nest of inline calls, with no virtual dispatch.  Leaves are
+   numbered and shared as the parser would number and share them, and
+   memoized in the context the same way, so a query gives what the
+   interpreter would give for its text, match for match; for that, path
+   leaves must be made with the function for the kind the parser would pick
+   from the path's extension.  Like an unplanned expression, a query
+   evaluates its operands left to right and never short-circuits.
+
+   A leaf is a match's cause, so results refer into the query that made
+   them and are good only as long as it is. */
+namespace dsl {
+
+/* The base of every node of a query, whose type is given, so the
+   operators below take only nodes. */
+template <typename node_t>
+class base_t {
+  public:
+
+  /* The node we are. */
+  const node_t &get_node() const noexcept {
+    return static_cast<const node_t &>(*this);
+  }
+
+  protected:
+
+  /* Do-little. */
+  base_t() {}
+
+};  // base_t<node_t>
+
+/* The cause of a leaf's matches.  The query numbers its leaves and picks
+   the canonical one of each set of identical ones (see query_t). */
+class cause_t
+    : public match_t::cause_t {
+  public:
+
+  /* Satisfy our duty as a cause of a match. */
+  virtual const std::string &get_desc() const override final {
+    return desc;
+  }
+
+  /* The leaf which stands in for the leaves of our query which match the
+     same way we do.  This may be us. */
+  const cause_t *get_canon() const noexcept {
+    return canon;
+  }
+
+  /* Make the given leaf, with the given id, our canonical leaf. */
+  void set_canon(cause_t *canon, std::size_t id) noexcept {
+    if (canon != this) {
+      canon->shared = true;
+    }
+    this->canon = canon;
+    set_id(id);
+  }
+
+  /* True iff. other leaves of our query have our canonical leaf, so its
+     result is worth memoizing. */
+  bool is_shared() const noexcept {
+    return canon->shared;
+  }
+
+  protected:
+
+  /* Describe ourself as the interpreter's leaf would. */
+  explicit cause_t(std::string &&desc)
+      : desc(std::move(desc)), canon(this), shared(false) {}
+
+  /* A copy is canonical and has no id until its query says otherwise. */
+  cause_t(const cause_t &that)
+      : match_t::cause_t(that), desc(that.desc), canon(this),
+        shared(false) {
+    set_id(get_no_id());
+  }
+
+  private:
+
+  /* See accessor. */
+  std::string desc;
+
+  /* See accessor. */
+  const cause_t *canon;
+
+  /* True iff. we're canonical and other leaves have us as their canonical
+     leaf. */
+  bool shared;
+
+};  // cause_t
+
+/* The base of leaves, which say how they match with
+   match(file, cause, limit). */
+template <typename leaf_t>
+class leaf_base_t
+    : public base_t<leaf_t>, public cause_t {
+  public:
+
+  /* Evaluate the canonical leaf, using the memoized result, if there is
+     one, if other leaves share it. */
+  result_t eval(const file_t &file, context_t &context) const {
+    auto match = [this, &file, &context]() {
+      return static_cast<const leaf_t *>(this)->match(
+          file, get_canon(), context.get_limit());
+    };
+    if (!is_shared()) {
+      return match();
+    }
+    return context.memoize(get_id(), match);
+  }
+
+  /* Call fn(cause) for ourself. */
+  template <typename fn_t>
+  void for_each_leaf(const fn_t &fn) {
+    fn(static_cast<cause_t &>(*this));
+  }
+
+  protected:
+
+  /* See base class. */
+  explicit leaf_base_t(std::string &&desc)
+      : cause_t(std::move(desc)) {}
+
+};  // leaf_base_t<leaf_t>
+
+/* Matches a string, without regard to case if is_folded. */
+template <bool is_folded>
+class string_leaf_t final
+    : public leaf_base_t<string_leaf_t<is_folded>> {
+  public:
+
+  /* Cache the text to match. */
+  explicit string_leaf_t(const std::string &text)
+      : leaf_base_t<string_leaf_t>(
+            (is_folded ? '\'' : '"') + text + (is_folded ? '\'' : '"')),
+        text(text) {}
+
+  /* See leaf_base_t. */
+  result_t match(
+      const file_t &file, const match_t::cause_t *cause,
+      std::size_t limit) const {
+    return is_folded
+        ? file.match_case_insensitive_string(cause, text, limit)
+        : file.match_case_sensitive_string(cause, text, limit);
+  }
+
+  private:
+
+  /* See constructor. */
+  std::string text;
+
+};  // string_leaf_t<is_folded>
+
+/* Matches elements which refer to an asset path, or have an id, as the
+   given kind of selector says. */
+template <selector_t::kind_t kind>
+class symbol_leaf_t final
+    : public leaf_base_t<symbol_leaf_t<kind>> {
+  public:
+
+  /* Cache the path or id to match. */
+  explicit symbol_leaf_t(const std::string &text)
+      : leaf_base_t<symbol_leaf_t>((kind == selector_t::id ? "#" : "") + text),
+        symbol(refs.intern(text)) {}
+
+  /* See leaf_base_t. */
+  result_t match(
+      const file_t &file, const match_t::cause_t *cause,
+      std::size_t limit) const {
+    switch (kind) {
+      case selector_t::anchor: return file.match_anchor(cause, symbol, limit);
+      case selector_t::css: return file.match_css(cause, symbol, limit);
+      case selector_t::image: return file.match_image(cause, symbol, limit);
+      case selector_t::js: return file.match_js(cause, symbol, limit);
+      default: return file.match_css_id(cause, symbol, limit);
+    }  // switch
+  }
+
+  private:
+
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* See constructor. */
+  symbol_table_t::symbol_t symbol;
+
+};  // symbol_leaf_t<kind>
+
+/* Matches elements with all of the given class names. */
+class classes_leaf_t final
+    : public leaf_base_t<classes_leaf_t> {
+  public:
+
+  /* Cache the class names to match. */
+  explicit classes_leaf_t(const std::vector<std::string> &texts)
+      : leaf_base_t<classes_leaf_t>(get_desc(texts)) {
+    for (const auto &text: texts) {
+      symbols.push_back(refs.intern(text));
+    }
+  }
+
+  /* See leaf_base_t. */
+  result_t match(
+      const file_t &file, const match_t::cause_t *cause,
+      std::size_t limit) const {
+    return file.match_class_names(cause, symbols, limit);
+  }
+
+  private:
+
+  /* The class names, dotted, as the interpreter writes them. */
+  static std::string get_desc(const std::vector<std::string> &texts) {
+    std::string desc;
+    for (const auto &text: texts) {
+      desc += '.' + text;
+    }
+    return desc;
+  }
+
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* The class names as symbols. */
+  std::vector<symbol_table_t::symbol_t> symbols;
+
+};  // classes_leaf_t
+
+/* Matches lines on which a regular expression matches. */
+class regex_leaf_t final
+    : public leaf_base_t<regex_leaf_t> {
+  public:
+
+  /* Compile the pattern.  The DFA is shared by copies, as it's the same
+     for all of them. */
+  explicit regex_leaf_t(const std::string &pattern)
+      : leaf_base_t<regex_leaf_t>(get_desc(pattern)),
+        dfa(std::make_shared<const dfa_t>(pattern, pos_t())) {}
+
+  /* See leaf_base_t. */
+  result_t match(
+      const file_t &file, const match_t::cause_t *cause,
+      std::size_t limit) const {
+    return file.match_regex(cause, *dfa, limit);
+  }
+
+  private:
+
+  /* The pattern, backquoted, as the interpreter writes it. */
+  static std::string get_desc(const std::string &pattern) {
+    std::string desc = "`";
+    for (auto c: pattern) {
+      if (c == '`') {
+        desc += '\\';
+      }
+      desc += c;
+    }
+    desc += '`';
+    return desc;
+  }
+
+  /* The pattern, compiled. */
+  std::shared_ptr<const dfa_t> dfa;
+
+};  // regex_leaf_t
+
+/* Logical-not of a node. */
+template <typename subexpr_t>
+class not_t final
+    : public base_t<not_t<subexpr_t>> {
+  public:
+
+  /* Cache the operand. */
+  explicit not_t(const subexpr_t &subexpr)
+      : subexpr(subexpr) {}
+
+  /* Evaluate the operand and negate the result. */
+  result_t eval(const file_t &file, context_t &context) const {
+    return !subexpr.eval(file, context);
+  }
+
+  /* Call fn(cause) for each of our leaves, in order. */
+  template <typename fn_t>
+  void for_each_leaf(const fn_t &fn) {
+    subexpr.for_each_leaf(fn);
+  }
+
+  private:
+
+  /* See constructor. */
+  subexpr_t subexpr;
+
+};  // not_t<subexpr_t>
+
+/* Logical-and of two nodes. */
+template <typename left_t, typename right_t>
+class and_t final
+    : public base_t<and_t<left_t, right_t>> {
+  public:
+
+  /* Cache the operands. */
+  and_t(const left_t &left, const right_t &right)
+      : left(left), right(right) {}
+
+  /* Evaluate the operands, left to right, and combine the results. */
+  result_t eval(const file_t &file, context_t &context) const {
+    auto result = left.eval(file, context);
+    return result && right.eval(file, context);
+  }
+
+  /* Call fn(cause) for each of our leaves, in order. */
+  template <typename fn_t>
+  void for_each_leaf(const fn_t &fn) {
+    left.for_each_leaf(fn);
+    right.for_each_leaf(fn);
+  }
+
+  private:
+
+  /* See constructor. */
+  left_t left;
+
+  /* See constructor. */
+  right_t right;
+
+};  // and_t<left_t, right_t>
+
+/* Logical-or of two nodes. */
+template <typename left_t, typename right_t>
+class or_t final
+    : public base_t<or_t<left_t, right_t>> {
+  public:
+
+  /* Cache the operands. */
+  or_t(const left_t &left, const right_t &right)
+      : left(left), right(right) {}
+
+  /* Evaluate the operands, left to right, and combine the results. */
+  result_t eval(const file_t &file, context_t &context) const {
+    auto result = left.eval(file, context);
+    return result || right.eval(file, context);
+  }
+
+  /* Call fn(cause) for each of our leaves, in order. */
+  template <typename fn_t>
+  void for_each_leaf(const fn_t &fn) {
+    left.for_each_leaf(fn);
+    right.for_each_leaf(fn);
+  }
+
+  private:
+
+  /* See constructor. */
+  left_t left;
+
+  /* See constructor. */
+  right_t right;
+
+};  // or_t<left_t, right_t>
+
+/* A whole query, whose leaves are numbered and shared (see cause_t) in the
+   order they appear, as the parser does. */
+template <typename root_t>
+class query_t final {
+  public:
+
+  /* Copy the given node and number its leaves. */
+  explicit query_t(const root_t &root)
+      : root(root) {
+    canonicalize();
+  }
+
+  /* Copy the given query and number the copy's leaves, so its results
+     refer to it. */
+  query_t(const query_t &that)
+      : root(that.root) {
+    canonicalize();
+  }
+
+  /* Not assignable. */
+  query_t &operator=(const query_t &) = delete;
+
+  /* Evaluate the query on the given subject file. */
+  result_t eval(const file_t &file) const {
+    context_t context;
+    return eval(file, context);
+  }
+
+  /* Evaluate the query on the given subject file as part of the given
+     evaluation. */
+  result_t eval(const file_t &file, context_t &context) const {
+    return root.eval(file, context);
+  }
+
+  private:
+
+  /* Make each leaf canonical, with the next id, unless an earlier one has
+     the same description, which is then its canonical leaf. */
+  void canonicalize() {
+    std::map<std::string, cause_t *> canon_leaves;
+    root.for_each_leaf([&canon_leaves](cause_t &leaf) {
+      auto result = canon_leaves.insert(
+          std::make_pair(leaf.get_desc(), &leaf));
+      auto *canon = result.first->second;
+      leaf.set_canon(
+          canon, result.second ? canon_leaves.size() - 1 : canon->get_id());
+    });
+  }
+
+  /* See constructor. */
+  root_t root;
+
+};  // query_t<root_t>
+
+/* Convenience. */
+template <typename root_t>
+query_t<root_t> make_query(const base_t<root_t> &root) {
+  return query_t<root_t>(root.get_node());
+}
+
+/* The logical-not of a node. */
+template <typename subexpr_t>
+not_t<subexpr_t> operator!(const base_t<subexpr_t> &subexpr) {
+  return not_t<subexpr_t>(subexpr.get_node());
+}
+
+/* The logical-and of two nodes. */
+template <typename left_t, typename right_t>
+and_t<left_t, right_t> operator&&(
+    const base_t<left_t> &left, const base_t<right_t> &right) {
+  return and_t<left_t, right_t>(left.get_node(), right.get_node());
+}
+
+/* The logical-or of two nodes. */
+template <typename left_t, typename right_t>
+or_t<left_t, right_t> operator||(
+    const base_t<left_t> &left, const base_t<right_t> &right) {
+  return or_t<left_t, right_t>(left.get_node(), right.get_node());
+}
+
+/* A case-sensitive string, like "text". */
+inline string_leaf_t<false> text(const std::string &text) {
+  return string_leaf_t<false>(text);
+}
+
+/* A case-insensitive string, like 'text'. */
+inline string_leaf_t<true> itext(const std::string &text) {
+  return string_leaf_t<true>(text);
+}
+
+/* A path to an anchor's target, like /pages/p1.html. */
+inline symbol_leaf_t<selector_t::anchor> anchor(const std::string &path) {
+  return symbol_leaf_t<selector_t::anchor>(path);
+}
+
+/* A path to a stylesheet, like /static/s1.css. */
+inline symbol_leaf_t<selector_t::css> css(const std::string &path) {
+  return symbol_leaf_t<selector_t::css>(path);
+}
+
+/* A path to an image, like /static/s1.png. */
+inline symbol_leaf_t<selector_t::image> image(const std::string &path) {
+  return symbol_leaf_t<selector_t::image>(path);
+}
+
+/* A path to a script, like /static/s1.js. */
+inline symbol_leaf_t<selector_t::js> js(const std::string &path) {
+  return symbol_leaf_t<selector_t::js>(path);
+}
+
+/* An element id, like #d1. */
+inline symbol_leaf_t<selector_t::id> id(const std::string &id) {
+  return symbol_leaf_t<selector_t::id>(id);
+}
+
+/* Class names, all on one element, like .c1.c2. */
+inline classes_leaf_t classes(std::initializer_list<std::string> names) {
+  return classes_leaf_t(names);
+}
+
+/* A regular expression, like `word[0-9]`. */
+inline regex_leaf_t regex(const std::string &pattern) {
+  return regex_leaf_t(pattern);
+}
+
+}  // dsl
+
+}  // qmellow
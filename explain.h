@@ -0,0 +1,156 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include "context.h"
+#include "expr.h"
+#include "file.h"
+#include "profile.h"
+
+namespace qmellow {
+
+/* Writes an expression tree as an indented plan, one node per line, as it
+   will actually be evaluated: operands in planned order, with notes on
+   short-circuiting and shared leaves.  If we have a profile, each node's
+   line ends with the work it did. */
+class explainer_t final
+    : public visitor_t {
+  public:
+
+  /* Write to the given stream, annotating from the given profile, if
+     any. */
+  explainer_t(std::ostream &strm, const profile_t *profile = nullptr)
+      : strm(strm), profile(profile), depth(0) {}
+
+  /* Write the plan of the given expression. */
+  void explain(const expr_t *expr) {
+    int was_depth = depth;
+    expr->accept(*this);
+    depth = was_depth;
+  }
+
+  /* Write a leaf, with its id.  A leaf which isn't canonical gets its
+     result from the memo table. */
+  virtual void visit(const leaf_t *leaf) override {
+    begin_line() << leaf->get_desc();
+    if (leaf->get_id() != context_t::get_no_id()) {
+      strm << " [leaf " << leaf->get_id();
+      if (leaf->get_canon() != leaf) {
+        strm << ", shared";
+      }
+      strm << ']';
+    }
+    end_line(leaf);
+  }
+
+  /* Write a not and its operand. */
+  virtual void visit(const not_t *expr) override {
+    begin_line() << "not";
+    end_line(expr);
+    explain_child(expr->get_subexpr());
+  }
+
+  /* Groups are only syntax, so we write just the operand. */
+  virtual void visit(const group_t *expr) override {
+    explain(expr->get_subexpr());
+  }
+
+  /* Write an and and its operands. */
+  virtual void visit(const and_t *expr) override {
+    explain_infix("and", expr);
+  }
+
+  /* Write an or and its operands. */
+  virtual void visit(const or_t *expr) override {
+    explain_infix("or", expr);
+  }
+
+  private:
+
+  /* Indent and return the stream, ready for the node's description. */
+  std::ostream &begin_line() {
+    return strm << std::string(depth * 2, ' ');
+  }
+
+  /* Write the node's profile, if any, and end the line. */
+  void end_line(const expr_t *expr) {
+    const profile_t::node_profile_t *counts =
+        profile ? profile->get(expr) : nullptr;
+    if (counts) {
+      strm
+          << "  -- calls " << counts->calls
+          << ", ns " << counts->ns
+          << ", matches " << counts->matches;
+      if (counts->short_circuits) {
+        strm << ", short-circuits " << counts->short_circuits;
+      }
+    } else if (profile) {
+      strm << "  -- never evaluated";
+    }
+    strm << '\n';
+  }
+
+  /* Write the given node one level deeper. */
+  void explain_child(const expr_t *expr) {
+    ++depth;
+    explain(expr);
+    --depth;
+  }
+
+  /* Write an and or or, followed by its operands in the order in which
+     they're evaluated. */
+  void explain_infix(const char *kwd, const infix_t *expr) {
+    auto plan = expr->get_plan();
+    begin_line() << kwd;
+    if (plan.may_short_circuit()) {
+      strm << " (short-circuit";
+      if (plan.is_swapped()) {
+        strm << ", right first";
+      }
+      strm << ')';
+    }
+    end_line(expr);
+    explain_child(expr->get_first_subexpr(plan));
+    explain_child(expr->get_second_subexpr(plan));
+  }
+
+  /* See constructor. */
+  std::ostream &strm;
+
+  /* See constructor. */
+  const profile_t *profile;
+
+  /* The nesting level of the node we're writing. */
+  int depth;
+
+};  // explainer_t
+
+/* Write the plan of the given expression. */
+inline void explain(std::ostream &strm, const expr_t *expr) {
+  explainer_t(strm).explain(expr);
+}
+
+/* Evaluate the given expression on each of the subject files in the given
+   range, then write its plan annotated with the work each node did.  If
+   stats isn't null, leaf statistics are recorded there as well. */
+template <typename iter_t>
+void explain_analyze(
+    std::ostream &strm, const expr_t *expr, iter_t begin, iter_t end,
+    stats_t *stats = nullptr) {
+  profile_t profile;
+  for (; begin != end; ++begin) {
+    const file_t &file = *begin;
+    context_t context(stats, &profile);
+    expr->eval(file, context);
+  }
+  explainer_t(strm, &profile).explain(expr);
+}
+
+/* Evaluate the given expression on the given subject file, then write its
+   plan annotated with the work each node did. */
+inline void explain_analyze(
+    std::ostream &strm, const expr_t *expr, const file_t &file) {
+  explain_analyze(strm, expr, &file, &file + 1);
+}
+
+}  // qmellow
@@ -1,17 +1,60 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <ostream>
 #include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
+#include "context.h"
 #include "file.h"
 #include "match.h"
+#include "metrics.h"
 #include "result.h"
+#include "selector.h"
+#include "sketch.h"
+#include "symbols.h"
 
 namespace qmellow {
 
+class and_t;
+class group_t;
+class leaf_t;
+class not_t;
+class or_t;
+
+/* The base of all things which walk an expression tree.  Each expression's
+   accept function calls the visit function which suits it.  The visitor
+   decides whether and in what order to go on to the sub-expressions. */
+class visitor_t {
+  public:
+
+  /* Do-little. */
+  virtual ~visitor_t() {}
+
+  /* Override to visit a leaf of any kind. */
+  virtual void visit(const leaf_t *leaf) = 0;
+
+  /* Override to visit a logical-not. */
+  virtual void visit(const not_t *expr) = 0;
+
+  /* Override to visit a grouping. */
+  virtual void visit(const group_t *expr) = 0;
+
+  /* Override to visit a logical-and. */
+  virtual void visit(const and_t *expr) = 0;
+
+  /* Override to visit a logical-or. */
+  virtual void visit(const or_t *expr) = 0;
+
+  protected:
+
+  /* Do-little. */
+  visitor_t() {}
+
+};  // visitor_t
+
 /* The base of all kinds of expressions. */
 class expr_t {
   public:
@@ -19,8 +62,31 @@ class expr_t {
   /* Do-little. */
   virtual ~expr_t() {}
 
-  /* Override to evaluate the expression on the given subject file. */
-  virtual result_t eval(const file_t &file) const = 0;
+  /* Evaluate the expression on the given subject file. */
+  result_t eval(const file_t &file) const {
+    context_t context;
+    return eval(file, context);
+  }
+
+  /* Evaluate the expression on the given subject file as part of the given
+     evaluation.  Leaves already evaluated in this context are not evaluated
+     again.  If the context has a profile, count and time the evaluation. */
+  result_t eval(const file_t &file, context_t &context) const {
+    QMELLOW_METRICS_TIME(eval_ns);
+    auto *profile = context.get_profile();
+    if (!profile) {
+      return eval_node(file, context);
+    }
+    auto start = profile_t::clock_t::now();
+    auto result = eval_node(file, context);
+    profile->record(
+        this, result.is_match(), profile_t::clock_t::now() - start);
+    return result;
+  }
+
+  /* Override to call the visit function of the given visitor which suits
+     this kind of expression. */
+  virtual void accept(visitor_t &visitor) const = 0;
 
   /* Override to pretty-print the expression as source script. */
   virtual void pretty_print(std::ostream &strm) const = 0;
@@ -30,6 +96,11 @@ class expr_t {
   /* Do-little. */
   expr_t() {}
 
+  /* Override to evaluate the expression on the given subject file.  Use
+     eval(), above, to evaluate sub-expressions. */
+  virtual result_t eval_node(
+      const file_t &file, context_t &context) const = 0;
+
 };  // expr_t
 
 /* The base an expression which owns no sub-expressions. */
@@ -47,13 +118,111 @@ class leaf_t
     return desc;
   }
 
+  /* The leaf which stands in for all the leaves in our program which match
+     the same way we do.  This may be us.  Matches are always attributed to
+     the canonical leaf, so identical leaves give identical matches. */
+  const leaf_t *get_canon() const noexcept {
+    return canon;
+  }
+
+  /* The id of our canonical leaf, which is ours as a cause, too.  Ids are
+     given in the order leaves first appear in the program, so they're the
+     same every time it's compiled, and they're small and dense, so they
+     can be used to index tables. */
+  using cause_t::get_id;
+
+  /* Visit a leaf. */
+  virtual void accept(visitor_t &visitor) const override final {
+    visitor.visit(this);
+  }
+
+  /* True iff. we match the given file.  Unlike eval(), this uses no
+     context, so nothing is memoized or recorded.  We stop at the first
+     match. */
+  bool is_match(const file_t &file) const {
+    return match(file, 1).is_match();
+  }
+
+  /* Add to the probe what a file's sketch must contain for us to match
+     it.  Returns false, adding nothing, if we can't tell from a sketch.
+     This is the default. */
+  virtual bool get_probe(sketch_t::probe_t &) const {
+    return false;
+  }
+
+  /* Set the selector to say where in a file we match, for containment
+     (see inside_t).  Returns false, leaving the selector alone, if we can't
+     say.  This is the default. */
+  virtual bool get_selector(selector_t &) const {
+    return false;
+  }
+
+  /* Make the given leaf, which must match the same way we do, our
+     canonical leaf.  The parser calls this as it builds the tree. */
+  void set_canon(leaf_t *canon, std::size_t id) noexcept {
+    if (canon != this) {
+      canon->shared = true;
+    }
+    this->canon = canon;
+    set_id(id);
+  }
+
+  /* True iff. other leaves of our program have our canonical leaf, so its
+     result is worth memoizing. */
+  bool is_shared() const noexcept {
+    return canon->shared;
+  }
+
   protected:
 
   /* Do-little. */
-  leaf_t() {}
+  leaf_t()
+      : canon(this), shared(false) {}
+
+  /* Evaluate the canonical leaf.  If other leaves share it, we use the
+     memoized result, if there is one, whose copies share its matches (see
+     result_t); otherwise, there's nothing to share, so nothing is
+     memoized. */
+  virtual result_t eval_node(
+      const file_t &file, context_t &context) const override final {
+    auto id = get_id();
+    if (!is_shared() || id == context_t::get_no_id()) {
+      return eval_canon(file, context);
+    }
+    return context.memoize(id, [this, &file, &context]() {
+      return eval_canon(file, context);
+    });
+  }
+
+  /* Override to match against the subject file, stopping once the result
+     has as many matches as the given limit (see result_t).  Report matches
+     as being caused by get_canon(). */
+  virtual result_t match(const file_t &file, std::size_t limit) const = 0;
 
   private:
 
+  /* Match, and if the context has statistics, count and time the
+     evaluation. */
+  result_t eval_canon(const file_t &file, context_t &context) const {
+    auto id = get_id();
+    auto *stats = context.get_stats();
+    if (!stats || id == context_t::get_no_id()) {
+      return match(file, context.get_limit());
+    }
+    auto start = stats_t::clock_t::now();
+    auto result = match(file, context.get_limit());
+    stats->record(
+        id, get_desc(), result.is_match(), stats_t::clock_t::now() - start);
+    return result;
+  }
+
+  /* See accessor. */
+  const leaf_t *canon;
+
+  /* True iff. we're canonical and other leaves have us as their canonical
+     leaf. */
+  bool shared;
+
   /* Empty until get_desc is called, then it contains our pretty-printed
      self. */
   mutable std::string desc;
@@ -97,20 +266,89 @@ class infix_t
   const expr_t *get_right_subexpr() const noexcept {
     return right_subexpr.get();
   }
+
+  /* The order in which we evaluate our sub-expressions and whether we may
+     short-circuit.  We keep a plan in one word, set and got whole, so an
+     evaluation which gets it once sees one plan throughout, even while
+     the planner sets another. */
+  class plan_t final {
+    public:
+
+    /* Evaluate the right-hand sub-expression first iff. swapped, and
+       short-circuit iff. short_circuit. */
+    plan_t(bool swapped, bool short_circuit) noexcept
+        : bits(static_cast<unsigned char>(
+              (swapped ? swapped_bit : 0)
+              | (short_circuit ? short_circuit_bit : 0))) {}
+
+    /* True iff. we evaluate the right-hand sub-expression first. */
+    bool is_swapped() const noexcept {
+      return (bits & swapped_bit) != 0;
+    }
+
+    /* True iff. we may skip the second sub-expression when the first one
+       alone decides whether we match. */
+    bool may_short_circuit() const noexcept {
+      return (bits & short_circuit_bit) != 0;
+    }
+
+    private:
+
+    /* The bits of a plan. */
+    enum : unsigned char { swapped_bit = 1, short_circuit_bit = 2 };
+
+    /* A plan of the given bits. */
+    explicit plan_t(unsigned char bits) noexcept
+        : bits(bits) {}
+
+    /* Some of the bits above. */
+    unsigned char bits;
+
+    friend class infix_t;
+
+  };  // infix_t::plan_t
+
+  /* Our plan, as of now. */
+  plan_t get_plan() const noexcept {
+    return plan_t(plan.load());
+  }
+
+  /* The sub-expression the given plan of ours evaluates first. */
+  const expr_t *get_first_subexpr(const plan_t &plan) const noexcept {
+    return plan.is_swapped() ? right_subexpr.get() : left_subexpr.get();
+  }
+
+  /* The sub-expression the given plan of ours evaluates second. */
+  const expr_t *get_second_subexpr(const plan_t &plan) const noexcept {
+    return plan.is_swapped() ? left_subexpr.get() : right_subexpr.get();
+  }
+
+  /* Set our plan.  The planner calls this.  A plan doesn't affect what we
+     mean, so this is const and can be called while other threads evaluate
+     us. */
+  void set_plan(const plan_t &plan) const noexcept {
+    this->plan.store(plan.bits);
+  }
+
   protected:
 
-  /* Take ownership of the sub-expressions. */
+  /* Take ownership of the sub-expressions.  Until we're planned, we
+     evaluate left-to-right and never short-circuit. */
   infix_t(
       std::unique_ptr<expr_t> &&left_subexpr,
       std::unique_ptr<expr_t> &&right_subexpr)
       : left_subexpr(std::move(left_subexpr)),
-        right_subexpr(std::move(right_subexpr)) {}
+        right_subexpr(std::move(right_subexpr)),
+        plan(plan_t(false, false).bits) {}
 
   private:
 
   /* See accessors. */
   std::unique_ptr<expr_t> left_subexpr, right_subexpr;
 
+  /* The bits of our plan. */
+  mutable std::atomic<unsigned char> plan;
+
 };  // infix_t
 
 /* ------------------------------------------------------------------------
@@ -124,11 +362,28 @@ class anchor_t final
 
   /* Cache the text to match. */
   anchor_t(std::string &&text)
-      : text(std::move(text)) {}
+      : text(std::move(text)),
+        symbol(refs.intern(this->text)) {}
+
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_anchor(get_canon(), symbol, limit);
+  }
 
-  /* Evaluate the expression on the subject file. */
-  virtual result_t eval(const file_t &file) const override {
-    return file.match_anchor(this, text);
+  /* Require what we match in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    if (text.empty() || text[0] != '/') {
+      return false;
+    }
+    probe.add(sketch_t::anchor, text);
+    return true;
+  }
+
+  /* Select what we match. */
+  virtual bool get_selector(selector_t &selector) const override {
+    selector = selector_t(selector_t::anchor, { text });
+    return true;
   }
 
   /* Pretty-print the expression. */
@@ -141,6 +396,12 @@ class anchor_t final
   /* The text to match.  It will start with a slash. */
   std::string text;
 
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* The text as a symbol. */
+  symbol_table_t::symbol_t symbol;
+
 };  // anchor_t
 
 /* Match a case-insensitive string. */
@@ -152,9 +413,22 @@ class case_insensitive_string_t final
   case_insensitive_string_t(const std::string &text)
       : text(std::move(text)) {}
 
-  /* Evaluate the expression on the subject file. */
-  virtual result_t eval(const file_t &file) const override {
-    return file.match_case_insensitive_string(this, text);
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_case_insensitive_string(get_canon(), text, limit);
+  }
+
+  /* Require what we match in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    return probe.add_text(sketch_t::folded_text, file_t::fold_text(text));
+  }
+
+  /* Select what we match. */
+  virtual bool get_selector(selector_t &selector) const override {
+    selector = selector_t(
+        selector_t::folded_text, { file_t::fold_text(text) });
+    return true;
   }
 
   /* Pretty-print the expression. */
@@ -178,9 +452,21 @@ class case_sensitive_string_t final
   case_sensitive_string_t(const std::string &text)
       : text(std::move(text)) {}
 
-  /* Evaluate the expression on the subject file. */
-  virtual result_t eval(const file_t &file) const override {
-    return file.match_case_sensitive_string(this, text);
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_case_sensitive_string(get_canon(), text, limit);
+  }
+
+  /* Require what we match in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    return probe.add_text(sketch_t::exact_text, text);
+  }
+
+  /* Select what we match. */
+  virtual bool get_selector(selector_t &selector) const override {
+    selector = selector_t(selector_t::exact_text, { text });
+    return true;
   }
 
   /* Pretty-print the expression. */
@@ -202,11 +488,31 @@ class class_names_t final
 
   /* Cache the text to match. */
   class_names_t(std::vector<std::string> &&texts)
-      : texts(std::move(texts)) {}
+      : texts(std::move(texts)) {
+    for (const auto &text: this->texts) {
+      symbols.push_back(refs.intern(text));
+    }
+  }
 
-  /* Evaluate the expression on the subject file. */
-  virtual result_t eval(const file_t &file) const override {
-    return file.match_class_names(this, texts);
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_class_names(get_canon(), symbols, limit);
+  }
+
+  /* Require what we match in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    for (const auto &text: texts) {
+      probe.add(sketch_t::class_name, text);
+    }
+    return !texts.empty();
+  }
+
+  /* Select what we match. */
+  virtual bool get_selector(selector_t &selector) const override {
+    selector = selector_t(
+        selector_t::class_names, std::vector<std::string>(texts));
+    return true;
   }
 
   /* Pretty-print the expression. */
@@ -221,6 +527,12 @@ class class_names_t final
   /* The texts to match. */
   std::vector<std::string> texts;
 
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* The texts as symbols. */
+  std::vector<symbol_table_t::symbol_t> symbols;
+
 };  // class_names_t
 
 /* Match CSS. */
@@ -230,11 +542,28 @@ class css_t final
 
   /* Cache the text to match. */
   css_t(std::string &&text)
-      : text(std::move(text)) {}
+      : text(std::move(text)),
+        symbol(refs.intern(this->text)) {}
+
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_css(get_canon(), symbol, limit);
+  }
+
+  /* Require what we match in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    if (text.empty() || text[0] != '/') {
+      return false;
+    }
+    probe.add(sketch_t::css, text);
+    return true;
+  }
 
-  /* Evaluate the expression on the subject file. */
-  virtual result_t eval(const file_t &file) const override {
-    return file.match_css(this, text);
+  /* Select what we match. */
+  virtual bool get_selector(selector_t &selector) const override {
+    selector = selector_t(selector_t::css, { text });
+    return true;
   }
 
   /* Pretty-print the expression. */
@@ -247,6 +576,12 @@ class css_t final
   /* The text to match.  It will start with a slash. */
   std::string text;
 
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* The text as a symbol. */
+  symbol_table_t::symbol_t symbol;
+
 };  // css_t
 
 /* Match a CSS id. */
@@ -256,11 +591,27 @@ class css_id_t final
 
   /* Cache the text to match. */
   css_id_t(const std::string &text)
-      : text(text) {}
+      : text(text), symbol(refs.intern(text)) {}
+
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_css_id(get_canon(), symbol, limit);
+  }
 
-  /* Evaluate the expression on the subject file. */
-  virtual result_t eval(const file_t &file) const override {
-    return file.match_css_id(this, text);
+  /* Require what we match in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    if (text.empty()) {
+      return false;
+    }
+    probe.add(sketch_t::id, text);
+    return true;
+  }
+
+  /* Select what we match. */
+  virtual bool get_selector(selector_t &selector) const override {
+    selector = selector_t(selector_t::id, { text });
+    return true;
   }
 
   /* Pretty-print the expression. */
@@ -273,6 +624,12 @@ class css_id_t final
   /* The text to match. */
   std::string text;
 
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* The text as a symbol. */
+  symbol_table_t::symbol_t symbol;
+
 };  // css_id_t
 
 /* Match an image. */
@@ -282,11 +639,28 @@ class image_t final
 
   /* Cache the text to match. */
   image_t(std::string &&text)
-      : text(std::move(text)) {}
+      : text(std::move(text)),
+        symbol(refs.intern(this->text)) {}
 
-  /* Evaluate the expression on the subject file. */
-  virtual result_t eval(const file_t &file) const override {
-    return file.match_image(this, text);
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_image(get_canon(), symbol, limit);
+  }
+
+  /* Require what we match in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    if (text.empty() || text[0] != '/') {
+      return false;
+    }
+    probe.add(sketch_t::image, text);
+    return true;
+  }
+
+  /* Select what we match. */
+  virtual bool get_selector(selector_t &selector) const override {
+    selector = selector_t(selector_t::image, { text });
+    return true;
   }
 
   /* Pretty-print the expression. */
@@ -299,6 +673,12 @@ class image_t final
   /* The text to match.  It will start with a slash. */
   std::string text;
 
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* The text as a symbol. */
+  symbol_table_t::symbol_t symbol;
+
 };  // image_t
 
 /* Match JS. */
@@ -308,11 +688,28 @@ class js_t final
 
   /* Cache the text to match. */
   js_t(std::string &&text)
-      : text(std::move(text)) {}
+      : text(std::move(text)),
+        symbol(refs.intern(this->text)) {}
 
-  /* Evaluate the expression on the subject file. */
-  virtual result_t eval(const file_t &file) const override {
-    return file.match_js(this, text);
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_js(get_canon(), symbol, limit);
+  }
+
+  /* Require what we match in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    if (text.empty() || text[0] != '/') {
+      return false;
+    }
+    probe.add(sketch_t::js, text);
+    return true;
+  }
+
+  /* Select what we match. */
+  virtual bool get_selector(selector_t &selector) const override {
+    selector = selector_t(selector_t::js, { text });
+    return true;
   }
 
   /* Pretty-print the expression. */
@@ -325,8 +722,119 @@ class js_t final
   /* The text to match.  It will start with a slash. */
   std::string text;
 
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* The text as a symbol. */
+  symbol_table_t::symbol_t symbol;
+
 };  // js_t
 
+/* Match a regular expression. */
+class regex_t final
+    : public leaf_t {
+  public:
+
+  /* Cache the pattern and compile it.  The position is where it is in the
+     program, for reporting errors. */
+  regex_t(const std::string &pattern, const pos_t &pos)
+      : pattern(pattern), dfa(pattern, pos) {}
+
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_regex(get_canon(), dfa, limit);
+  }
+
+  /* Require the literal text every match begins with in the sketch. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    return probe.add_text(sketch_t::exact_text, dfa.get_prefix());
+  }
+
+  /* Pretty-print the expression. */
+  virtual void pretty_print(std::ostream &strm) const override {
+    strm << '`';
+    for (auto c: pattern) {
+      if (c == '`') {
+        strm << '\\';
+      }
+      strm << c;
+    }
+    strm << '`';
+  }
+
+  private:
+
+  /* The pattern, as given. */
+  std::string pattern;
+
+  /* The pattern, compiled. */
+  dfa_t dfa;
+
+};  // regex_t
+
+/* Match what one leaf matches where it's inside what another matches,
+   which may in turn be inside what another matches, and so on.  We're a
+   leaf ourselves, so we're memoized, sketched, and planned like any other;
+   we just match by asking the file to look for our parts together. */
+class inside_t final
+    : public leaf_t {
+  public:
+
+  /* Take ownership of the parts, innermost first.  All but the first must
+     select elements.  is_directs says, for each part after the first,
+     whether the part before it must be directly inside it. */
+  inside_t(
+      std::vector<std::unique_ptr<leaf_t>> &&parts,
+      const std::vector<bool> &is_directs)
+      : parts(std::move(parts)), is_directs(is_directs) {
+    for (std::size_t i = 0; i < this->parts.size(); ++i) {
+      selector_t selector;
+      this->parts[i]->get_selector(selector);
+      selector.is_direct = (i > 0) && is_directs[i - 1];
+      chain.push_back(std::move(selector));
+    }
+  }
+
+  /* Match against the subject file. */
+  virtual result_t match(
+      const file_t &file, std::size_t limit) const override {
+    return file.match_inside(get_canon(), chain, limit);
+  }
+
+  /* Require what each of our parts requires in the sketch, since we match
+     only where they all do. */
+  virtual bool get_probe(sketch_t::probe_t &probe) const override {
+    bool is_known = false;
+    for (const auto &part: parts) {
+      is_known = part->get_probe(probe) || is_known;
+    }
+    return is_known;
+  }
+
+  /* Pretty-print the expression. */
+  virtual void pretty_print(std::ostream &strm) const override {
+    parts.front()->pretty_print(strm);
+    for (std::size_t i = 1; i < parts.size(); ++i) {
+      strm << (is_directs[i - 1] ? " directly inside " : " inside ");
+      parts[i]->pretty_print(strm);
+    }
+  }
+
+  private:
+
+  /* The leaves we're made of, innermost first.  These are never evaluated
+     on their own. */
+  std::vector<std::unique_ptr<leaf_t>> parts;
+
+  /* See constructor. */
+  std::vector<bool> is_directs;
+
+  /* The selectors of our parts, innermost first. */
+  std::vector<selector_t> chain;
+
+};  // inside_t
+
 /* Logical-not of a sub-expression. */
 class not_t final
     : public affix_t {
@@ -336,9 +844,15 @@ class not_t final
   not_t(std::unique_ptr<expr_t> &&subexpr)
       : affix_t(std::move(subexpr)) {}
 
+  /* Visit a logical-not. */
+  virtual void accept(visitor_t &visitor) const override {
+    visitor.visit(this);
+  }
+
   /* Evaluate the sub-expression on the given file and negate the result. */
-  virtual result_t eval(const file_t &file) const override {
-    return !(get_subexpr()->eval(file));
+  virtual result_t eval_node(
+      const file_t &file, context_t &context) const override {
+    return !(get_subexpr()->eval(file, context));
   }
 
   /* Pretty-print the sub-expression to the given stream, putting a 'not'
@@ -359,9 +873,15 @@ class group_t final
   group_t(std::unique_ptr<expr_t> &&subexpr)
       : affix_t(std::move(subexpr)) {}
 
+  /* Visit a grouping. */
+  virtual void accept(visitor_t &visitor) const override {
+    visitor.visit(this);
+  }
+
   /* Pass the evaluation through to the sub-expression. */
-  virtual result_t eval(const file_t &file) const override {
-    return get_subexpr()->eval(file);
+  virtual result_t eval_node(
+      const file_t &file, context_t &context) const override {
+    return get_subexpr()->eval(file, context);
   }
 
   /* Pretty-print the sub-expression to the given stream, putting parentheses
@@ -385,10 +905,25 @@ class and_t final
       std::unique_ptr<expr_t> &&right_subexpr)
       : infix_t(std::move(left_subexpr), std::move(right_subexpr)) {}
 
+  /* Visit a logical-and. */
+  virtual void accept(visitor_t &visitor) const override {
+    visitor.visit(this);
+  }
+
   /* Evaluate the sub-expressions on the given file and combine the
-     results with an logical-and operation. */
-  virtual result_t eval(const file_t &file) const override {
-    return get_left_subexpr()->eval(file) && get_right_subexpr()->eval(file);
+     results with an logical-and operation.  If we may short-circuit and the
+     first sub-expression doesn't match, we don't evaluate the second. */
+  virtual result_t eval_node(
+      const file_t &file, context_t &context) const override {
+    auto plan = get_plan();
+    auto result = get_first_subexpr(plan)->eval(file, context);
+    if (!result.is_match() && plan.may_short_circuit()) {
+      if (auto *profile = context.get_profile()) {
+        profile->record_short_circuit(this);
+      }
+      return std::move(result);
+    }
+    return result && get_second_subexpr(plan)->eval(file, context);
   }
 
   /* Pretty-print the sub-expressions to the given stream, putting an
@@ -412,10 +947,25 @@ class or_t final
       std::unique_ptr<expr_t> &&right_subexpr)
       : infix_t(std::move(left_subexpr), std::move(right_subexpr)) {}
 
+  /* Visit a logical-or. */
+  virtual void accept(visitor_t &visitor) const override {
+    visitor.visit(this);
+  }
+
   /* Evaluate the sub-expressions on the given file and combine the
-     results with a logical-or operation. */
-  virtual result_t eval(const file_t &file) const override {
-    return get_left_subexpr()->eval(file) || get_right_subexpr()->eval(file);
+     results with a logical-or operation.  If we may short-circuit and the
+     first sub-expression matches, we don't evaluate the second. */
+  virtual result_t eval_node(
+      const file_t &file, context_t &context) const override {
+    auto plan = get_plan();
+    auto result = get_first_subexpr(plan)->eval(file, context);
+    if (result.is_match() && plan.may_short_circuit()) {
+      if (auto *profile = context.get_profile()) {
+        profile->record_short_circuit(this);
+      }
+      return std::move(result);
+    }
+    return result || get_second_subexpr(plan)->eval(file, context);
   }
 
   /* Pretty-print the sub-expressions to the given stream, putting an
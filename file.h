@@ -1,90 +1,945 @@
 #pragma once
 
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <memory>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
+#include "bitmap.h"
+#include "dfa.h"
+#include "dom.h"
+#include "fold.h"
 #include "match.h"
+#include "metrics.h"
 #include "result.h"
+#include "selector.h"
+#include "sketch.h"
+#include "symbols.h"
 #include "utils.h"
 
 namespace qmellow {
 
-/* A file to match against. */
-class file_t {
+/* A file to match against.  We scan the HTML once, when we're constructed,
+   and keep the facts about its elements which the match functions need.
+   We're the source of the lines of our matches, so results can look up
+   their text later (see result_t).  The match functions find matches in
+   order and stop once they've found as many as the given limit. */
+class file_t
+    : public match_t::source_t {
   public:
 
   /* Borrow this type. */
   using cause_t = match_t::cause_t;
 
-  /* TODO: construct from some JS thing. */
+  /* Borrow this type. */
+  using symbol_t = symbol_table_t::symbol_t;
+
+  /* A sub-file and the path by which we report its matches. */
+  using sub_file_t = std::pair<std::string, std::shared_ptr<const file_t>>;
+
+  /* An empty file.  Nothing matches it. */
   file_t() {}
 
+  /* Take ownership of the given HTML text and scan it. */
+  explicit file_t(std::string &&text)
+      : text(std::move(text)) {
+    scan();
+  }
+
   /* Find matching anchors. */
   result_t match_anchor(
-        const cause_t *cause, const std::string &text) const {
-    result_t result;
-    /* TODO: call result.add(match_t(...)) for each match. */
-    return std::move(result);
+      const cause_t *cause, symbol_t asset, std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_anchor_ns);
+    auto tag = get_path_tag(selector_t::anchor);
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          file.for_each_path_elem(tag, asset, [&](dom_t::node_t node) {
+            return file.add_elem_match(result, cause, path, node);
+          });
+        });
   }
 
   /* Find matching strings without regard to case. */
   result_t match_case_insensitive_string(
-        const cause_t *cause, const std::string &text) const {
-    result_t result;
-    /* TODO: call result.add(match_t(...)) for each match. */
-    return std::move(result);
+        const cause_t *cause, const std::string &text,
+        std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_case_insensitive_string_ns);
+    auto folded = fold_text(text);
+    return match_searched(cause, true, needle_search_t(folded), limit);
   }
 
   /* Find matching strings. */
   result_t match_case_sensitive_string(
-        const cause_t *cause, const std::string &text) const {
-    result_t result;
-    /* TODO: call result.add(match_t(...)) for each match. */
-    return std::move(result);
+        const cause_t *cause, const std::string &text,
+        std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_case_sensitive_string_ns);
+    return match_searched(cause, false, needle_search_t(text), limit);
+  }
+
+  /* Find the lines on which the given search finds something in our text,
+     or, if is_folded, in our text folded (see fold_text()).  The search is
+     called as search(haystack, offset) and returns where the next thing it
+     looks for starts, at or after the offset, or npos.  The string matchers
+     search with std::string::find(); generated evaluators (see codegen.h)
+     search with code specialized to their literals. */
+  template <typename search_t>
+  result_t match_searched(
+      const cause_t *cause, bool is_folded, const search_t &search,
+      std::size_t limit) const {
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          file.match_string(result, cause, path, is_folded, search);
+        });
   }
 
   /* Find matching class names (within a single element). */
   result_t match_class_names(
-        const cause_t *cause, const std::vector<std::string> &texts) const {
-    result_t result;
-    /* TODO: call result.add(match_t(...)) for each match. */
-    return std::move(result);
+        const cause_t *cause, const std::vector<symbol_t> &symbols,
+        std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_class_names_ns);
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          file.for_each_class_elem(symbols, [&](dom_t::node_t node) {
+            return file.add_elem_match(result, cause, path, node);
+          });
+        });
   }
 
   /* Find matching CSS includes. */
   result_t match_css(
-        const cause_t *cause, const std::string &text) const {
-    result_t result;
-    /* TODO: call result.add(match_t(...)) for each match. */
-    return std::move(result);
+      const cause_t *cause, symbol_t asset, std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_css_ns);
+    auto tag = get_path_tag(selector_t::css);
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          file.for_each_path_elem(tag, asset, [&](dom_t::node_t node) {
+            return file.add_elem_match(result, cause, path, node);
+          });
+        });
   }
 
   /* Find matching CSS ids. */
-  result_t match_css_id(const cause_t *cause, const std::string &text) const {
-    result_t result;
-    /* TODO: call result.add(match_t(...)) for each match. */
-    return std::move(result);
+  result_t match_css_id(
+      const cause_t *cause, symbol_t id, std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_css_id_ns);
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          file.for_each_id_elem(id, [&](dom_t::node_t node) {
+            return file.add_elem_match(result, cause, path, node);
+          });
+        });
   }
 
   /* Find matching images. */
   result_t match_image(
-        const cause_t *cause, const std::string &text) const {
-    result_t result;
-    /* TODO: call result.add(match_t(...)) for each match. */
-    return std::move(result);
+      const cause_t *cause, symbol_t asset, std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_image_ns);
+    auto tag = get_path_tag(selector_t::image);
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          file.for_each_path_elem(tag, asset, [&](dom_t::node_t node) {
+            return file.add_elem_match(result, cause, path, node);
+          });
+        });
   }
 
   /* Find matching JS includes. */
   result_t match_js(
-        const cause_t *cause, const std::string &text) const {
-    result_t result;
-    /* TODO: call result.add(match_t(...)) for each match. */
+      const cause_t *cause, symbol_t asset, std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_js_ns);
+    auto tag = get_path_tag(selector_t::js);
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          file.for_each_path_elem(tag, asset, [&](dom_t::node_t node) {
+            return file.add_elem_match(result, cause, path, node);
+          });
+        });
+  }
+
+  /* Find lines matching a regular expression. */
+  result_t match_regex(
+      const cause_t *cause, const dfa_t &dfa, std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_regex_ns);
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          dfa.for_each_matching_line(file.text, [&](std::size_t offset) {
+            return file.add_match(
+                result, cause, path, file.get_line_number(offset));
+          });
+        });
+  }
+
+  /* Find what the first selector of the chain selects, where it's inside
+     what the second selects, which is inside what the third selects, and so
+     on.  Only the first selector may select text.  Each file, subject or
+     sub-file, is searched on its own, as an include's elements don't nest
+     in its includer's. */
+  result_t match_inside(
+      const cause_t *cause, const std::vector<selector_t> &chain,
+      std::size_t limit) const {
+    QMELLOW_METRICS_TIME(match_inside_ns);
+    return find_everywhere(
+        limit,
+        [&](const file_t &file, result_t &result, const std::string &path) {
+          file.match_chain(result, cause, path, chain);
+        });
+  }
+
+  /* Summarize our text and elements, and those of our sub-files, into the
+     given sketch.  Asset paths are added by every suffix which starts with
+     a slash, since that's how the path matchers compare them. */
+  void add_to_sketch(sketch_t &sketch) const {
+    add_own_to_sketch(sketch);
+    for (const auto &sub_file: sub_files) {
+      sub_file.second->add_own_to_sketch(sketch);
+    }
+  }
+
+  /* Give up our text, so its buffer can be reused, and forget everything
+     we scanned.  We're left as an empty file. */
+  std::string release_text() {
+    std::string result = std::move(text);
+    *this = file_t();
     return std::move(result);
   }
 
+  /* The paths named by our server-side include directives (the virtual or
+     file attribute of each <!--#include ... -->), in order, as written. */
+  const std::vector<std::string> &get_include_paths() const noexcept {
+    return include_paths;
+  }
+
+  /* The sub-files which are searched along with our own text, each with the
+     path by which its matches are reported.  A sub-file's own sub-files are
+     not searched, so the caller should flatten nested includes. */
+  const std::vector<sub_file_t> &get_sub_files() const noexcept {
+    return sub_files;
+  }
+
+  /* See accessor. */
+  void set_sub_files(std::vector<sub_file_t> &&sub_files) {
+    this->sub_files = std::move(sub_files);
+  }
+
+  /* Fold a string, the way case-insensitive matching does (see
+     folder_t). */
+  static std::string fold_text(const std::string &text) {
+    return folder_t::fold(text);
+  }
+
+  /* The HTML text we scanned. */
+  const std::string &get_text() const noexcept {
+    return text;
+  }
+
   private:
 
-  /* TODO: add state you'll use in the match functions, above. */
+  /* Summarize our own text and elements into the given sketch. */
+  void add_own_to_sketch(sketch_t &sketch) const {
+    const auto &table = symbol_table_t::get();
+    auto a = get_path_tag(selector_t::anchor),
+        link = get_path_tag(selector_t::css),
+        img = get_path_tag(selector_t::image),
+        script = get_path_tag(selector_t::js);
+    for (dom_t::node_t node = 0; node < dom.get_size(); ++node) {
+      auto id = dom.get_id(node);
+      if (id != dom_t::get_no_symbol()) {
+        sketch.add(sketch_t::id, table.get_text(id));
+      }
+      for (auto iter = dom.get_classes_begin(node);
+          iter != dom.get_classes_end(node); ++iter) {
+        sketch.add(sketch_t::class_name, table.get_text(*iter));
+      }
+      auto tag = dom.get_tag(node);
+      sketch_t::kind_t kind;
+      if (tag == a) {
+        kind = sketch_t::anchor;
+      } else if (tag == link) {
+        kind = sketch_t::css;
+      } else if (tag == img) {
+        kind = sketch_t::image;
+      } else if (tag == script) {
+        kind = sketch_t::js;
+      } else {
+        continue;
+      }
+      for (auto iter = dom.get_paths_begin(node);
+          iter != dom.get_paths_end(node); ++iter) {
+        sketch.add(kind, table.get_text(*iter));
+      }
+    }
+    sketch.add_text(sketch_t::exact_text, text);
+    sketch.add_text(sketch_t::folded_text, folded_text);
+  }
+
+  /* The size of the given attribute value, less any query string or
+     fragment.  A path leaf matches the rest of the value if it's a suffix
+     of it starting with a slash, so it matches absolute URLs as well (see
+     dom_t::get_paths_begin()). */
+  static std::size_t get_path_size(const char *data, std::size_t size) {
+    for (std::size_t i = 0; i < size; ++i) {
+      if (data[i] == '?' || data[i] == '#') {
+        return i;
+      }
+    }
+    return size;
+  }
+
+  /* The tag of the elements which refer to asset paths of the given kind,
+     which must be a kind of path selector. */
+  static symbol_t get_path_tag(selector_t::kind_t kind) {
+    static const symbol_t
+        a = symbol_table_t::get().intern("a"),
+        link = symbol_table_t::get().intern("link"),
+        img = symbol_table_t::get().intern("img"),
+        script = symbol_table_t::get().intern("script");
+    switch (kind) {
+      case selector_t::anchor: return a;
+      case selector_t::css: return link;
+      case selector_t::image: return img;
+      case selector_t::js: return script;
+      default: return symbol_table_t::get_no_symbol();
+    }  // switch
+  }
+
+  /* Call fn(node) for each element with the given tag which refers to a
+     path ending in the given one, in order, until it returns false. */
+  template <typename fn_t>
+  void for_each_path_elem(
+      symbol_t tag, symbol_t asset, const fn_t &fn) const {
+    for (dom_t::node_t node = 0; node < dom.get_size(); ++node) {
+      if (dom.get_tag(node) == tag) {
+        auto end = dom.get_paths_end(node);
+        if (std::find(dom.get_paths_begin(node), end, asset) != end
+            && !fn(node)) {
+          return;
+        }
+      }
+    }
+  }
+
+  /* Call fn(node) for each element which has all of the given class names,
+     in order, until it returns false. */
+  template <typename fn_t>
+  void for_each_class_elem(
+      const std::vector<symbol_t> &symbols, const fn_t &fn) const {
+    for (dom_t::node_t node = 0; node < dom.get_size(); ++node) {
+      auto begin = dom.get_classes_begin(node);
+      auto end = dom.get_classes_end(node);
+      bool is_match = (begin != end);
+      for (auto symbol: symbols) {
+        if (std::find(begin, end, symbol) == end) {
+          is_match = false;
+          break;
+        }
+      }
+      if (is_match && !fn(node)) {
+        return;
+      }
+    }
+  }
+
+  /* Call fn(node) for each element with the given id, in order, until it
+     returns false. */
+  template <typename fn_t>
+  void for_each_id_elem(symbol_t id, const fn_t &fn) const {
+    for (dom_t::node_t node = 0; node < dom.get_size(); ++node) {
+      if (dom.get_id(node) == id && !fn(node)) {
+        return;
+      }
+    }
+  }
+
+  /* Call fn(node) for each element the given selector, which must select
+     elements, selects, in order, until it returns false. */
+  template <typename fn_t>
+  void for_each_elem(const selector_t &selector, const fn_t &fn) const {
+    switch (selector.kind) {
+      case selector_t::anchor:
+      case selector_t::css:
+      case selector_t::image:
+      case selector_t::js: {
+        for_each_path_elem(
+            get_path_tag(selector.kind), selector.symbols.front(), fn);
+        break;
+      }
+      case selector_t::id: {
+        for_each_id_elem(selector.symbols.front(), fn);
+        break;
+      }
+      case selector_t::class_names: {
+        for_each_class_elem(selector.symbols, fn);
+        break;
+      }
+      case selector_t::exact_text:
+      case selector_t::folded_text: break;
+    }  // switch
+  }
+
+  /* Add to the result a match on the line of the given element.  Returns
+     false once the result is full. */
+  bool add_elem_match(
+      result_t &result, const cause_t *cause, const std::string &path,
+      dom_t::node_t node) const {
+    return add_match(result, cause, path, dom.get_line_number(node));
+  }
+
+  /* See match_inside().  We work from the outside in, narrowing the
+     elements of each selector to those inside the elements left of the one
+     after it, and finally narrowing the matches of the first. */
+  void match_chain(
+      result_t &result, const cause_t *cause, const std::string &path,
+      const std::vector<selector_t> &chain) const {
+    bitmap_t outers(dom.get_size());
+    for_each_elem(chain.back(), [&](dom_t::node_t node) {
+      outers.set(node);
+      return true;
+    });
+    for (auto i = chain.size() - 1; i > 0 && !outers.is_empty(); --i) {
+      const auto &inner = chain[i - 1];
+      bool is_direct = chain[i].is_direct;
+      if (!inner.is_element()) {
+        const auto &needle = inner.texts.front();
+        bool is_folded = (inner.kind == selector_t::folded_text);
+        const auto &haystack = is_folded ? folded_text : text;
+        std::vector<std::size_t> offsets;
+        for (auto offset = haystack.find(needle);
+            !needle.empty() && offset != std::string::npos;
+            offset = haystack.find(needle, offset + 1)) {
+          offsets.push_back(is_folded ? get_text_offset(offset) : offset);
+        }
+        filter_inside(offsets, outers, is_direct, [&](std::size_t offset) {
+          return add_match(result, cause, path, get_line_number(offset));
+        });
+        return;
+      }
+      std::vector<dom_t::node_t> nodes;
+      for_each_elem(inner, [&](dom_t::node_t node) {
+        nodes.push_back(node);
+        return true;
+      });
+      bitmap_t next_outers(dom.get_size());
+      filter_inside(nodes, outers, is_direct, [&](dom_t::node_t node) {
+        next_outers.set(node);
+        return true;
+      });
+      outers = std::move(next_outers);
+    }
+    outers.for_each([&](std::size_t node) {
+      if (!result.is_full()) {
+        add_elem_match(
+            result, cause, path, static_cast<dom_t::node_t>(node));
+      }
+    });
+  }
+
+  /* Call fn(node) for each of the given elements, in order, which is inside
+     one of the outer elements: directly, if is_direct, or at any depth,
+     until it returns false.  We
+     sweep the elements and the outer elements together in document order,
+     keeping a stack of the outer elements we're within, so each test is a
+     comparison against the end of a subtree. */
+  template <typename fn_t>
+  void filter_inside(
+      const std::vector<dom_t::node_t> &nodes, const bitmap_t &outers,
+      bool is_direct, const fn_t &fn) const {
+    if (is_direct) {
+      for (auto node: nodes) {
+        auto parent = dom.get_parent(node);
+        if (parent != dom_t::get_no_node() && outers.test(parent)
+            && !fn(node)) {
+          return;
+        }
+      }
+      return;
+    }
+    std::vector<dom_t::node_t> outer_nodes, stack;
+    outers.for_each([&](std::size_t node) {
+      outer_nodes.push_back(static_cast<dom_t::node_t>(node));
+    });
+    auto next_outer = outer_nodes.begin();
+    for (auto node: nodes) {
+      for (; next_outer != outer_nodes.end() && *next_outer < node;
+          ++next_outer) {
+        while (!stack.empty() && !dom.is_inside(*next_outer, stack.back())) {
+          stack.pop_back();
+        }
+        stack.push_back(*next_outer);
+      }
+      while (!stack.empty() && !dom.is_inside(node, stack.back())) {
+        stack.pop_back();
+      }
+      if (!stack.empty() && !fn(node)) {
+        return;
+      }
+    }
+  }
+
+  /* Call fn(offset) for each of the given offsets into the text, in order,
+     which is inside one of the outer elements: directly, meaning no other
+     element between, if is_direct, or at any depth, until it returns
+     false.  We sweep the offsets
+     and the elements together in order of where they start in the text,
+     keeping a stack of the elements we're within. */
+  template <typename fn_t>
+  void filter_inside(
+      const std::vector<std::size_t> &offsets, const bitmap_t &outers,
+      bool is_direct, const fn_t &fn) const {
+    std::vector<dom_t::node_t> stack;
+    std::size_t outer_depth = 0;
+    auto pop_ended = [&](std::size_t offset) {
+      while (!stack.empty() && dom.get_text_end(stack.back()) <= offset) {
+        outer_depth -= outers.test(stack.back()) ? 1 : 0;
+        stack.pop_back();
+      }
+    };
+    dom_t::node_t next_node = 0;
+    for (auto offset: offsets) {
+      for (; next_node < dom.get_size()
+          && dom.get_text_start(next_node) <= offset; ++next_node) {
+        pop_ended(dom.get_text_start(next_node));
+        stack.push_back(next_node);
+        outer_depth += outers.test(next_node) ? 1 : 0;
+      }
+      pop_ended(offset);
+      if (is_direct
+          ? (!stack.empty() && outers.test(stack.back()))
+          : (outer_depth > 0)) {
+        if (!fn(offset)) {
+          return;
+        }
+      }
+    }
+  }
+
+  /* Call find(file, result, path) for ourself, with an empty path, and then
+     for each of our sub-files, collecting the matches into one result with
+     the given limit.  With a limit, we go through the sub-files in order of
+     path, as that's the order of their matches, and stop once the result is
+     full. */
+  template <typename find_t>
+  result_t find_everywhere(std::size_t limit, const find_t &find) const {
+    result_t result(limit);
+    find(*this, result, std::string());
+    if (limit == result_t::get_no_limit()) {
+      for (const auto &sub_file: sub_files) {
+        find(*sub_file.second, result, sub_file.first);
+      }
+    } else if (!result.is_full() && !sub_files.empty()) {
+      std::vector<const sub_file_t *> by_path;
+      for (const auto &sub_file: sub_files) {
+        by_path.push_back(&sub_file);
+      }
+      std::stable_sort(
+          by_path.begin(), by_path.end(),
+          [](const sub_file_t *lhs, const sub_file_t *rhs) {
+            return lhs->first < rhs->first;
+          });
+      for (auto iter = by_path.begin();
+          iter != by_path.end() && !result.is_full(); ++iter) {
+        find(*(*iter)->second, result, (*iter)->first);
+      }
+    }
+    result.choose_representation();
+    return std::move(result);
+  }
+
+  /* Add to the result a match on the given line of this file, which is the
+     sub-file at the given path (or the subject, if the path is empty).
+     Returns false once the result is full. */
+  bool add_match(
+      result_t &result, const cause_t *cause, const std::string &path,
+      int line_number) const {
+    result.add_line(cause, path, this, line_number);
+    return !result.is_full();
+  }
+
+  /* The line number, counting from 1, of the given offset into our text. */
+  int get_line_number(std::size_t offset) const {
+    return static_cast<int>(
+        std::upper_bound(line_starts.begin(), line_starts.end(), offset)
+        - line_starts.begin());
+  }
+
+  /* The text of the given line, without its line break. */
+  virtual std::string get_line_text(int line_number) const override {
+    auto start = line_starts[line_number - 1];
+    auto end = text.find('\n', start);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    if (end > start && text[end - 1] == '\r') {
+      --end;
+    }
+    return text.substr(start, end - start);
+  }
+
+  /* A search, as match_searched() takes, for a needle with
+     std::string::find().  An empty needle is found nowhere. */
+  class needle_search_t final {
+    public:
+
+    /* Search for the given needle, which must outlive us. */
+    explicit needle_search_t(const std::string &needle)
+        : needle(needle) {}
+
+    /* See match_searched(). */
+    std::size_t operator()(
+        const std::string &haystack, std::size_t offset) const {
+      return needle.empty()
+          ? std::string::npos : haystack.find(needle, offset);
+    }
+
+    private:
+
+    /* See constructor. */
+    const std::string &needle;
+
+  };  // file_t::needle_search_t
+
+  /* Add a match for each line of our text, or, if is_folded, of our
+     folded text, on which the given search finds something, until the
+     result is full. */
+  template <typename search_t>
+  void match_string(
+      result_t &result, const cause_t *cause, const std::string &path,
+      bool is_folded, const search_t &search) const {
+    const auto &haystack = is_folded ? folded_text : text;
+    auto offset = search(haystack, 0);
+    while (offset != std::string::npos) {
+      int line_number = get_line_number(
+          is_folded ? get_text_offset(offset) : offset);
+      if (!add_match(result, cause, path, line_number)
+          || static_cast<std::size_t>(line_number) >= line_starts.size()) {
+        break;
+      }
+      auto next = line_starts[line_number];
+      offset = search(haystack, is_folded ? get_folded_offset(next) : next);
+    }
+  }
+
+  /* The offset into our text of the given offset into our folded text. */
+  std::size_t get_text_offset(std::size_t folded_offset) const noexcept {
+    return map_offset(folded_offset, false);
+  }
+
+  /* The offset into our folded text of the given offset into our text. */
+  std::size_t get_folded_offset(std::size_t text_offset) const noexcept {
+    return map_offset(text_offset, true);
+  }
+
+  /* Map an offset into our folded text to one into our text, or, if
+     is_to_folded, the other way, by way of the last shift at or before
+     it. */
+  std::size_t map_offset(
+      std::size_t offset, bool is_to_folded) const noexcept {
+    if (folded_shifts.empty()) {
+      return offset;
+    }
+    auto iter = std::upper_bound(
+        folded_shifts.begin(), folded_shifts.end(), offset,
+        [is_to_folded](std::size_t offset, const shift_t &shift) {
+          return offset < (is_to_folded ? shift.first : shift.second);
+        });
+    if (iter == folded_shifts.begin()) {
+      return offset;
+    }
+    --iter;
+    return is_to_folded
+        ? iter->second + (offset - iter->first)
+        : iter->first + (offset - iter->second);
+  }
+
+  /* Scan our text, finding line starts and elements. */
+  void scan() {
+    line_starts.push_back(0);
+    for (std::size_t i = 0; i < text.size(); ++i) {
+      if (text[i] == '\n') {
+        line_starts.push_back(i + 1);
+      }
+    }
+    folded_text.resize(text.size());
+    bool is_ascii =
+        folder_t::fold_ascii(text.data(), &folded_text[0], text.size());
+    std::size_t cursor = 0;
+    while ((cursor = text.find('<', cursor)) != std::string::npos) {
+      if (text.compare(cursor, 4, "<!--") == 0) {
+        auto start = cursor + 4;
+        cursor = skip_past(start, "-->");
+        if (folded_text.compare(start, 9, "#include ") == 0) {
+          scan_include(start + 9, cursor);
+        }
+      } else if (cursor + 1 < text.size()
+          && isalpha(static_cast<unsigned char>(text[cursor + 1]))) {
+        cursor = scan_start_tag(cursor);
+      } else if (cursor + 2 < text.size() && text[cursor + 1] == '/'
+          && isalpha(static_cast<unsigned char>(text[cursor + 2]))) {
+        cursor = scan_end_tag(cursor);
+      } else {
+        ++cursor;
+      }
+    }
+    dom.finish(text.size());
+    if (!is_ascii) {
+      fold_unicode();
+    }
+  }
+
+  /* Fold our text again, non-ASCII characters and all.  Scanning needs
+     only ASCII folded, and needs the folded text to line up with the text,
+     which it may not once the rest is folded, as some characters fold to
+     others of other sizes in UTF-8.  We note where it stops lining up. */
+  void fold_unicode() {
+    folded_text.clear();
+    folder_t::fold(
+        text.data(), text.size(), folded_text,
+        [this](std::size_t text_offset, std::size_t folded_offset) {
+          folded_shifts.emplace_back(text_offset, folded_offset);
+        });
+  }
+
+  /* Scan a start tag beginning at the given offset and return the offset
+     just past it.  Script and style elements have no child elements, so we
+     skip past their contents as well. */
+  std::size_t scan_start_tag(std::size_t cursor) {
+    int line_number = get_line_number(cursor);
+    auto offset = cursor++;
+    auto start = cursor;
+    while (cursor < text.size() && is_name_char(text[cursor])) {
+      ++cursor;
+    }
+    const char *tag = folded_text.data() + start;
+    auto tag_size = cursor - start;
+    bool is_raw_text = is_name(tag, tag_size, "script")
+        || is_name(tag, tag_size, "style");
+    bool is_container = !is_raw_text && !is_void_tag(tag, tag_size);
+    const char *path_name = nullptr;
+    if (is_name(tag, tag_size, "a") || is_name(tag, tag_size, "link")) {
+      path_name = "href";
+    } else if (is_name(tag, tag_size, "img")
+        || is_name(tag, tag_size, "script")) {
+      path_name = "src";
+    }
+    dom.open(tag, tag_size, line_number, offset, is_container);
+    bool is_self_closing = false;
+    for (;;) {
+      while (cursor < text.size() && is_space(text[cursor])) {
+        ++cursor;
+      }
+      if (cursor >= text.size() || text[cursor] == '>') {
+        break;
+      }
+      if (text[cursor] == '/') {
+        is_self_closing = true;
+        ++cursor;
+        continue;
+      }
+      is_self_closing = false;
+      start = cursor;
+      while (cursor < text.size() && is_name_char(text[cursor])) {
+        ++cursor;
+      }
+      if (cursor == start) {
+        ++cursor;
+        continue;
+      }
+      const char *name = folded_text.data() + start;
+      auto name_size = cursor - start;
+      dom_t::span_t value;
+      while (cursor < text.size() && is_space(text[cursor])) {
+        ++cursor;
+      }
+      if (cursor < text.size() && text[cursor] == '=') {
+        ++cursor;
+        while (cursor < text.size() && is_space(text[cursor])) {
+          ++cursor;
+        }
+        cursor = scan_value(cursor, value);
+      }
+      if (is_name(name, name_size, "id")) {
+        if (value.size) {
+          dom.set_id(text.data() + value.offset, value.size);
+        }
+      } else if (is_name(name, name_size, "class")) {
+        split_class_names(value);
+      } else if (path_name && is_name(name, name_size, path_name)) {
+        const char *data = text.data() + value.offset;
+        dom.set_path(data, get_path_size(data, value.size));
+      }
+    }
+    if (cursor < text.size()) {
+      ++cursor;
+    }
+    if (is_raw_text) {
+      cursor = skip_past(
+          cursor, is_name(tag, tag_size, "script") ? "</script" : "</style");
+    }
+    if (!is_container) {
+      dom.set_text_end(cursor);
+    } else if (is_self_closing) {
+      dom.close(tag, tag_size, cursor);
+    }
+    return cursor;
+  }
+
+  /* Scan an end tag beginning at the given offset, closing the element it
+     names, and return the offset just past it. */
+  std::size_t scan_end_tag(std::size_t cursor) {
+    cursor += 2;
+    auto start = cursor;
+    while (cursor < text.size() && is_name_char(text[cursor])) {
+      ++cursor;
+    }
+    auto end = text.find('>', cursor);
+    end = (end != std::string::npos) ? end + 1 : text.size();
+    dom.close(folded_text.data() + start, cursor - start, end);
+    return end;
+  }
+
+  /* True iff. the given (lower-case) tag or attribute name is the given
+     one. */
+  static bool is_name(const char *name, std::size_t size, const char *tag) {
+    return std::strlen(tag) == size && std::memcmp(name, tag, size) == 0;
+  }
+
+  /* True iff. the given (lower-case) tag name is of an element which can
+     never contain others, so has no end tag. */
+  static bool is_void_tag(const char *name, std::size_t size) {
+    static const char *const void_tags[] = {
+      "area", "base", "br", "col", "embed", "hr", "img", "input", "link",
+      "meta", "param", "source", "track", "wbr"
+    };
+    for (const char *tag: void_tags) {
+      if (is_name(name, size, tag)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Scan the attributes of a server-side include directive, between the
+     given offsets, keeping the path it names. */
+  void scan_include(std::size_t cursor, std::size_t end) {
+    while (cursor < end) {
+      auto start = cursor;
+      while (cursor < end && is_name_char(text[cursor])) {
+        ++cursor;
+      }
+      if (cursor == start || cursor >= end || text[cursor] != '=') {
+        cursor = start + 1;
+        continue;
+      }
+      const char *name = folded_text.data() + start;
+      auto name_size = cursor - start;
+      dom_t::span_t value;
+      cursor = scan_value(cursor + 1, value);
+      if (is_name(name, name_size, "virtual")
+          || is_name(name, name_size, "file")) {
+        include_paths.push_back(text.substr(value.offset, value.size));
+        break;
+      }
+    }
+  }
+
+  /* Scan an attribute value, quoted or not, beginning at the given offset,
+     finding its span.  Return the offset just past it. */
+  std::size_t scan_value(std::size_t cursor, dom_t::span_t &value) const {
+    if (cursor < text.size()
+        && (text[cursor] == '"' || text[cursor] == '\'')) {
+      char quote = text[cursor++];
+      auto end = text.find(quote, cursor);
+      if (end == std::string::npos) {
+        end = text.size();
+      }
+      value = dom_t::span_t(cursor, end - cursor);
+      return std::min(end + 1, text.size());
+    }
+    auto start = cursor;
+    while (cursor < text.size()
+        && !is_space(text[cursor]) && text[cursor] != '>') {
+      ++cursor;
+    }
+    value = dom_t::span_t(start, cursor - start);
+    return cursor;
+  }
+
+  /* Return the offset just past the first occurrence of the given
+     (lower-case) marker at or after the given offset, or the end of the
+     text if there is none. */
+  std::size_t skip_past(std::size_t cursor, const char *marker) const {
+    auto offset = folded_text.find(marker, cursor);
+    return (offset != std::string::npos)
+        ? offset + std::strlen(marker) : text.size();
+  }
+
+  /* True iff. the character can appear in a tag or attribute name. */
+  static bool is_name_char(char c) noexcept {
+    return isalnum(static_cast<unsigned char>(c))
+        || c == '-' || c == '_' || c == ':';
+  }
+
+  /* True iff. the character is whitespace. */
+  static bool is_space(char c) noexcept {
+    return isspace(static_cast<unsigned char>(c));
+  }
+
+  /* Split a whitespace-separated list of class names, adding each to the
+     element we're scanning. */
+  void split_class_names(dom_t::span_t value) {
+    std::size_t cursor = value.offset, end = value.offset + value.size;
+    for (;;) {
+      while (cursor < end && is_space(text[cursor])) {
+        ++cursor;
+      }
+      if (cursor >= end) {
+        break;
+      }
+      auto start = cursor;
+      while (cursor < end && !is_space(text[cursor])) {
+        ++cursor;
+      }
+      dom.add_class(text.data() + start, cursor - start);
+    }
+  }
+
+  /* See accessor. */
+  std::string text;
+
+  /* Our text, folded (see folder_t), for case-insensitive matching. */
+  std::string folded_text;
+
+  /* A point past which offsets into our text and into our folded text
+     differ by something else than before: the offsets into each. */
+  using shift_t = std::pair<std::size_t, std::size_t>;
+
+  /* The shifts, in order, each just past a character which folds to one
+     of another size.  Empty if our folded text lines up with our text, as
+     it does unless such characters are in it. */
+  std::vector<shift_t> folded_shifts;
+
+  /* The offsets into our text at which each line starts. */
+  std::vector<std::size_t> line_starts;
+
+  /* The elements in our text. */
+  dom_t dom;
+
+  /* See accessor. */
+  std::vector<std::string> include_paths;
+
+  /* See accessor. */
+  std::vector<sub_file_t> sub_files;
 
 };  // file_t
 
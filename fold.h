@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace qmellow {
+
+/* Case folding of UTF-8 text, for case-insensitive matching.  Each
+   character is replaced by its simple case folding, per Unicode's
+   CaseFolding.txt (statuses C and S), so 'Ğ' matches 'ğ', 'Σ' and 'ς'
+   match 'σ', and 'ẞ' matches 'ß'.  Folding is one character to one, so
+   'ß' doesn't match "ss", and locale-free, so Turkish 'I' folds to 'i', not
+   'ı'.  Bytes which aren't part of well-formed UTF-8 are left alone.
+
+   Most text we see is ASCII, so runs of it are found and folded 16 bytes
+   at a time, where SSE2 is available, and only the characters between
+   them are decoded and looked up. */
+class folder_t final {
+  public:
+
+  /* The size of the well-formed UTF-8 sequence of more than one byte at
+     the start of the given bytes, or 0 if there isn't one. */
+  static std::size_t get_utf8_size(
+      const char *data, std::size_t size) noexcept {
+    auto byte = [data](std::size_t i) {
+      return static_cast<unsigned char>(data[i]);
+    };
+    auto is_tail = [&byte](std::size_t i) {
+      return (byte(i) & 0xc0) == 0x80;
+    };
+    if (!size) {
+      return 0;
+    }
+    auto lead = byte(0);
+    if (lead >= 0xc2 && lead <= 0xdf) {
+      return (size >= 2 && is_tail(1)) ? 2 : 0;
+    }
+    if (lead >= 0xe0 && lead <= 0xef) {
+      if (size < 3 || !is_tail(1) || !is_tail(2)
+          || (lead == 0xe0 && byte(1) < 0xa0)
+          || (lead == 0xed && byte(1) >= 0xa0)) {
+        return 0;
+      }
+      return 3;
+    }
+    if (lead >= 0xf0 && lead <= 0xf4) {
+      if (size < 4 || !is_tail(1) || !is_tail(2) || !is_tail(3)
+          || (lead == 0xf0 && byte(1) < 0x90)
+          || (lead == 0xf4 && byte(1) >= 0x90)) {
+        return 0;
+      }
+      return 4;
+    }
+    return 0;
+  }
+
+  /* The number of bytes at the start of the given ones which are ASCII. */
+  static std::size_t get_ascii_size(
+      const char *data, std::size_t size) noexcept {
+    std::size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+      auto mask = _mm_movemask_epi8(_mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(data + i)));
+      if (mask) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+#endif
+    while (i < size && !(data[i] & 0x80)) {
+      ++i;
+    }
+    return i;
+  }
+
+  /* Copy the given bytes to dst, which may be the same, folding ASCII
+     capitals to lower case and leaving every other byte alone.  Returns
+     true iff. the bytes were all ASCII. */
+  static bool fold_ascii(
+      const char *src, char *dst, std::size_t size) noexcept {
+    std::size_t i = 0;
+    bool is_ascii = true;
+#ifdef __SSE2__
+    const auto before_a = _mm_set1_epi8('A' - 1);
+    const auto after_z = _mm_set1_epi8('Z' + 1);
+    const auto case_bit = _mm_set1_epi8(0x20);
+    auto high = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+      auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+      high = _mm_or_si128(high, bytes);
+      auto is_upper = _mm_and_si128(
+          _mm_cmpgt_epi8(bytes, before_a), _mm_cmplt_epi8(bytes, after_z));
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i *>(dst + i),
+          _mm_or_si128(bytes, _mm_and_si128(is_upper, case_bit)));
+    }
+    is_ascii = !_mm_movemask_epi8(high);
+#endif
+    for (; i < size; ++i) {
+      auto c = src[i];
+      is_ascii = is_ascii && !(c & 0x80);
+      dst[i] = (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+    return is_ascii;
+  }
+
+  /* Append the given text, folded, to the given string.  Where a
+     character's folding is of another size than it, as with 'K' (the
+     Kelvin sign), which folds to 'k', we call on_shift(text_offset,
+     folded_offset) with the offsets just past it in the text and in the
+     folded string, so offsets in one can be mapped to the other. */
+  template <typename on_shift_t>
+  static void fold(
+      const char *data, std::size_t size, std::string &folded,
+      const on_shift_t &on_shift) {
+    auto base = folded.size();
+    folded.resize(base + size);
+    std::size_t i = 0, j = base;
+    while (i < size) {
+      auto ascii_size = get_ascii_size(data + i, size - i);
+      fold_ascii(data + i, &folded[j], ascii_size);
+      i += ascii_size;
+      j += ascii_size;
+      while (i < size && (data[i] & 0x80)) {
+        auto char_size = get_utf8_size(data + i, size - i);
+        if (!char_size) {
+          folded[j++] = data[i++];
+          continue;
+        }
+        char buffer[4];
+        auto folded_size = encode(
+            fold_code_point(decode(data + i, char_size)), buffer);
+        if (folded_size > char_size) {
+          folded.resize(folded.size() + folded_size - char_size);
+        }
+        std::copy(buffer, buffer + folded_size, &folded[j]);
+        i += char_size;
+        j += folded_size;
+        if (folded_size != char_size) {
+          on_shift(i, j - base);
+        }
+      }
+    }
+    folded.resize(j);
+  }
+
+  /* Convenience. */
+  static std::string fold(const std::string &text) {
+    std::string folded;
+    fold(text.data(), text.size(), folded, [](std::size_t, std::size_t) {});
+    return folded;
+  }
+
+  /* The simple case folding of the given code point, which is itself if it
+     has none. */
+  static std::uint32_t fold_code_point(std::uint32_t code_point) noexcept {
+    if (code_point < 0x80) {
+      return (code_point >= 'A' && code_point <= 'Z')
+          ? code_point - 'A' + 'a' : code_point;
+    }
+    if (code_point < 0x800) {
+      return get_two_byte_folds().code_points[code_point - 0x80];
+    }
+    return fold_by_range(code_point);
+  }
+
+  private:
+
+  /* A run of code points which fold by adding the same delta: every one
+     from first to last, or every other one, as stride says. */
+  struct range_t {
+
+    /* See struct. */
+    std::uint32_t first, last;
+
+    /* See struct. */
+    std::int32_t delta;
+
+    /* See struct. */
+    std::uint32_t stride;
+
+  };  // folder_t::range_t
+
+  /* The foldings of the code points which take two bytes in UTF-8, from
+     U+0080 up, looked up directly, as they're the ones most of our
+     non-ASCII text is made of. */
+  struct two_byte_folds_t {
+
+    /* Look up each code point in the ranges. */
+    two_byte_folds_t() {
+      for (std::uint32_t i = 0; i < 0x800 - 0x80; ++i) {
+        code_points[i] = static_cast<std::uint16_t>(fold_by_range(i + 0x80));
+      }
+    }
+
+    /* See struct. */
+    std::uint16_t code_points[0x800 - 0x80];
+
+  };  // folder_t::two_byte_folds_t
+
+  /* See two_byte_folds_t. */
+  static const two_byte_folds_t &get_two_byte_folds() {
+    static const two_byte_folds_t folds;
+    return folds;
+  }
+
+  /* Fold the given code point by finding its range, if any. */
+  static std::uint32_t fold_by_range(std::uint32_t code_point) noexcept {
+    const range_t *end;
+    const auto *begin = get_ranges(end);
+    auto iter = std::upper_bound(
+        begin, end, code_point,
+        [](std::uint32_t code_point, const range_t &range) {
+          return code_point < range.first;
+        });
+    if (iter == begin) {
+      return code_point;
+    }
+    --iter;
+    if (code_point > iter->last || (code_point - iter->first) % iter->stride) {
+      return code_point;
+    }
+    return static_cast<std::uint32_t>(code_point + iter->delta);
+  }
+
+  /* The code point of the well-formed UTF-8 sequence of the given size. */
+  static std::uint32_t decode(const char *data, std::size_t size) noexcept {
+    static const unsigned char lead_masks[] = { 0, 0x7f, 0x1f, 0x0f, 0x07 };
+    std::uint32_t code_point =
+        static_cast<unsigned char>(data[0]) & lead_masks[size];
+    for (std::size_t i = 1; i < size; ++i) {
+      code_point =
+          (code_point << 6) | (static_cast<unsigned char>(data[i]) & 0x3f);
+    }
+    return code_point;
+  }
+
+  /* Write the UTF-8 encoding of the given code point to the buffer and
+     return its size. */
+  static std::size_t encode(std::uint32_t code_point, char *buffer) noexcept {
+    if (code_point < 0x80) {
+      buffer[0] = static_cast<char>(code_point);
+      return 1;
+    }
+    if (code_point < 0x800) {
+      buffer[0] = static_cast<char>(0xc0 | (code_point >> 6));
+      buffer[1] = static_cast<char>(0x80 | (code_point & 0x3f));
+      return 2;
+    }
+    if (code_point < 0x10000) {
+      buffer[0] = static_cast<char>(0xe0 | (code_point >> 12));
+      buffer[1] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+      buffer[2] = static_cast<char>(0x80 | (code_point & 0x3f));
+      return 3;
+    }
+    buffer[0] = static_cast<char>(0xf0 | (code_point >> 18));
+    buffer[1] = static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+    buffer[2] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+    buffer[3] = static_cast<char>(0x80 | (code_point & 0x3f));
+    return 4;
+  }
+
+  /* The ranges of code points above ASCII which fold, in order, from
+     Unicode 14's CaseFolding.txt.  Sets end to just past the last. */
+  static const range_t *get_ranges(const range_t *&end) noexcept {
+    static const range_t ranges[] = {
+      {0x00b5, 0x00b5, 775, 1}, {0x00c0, 0x00d6, 32, 1},
+      {0x00d8, 0x00de, 32, 1}, {0x0100, 0x012e, 1, 2}, {0x0132, 0x0136, 1, 2},
+      {0x0139, 0x0147, 1, 2}, {0x014a, 0x0176, 1, 2},
+      {0x0178, 0x0178, -121, 1}, {0x0179, 0x017d, 1, 2},
+      {0x017f, 0x017f, -268, 1}, {0x0181, 0x0181, 210, 1},
+      {0x0182, 0x0184, 1, 2}, {0x0186, 0x0186, 206, 1}, {0x0187, 0x0187, 1, 1},
+      {0x0189, 0x018a, 205, 1}, {0x018b, 0x018b, 1, 1},
+      {0x018e, 0x018e, 79, 1}, {0x018f, 0x018f, 202, 1},
+      {0x0190, 0x0190, 203, 1}, {0x0191, 0x0191, 1, 1},
+      {0x0193, 0x0193, 205, 1}, {0x0194, 0x0194, 207, 1},
+      {0x0196, 0x0196, 211, 1}, {0x0197, 0x0197, 209, 1},
+      {0x0198, 0x0198, 1, 1}, {0x019c, 0x019c, 211, 1},
+      {0x019d, 0x019d, 213, 1}, {0x019f, 0x019f, 214, 1},
+      {0x01a0, 0x01a4, 1, 2}, {0x01a6, 0x01a6, 218, 1}, {0x01a7, 0x01a7, 1, 1},
+      {0x01a9, 0x01a9, 218, 1}, {0x01ac, 0x01ac, 1, 1},
+      {0x01ae, 0x01ae, 218, 1}, {0x01af, 0x01af, 1, 1},
+      {0x01b1, 0x01b2, 217, 1}, {0x01b3, 0x01b5, 1, 2},
+      {0x01b7, 0x01b7, 219, 1}, {0x01b8, 0x01b8, 1, 1}, {0x01bc, 0x01bc, 1, 1},
+      {0x01c4, 0x01c4, 2, 1}, {0x01c5, 0x01c5, 1, 1}, {0x01c7, 0x01c7, 2, 1},
+      {0x01c8, 0x01c8, 1, 1}, {0x01ca, 0x01ca, 2, 1}, {0x01cb, 0x01db, 1, 2},
+      {0x01de, 0x01ee, 1, 2}, {0x01f1, 0x01f1, 2, 1}, {0x01f2, 0x01f4, 1, 2},
+      {0x01f6, 0x01f6, -97, 1}, {0x01f7, 0x01f7, -56, 1},
+      {0x01f8, 0x021e, 1, 2}, {0x0220, 0x0220, -130, 1},
+      {0x0222, 0x0232, 1, 2}, {0x023a, 0x023a, 10795, 1},
+      {0x023b, 0x023b, 1, 1}, {0x023d, 0x023d, -163, 1},
+      {0x023e, 0x023e, 10792, 1}, {0x0241, 0x0241, 1, 1},
+      {0x0243, 0x0243, -195, 1}, {0x0244, 0x0244, 69, 1},
+      {0x0245, 0x0245, 71, 1}, {0x0246, 0x024e, 1, 2},
+      {0x0345, 0x0345, 116, 1}, {0x0370, 0x0372, 1, 2}, {0x0376, 0x0376, 1, 1},
+      {0x037f, 0x037f, 116, 1}, {0x0386, 0x0386, 38, 1},
+      {0x0388, 0x038a, 37, 1}, {0x038c, 0x038c, 64, 1},
+      {0x038e, 0x038f, 63, 1}, {0x0391, 0x03a1, 32, 1},
+      {0x03a3, 0x03ab, 32, 1}, {0x03c2, 0x03c2, 1, 1}, {0x03cf, 0x03cf, 8, 1},
+      {0x03d0, 0x03d0, -30, 1}, {0x03d1, 0x03d1, -25, 1},
+      {0x03d5, 0x03d5, -15, 1}, {0x03d6, 0x03d6, -22, 1},
+      {0x03d8, 0x03ee, 1, 2}, {0x03f0, 0x03f0, -54, 1},
+      {0x03f1, 0x03f1, -48, 1}, {0x03f4, 0x03f4, -60, 1},
+      {0x03f5, 0x03f5, -64, 1}, {0x03f7, 0x03f7, 1, 1},
+      {0x03f9, 0x03f9, -7, 1}, {0x03fa, 0x03fa, 1, 1},
+      {0x03fd, 0x03ff, -130, 1}, {0x0400, 0x040f, 80, 1},
+      {0x0410, 0x042f, 32, 1}, {0x0460, 0x0480, 1, 2}, {0x048a, 0x04be, 1, 2},
+      {0x04c0, 0x04c0, 15, 1}, {0x04c1, 0x04cd, 1, 2}, {0x04d0, 0x052e, 1, 2},
+      {0x0531, 0x0556, 48, 1}, {0x10a0, 0x10c5, 7264, 1},
+      {0x10c7, 0x10c7, 7264, 1}, {0x10cd, 0x10cd, 7264, 1},
+      {0x13f8, 0x13fd, -8, 1}, {0x1c80, 0x1c80, -6222, 1},
+      {0x1c81, 0x1c81, -6221, 1}, {0x1c82, 0x1c82, -6212, 1},
+      {0x1c83, 0x1c84, -6210, 1}, {0x1c85, 0x1c85, -6211, 1},
+      {0x1c86, 0x1c86, -6204, 1}, {0x1c87, 0x1c87, -6180, 1},
+      {0x1c88, 0x1c88, 35267, 1}, {0x1c90, 0x1cba, -3008, 1},
+      {0x1cbd, 0x1cbf, -3008, 1}, {0x1e00, 0x1e94, 1, 2},
+      {0x1e9b, 0x1e9b, -58, 1}, {0x1e9e, 0x1e9e, -7615, 1},
+      {0x1ea0, 0x1efe, 1, 2}, {0x1f08, 0x1f0f, -8, 1}, {0x1f18, 0x1f1d, -8, 1},
+      {0x1f28, 0x1f2f, -8, 1}, {0x1f38, 0x1f3f, -8, 1},
+      {0x1f48, 0x1f4d, -8, 1}, {0x1f59, 0x1f5f, -8, 2},
+      {0x1f68, 0x1f6f, -8, 1}, {0x1f88, 0x1f8f, -8, 1},
+      {0x1f98, 0x1f9f, -8, 1}, {0x1fa8, 0x1faf, -8, 1},
+      {0x1fb8, 0x1fb9, -8, 1}, {0x1fba, 0x1fbb, -74, 1},
+      {0x1fbc, 0x1fbc, -9, 1}, {0x1fbe, 0x1fbe, -7173, 1},
+      {0x1fc8, 0x1fcb, -86, 1}, {0x1fcc, 0x1fcc, -9, 1},
+      {0x1fd8, 0x1fd9, -8, 1}, {0x1fda, 0x1fdb, -100, 1},
+      {0x1fe8, 0x1fe9, -8, 1}, {0x1fea, 0x1feb, -112, 1},
+      {0x1fec, 0x1fec, -7, 1}, {0x1ff8, 0x1ff9, -128, 1},
+      {0x1ffa, 0x1ffb, -126, 1}, {0x1ffc, 0x1ffc, -9, 1},
+      {0x2126, 0x2126, -7517, 1}, {0x212a, 0x212a, -8383, 1},
+      {0x212b, 0x212b, -8262, 1}, {0x2132, 0x2132, 28, 1},
+      {0x2160, 0x216f, 16, 1}, {0x2183, 0x2183, 1, 1}, {0x24b6, 0x24cf, 26, 1},
+      {0x2c00, 0x2c2f, 48, 1}, {0x2c60, 0x2c60, 1, 1},
+      {0x2c62, 0x2c62, -10743, 1}, {0x2c63, 0x2c63, -3814, 1},
+      {0x2c64, 0x2c64, -10727, 1}, {0x2c67, 0x2c6b, 1, 2},
+      {0x2c6d, 0x2c6d, -10780, 1}, {0x2c6e, 0x2c6e, -10749, 1},
+      {0x2c6f, 0x2c6f, -10783, 1}, {0x2c70, 0x2c70, -10782, 1},
+      {0x2c72, 0x2c72, 1, 1}, {0x2c75, 0x2c75, 1, 1},
+      {0x2c7e, 0x2c7f, -10815, 1}, {0x2c80, 0x2ce2, 1, 2},
+      {0x2ceb, 0x2ced, 1, 2}, {0x2cf2, 0x2cf2, 1, 1}, {0xa640, 0xa66c, 1, 2},
+      {0xa680, 0xa69a, 1, 2}, {0xa722, 0xa72e, 1, 2}, {0xa732, 0xa76e, 1, 2},
+      {0xa779, 0xa77b, 1, 2}, {0xa77d, 0xa77d, -35332, 1},
+      {0xa77e, 0xa786, 1, 2}, {0xa78b, 0xa78b, 1, 1},
+      {0xa78d, 0xa78d, -42280, 1}, {0xa790, 0xa792, 1, 2},
+      {0xa796, 0xa7a8, 1, 2}, {0xa7aa, 0xa7aa, -42308, 1},
+      {0xa7ab, 0xa7ab, -42319, 1}, {0xa7ac, 0xa7ac, -42315, 1},
+      {0xa7ad, 0xa7ad, -42305, 1}, {0xa7ae, 0xa7ae, -42308, 1},
+      {0xa7b0, 0xa7b0, -42258, 1}, {0xa7b1, 0xa7b1, -42282, 1},
+      {0xa7b2, 0xa7b2, -42261, 1}, {0xa7b3, 0xa7b3, 928, 1},
+      {0xa7b4, 0xa7c2, 1, 2}, {0xa7c4, 0xa7c4, -48, 1},
+      {0xa7c5, 0xa7c5, -42307, 1}, {0xa7c6, 0xa7c6, -35384, 1},
+      {0xa7c7, 0xa7c9, 1, 2}, {0xa7d0, 0xa7d0, 1, 1}, {0xa7d6, 0xa7d8, 1, 2},
+      {0xa7f5, 0xa7f5, 1, 1}, {0xab70, 0xabbf, -38864, 1},
+      {0xff21, 0xff3a, 32, 1}, {0x10400, 0x10427, 40, 1},
+      {0x104b0, 0x104d3, 40, 1}, {0x10570, 0x1057a, 39, 1},
+      {0x1057c, 0x1058a, 39, 1}, {0x1058c, 0x10592, 39, 1},
+      {0x10594, 0x10595, 39, 1}, {0x10c80, 0x10cb2, 64, 1},
+      {0x118a0, 0x118bf, 32, 1}, {0x16e40, 0x16e5f, 32, 1},
+      {0x1e900, 0x1e921, 34, 1},
+    };
+    end = ranges + sizeof(ranges) / sizeof(ranges[0]);
+    return ranges;
+  }
+
+};  // folder_t
+
+}  // qmellow
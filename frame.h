@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace qmellow {
+
+/* Frames carry messages over a stream socket.  Each frame is a 4-byte
+   big-endian length followed by that many bytes of payload.
+
+   A client sends one frame holding the text of a query.  The daemon answers
+   with any number of match frames, then one end frame or one error frame.
+   To ask only which files match, the client puts the letter L and a tab in
+   front of the query; the daemon then answers with file frames in place of
+   match frames.  To have at most some number of matches of each file, the
+   first in order of sub-file and line, the client puts the letter N, the
+   number, and a tab in front of the query (after any L and tab, which
+   makes it moot).  The payload of each frame starts with a letter telling
+   which it is and is made of fields separated by tabs:
+
+     M <path> <line number> <cause> <line text>
+     F <path>
+     E <number of matching files> <number of files searched>
+       <number of those ruled out by their sketches>
+     X <error message> */
+
+/* The largest payload we'll accept. */
+inline std::uint32_t get_max_frame_size() noexcept {
+  return 1 << 24;
+}
+
+/* Append a frame holding the given payload to the given buffer. */
+inline void append_frame(std::string &buffer, const std::string &payload) {
+  std::uint32_t size = payload.size();
+  unsigned char header[4] = {
+    static_cast<unsigned char>(size >> 24),
+    static_cast<unsigned char>(size >> 16),
+    static_cast<unsigned char>(size >> 8),
+    static_cast<unsigned char>(size)
+  };
+  buffer.append(reinterpret_cast<const char *>(header), 4);
+  buffer += payload;
+}
+
+/* Write all of the given bytes. */
+inline void write_all(int fd, const std::string &bytes) {
+  const char *cursor = bytes.data();
+  std::size_t left = bytes.size();
+  while (left) {
+    auto n = send(fd, cursor, left, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(
+          std::string("could not write frame: ") + std::strerror(errno));
+    }
+    cursor += n;
+    left -= n;
+  }
+}
+
+/* Write a frame holding the given payload. */
+inline void write_frame(int fd, const std::string &payload) {
+  std::string frame;
+  append_frame(frame, payload);
+  write_all(fd, frame);
+}
+
+/* Gathers frames and writes them together, so a long answer takes a few
+   large writes rather than one per frame. */
+class frame_writer_t final {
+  public:
+
+  /* Write to the given socket, whenever we've gathered at least the given
+     number of bytes. */
+  explicit frame_writer_t(int fd, std::size_t capacity = 1 << 16)
+      : fd(fd), capacity(capacity) {}
+
+  /* Add a frame holding the given payload, writing what we've gathered if
+     we're full. */
+  void write(const std::string &payload) {
+    append_frame(buffer, payload);
+    if (buffer.size() >= capacity) {
+      flush();
+    }
+  }
+
+  /* Write what we've gathered now. */
+  void flush() {
+    write_all(fd, buffer);
+    buffer.clear();
+  }
+
+  private:
+
+  /* See constructor. */
+  int fd;
+
+  /* See constructor. */
+  std::size_t capacity;
+
+  /* The frames gathered but not yet written. */
+  std::string buffer;
+
+};  // frame_writer_t
+
+/* Read exactly size bytes.  Returns false if the stream ends first, before
+   any bytes arrive; ending part-way through is an error. */
+inline bool read_exactly(int fd, char *buf, std::size_t size) {
+  std::size_t done = 0;
+  while (done < size) {
+    auto n = read(fd, buf + done, size - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(
+          std::string("could not read frame: ") + std::strerror(errno));
+    }
+    if (n == 0) {
+      if (done == 0) {
+        return false;
+      }
+      throw std::runtime_error("stream ended inside a frame");
+    }
+    done += n;
+  }
+  return true;
+}
+
+/* Read a frame into payload.  Returns false if the stream ended cleanly
+   instead. */
+inline bool read_frame(int fd, std::string &payload) {
+  unsigned char header[4];
+  if (!read_exactly(fd, reinterpret_cast<char *>(header), 4)) {
+    return false;
+  }
+  std::uint32_t size =
+      (std::uint32_t(header[0]) << 24) | (std::uint32_t(header[1]) << 16)
+      | (std::uint32_t(header[2]) << 8) | std::uint32_t(header[3]);
+  if (size > get_max_frame_size()) {
+    std::ostringstream strm;
+    strm << "frame of " << size << " bytes is too large";
+    throw std::runtime_error(strm.str());
+  }
+  payload.resize(size);
+  if (size && !read_exactly(fd, &payload[0], size)) {
+    throw std::runtime_error("stream ended inside a frame");
+  }
+  return true;
+}
+
+}  // qmellow
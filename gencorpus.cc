@@ -0,0 +1,130 @@
+/* Generates a synthetic corpus of HTML pages for benchmarking.  The output is
+   a function of the options alone, so the same command line always makes the
+   same corpus.
+
+     gencorpus [--option=value ...] out_dir
+
+   Pages go in out_dir/pages, a thousand to a subdirectory.  The files they
+   include with server-side includes go in out_dir/inc. */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include "synth.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* Make the directory at the given path, if it doesn't already exist. */
+void make_dir(const string &path) {
+  if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) {
+    ostringstream strm;
+    strm << "could not make \"" << path << "\": " << strerror(errno);
+    throw runtime_error(strm.str());
+  }
+}
+
+/* Write the given text to a file at the given path. */
+void write_file(const string &path, const string &text) {
+  ofstream strm(path, ios::binary);
+  strm << text;
+  if (!strm) {
+    ostringstream msg;
+    msg << "could not write to \"" << path << '"';
+    throw runtime_error(msg.str());
+  }
+}
+
+/* Write the usage message and exit. */
+void usage() {
+  cerr
+      << "usage: gencorpus [--option=value ...] out_dir\n"
+      << "options:\n"
+      << "  --seed=N             pseudo-random seed (1)\n"
+      << "  --pages=N            number of pages (1000)\n"
+      << "  --median-lines=N     median lines per page (200)\n"
+      << "  --sigma=X            log-normal shape of page sizes (0.8)\n"
+      << "  --vocab=N            distinct words, classes, ids, assets (100)\n"
+      << "  --class-density=X    chance an element has classes (0.3)\n"
+      << "  --id-density=X       chance an element has an id (0.05)\n"
+      << "  --asset-density=X    chance a line refers to an asset (0.05)\n"
+      << "  --include-density=X  chance a line is an include (0.01)\n";
+  exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  map<string, double> opts = {
+    { "seed", 1 }, { "pages", 1000 }, { "median-lines", 200 },
+    { "sigma", 0.8 }, { "vocab", 100 }, { "class-density", 0.3 },
+    { "id-density", 0.05 }, { "asset-density", 0.05 },
+    { "include-density", 0.01 }
+  };
+  string out_dir;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, 2, "--") != 0) {
+      if (!out_dir.empty()) {
+        usage();
+      }
+      out_dir = arg;
+      continue;
+    }
+    auto eq = arg.find('=');
+    auto iter = opts.find(arg.substr(2, eq - 2));
+    if (eq == string::npos || iter == opts.end()) {
+      usage();
+    }
+    iter->second = atof(arg.c_str() + eq + 1);
+  }
+  if (out_dir.empty()) {
+    usage();
+  }
+  try {
+    synth_t synth(static_cast<uint64_t>(opts["seed"]));
+    synth_t::html_params_t params;
+    params.vocab_size = static_cast<size_t>(opts["vocab"]);
+    params.class_density = opts["class-density"];
+    params.id_density = opts["id-density"];
+    params.asset_density = opts["asset-density"];
+    params.include_density = opts["include-density"];
+    make_dir(out_dir);
+    make_dir(out_dir + "/inc");
+    make_dir(out_dir + "/pages");
+    synth_t::html_params_t inc_params = params;
+    inc_params.include_density = 0;
+    for (size_t i = 0; i < params.vocab_size; ++i) {
+      inc_params.line_count = 1 + synth.below(10);
+      ostringstream path;
+      path << out_dir << "/inc/i" << i << ".html";
+      write_file(path.str(), synth.make_html(inc_params));
+    }
+    auto page_count = static_cast<size_t>(opts["pages"]);
+    for (size_t i = 0; i < page_count; ++i) {
+      ostringstream dir;
+      dir << out_dir << "/pages/" << (i / 1000);
+      if (i % 1000 == 0) {
+        make_dir(dir.str());
+      }
+      params.line_count = static_cast<size_t>(
+          synth.lognormal(opts["median-lines"], opts["sigma"])) + 1;
+      ostringstream path;
+      path << dir.str() << "/p" << i << ".html";
+      write_file(path.str(), synth.make_html(params));
+    }
+  } catch (const exception &ex) {
+    cerr << "error: " << ex.what() << endl;
+    return 1;
+  }
+  return 0;
+}
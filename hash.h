@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace qmellow {
+
+/* A fast, non-cryptographic, 64-bit hash of a run of bytes.  This is
+   Yann Collet's XXH64, which hashes 32 bytes per round in four independent
+   lanes and runs at several gigabytes per second.  Don't use it where an
+   adversary chooses the input and collisions matter. */
+inline std::uint64_t hash_bytes(
+    const char *data, std::size_t size, std::uint64_t seed = 0) {
+  const std::uint64_t
+      p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL,
+      p3 = 1609587929392839161ULL, p4 = 9650029242287828579ULL,
+      p5 = 2870177450012600261ULL;
+  auto rotl = [](std::uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  };
+  auto read64 = [](const char *p) {
+    std::uint64_t x;
+    std::memcpy(&x, p, sizeof(x));
+    return x;
+  };
+  auto read32 = [](const char *p) {
+    std::uint32_t x;
+    std::memcpy(&x, p, sizeof(x));
+    return static_cast<std::uint64_t>(x);
+  };
+  auto round = [&](std::uint64_t acc, std::uint64_t input) {
+    return rotl(acc + input * p2, 31) * p1;
+  };
+  auto merge = [&](std::uint64_t acc, std::uint64_t val) {
+    return (acc ^ round(0, val)) * p1 + p4;
+  };
+  const char *end = data + size;
+  std::uint64_t h;
+  if (size >= 32) {
+    std::uint64_t
+        v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+    for (const char *limit = end - 32; data <= limit; data += 32) {
+      v1 = round(v1, read64(data));
+      v2 = round(v2, read64(data + 8));
+      v3 = round(v3, read64(data + 16));
+      v4 = round(v4, read64(data + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge(h, v1);
+    h = merge(h, v2);
+    h = merge(h, v3);
+    h = merge(h, v4);
+  } else {
+    h = seed + p5;
+  }
+  h += size;
+  for (; data + 8 <= end; data += 8) {
+    h = rotl(h ^ round(0, read64(data)), 27) * p1 + p4;
+  }
+  if (data + 4 <= end) {
+    h = rotl(h ^ (read32(data) * p1), 23) * p2 + p3;
+    data += 4;
+  }
+  for (; data < end; ++data) {
+    h = rotl(h ^ (static_cast<unsigned char>(*data) * p5), 11) * p1;
+  }
+  h ^= h >> 33;
+  h *= p2;
+  h ^= h >> 29;
+  h *= p3;
+  h ^= h >> 32;
+  return h;
+}
+
+/* Convenience. */
+inline std::uint64_t hash_bytes(
+    const std::string &text, std::uint64_t seed = 0) {
+  return hash_bytes(text.data(), text.size(), seed);
+}
+
+}  // qmellow
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include "decompress.h"
+#include "file.h"
+#include "parallel.h"
+#include "sketch.h"
+#include "utils.h"
+
+namespace qmellow {
+
+/* The scanned files of a corpus, kept in memory so queries don't have to
+   read and scan them again.  Each file is remembered along with the
+   modification time and size it had when we read it, so we can tell when
+   it needs reading again, and a sketch of it, so queries can skip it
+   without looking at it (see prefilter_t).  If we're asked not to keep
+   files, we keep only their sketches, and files are read again when a
+   query can't rule them out.  Files and sketches are shared, so a query
+   can go on using a snapshot of the index while the index is updated. */
+class index_t final {
+  public:
+
+  /* A file in a snapshot of the index. */
+  struct entry_t {
+
+    /* Where the file is. */
+    std::string path;
+
+    /* The file's sketch. */
+    std::shared_ptr<const sketch_t> sketch;
+
+    /* The scanned file, or null if we don't keep files. */
+    std::shared_ptr<const file_t> file;
+
+  };  // index_t::entry_t
+
+  /* Index the tree beneath the given directory, reading files on the given
+     number of threads (zero meaning one per hardware thread).  If
+     keep_files is false, we keep only sketches. */
+  explicit index_t(
+      const std::string &root, std::size_t thread_count = 0,
+      bool keep_files = true)
+      : root(root), thread_count(thread_count), keep_files(keep_files),
+        generation(0) {
+    rescan();
+  }
+
+  /* The scanned file of the given entry, read again if we don't keep
+     files.  Throws if it can't be read. */
+  static std::shared_ptr<const file_t> load(const entry_t &entry) {
+    return entry.file
+        ? entry.file
+        : std::make_shared<file_t>(load_subject_file(entry.path));
+  }
+
+  /* The directory we index. */
+  const std::string &get_root() const noexcept {
+    return root;
+  }
+
+  /* Bring the whole index up to date with the file system.  Returns the
+     paths whose entries were added, changed, or removed. */
+  std::vector<std::string> rescan() {
+    std::vector<std::string> paths;
+    list_files(root, paths);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (const auto &record: records) {
+        paths.push_back(record.first);
+      }
+    }
+    return update(paths);
+  }
+
+  /* Bring the entries for the given paths up to date with the file system.
+     A path which no longer exists takes with it every entry beneath it, in
+     case it was a directory.  Returns the paths whose entries were added,
+     changed, or removed. */
+  std::vector<std::string> update(std::vector<std::string> paths) {
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+    std::vector<std::string> changed;
+    std::vector<std::pair<std::string, stamp_t>> to_read;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (const auto &path: paths) {
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+          stamp_t stamp(info);
+          auto iter = records.find(path);
+          if (iter == records.end() || !(iter->second.stamp == stamp)) {
+            to_read.emplace_back(path, stamp);
+          }
+        } else {
+          remove(path, changed);
+        }
+      }
+    }
+    std::vector<std::shared_ptr<const file_t>> files(to_read.size());
+    std::vector<std::shared_ptr<const sketch_t>> sketches(to_read.size());
+    parallel_for(to_read.size(), thread_count, [&](std::size_t i) {
+      try {
+        auto file = std::make_shared<file_t>(
+            load_subject_file(to_read[i].first));
+        auto sketch = std::make_shared<sketch_t>();
+        file->add_to_sketch(*sketch);
+        sketches[i] = std::move(sketch);
+        if (keep_files) {
+          files[i] = std::move(file);
+        }
+      } catch (const std::runtime_error &) {}
+    });
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::size_t i = 0; i < to_read.size(); ++i) {
+      const auto &path = to_read[i].first;
+      if (sketches[i]) {
+        auto &record = records[path];
+        record.stamp = to_read[i].second;
+        record.sketch = std::move(sketches[i]);
+        record.file = std::move(files[i]);
+        changed.push_back(path);
+        ++generation;
+      } else {
+        remove(path, changed);
+      }
+    }
+    return changed;
+  }
+
+  /* Every entry, in order of path. */
+  std::vector<entry_t> get_snapshot() const {
+    std::size_t generation;
+    return get_snapshot(generation);
+  }
+
+  /* Every entry, in order of path, along with the generation of the index
+     they come from.  The generation changes whenever an entry does, so two
+     snapshots of the same generation have the same entries in the same
+     order, and what was learned about one holds for the other. */
+  std::vector<entry_t> get_snapshot(std::size_t &generation) const {
+    std::vector<entry_t> entries;
+    std::lock_guard<std::mutex> lock(mutex);
+    generation = this->generation;
+    entries.reserve(records.size());
+    for (const auto &record: records) {
+      entries.push_back(
+          entry_t { record.first, record.second.sketch, record.second.file });
+    }
+    return entries;
+  }
+
+  private:
+
+  /* What we knew about a file when we read it. */
+  struct stamp_t {
+
+    /* Nothing known. */
+    stamp_t() noexcept
+        : mtime_sec(0), mtime_nsec(0), size(0) {}
+
+    /* Take the modification time and size from the given stat. */
+    explicit stamp_t(const struct stat &info) noexcept
+        : mtime_sec(info.st_mtim.tv_sec), mtime_nsec(info.st_mtim.tv_nsec),
+          size(info.st_size) {}
+
+    /* True iff. the stamps are the same. */
+    bool operator==(const stamp_t &that) const noexcept {
+      return mtime_sec == that.mtime_sec && mtime_nsec == that.mtime_nsec
+          && size == that.size;
+    }
+
+    /* The modification time. */
+    long long mtime_sec, mtime_nsec;
+
+    /* The size, in bytes. */
+    long long size;
+
+  };  // index_t::stamp_t
+
+  /* What we keep for each file. */
+  struct record_t {
+
+    /* See stamp_t. */
+    stamp_t stamp;
+
+    /* See entry_t. */
+    std::shared_ptr<const sketch_t> sketch;
+
+    /* See entry_t. */
+    std::shared_ptr<const file_t> file;
+
+  };  // index_t::record_t
+
+  /* Remove the entry for the given path and any beneath it, appending to
+     changed the paths of those we removed.  The caller holds the lock. */
+  void remove(const std::string &path, std::vector<std::string> &changed) {
+    auto iter = records.find(path);
+    if (iter != records.end()) {
+      changed.push_back(path);
+      records.erase(iter);
+      ++generation;
+    }
+    std::string prefix = path + '/';
+    iter = records.lower_bound(prefix);
+    while (iter != records.end()
+        && iter->first.compare(0, prefix.size(), prefix) == 0) {
+      changed.push_back(iter->first);
+      iter = records.erase(iter);
+      ++generation;
+    }
+  }
+
+  /* See accessor. */
+  std::string root;
+
+  /* See constructor. */
+  std::size_t thread_count;
+
+  /* See constructor. */
+  bool keep_files;
+
+  /* Covers records and generation. */
+  mutable std::mutex mutex;
+
+  /* Counts changes to records.  See get_snapshot(). */
+  std::size_t generation;
+
+  /* What we know about each file, by path. */
+  std::map<std::string, record_t> records;
+
+};  // index_t
+
+}  // qmellow
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <cctype>
+#include <cstring>
 #include <map>
 #include <vector>
 #include "error.h"
+#include "fold.h"
 #include "ice.h"
 #include "pos.h"
 #include "token.h"
@@ -89,7 +91,12 @@ class lexer_t final {
             }
             case '"': {
               tokens.emplace_back(
-                  pos, token_t::single_string, lex_string());
+                  pos, token_t::double_string, lex_string());
+              break;
+            }
+            case '`': {
+              auto start_pos = pos;
+              tokens.emplace_back(start_pos, token_t::regex, lex_regex());
               break;
             }
             case '-': {
@@ -175,11 +182,19 @@ class lexer_t final {
             go = false;
             break;
           }
-          if (c >= ' ' && c <= 'z') {
+          if (c >= ' ' && c <= '~') {
             strm.put(c);
             pop();
             break;
           }
+          /* A well-formed UTF-8 character goes in whole. */
+          auto size = folder_t::get_utf8_size(cursor, strnlen(cursor, 4));
+          if (size) {
+            for (; size; --size) {
+              strm.put(pop());
+            }
+            break;
+          }
           throw error_t(this, "bad character in quoted string");
         }
         case escaped: {
@@ -194,14 +209,17 @@ class lexer_t final {
             case 'n': {
               strm.put('\n');
               pop();
+              break;
             }
             case 'r': {
-              strm.put('\t');
+              strm.put('\r');
               pop();
+              break;
             }
             case 't': {
               strm.put('\t');
               pop();
+              break;
             }
             default: {
               throw error_t(this, "bad escape character in quoted string");
@@ -215,6 +233,35 @@ class lexer_t final {
     return strm.str();
   }
 
+  /* Lex a regular expression between backquotes.  The returned string will
+     not have the backquotes around it.  A backslash before a backquote
+     stands for the backquote; any other escape is left for the regular
+     expression to translate. */
+  std::string lex_regex() {
+    std::ostringstream strm;
+    pop();
+    for (;;) {
+      char c = peek();
+      if (!c) {
+        throw error_t(this, "end-of-program inside regular expression");
+      }
+      pop();
+      if (c == '`') {
+        break;
+      }
+      if (c < ' ' || c > '~') {
+        throw error_t(this, "bad character in regular expression");
+      }
+      if (c == '\\' && peek() == '`') {
+        c = pop();
+      } else if (c == '\\' && peek() == '\\') {
+        strm.put(pop());
+      }
+      strm.put(c);
+    }
+    return strm.str();
+  }
+
   /* Return the current character from the source text but don't advance to
      the next one. */
   char peek() const {
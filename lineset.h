@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+namespace qmellow {
+
+/* A compressed set of line numbers, in the manner of a roaring bitmap.  The
+   numbers are split into chunks of 65536 by their upper 16 bits.  A chunk
+   with few members keeps them as a sorted array of their lower 16 bits; one
+   with many keeps a 65536-bit bitmap, which is never bigger than the array
+   would be, and is merged a 64-bit word at a time.  Nearly every file has
+   fewer than 65536 lines, so nearly every set is a single chunk. */
+class line_set_t final {
+  public:
+
+  /* An empty set. */
+  line_set_t() {}
+
+  /* Add the given number. */
+  void add(std::uint32_t n) {
+    auto key = static_cast<std::uint16_t>(n >> 16);
+    get_chunk(key).add(static_cast<std::uint16_t>(n));
+  }
+
+  /* Add the members of that set. */
+  line_set_t &operator|=(const line_set_t &that) {
+    std::vector<chunk_t> merged;
+    merged.reserve(chunks.size() + that.chunks.size());
+    auto lhs = chunks.begin();
+    auto rhs = that.chunks.begin();
+    while (lhs != chunks.end() || rhs != that.chunks.end()) {
+      if (rhs == that.chunks.end()
+          || (lhs != chunks.end() && lhs->key < rhs->key)) {
+        merged.push_back(std::move(*lhs++));
+      } else if (lhs == chunks.end() || rhs->key < lhs->key) {
+        merged.push_back(*rhs++);
+      } else {
+        lhs->merge(*rhs++);
+        merged.push_back(std::move(*lhs++));
+      }
+    }
+    chunks = std::move(merged);
+    return *this;
+  }
+
+  /* The number of members. */
+  std::size_t count() const noexcept {
+    std::size_t result = 0;
+    for (const auto &chunk: chunks) {
+      result += chunk.count();
+    }
+    return result;
+  }
+
+  /* True iff. we have no members. */
+  bool is_empty() const noexcept {
+    return chunks.empty();
+  }
+
+  /* Call fn(n) for each member, in order. */
+  template <typename fn_t>
+  void for_each(const fn_t &fn) const {
+    for (const auto &chunk: chunks) {
+      std::uint32_t high = std::uint32_t(chunk.key) << 16;
+      if (chunk.is_dense()) {
+        for (std::size_t w = 0; w < chunk.words.size(); ++w) {
+          for (auto word = chunk.words[w]; word; word &= word - 1) {
+            fn(high | static_cast<std::uint32_t>(
+                w * 64 + __builtin_ctzll(word)));
+          }
+        }
+      } else {
+        for (auto low: chunk.values) {
+          fn(high | low);
+        }
+      }
+    }
+  }
+
+  private:
+
+  /* The members sharing the same upper 16 bits. */
+  struct chunk_t {
+
+    /* The most members we keep as an array.  Past this, the bitmap is
+       smaller. */
+    static std::size_t get_max_array_size() noexcept {
+      return 4096;
+    }
+
+    /* An empty chunk for the given upper bits. */
+    explicit chunk_t(std::uint16_t key)
+        : key(key) {}
+
+    /* True iff. we keep a bitmap. */
+    bool is_dense() const noexcept {
+      return !words.empty();
+    }
+
+    /* The number of members. */
+    std::size_t count() const noexcept {
+      if (!is_dense()) {
+        return values.size();
+      }
+      std::size_t result = 0;
+      for (auto word: words) {
+        result += __builtin_popcountll(word);
+      }
+      return result;
+    }
+
+    /* Add the given lower bits.  Lines are mostly found in order, so we
+       look at the end of the array first. */
+    void add(std::uint16_t low) {
+      if (is_dense()) {
+        words[low / 64] |= std::uint64_t(1) << (low % 64);
+        return;
+      }
+      if (values.empty() || values.back() < low) {
+        values.push_back(low);
+      } else {
+        auto iter = std::lower_bound(values.begin(), values.end(), low);
+        if (*iter == low) {
+          return;
+        }
+        values.insert(iter, low);
+      }
+      if (values.size() > get_max_array_size()) {
+        make_dense();
+      }
+    }
+
+    /* Add the members of that chunk, which has the same key. */
+    void merge(const chunk_t &that) {
+      if (that.is_dense()) {
+        if (!is_dense()) {
+          auto old_values = std::move(values);
+          values.clear();
+          words = that.words;
+          for (auto low: old_values) {
+            words[low / 64] |= std::uint64_t(1) << (low % 64);
+          }
+          return;
+        }
+        auto *lhs = words.data();
+        const auto *rhs = that.words.data();
+        for (std::size_t i = 0, n = words.size(); i < n; ++i) {
+          lhs[i] |= rhs[i];
+        }
+      } else if (is_dense()) {
+        for (auto low: that.values) {
+          words[low / 64] |= std::uint64_t(1) << (low % 64);
+        }
+      } else {
+        std::vector<std::uint16_t> merged;
+        merged.reserve(values.size() + that.values.size());
+        std::set_union(
+            values.begin(), values.end(),
+            that.values.begin(), that.values.end(),
+            std::back_inserter(merged));
+        values = std::move(merged);
+        if (values.size() > get_max_array_size()) {
+          make_dense();
+        }
+      }
+    }
+
+    /* Switch from an array to a bitmap. */
+    void make_dense() {
+      words.assign(65536 / 64, 0);
+      for (auto low: values) {
+        words[low / 64] |= std::uint64_t(1) << (low % 64);
+      }
+      values.clear();
+      values.shrink_to_fit();
+    }
+
+    /* Our upper 16 bits. */
+    std::uint16_t key;
+
+    /* Our members' lower 16 bits, sorted, unless we're dense. */
+    std::vector<std::uint16_t> values;
+
+    /* Our members as a bitmap, if we're dense; otherwise, empty. */
+    std::vector<std::uint64_t> words;
+
+  };  // line_set_t::chunk_t
+
+  /* The chunk for the given upper bits, made if need be. */
+  chunk_t &get_chunk(std::uint16_t key) {
+    if (chunks.empty() || chunks.back().key < key) {
+      chunks.emplace_back(key);
+      return chunks.back();
+    }
+    if (chunks.back().key == key) {
+      return chunks.back();
+    }
+    auto iter = std::lower_bound(
+        chunks.begin(), chunks.end(), key,
+        [](const chunk_t &chunk, std::uint16_t key) {
+          return chunk.key < key;
+        });
+    if (iter == chunks.end() || iter->key != key) {
+      iter = chunks.insert(iter, chunk_t(key));
+    }
+    return *iter;
+  }
+
+  /* Our non-empty chunks, in order of key. */
+  std::vector<chunk_t> chunks;
+
+};  // line_set_t
+
+}  // qmellow
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include "context.h"
+#include "decompress.h"
+#include "file.h"
+#include "match.h"
+#include "pack.h"
+#include "parallel.h"
+#include "result.h"
+#include "utils.h"
+
+namespace qmellow {
+
+/* Keeps the last result of every rule of a pack against every file of a
+   corpus, and brings them up to date as files change, reporting only the
+   matches which appeared or went away.
+
+   A file's server-side includes are searched along with it, so a file
+   depends on the files it includes, directly or not.  When a file changes,
+   we read and scan just that file, then re-evaluate it and everything which
+   depends on it.  The work done for a change is proportional to the size of
+   the change, not to the size of the corpus. */
+class live_t final {
+  public:
+
+  /* Track the tree beneath the given directory, evaluating the given pack
+     on the given number of threads (zero meaning one per hardware
+     thread).  Nothing is read until the first call to rescan(). */
+  live_t(
+      const pack_t &pack, const std::string &root,
+      std::size_t thread_count = 0)
+      : pack(pack), root(trim_root(root)), thread_count(thread_count) {}
+
+  /* The directory we track, without a trailing slash. */
+  const std::string &get_root() const noexcept {
+    return root;
+  }
+
+  /* The number of files we know about. */
+  std::size_t get_file_count() const noexcept {
+    return nodes.size();
+  }
+
+  /* Bring every file up to date with the file system, as after starting or
+     losing track of changes.  See update(). */
+  template <typename on_delta_t>
+  std::size_t rescan(const on_delta_t &on_delta) {
+    std::vector<std::string> paths;
+    list_files(root, paths);
+    for (const auto &node: nodes) {
+      paths.push_back(node.first);
+    }
+    return update(paths, on_delta);
+  }
+
+  /* Bring the files at the given paths up to date with the file system,
+     then re-evaluate them and their dependents.  A path which no longer
+     exists takes with it every file beneath it, in case it was a
+     directory.  For each match which appeared, we call
+     on_delta(true, path, rule, match); for each which went away,
+     on_delta(false, path, rule, match).  The calls come in order of path,
+     then rule.  Returns the number of files we re-evaluated. */
+  template <typename on_delta_t>
+  std::size_t update(
+      const std::vector<std::string> &paths, const on_delta_t &on_delta) {
+    std::set<std::string> changed;
+    std::vector<std::string> to_read;
+    for (const auto &path: paths) {
+      struct stat info;
+      if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+        to_read.push_back(path);
+      } else {
+        remove(path, changed, on_delta);
+      }
+    }
+    std::vector<std::shared_ptr<file_t>> files(to_read.size());
+    parallel_for(to_read.size(), thread_count, [&](std::size_t i) {
+      try {
+        files[i] = std::make_shared<file_t>(
+            load_subject_file(to_read[i]));
+      } catch (const std::runtime_error &) {}
+    });
+    for (std::size_t i = 0; i < to_read.size(); ++i) {
+      if (files[i]) {
+        set_file(to_read[i], std::move(files[i]));
+        changed.insert(to_read[i]);
+      } else {
+        remove(to_read[i], changed, on_delta);
+      }
+    }
+    return evaluate(get_dependents(changed), on_delta);
+  }
+
+  private:
+
+  /* What we know about each file. */
+  struct node_t {
+
+    /* The scanned file, with its includes attached as sub-files. */
+    std::shared_ptr<file_t> file;
+
+    /* The paths of the files this one includes directly, resolved. */
+    std::vector<std::string> include_paths;
+
+    /* The last result of each rule against this file. */
+    std::vector<result_t> results;
+
+  };  // live_t::node_t
+
+  /* The root, without trailing slashes. */
+  static std::string trim_root(std::string root) {
+    while (root.size() > 1 && root.back() == '/') {
+      root.pop_back();
+    }
+    return root;
+  }
+
+  /* The matches we report for the given result: none, unless it matched.
+     A result which didn't match may still hold matches, as that of a not
+     does: those of its operand. */
+  static const result_t::matches_t &get_reported(const result_t &result) {
+    static const result_t::matches_t none;
+    return result.is_match() ? result.get_matches() : none;
+  }
+
+  /* Resolve the path named by an include directive in the file at the
+     given path.  Virtual paths starting with a slash are relative to our
+     root; others, to the including file's directory. */
+  std::string resolve(
+      const std::string &from, const std::string &include_path) const {
+    std::string path = (!include_path.empty() && include_path[0] == '/')
+        ? root + include_path
+        : from.substr(0, from.rfind('/') + 1) + include_path;
+    std::vector<std::string> parts;
+    std::size_t start = 0;
+    while (start <= path.size()) {
+      auto end = path.find('/', start);
+      if (end == std::string::npos) {
+        end = path.size();
+      }
+      auto part = path.substr(start, end - start);
+      if (part == "..") {
+        if (!parts.empty()) {
+          parts.pop_back();
+        }
+      } else if (part != "." && (!part.empty() || parts.empty())) {
+        parts.push_back(std::move(part));
+      }
+      start = end + 1;
+    }
+    std::string result;
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+      if (i) {
+        result += '/';
+      }
+      result += parts[i];
+    }
+    return std::move(result);
+  }
+
+  /* Put a freshly read file in place, noting what it includes. */
+  void set_file(const std::string &path, std::shared_ptr<file_t> &&file) {
+    auto &node = nodes[path];
+    for (const auto &include_path: node.include_paths) {
+      unlink(include_path, path);
+    }
+    node.include_paths.clear();
+    for (const auto &include_path: file->get_include_paths()) {
+      node.include_paths.push_back(resolve(path, include_path));
+      includers[node.include_paths.back()].insert(path);
+    }
+    node.file = std::move(file);
+  }
+
+  /* Forget that the file at the given path includes the given one. */
+  void unlink(const std::string &include_path, const std::string &path) {
+    auto iter = includers.find(include_path);
+    if (iter != includers.end()) {
+      iter->second.erase(path);
+      if (iter->second.empty()) {
+        includers.erase(iter);
+      }
+    }
+  }
+
+  /* Forget the file at the given path and any beneath it, reporting their
+     matches as gone and adding their paths to changed, so their dependents
+     are re-evaluated. */
+  template <typename on_delta_t>
+  void remove(
+      const std::string &path, std::set<std::string> &changed,
+      const on_delta_t &on_delta) {
+    std::string prefix = path + '/';
+    for (auto iter = nodes.lower_bound(path); iter != nodes.end(); ) {
+      if (iter->first != path
+          && iter->first.compare(0, prefix.size(), prefix) != 0) {
+        if (iter->first > prefix) {
+          break;
+        }
+        ++iter;
+        continue;
+      }
+      const auto &rules = pack.get_rules();
+      for (std::size_t i = 0; i < iter->second.results.size(); ++i) {
+        for (const auto &match: get_reported(iter->second.results[i])) {
+          on_delta(false, iter->first, rules[i], match);
+        }
+      }
+      for (const auto &include_path: iter->second.include_paths) {
+        unlink(include_path, iter->first);
+      }
+      changed.insert(iter->first);
+      iter = nodes.erase(iter);
+    }
+  }
+
+  /* The given paths, plus the paths of every file which includes any of
+     them, directly or not. */
+  std::set<std::string> get_dependents(
+      const std::set<std::string> &paths) const {
+    std::set<std::string> dependents;
+    std::vector<std::string> stack(paths.begin(), paths.end());
+    while (!stack.empty()) {
+      auto path = std::move(stack.back());
+      stack.pop_back();
+      if (!dependents.insert(path).second) {
+        continue;
+      }
+      auto iter = includers.find(path);
+      if (iter != includers.end()) {
+        stack.insert(stack.end(), iter->second.begin(), iter->second.end());
+      }
+    }
+    return std::move(dependents);
+  }
+
+  /* The files included by the file at the given path, directly or not, in
+     the order they're first included.  A file which includes itself, or is
+     included twice, appears once. */
+  std::vector<file_t::sub_file_t> get_sub_files(
+      const std::string &path) const {
+    std::vector<file_t::sub_file_t> sub_files;
+    std::set<std::string> seen { path };
+    collect_sub_files(path, seen, sub_files);
+    return std::move(sub_files);
+  }
+
+  /* Helper for get_sub_files(). */
+  void collect_sub_files(
+      const std::string &path, std::set<std::string> &seen,
+      std::vector<file_t::sub_file_t> &sub_files) const {
+    auto node = nodes.find(path);
+    if (node == nodes.end()) {
+      return;
+    }
+    for (const auto &include_path: node->second.include_paths) {
+      auto iter = nodes.find(include_path);
+      if (iter == nodes.end() || !seen.insert(include_path).second) {
+        continue;
+      }
+      sub_files.emplace_back(include_path, iter->second.file);
+      collect_sub_files(include_path, seen, sub_files);
+    }
+  }
+
+  /* Re-evaluate every rule against the files at the given paths which still
+     exist, reporting the differences from their last results.  Returns the
+     number of files evaluated. */
+  template <typename on_delta_t>
+  std::size_t evaluate(
+      const std::set<std::string> &paths, const on_delta_t &on_delta) {
+    std::vector<node_t *> to_eval;
+    std::vector<const std::string *> to_eval_paths;
+    for (const auto &path: paths) {
+      auto iter = nodes.find(path);
+      if (iter != nodes.end()) {
+        to_eval.push_back(&iter->second);
+        to_eval_paths.push_back(&iter->first);
+      }
+    }
+    /* Attach sub-files before fanning out.  Searching a sub-file reads
+       only its own text, so this doesn't race with evaluating it. */
+    for (std::size_t i = 0; i < to_eval.size(); ++i) {
+      to_eval[i]->file->set_sub_files(get_sub_files(*to_eval_paths[i]));
+    }
+    const auto &rules = pack.get_rules();
+    std::vector<std::vector<result_t>> results(to_eval.size());
+    parallel_for(to_eval.size(), thread_count, [&](std::size_t i) {
+      results[i].reserve(rules.size());
+      for (const auto &rule: rules) {
+        context_t context;
+        results[i].push_back(
+            rule.get_expr()->eval(*to_eval[i]->file, context));
+        results[i].back().expand();
+      }
+    });
+    const result_t none;
+    for (std::size_t i = 0; i < to_eval.size(); ++i) {
+      auto &old_results = to_eval[i]->results;
+      for (std::size_t j = 0; j < rules.size(); ++j) {
+        report_delta(
+            *to_eval_paths[i], rules[j],
+            (j < old_results.size()) ? old_results[j] : none, results[i][j],
+            on_delta);
+      }
+      old_results = std::move(results[i]);
+    }
+    return to_eval.size();
+  }
+
+  /* Report the matches which are in one result but not the other, where a
+     result which didn't match has none.  Matches are the same if they're on
+     the same line of the same file, have the same cause, and the line reads
+     the same. */
+  template <typename on_delta_t>
+  static void report_delta(
+      const std::string &path, const pack_t::rule_t &rule,
+      const result_t &old_result, const result_t &new_result,
+      const on_delta_t &on_delta) {
+    const auto &old_matches = get_reported(old_result);
+    const auto &new_matches = get_reported(new_result);
+    auto old_iter = old_matches.begin();
+    auto new_iter = new_matches.begin();
+    while (old_iter != old_matches.end() || new_iter != new_matches.end()) {
+      if (new_iter == new_matches.end()
+          || (old_iter != old_matches.end() && *old_iter < *new_iter)) {
+        on_delta(false, path, rule, *old_iter++);
+      } else if (old_iter == old_matches.end() || *new_iter < *old_iter) {
+        on_delta(true, path, rule, *new_iter++);
+      } else {
+        if (old_iter->get_line_text() != new_iter->get_line_text()) {
+          on_delta(false, path, rule, *old_iter);
+          on_delta(true, path, rule, *new_iter);
+        }
+        ++old_iter;
+        ++new_iter;
+      }
+    }
+  }
+
+  /* See constructor. */
+  const pack_t &pack;
+
+  /* See accessor. */
+  std::string root;
+
+  /* See constructor. */
+  std::size_t thread_count;
+
+  /* What we know about each file, by path. */
+  std::map<std::string, node_t> nodes;
+
+  /* The paths of the files which directly include each path. */
+  std::map<std::string, std::set<std::string>> includers;
+
+};  // live_t
+
+}  // qmellow
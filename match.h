@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 namespace qmellow {
@@ -12,19 +13,61 @@ class match_t final {
   class cause_t {
     public:
 
+    /* The id of a cause which was never given one. */
+    static std::size_t get_no_id() noexcept {
+      return static_cast<std::size_t>(-1);
+    }
+
     /* Override to describe the cause. */
     virtual const std::string &get_desc() const = 0;
 
+    /* A number, fixed when the cause was compiled, which tells it apart
+       from the other causes of the same program.  Matches on the same line
+       are ordered by it, so their order is the same from run to run and
+       from process to process. */
+    std::size_t get_id() const noexcept {
+      return id;
+    }
+
     protected:
 
-    /* Do-little. */
-    cause_t() {}
+    /* Start with no id. */
+    cause_t()
+        : id(get_no_id()) {}
 
     /* Do-little. */
     virtual ~cause_t() {}
 
+    /* See accessor. */
+    void set_id(std::size_t id) noexcept {
+      this->id = id;
+    }
+
+    private:
+
+    /* See accessor. */
+    std::size_t id;
+
   };  // match_t::cause_t;
 
+  /* Where matched lines come from, so a result can keep just their numbers
+     and look up their text when asked for its matches. */
+  class source_t {
+    public:
+
+    /* Override to return the text of the given line, counting from 1. */
+    virtual std::string get_line_text(int line_number) const = 0;
+
+    protected:
+
+    /* Do-little. */
+    source_t() {}
+
+    /* Do-little. */
+    virtual ~source_t() {}
+
+  };  // match_t::source_t
+
   /* Cache the arguments. */
   explicit match_t(
         const cause_t *cause, const std::string &sub_file_path,
@@ -38,10 +81,27 @@ class match_t final {
         int line_number, const std::string &line_text)
       : cause(cause), line_number(line_number), line_text(line_text) {}
 
-  /* Strict weak ordering by line number, then by cause. */
+  /* Strict weak ordering of causes, by id.  Causes without ids, which
+     only appear outside compiled programs, fall back to their addresses. */
+  static bool is_before(const cause_t *lhs, const cause_t *rhs) noexcept {
+    return lhs->get_id() < rhs->get_id()
+        || (lhs->get_id() == rhs->get_id() && lhs < rhs);
+  }
+
+  /* Strict weak ordering by sub-file (so the subject's own matches come
+     first), then by line number, then by cause (see is_before()). */
   bool operator<(const match_t &that) const {
-    return line_number < that.line_number
-        || (line_number == that.line_number && cause < that.cause);
+    int diff = sub_file_path.compare(that.sub_file_path);
+    return diff < 0
+        || (diff == 0
+            && (line_number < that.line_number
+                || (line_number == that.line_number
+                    && is_before(cause, that.cause))));
+  }
+
+  /* The id of the cause of the match. */
+  std::size_t get_cause_id() const noexcept {
+    return cause->get_id();
   }
 
   /* A string describing the cause of the match. */
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace qmellow {
+
+/* Live counters and histograms for the hot paths.  Each thread counts into
+   its own shard, so threads don't contend over cache lines; reading a
+   metric sums the shards.  Histograms are log-linear, in the manner of HDR
+   histograms: each power of two is split into four buckets, so any value is
+   recorded to within 25%.
+
+   The engine counts through the QMELLOW_METRICS_* macros, below.  Unless
+   QMELLOW_METRICS is defined, those macros expand to nothing and the
+   metrics stay at zero. */
+class metrics_t final {
+  public:
+
+  /* The counters we keep. */
+  enum counter_t {
+    bytes_read, files_evaluated, files_deduplicated, files_skipped,
+    memo_hits, memo_misses, counter_count
+  };
+
+  /* The histograms we keep. */
+  enum histogram_t {
+    match_anchor_ns, match_case_insensitive_string_ns,
+    match_case_sensitive_string_ns, match_class_names_ns, match_css_ns,
+    match_css_id_ns, match_image_ns, match_inside_ns, match_js_ns,
+    match_regex_ns,
+    eval_ns, merge_size,
+    histogram_count
+  };
+
+  /* The number of buckets in each histogram. */
+  static std::size_t get_bucket_count() noexcept {
+    return bucket_count;
+  }
+
+  /* The one and only registry. */
+  static metrics_t &get() {
+    static metrics_t metrics;
+    return metrics;
+  }
+
+  /* Add to a counter. */
+  void add(counter_t counter, std::uint64_t n) noexcept {
+    get_shard().counters[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /* Record a value in a histogram. */
+  void record(histogram_t histogram, std::uint64_t value) noexcept {
+    auto &shard = get_shard();
+    shard.buckets[histogram][get_bucket(value)].fetch_add(
+        1, std::memory_order_relaxed);
+    shard.sums[histogram].fetch_add(value, std::memory_order_relaxed);
+  }
+
+  /* The current value of a counter. */
+  std::uint64_t get_count(counter_t counter) const noexcept {
+    std::uint64_t n = 0;
+    for (const auto &shard: shards) {
+      n += shard.counters[counter].load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  /* The number of values recorded in the given bucket of a histogram. */
+  std::uint64_t get_count(
+      histogram_t histogram, std::size_t bucket) const noexcept {
+    std::uint64_t n = 0;
+    for (const auto &shard: shards) {
+      n += shard.buckets[histogram][bucket].load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  /* The sum of the values recorded in a histogram. */
+  std::uint64_t get_sum(histogram_t histogram) const noexcept {
+    std::uint64_t n = 0;
+    for (const auto &shard: shards) {
+      n += shard.sums[histogram].load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  /* The bucket into which a value falls. */
+  static std::size_t get_bucket(std::uint64_t value) noexcept {
+    if (value < 4) {
+      return static_cast<std::size_t>(value);
+    }
+    int exp = 63 - __builtin_clzll(value);
+    return (exp - 1) * 4 + ((value >> (exp - 2)) & 3);
+  }
+
+  /* The largest value which falls into the given bucket. */
+  static std::uint64_t get_bucket_limit(std::size_t bucket) noexcept {
+    if (bucket < 4) {
+      return bucket;
+    }
+    int exp = static_cast<int>(bucket / 4) + 1;
+    std::uint64_t width = std::uint64_t(1) << (exp - 2);
+    return (4 + bucket % 4) * width + (width - 1);
+  }
+
+  /* Write every metric in Prometheus's text exposition format. */
+  void write_prometheus(std::ostream &strm) const {
+    for (int i = 0; i < counter_count; ++i) {
+      auto counter = static_cast<counter_t>(i);
+      const char *name = get_name(counter);
+      strm
+          << "# TYPE qmellow_" << name << "_total counter\n"
+          << "qmellow_" << name << "_total " << get_count(counter) << '\n';
+    }
+    const char *prev_family = "";
+    for (int i = 0; i < histogram_count; ++i) {
+      auto histogram = static_cast<histogram_t>(i);
+      const char *family, *label;
+      get_name(histogram, family, label);
+      if (std::string(family) != prev_family) {
+        strm << "# TYPE qmellow_" << family << " histogram\n";
+        prev_family = family;
+      }
+      std::string labels = label
+          ? std::string("kind=\"") + label + "\"," : std::string();
+      std::uint64_t total = 0;
+      for (std::size_t bucket = 0; bucket < get_bucket_count(); ++bucket) {
+        auto n = get_count(histogram, bucket);
+        if (!n) {
+          continue;
+        }
+        total += n;
+        strm
+            << "qmellow_" << family << "_bucket{" << labels
+            << "le=\"" << get_bucket_limit(bucket) << "\"} " << total << '\n';
+      }
+      strm
+          << "qmellow_" << family << "_bucket{" << labels
+          << "le=\"+Inf\"} " << total << '\n';
+      labels = label ? std::string("{kind=\"") + label + "\"}" : "";
+      strm
+          << "qmellow_" << family << "_sum" << labels << ' '
+          << get_sum(histogram) << '\n'
+          << "qmellow_" << family << "_count" << labels << ' ' << total
+          << '\n';
+    }
+  }
+
+  /* Write every metric as a JSON object.  Histograms list only their
+     non-empty buckets, as [limit, count] pairs. */
+  void write_json(std::ostream &strm) const {
+    strm << "{\"counters\":{";
+    for (int i = 0; i < counter_count; ++i) {
+      auto counter = static_cast<counter_t>(i);
+      strm
+          << (i ? "," : "") << '"' << get_name(counter) << "\":"
+          << get_count(counter);
+    }
+    strm << "},\"histograms\":{";
+    for (int i = 0; i < histogram_count; ++i) {
+      auto histogram = static_cast<histogram_t>(i);
+      const char *family, *label;
+      get_name(histogram, family, label);
+      strm << (i ? "," : "") << '"' << family;
+      if (label) {
+        strm << '/' << label;
+      }
+      strm << "\":{\"sum\":" << get_sum(histogram) << ",\"buckets\":[";
+      const char *sep = "";
+      for (std::size_t bucket = 0; bucket < get_bucket_count(); ++bucket) {
+        auto n = get_count(histogram, bucket);
+        if (n) {
+          strm << sep << '[' << get_bucket_limit(bucket) << ',' << n << ']';
+          sep = ",";
+        }
+      }
+      strm << "]}";
+    }
+    strm << "}}\n";
+  }
+
+  /* Times its own lifetime into a histogram. */
+  class timer_t final {
+    public:
+
+    /* Start timing. */
+    explicit timer_t(histogram_t histogram) noexcept
+        : histogram(histogram), start(clock_t::now()) {}
+
+    /* Stop timing and record. */
+    ~timer_t() {
+      metrics_t::get().record(
+          histogram,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              clock_t::now() - start).count());
+    }
+
+    private:
+
+    /* The clock we time with. */
+    using clock_t = std::chrono::steady_clock;
+
+    /* See constructor. */
+    histogram_t histogram;
+
+    /* When we started. */
+    clock_t::time_point start;
+
+  };  // metrics_t::timer_t
+
+  private:
+
+  /* See get_bucket_count(). */
+  static constexpr std::size_t bucket_count = 256;
+
+  /* See get_shard_count(). */
+  static constexpr std::size_t shard_count = 16;
+
+  /* The number of shards.  Threads beyond this many share shards. */
+  static std::size_t get_shard_count() noexcept {
+    return shard_count;
+  }
+
+  /* One thread's worth of metrics, on cache lines of its own. */
+  struct alignas(64) shard_t {
+
+    /* See counter_t. */
+    std::atomic<std::uint64_t> counters[counter_count];
+
+    /* See histogram_t. */
+    std::atomic<std::uint64_t> buckets[histogram_count][bucket_count];
+
+    /* The sums of the values recorded in each histogram. */
+    std::atomic<std::uint64_t> sums[histogram_count];
+
+  };  // metrics_t::shard_t
+
+  /* Start with all zeros. */
+  metrics_t() {
+    for (auto &shard: shards) {
+      for (auto &counter: shard.counters) {
+        counter.store(0, std::memory_order_relaxed);
+      }
+      for (auto &buckets: shard.buckets) {
+        for (auto &bucket: buckets) {
+          bucket.store(0, std::memory_order_relaxed);
+        }
+      }
+      for (auto &sum: shard.sums) {
+        sum.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /* The shard of the calling thread.  Threads are given shards
+     round-robin as they first arrive. */
+  shard_t &get_shard() noexcept {
+    static std::atomic<std::size_t> next(0);
+    static thread_local std::size_t index =
+        next.fetch_add(1, std::memory_order_relaxed) % get_shard_count();
+    return shards[index];
+  }
+
+  /* The name of a counter. */
+  static const char *get_name(counter_t counter) noexcept {
+    const char *name = "";
+    switch (counter) {
+      case bytes_read: name = "bytes_read"; break;
+      case files_evaluated: name = "files_evaluated"; break;
+      case files_deduplicated: name = "files_deduplicated"; break;
+      case files_skipped: name = "files_skipped"; break;
+      case memo_hits: name = "memo_hits"; break;
+      case memo_misses: name = "memo_misses"; break;
+      case counter_count: break;
+    }  // switch
+    return name;
+  }
+
+  /* The family name of a histogram and the leaf kind it's labelled with,
+     if any. */
+  static void get_name(
+      histogram_t histogram, const char *&family, const char *&label) {
+    family = "leaf_eval_ns";
+    label = nullptr;
+    switch (histogram) {
+      case match_anchor_ns: label = "anchor"; break;
+      case match_case_insensitive_string_ns:
+        label = "case_insensitive_string"; break;
+      case match_case_sensitive_string_ns:
+        label = "case_sensitive_string"; break;
+      case match_class_names_ns: label = "class_names"; break;
+      case match_css_ns: label = "css"; break;
+      case match_css_id_ns: label = "css_id"; break;
+      case match_image_ns: label = "image"; break;
+      case match_inside_ns: label = "inside"; break;
+      case match_js_ns: label = "js"; break;
+      case match_regex_ns: label = "regex"; break;
+      case eval_ns: family = "eval_ns"; break;
+      case merge_size: family = "merge_size"; break;
+      case histogram_count: break;
+    }  // switch
+  }
+
+  /* Our shards. */
+  shard_t shards[shard_count];
+
+};  // metrics_t
+
+}  // qmellow
+
+#ifdef QMELLOW_METRICS
+
+/* Add n to the given counter. */
+#define QMELLOW_METRICS_ADD(counter, n) \
+    ::qmellow::metrics_t::get().add(::qmellow::metrics_t::counter, (n))
+
+/* Record a value in the given histogram. */
+#define QMELLOW_METRICS_RECORD(histogram, value) \
+    ::qmellow::metrics_t::get().record( \
+        ::qmellow::metrics_t::histogram, (value))
+
+/* Time the rest of the enclosing scope into the given histogram. */
+#define QMELLOW_METRICS_TIME(histogram) \
+    ::qmellow::metrics_t::timer_t qmellow_metrics_timer( \
+        ::qmellow::metrics_t::histogram)
+
+#else
+
+#define QMELLOW_METRICS_ADD(counter, n)
+#define QMELLOW_METRICS_RECORD(histogram, value)
+#define QMELLOW_METRICS_TIME(histogram)
+
+#endif
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <dlfcn.h>
+#include "context.h"
+#include "expr.h"
+#include "file.h"
+#include "pack.h"
+#include "result.h"
+#include "symbols.h"
+
+namespace qmellow {
+
+/* What a shared object of generated evaluators (see codegen_t) exports,
+   under the C name qmellow_native_module.  There's an evaluator for each
+   rule of the pack it was generated from.  An evaluator is called as
+   eval(file, context, leaves), where leaves holds the rule's canonical
+   leaves, by id.  It gives what the rule's expression would give if
+   evaluated in the context, and attributes matches to the same leaves. */
+struct native_module_t {
+
+  /* An evaluator of a rule. */
+  using eval_t = result_t (*)(
+      const file_t &, context_t &, const leaf_t *const *);
+
+  /* The version of this layout and of the headers the module was built
+     with.  Bump it when either changes in a way the module would see. */
+  static constexpr int get_abi_version() noexcept {
+    return 3;
+  }
+
+  /* The features compiled in which change what the headers' inline code
+     does, one bit each. */
+  static constexpr std::uint64_t get_features() noexcept {
+    return 0
+#ifdef QMELLOW_METRICS
+        | 1
+#endif
+#ifdef QMELLOW_TRACE
+        | 2
+#endif
+        ;
+  }
+
+  /* A stamp of the build, from the version, the features, and the sizes
+     of the types the module shares with its loader.  Code built with
+     other headers or other flags than its loader's disagrees with it about
+     those, even when the version is the same, and mustn't be loaded. */
+  static constexpr std::uint64_t get_abi_stamp() noexcept {
+    return mix(mix(mix(mix(mix(mix(mix(
+        static_cast<std::uint64_t>(get_abi_version()), get_features()),
+        sizeof(file_t)), sizeof(context_t)), sizeof(result_t)),
+        sizeof(match_t)), sizeof(leaf_t)), sizeof(symbol_table_t));
+  }
+
+  /* See get_abi_stamp(). */
+  std::uint64_t abi_stamp;
+
+  /* The number of rules. */
+  std::size_t rule_count;
+
+  /* The source text of each rule, as pack_t keeps it. */
+  const char *const *rule_texts;
+
+  /* The evaluator of each rule. */
+  const eval_t *evals;
+
+  /* The symbol table the module's code interns into.  This must be the one
+     the loader uses, or the module's symbols mean nothing to it. */
+  symbol_table_t &(*get_symbol_table)();
+
+  private:
+
+  /* The stamp with the value folded into it. */
+  static constexpr std::uint64_t mix(
+      std::uint64_t stamp, std::uint64_t value) noexcept {
+    return (stamp ^ value) * 1099511628211ULL;
+  }
+
+};  // native_module_t
+
+/* The position of the next occurrence of a literal of the given size in
+   the haystack, at or after the offset, or npos.  We look for the literal's
+   byte at the given pivot, which the generator picks to be a rare one, with
+   memchr(), then compare the rest, whose size is known here, so the
+   compiler can unroll it.  Generated evaluators search with this. */
+template <std::size_t size, std::size_t pivot>
+std::size_t find_literal(
+    const std::string &haystack, std::size_t offset,
+    const char *literal) noexcept {
+  static_assert(size > 0 && pivot < size, "pivot must be in the literal");
+  if (haystack.size() < size || offset > haystack.size() - size) {
+    return std::string::npos;
+  }
+  const char *data = haystack.data();
+  const char *cursor = data + offset + pivot;
+  const char *end = data + haystack.size() - size + pivot + 1;
+  while (cursor < end) {
+    cursor = static_cast<const char *>(
+        std::memchr(cursor, literal[pivot], end - cursor));
+    if (!cursor) {
+      break;
+    }
+    if (std::memcmp(cursor - pivot, literal, size) == 0) {
+      return static_cast<std::size_t>(cursor - pivot - data);
+    }
+    ++cursor;
+  }
+  return std::string::npos;
+}
+
+/* The generated evaluators of a pack, loaded from a shared object which
+   codegen_t's source was built into.  Loading checks that the module was
+   generated from the same rules and built against the same headers with
+   the same features, and that it shares our symbol table, which it can
+   only do if the program was linked with -rdynamic.  check() compares the
+   evaluators against the interpreter. */
+class native_pack_t final {
+  public:
+
+  /* Load the shared object at the given path, which must have been
+     generated from the given pack.  The pack must outlive us. */
+  native_pack_t(const pack_t &pack, const std::string &path)
+      : pack(pack), handle(dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL)) {
+    if (!handle) {
+      throw std::runtime_error(
+          "could not load " + path + ": " + get_dl_error());
+    }
+    try {
+      module = static_cast<const native_module_t *>(
+          dlsym(handle, "qmellow_native_module"));
+      if (!module) {
+        throw std::runtime_error(path + " is not a qmellow native module");
+      }
+      if (module->abi_stamp != native_module_t::get_abi_stamp()) {
+        throw std::runtime_error(
+            path + " was built with other headers or flags");
+      }
+      if (&module->get_symbol_table() != &symbol_table_t::get()) {
+        throw std::runtime_error(
+            path + " doesn't share our symbols; link with -rdynamic");
+      }
+      const auto &rules = pack.get_rules();
+      if (module->rule_count != rules.size()) {
+        throw std::runtime_error(path + " was generated from another pack");
+      }
+      for (std::size_t i = 0; i < rules.size(); ++i) {
+        if (rules[i].get_text() != module->rule_texts[i]) {
+          throw std::runtime_error(
+              path + " was generated from another version of rule "
+              + std::to_string(i));
+        }
+        leaves.push_back(collector_t().collect(rules[i].get_expr()));
+      }
+    } catch (...) {
+      dlclose(handle);
+      throw;
+    }
+  }
+
+  /* Not copyable. */
+  native_pack_t(const native_pack_t &) = delete;
+
+  /* Not copyable. */
+  native_pack_t &operator=(const native_pack_t &) = delete;
+
+  /* Unload the shared object. */
+  ~native_pack_t() {
+    dlclose(handle);
+  }
+
+  /* Evaluate the given rule of the pack on the given file, as its
+     expression would in the given context. */
+  result_t eval(
+      std::size_t rule_index, const file_t &file,
+      context_t &context) const {
+    return module->evals[rule_index](
+        file, context, leaves[rule_index].data());
+  }
+
+  /* Evaluate every rule on the given file both with its evaluator and by
+     interpreting its expression, with the given limit, and throw if the
+     results differ, saying which rule. */
+  void check(
+      const file_t &file,
+      std::size_t limit = result_t::get_no_limit()) const {
+    const auto &rules = pack.get_rules();
+    for (std::size_t i = 0; i < rules.size(); ++i) {
+      context_t native_context(nullptr, nullptr, limit);
+      auto native = eval(i, file, native_context);
+      context_t context(nullptr, nullptr, limit);
+      auto interpreted = rules[i].get_expr()->eval(file, context);
+      native.expand();
+      interpreted.expand();
+      if (!is_same(native, interpreted)) {
+        std::ostringstream strm;
+        strm
+            << "rule " << i << " (" << rules[i].get_text() << ") gave "
+            << native.get_match_count() << " native matches but "
+            << interpreted.get_match_count() << " interpreted";
+        throw std::runtime_error(strm.str());
+      }
+    }
+  }
+
+  private:
+
+  /* Collects the canonical leaves of an expression, by id. */
+  class collector_t final
+      : public visitor_t {
+    public:
+
+    /* The canonical leaves of the given expression, by id. */
+    std::vector<const leaf_t *> collect(const expr_t *expr) {
+      expr->accept(*this);
+      return std::move(leaves);
+    }
+
+    /* Keep the leaf's canonical leaf. */
+    virtual void visit(const leaf_t *leaf) override {
+      auto id = leaf->get_id();
+      if (id == context_t::get_no_id()) {
+        throw std::runtime_error("a leaf was never canonicalized");
+      }
+      if (id >= leaves.size()) {
+        leaves.resize(id + 1);
+      }
+      leaves[id] = leaf->get_canon();
+    }
+
+    /* Go on to the operand. */
+    virtual void visit(const not_t *expr) override {
+      expr->get_subexpr()->accept(*this);
+    }
+
+    /* Go on to the operand. */
+    virtual void visit(const group_t *expr) override {
+      expr->get_subexpr()->accept(*this);
+    }
+
+    /* Go on to the operands. */
+    virtual void visit(const and_t *expr) override {
+      expr->get_left_subexpr()->accept(*this);
+      expr->get_right_subexpr()->accept(*this);
+    }
+
+    /* Go on to the operands. */
+    virtual void visit(const or_t *expr) override {
+      expr->get_left_subexpr()->accept(*this);
+      expr->get_right_subexpr()->accept(*this);
+    }
+
+    private:
+
+    /* See collect(). */
+    std::vector<const leaf_t *> leaves;
+
+  };  // native_pack_t::collector_t
+
+  /* The last error from dlopen() and friends. */
+  static std::string get_dl_error() {
+    const char *error = dlerror();
+    return error ? error : "unknown error";
+  }
+
+  /* True iff. the results, which must be expanded, agree on whether they
+     match and on each of their matches. */
+  static bool is_same(const result_t &lhs, const result_t &rhs) {
+    if (lhs.is_match() != rhs.is_match()) {
+      return false;
+    }
+    const auto &lhs_matches = lhs.get_matches();
+    const auto &rhs_matches = rhs.get_matches();
+    return lhs_matches.size() == rhs_matches.size()
+        && std::equal(
+            lhs_matches.begin(), lhs_matches.end(), rhs_matches.begin(),
+            [](const match_t &lhs, const match_t &rhs) {
+              return !(lhs < rhs) && !(rhs < lhs);
+            });
+  }
+
+  /* See constructor. */
+  const pack_t &pack;
+
+  /* From dlopen(). */
+  void *handle;
+
+  /* What the shared object exports. */
+  const native_module_t *module;
+
+  /* The canonical leaves of each rule, by id. */
+  std::vector<std::vector<const leaf_t *>> leaves;
+
+};  // native_pack_t
+
+}  // qmellow
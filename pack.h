@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "expr.h"
+#include "lexer.h"
+#include "parser.h"
+#include "pos.h"
+#include "utils.h"
+
+namespace qmellow {
+
+/* A set of rules, compiled from the text of a rule pack.  Each non-blank
+   line of the pack is a rule.  Lines holding only comments are skipped. */
+class pack_t final {
+  public:
+
+  /* A single compiled rule. */
+  class rule_t final {
+    public:
+
+    /* Cache the source text and the compiled expression. */
+    rule_t(std::string &&text, std::unique_ptr<expr_t> &&expr)
+        : text(std::move(text)), expr(std::move(expr)) {}
+
+    /* The compiled expression. */
+    const expr_t *get_expr() const noexcept {
+      return expr.get();
+    }
+
+    /* The source text from which the rule was compiled. */
+    const std::string &get_text() const noexcept {
+      return text;
+    }
+
+    private:
+
+    /* See accessor. */
+    std::string text;
+
+    /* See accessor. */
+    std::unique_ptr<expr_t> expr;
+
+  };  // pack_t::rule_t
+
+  /* Compile the rules in the given text.  Errors report their positions
+     relative to the whole text. */
+  explicit pack_t(const std::string &text) {
+    pos_t pos;
+    std::size_t start = 0;
+    while (start < text.size()) {
+      auto end = text.find('\n', start);
+      if (end == std::string::npos) {
+        end = text.size();
+      }
+      std::string line = text.substr(start, end - start);
+      auto tokens = lexer_t::lex(line, pos);
+      if (tokens.size() > 1) {
+        auto expr = parser_t::parse(tokens.data());
+        rules.emplace_back(std::move(line), std::move(expr));
+      }
+      pos.next_line();
+      start = end + 1;
+    }
+  }
+
+  /* Compile the rules in the file at the given path. */
+  static pack_t load(const std::string &path) {
+    return pack_t(read_whole_file(path));
+  }
+
+  /* The rules, in the order they appeared. */
+  const std::vector<rule_t> &get_rules() const noexcept {
+    return rules;
+  }
+
+  private:
+
+  /* See accessor. */
+  std::vector<rule_t> rules;
+
+};  // pack_t
+
+}  // qmellow
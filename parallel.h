@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace qmellow {
+
+/* The number of threads to use when asked for zero, which means one per
+   hardware thread. */
+inline std::size_t get_thread_count(std::size_t thread_count) {
+  return thread_count
+      ? thread_count
+      : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/* Call fn(i) for each i in [0, count), spreading the calls across the given
+   number of threads (zero meaning one per hardware thread).  The calling
+   thread is one of them.  Threads take indices in order as they become
+   free, so long calls don't hold up the rest.  We return when all the calls
+   have.  fn must be thread-safe. */
+template <typename fn_t>
+void parallel_for(
+    std::size_t count, std::size_t thread_count, const fn_t &fn) {
+  std::atomic<std::size_t> next(0);
+  auto work = [&]() {
+    for (;;) {
+      auto i = next++;
+      if (i >= count) {
+        break;
+      }
+      fn(i);
+    }
+  };
+  thread_count = std::min(get_thread_count(thread_count), count);
+  std::vector<std::thread> threads;
+  for (std::size_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto &thread: threads) {
+    thread.join();
+  }
+}
+
+/* A pool of worker threads, started once and shared by any number of
+   callers, each of which runs loops across them as parallel_for() would.
+   However many callers there are, no more than our threads do the work,
+   and no thread is started per loop.  The loops being run take turns: a
+   free thread takes the next index of the loop whose turn it is, and the
+   loop then waits behind the others, so a caller running a short loop
+   waits for an index of each other loop, not for all of a long one. */
+class pool_t final {
+  public:
+
+  /* Start the given number of threads (zero meaning one per hardware
+     thread). */
+  explicit pool_t(std::size_t thread_count = 0)
+      : is_stopping(false) {
+    thread_count = get_thread_count(thread_count);
+    for (std::size_t i = 0; i < thread_count; ++i) {
+      threads.emplace_back([this]() { work(); });
+    }
+  }
+
+  /* Finish the loops being run and stop the threads. */
+  ~pool_t() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      is_stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto &thread: threads) {
+      thread.join();
+    }
+  }
+
+  /* Not copyable. */
+  pool_t(const pool_t &) = delete;
+
+  /* Not copyable. */
+  pool_t &operator=(const pool_t &) = delete;
+
+  /* Call fn(i) for each i in [0, count), on our threads, and return when
+     all the calls have.  The calling thread waits.  If a call throws, the
+     rest are still made, and then the first exception is rethrown.  fn
+     must be thread-safe, and mustn't itself run loops on us. */
+  template <typename fn_t>
+  void run(std::size_t count, const fn_t &fn) {
+    if (!count) {
+      return;
+    }
+    loop_t loop(count, [&fn](std::size_t i) { fn(i); });
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      loops.push_back(&loop);
+    }
+    work_ready.notify_all();
+    std::unique_lock<std::mutex> lock(mutex);
+    loop_done.wait(lock, [&loop]() { return loop.done_count == loop.count; });
+    if (loop.error) {
+      std::rethrow_exception(loop.error);
+    }
+  }
+
+  private:
+
+  /* A loop being run. */
+  struct loop_t {
+
+    /* Cache the arguments. */
+    loop_t(std::size_t count, std::function<void(std::size_t)> &&fn)
+        : count(count), next(0), done_count(0), fn(std::move(fn)) {}
+
+    /* See run(). */
+    std::size_t count;
+
+    /* The next index to hand out. */
+    std::size_t next;
+
+    /* The number of calls which have returned. */
+    std::size_t done_count;
+
+    /* See run(). */
+    std::function<void(std::size_t)> fn;
+
+    /* The first exception a call threw, if any. */
+    std::exception_ptr error;
+
+  };  // pool_t::loop_t
+
+  /* Make calls of the loops being run until we're stopped. */
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      work_ready.wait(lock, [this]() {
+        return is_stopping || !loops.empty();
+      });
+      if (loops.empty()) {
+        return;
+      }
+      auto *loop = loops.front();
+      loops.pop_front();
+      auto i = loop->next++;
+      if (loop->next < loop->count) {
+        loops.push_back(loop);
+      }
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        loop->fn(i);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      if (error && !loop->error) {
+        loop->error = error;
+      }
+      if (++loop->done_count == loop->count) {
+        loop_done.notify_all();
+      }
+    }
+  }
+
+  /* Covers the members below. */
+  std::mutex mutex;
+
+  /* Signalled when there's a loop to work on, or we're stopping. */
+  std::condition_variable work_ready;
+
+  /* Signalled when a loop is done. */
+  std::condition_variable loop_done;
+
+  /* The loops with indices left to hand out, in the order in which
+     they'll next get one. */
+  std::deque<loop_t *> loops;
+
+  /* True once we're being destroyed. */
+  bool is_stopping;
+
+  /* Our threads. */
+  std::vector<std::thread> threads;
+
+};  // pool_t
+
+}  // qmellow
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
@@ -62,6 +63,18 @@ class parser_t final {
     return token;
   }
 
+  /* Canonicalize a leaf.  If we've already made a leaf of the same kind
+     and text, that one becomes the new leaf's canonical leaf; otherwise, the
+     new leaf is canonical and gets the next id. */
+  std::unique_ptr<expr_t> canonicalize(std::unique_ptr<leaf_t> &&leaf) {
+    auto result = canon_leaves.insert(
+        std::make_pair(leaf->get_desc(), leaf.get()));
+    leaf_t *canon = result.first->second;
+    leaf->set_canon(
+        canon, result.second ? canon_leaves.size() - 1 : canon->get_id());
+    return std::move(leaf);
+  }
+
   /* Parse a whole program and expect to find the end token. */
   std::unique_ptr<expr_t> parse() {
     auto expr = parse_ors();
@@ -78,12 +91,66 @@ class parser_t final {
     return std::move(expr);
   }
 
-  /* Parse a leaf or a group. */
+  /* Parse a leaf, possibly with containment, or a group. */
   std::unique_ptr<expr_t> parse_atom() {
-    std::unique_ptr<expr_t> expr;
-    auto *token = match_token({
-        token_t::single_string, token_t::double_string, token_t::hash,
-        token_t::dot, token_t::slash, token_t::open_paren });
+    if (try_match_token({ token_t::open_paren })) {
+      auto expr = make_unique<group_t>(parse_ors());
+      match_token({ token_t::close_paren });
+      return std::move(expr);
+    }
+    return parse_contained();
+  }
+
+  /* Parse a leaf followed by any number of containments, such as
+     "'a' inside .b directly inside #c", which nest to the right.  Only
+     leaves which select elements may contain, and only leaves with
+     selectors may be contained. */
+  std::unique_ptr<expr_t> parse_contained() {
+    std::vector<std::unique_ptr<leaf_t>> parts;
+    std::vector<bool> is_directs;
+    parts.push_back(parse_leaf({
+        token_t::single_string, token_t::double_string, token_t::regex,
+        token_t::hash, token_t::dot, token_t::slash, token_t::open_paren }));
+    selector_t selector;
+    if (!parts.front()->get_selector(selector)) {
+      return canonicalize(std::move(parts.front()));
+    }
+    for (;;) {
+      bool is_direct = try_match_word("directly") != nullptr;
+      if (is_direct) {
+        if (!try_match_word("inside")) {
+          throw error_t(this, { token_t::inside_kwd });
+        }
+      } else if (!try_match_word("inside")) {
+        break;
+      }
+      is_directs.push_back(is_direct);
+      parts.push_back(
+          parse_leaf({ token_t::hash, token_t::dot, token_t::slash }));
+    }
+    if (parts.size() == 1) {
+      return canonicalize(std::move(parts.front()));
+    }
+    return canonicalize(
+        make_unique<inside_t>(std::move(parts), is_directs));
+  }
+
+  /* Parse something that looks like "a.b.c" and return it as a vector of
+     individual texts. */
+  std::vector<std::string> parse_dotted_names() {
+    std::vector<std::string> texts;
+    do {
+      texts.push_back(match_token({ token_t::name })->get_text());
+    } while (try_match_token({ token_t::dot }));
+    return std::move(texts);
+  }
+
+  /* Parse a leaf beginning with a token of one of the given kinds.  An
+     open-paren is among the kinds only so it shows up in error messages;
+     parse_atom() handles groups.  The leaf is not yet canonical. */
+  std::unique_ptr<leaf_t> parse_leaf(const std::set<token_t::kind_t> &kinds) {
+    std::unique_ptr<leaf_t> expr;
+    auto *token = match_token(kinds);
     switch (token->get_kind()) {
       case token_t::single_string: {
         expr = make_unique<case_insensitive_string_t>(token->get_text());
@@ -93,6 +160,10 @@ class parser_t final {
         expr = make_unique<case_sensitive_string_t>(token->get_text());
         break;
       }
+      case token_t::regex: {
+        expr = make_unique<regex_t>(token->get_text(), token->get_pos());
+        break;
+      }
       case token_t::hash: {
         token = match_token({ token_t::name });
         expr = make_unique<css_id_t>(token->get_text());
@@ -136,27 +207,12 @@ class parser_t final {
         }  // for
         break;
       }
-      case token_t::open_paren: {
-        expr = make_unique<group_t>(parse_ors());
-        match_token({ token_t::close_paren });
-        break;
-      }
       default:
         throw ice_t(token->get_pos(), __FILE__, __LINE__);
     }  // switch
     return std::move(expr);
   }
 
-  /* Parse something that looks like "a.b.c" and return it as a vector of
-     individual texts. */
-  std::vector<std::string> parse_dotted_names() {
-    std::vector<std::string> texts;
-    do {
-      texts.push_back(match_token({ token_t::name })->get_text());
-    } while (try_match_token({ token_t::dot }));
-    return std::move(texts);
-  }
-
   /* Parse some number of not-operations, followed by an atom. */
   std::unique_ptr<expr_t> parse_nots() {
     bool is_not = false;
@@ -187,6 +243,15 @@ class parser_t final {
     return (iter != kinds.end()) ? cursor++ : nullptr;
   }
 
+  /* Like try_match_token, above, but for a name token of the given text.
+     This is how we match the containment keywords, which the lexer leaves
+     as names, so they're keywords only after a leaf and remain usable as
+     names everywhere else, as in "#inside". */
+  const token_t *try_match_word(const char *text) {
+    return (cursor->get_kind() == token_t::name && cursor->get_text() == text)
+        ? cursor++ : nullptr;
+  }
+
   /* Reverse the parse_dotted_names function, above, writing out the texts as
      a single string. */
   static void write_dotted_names(
@@ -201,6 +266,10 @@ class parser_t final {
   /* Our current position in the array of tokens. */
   const token_t *cursor;
 
+  /* The canonical leaves we've made so far, keyed by their pretty-printed
+     selves, which encode both kind and text. */
+  std::map<std::string, leaf_t *> canon_leaves;
+
 };  // parser_t
 
 }  // qmellow
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "context.h"
+#include "expr.h"
+#include "stats.h"
+
+namespace qmellow {
+
+/* Decides, from leaf statistics, the order in which each and and or should
+   evaluate its operands and whether it may short-circuit.
+
+   Skipping an operand never changes whether the whole expression matches,
+   but it can drop matches from the result.  An and which fails has no
+   matches worth reporting unless an odd number of nots sits above it, and
+   the same goes for an or which succeeds beneath an odd number of nots.
+   So we let ands short-circuit only in positive positions and ors only in
+   negative ones.  Every successful result then has exactly the matches it
+   would have had without planning; failed results may carry fewer of their
+   reasons for failing.
+
+   Within each and or or, we put first the operand which is cheapest per
+   chance of deciding the outcome.  The estimates come from the statistics
+   of the leaves beneath. */
+class planner_t final {
+  public:
+
+  /* Plan from the given statistics, replanning after every interval calls
+     to tick(). */
+  explicit planner_t(stats_t &stats, std::size_t interval = 1000)
+      : stats(stats), interval(interval ? interval : 1), ticks(0) {}
+
+  /* Plan the given expression now. */
+  void plan(const expr_t *expr) {
+    walker_t(stats).plan(expr, true);
+  }
+
+  /* Note that another file has been evaluated with the given expression.
+     Every so often, this replans it. */
+  void tick(const expr_t *expr) {
+    if (++ticks % interval == 0) {
+      plan(expr);
+    }
+  }
+
+  private:
+
+  /* The estimated cost of a node and chance that it matches. */
+  struct estimate_t {
+
+    /* The chance, between 0 and 1, that the node matches. */
+    double p;
+
+    /* The expected time to evaluate the node, in nanoseconds. */
+    double ns;
+
+  };  // planner_t::estimate_t
+
+  /* Walks the tree, estimating and planning each node. */
+  class walker_t final
+      : public qmellow::visitor_t {
+    public:
+
+    /* Estimate from the given statistics. */
+    explicit walker_t(stats_t &stats)
+        : stats(stats), is_positive(true) {}
+
+    /* Plan the given node, in a position of the given polarity, and return
+       its estimate. */
+    estimate_t plan(const expr_t *expr, bool is_positive) {
+      bool was_positive = this->is_positive;
+      this->is_positive = is_positive;
+      expr->accept(*this);
+      this->is_positive = was_positive;
+      return estimate;
+    }
+
+    /* A leaf we haven't seen yet, or can't keep statistics for, as it was
+       never canonicalized, is given an even chance and a middling cost. */
+    virtual void visit(const leaf_t *leaf) override {
+      auto id = leaf->get_id();
+      auto counts = (id != context_t::get_no_id())
+          ? stats.get(id, leaf->get_desc()) : stats_t::leaf_stats_t();
+      estimate.p = (counts.hits + 1.0) / (counts.calls + 2.0);
+      estimate.ns = counts.calls
+          ? static_cast<double>(counts.ns) / counts.calls
+          : get_default_ns();
+    }
+
+    /* A not flips both the chance and the polarity. */
+    virtual void visit(const not_t *expr) override {
+      estimate = plan(expr->get_subexpr(), !is_positive);
+      estimate.p = 1 - estimate.p;
+    }
+
+    /* A group is transparent. */
+    virtual void visit(const group_t *expr) override {
+      estimate = plan(expr->get_subexpr(), is_positive);
+    }
+
+    /* An and is decided early when its first operand fails. */
+    virtual void visit(const and_t *expr) override {
+      plan_infix(expr, false);
+    }
+
+    /* An or is decided early when its first operand succeeds. */
+    virtual void visit(const or_t *expr) override {
+      plan_infix(expr, true);
+    }
+
+    private:
+
+    /* The cost we assume for a leaf we know nothing about. */
+    static double get_default_ns() noexcept {
+      return 1000;
+    }
+
+    /* Plan an and (if decider is false) or an or (if decider is true).  The
+       decider is the outcome of the first operand which lets us skip the
+       second. */
+    void plan_infix(const infix_t *expr, bool decider) {
+      auto left = plan(expr->get_left_subexpr(), is_positive);
+      auto right = plan(expr->get_right_subexpr(), is_positive);
+      bool short_circuit = (decider != is_positive);
+      bool swapped = false;
+      double p = decider
+          ? 1 - (1 - left.p) * (1 - right.p)
+          : left.p * right.p;
+      double ns = left.ns + right.ns;
+      if (short_circuit) {
+        double left_decides = decider ? left.p : 1 - left.p;
+        double right_decides = decider ? right.p : 1 - right.p;
+        double left_first = left.ns + (1 - left_decides) * right.ns;
+        double right_first = right.ns + (1 - right_decides) * left.ns;
+        swapped = right_first < left_first;
+        ns = swapped ? right_first : left_first;
+      }
+      expr->set_plan(infix_t::plan_t(swapped, short_circuit));
+      estimate.p = p;
+      estimate.ns = ns;
+    }
+
+    /* The statistics from which we estimate. */
+    stats_t &stats;
+
+    /* True iff. the node we're planning is beneath an even number of
+       nots. */
+    bool is_positive;
+
+    /* The estimate of the node we most recently planned. */
+    estimate_t estimate;
+
+  };  // planner_t::walker_t
+
+  /* See constructor. */
+  stats_t &stats;
+
+  /* See constructor. */
+  std::size_t interval;
+
+  /* The number of calls to tick() so far. */
+  std::size_t ticks;
+
+};  // planner_t
+
+/* Plans several expressions, such as the rules of a pack, each with leaf
+   ids of its own, from statistics gathered by any number of threads as
+   they evaluate them.  Each thread counts into a local_t of its own, and
+   every so many files folds its counts into ours, whereupon we replan
+   every expression.  This is thread-safe.  Expressions may be evaluated
+   while we replan them, as each and and or sets and gets its plan as one
+   word, and every plan gives the same successful results. */
+class shared_planner_t final {
+  public:
+
+  /* The statistics of one thread. */
+  class local_t final {
+    public:
+
+    /* Count for the given planner. */
+    explicit local_t(shared_planner_t &planner)
+        : planner(planner), stats(planner.exprs.size()), file_count(0) {}
+
+    /* Not copyable. */
+    local_t(const local_t &) = delete;
+
+    /* Not copyable. */
+    local_t &operator=(const local_t &) = delete;
+
+    /* The statistics into which to count evaluations of the expression
+       with the given index. */
+    stats_t *get_stats(std::size_t index) noexcept {
+      return &stats[index];
+    }
+
+    /* Note that another file has been evaluated.  Every so often, this
+       folds our counts into the planner's. */
+    void end_file() {
+      if (++file_count % planner.interval == 0) {
+        flush();
+      }
+    }
+
+    /* Fold our counts into the planner's now.  Call this when done. */
+    void flush() {
+      planner.fold(stats);
+    }
+
+    private:
+
+    /* See constructor. */
+    shared_planner_t &planner;
+
+    /* Ours, by expression. */
+    std::vector<stats_t> stats;
+
+    /* The number of calls to end_file() so far. */
+    std::size_t file_count;
+
+  };  // shared_planner_t::local_t
+
+  /* Plan the given expressions, which must outlive us, from the given
+     statistics of a previous run, and replan them whenever a thread has
+     evaluated another interval files. */
+  explicit shared_planner_t(
+      std::vector<const expr_t *> exprs,
+      const stats_t::totals_t &prior = stats_t::totals_t(),
+      std::size_t interval = 256)
+      : exprs(std::move(exprs)),
+        prior(std::make_shared<const stats_t::totals_t>(prior)),
+        interval(interval ? interval : 1) {
+    for (std::size_t i = 0; i < this->exprs.size(); ++i) {
+      stats.emplace_back(this->prior);
+      planner_t(stats[i]).plan(this->exprs[i]);
+    }
+  }
+
+  /* Our statistics, with those we started from, by leaf description. */
+  stats_t::totals_t get_totals() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto totals = *prior;
+    for (const auto &item: stats) {
+      item.add_to(totals);
+    }
+    return totals;
+  }
+
+  /* Add the given counts, by expression, to ours, clear them, and replan
+     every expression.  local_t does this for a thread; call it directly to
+     fold counts gathered some other way. */
+  void fold(std::vector<stats_t> &local) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::size_t i = 0; i < exprs.size(); ++i) {
+      stats[i].add(local[i]);
+      local[i].clear();
+      planner_t(stats[i]).plan(exprs[i]);
+    }
+  }
+
+  /* See constructor. */
+  std::vector<const expr_t *> exprs;
+
+  /* See constructor. */
+  std::shared_ptr<const stats_t::totals_t> prior;
+
+  /* See constructor. */
+  std::size_t interval;
+
+  /* Covers stats. */
+  mutable std::mutex mutex;
+
+  /* The statistics of each expression. */
+  std::vector<stats_t> stats;
+
+};  // shared_planner_t
+
+}  // qmellow
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+#include "expr.h"
+#include "sketch.h"
+
+namespace qmellow {
+
+/* The literals an expression needs a file to contain, arranged as the
+   expression arranges them, so a file's sketch can rule the file out
+   before it's scanned.
+
+   A sketch can only say that something is certainly absent, so only a
+   leaf in a positive position (beneath an even number of nots) can rule a
+   file out: if its literal is absent, the leaf fails, and so might the
+   whole expression.  In a positive position, an and needs both of its
+   operands and an or needs either one; in a negative position, the roles
+   are swapped.  A leaf in a negative position, or one which can't say what
+   it needs, rules nothing out. */
+class prefilter_t final {
+  public:
+
+  /* Derive the prefilter of the given expression. */
+  explicit prefilter_t(const expr_t *expr) {
+    root = walker_t().build(expr, true);
+  }
+
+  /* True iff. we can never rule a file out, so aren't worth testing. */
+  bool is_trivial() const noexcept {
+    return root.op == node_t::always;
+  }
+
+  /* False iff. a file with the given sketch certainly doesn't match. */
+  bool may_match(const sketch_t &sketch) const noexcept {
+    return may_match(root, sketch);
+  }
+
+  private:
+
+  /* A node of the requirement tree. */
+  struct node_t {
+
+    /* What a node requires. */
+    enum op_t {
+
+      /* Nothing. */
+      always,
+
+      /* The bits of the probe. */
+      probe,
+
+      /* Every child. */
+      all,
+
+      /* Any one child. */
+      any
+
+    };
+
+    /* Require nothing. */
+    node_t()
+        : op(always) {}
+
+    /* See op_t. */
+    op_t op;
+
+    /* Used if op is probe. */
+    sketch_t::probe_t probe_bits;
+
+    /* Used if op is all or any. */
+    std::vector<node_t> children;
+
+  };  // prefilter_t::node_t
+
+  /* Walks the expression, building the requirement tree. */
+  class walker_t final
+      : public qmellow::visitor_t {
+    public:
+
+    /* Start positive. */
+    walker_t()
+        : is_positive(true) {}
+
+    /* Build the node for the given expression, in a position of the given
+       polarity. */
+    node_t build(const expr_t *expr, bool is_positive) {
+      bool was_positive = this->is_positive;
+      this->is_positive = is_positive;
+      expr->accept(*this);
+      this->is_positive = was_positive;
+      return std::move(node);
+    }
+
+    /* A leaf requires its probe, but only in a positive position. */
+    virtual void visit(const leaf_t *leaf) override {
+      node = node_t();
+      if (is_positive && leaf->get_probe(node.probe_bits)) {
+        node.op = node_t::probe;
+      }
+    }
+
+    /* A not flips the polarity. */
+    virtual void visit(const not_t *expr) override {
+      node = build(expr->get_subexpr(), !is_positive);
+    }
+
+    /* A group is transparent. */
+    virtual void visit(const group_t *expr) override {
+      node = build(expr->get_subexpr(), is_positive);
+    }
+
+    /* See the class comment. */
+    virtual void visit(const and_t *expr) override {
+      build_infix(expr, is_positive ? node_t::all : node_t::any);
+    }
+
+    /* See the class comment. */
+    virtual void visit(const or_t *expr) override {
+      build_infix(expr, is_positive ? node_t::any : node_t::all);
+    }
+
+    private:
+
+    /* Combine the operands of an and or an or, folding away what rules
+       nothing out.  Nested nodes of the same op are flattened. */
+    void build_infix(const infix_t *expr, node_t::op_t op) {
+      node_t result;
+      result.op = op;
+      node_t operands[2] = {
+        build(expr->get_left_subexpr(), is_positive),
+        build(expr->get_right_subexpr(), is_positive)
+      };
+      for (auto &operand: operands) {
+        if (operand.op == node_t::always) {
+          if (op == node_t::any) {
+            node = node_t();
+            return;
+          }
+        } else if (operand.op == op) {
+          for (auto &child: operand.children) {
+            result.children.push_back(std::move(child));
+          }
+        } else {
+          result.children.push_back(std::move(operand));
+        }
+      }
+      if (result.children.empty()) {
+        node = node_t();
+      } else if (result.children.size() == 1) {
+        node = std::move(result.children[0]);
+      } else {
+        node = std::move(result);
+      }
+    }
+
+    /* True iff. the node we're building is beneath an even number of
+       nots. */
+    bool is_positive;
+
+    /* The node we most recently built. */
+    node_t node;
+
+  };  // prefilter_t::walker_t
+
+  /* See the public may_match(). */
+  static bool may_match(
+      const node_t &node, const sketch_t &sketch) noexcept {
+    switch (node.op) {
+      case node_t::always: return true;
+      case node_t::probe: return sketch.may_contain(node.probe_bits);
+      case node_t::all: {
+        for (const auto &child: node.children) {
+          if (!may_match(child, sketch)) {
+            return false;
+          }
+        }
+        return true;
+      }
+      case node_t::any: {
+        for (const auto &child: node.children) {
+          if (may_match(child, sketch)) {
+            return true;
+          }
+        }
+        return false;
+      }
+    }  // switch
+    return true;
+  }
+
+  /* The root of the requirement tree. */
+  node_t root;
+
+};  // prefilter_t
+
+}  // qmellow
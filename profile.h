@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+
+namespace qmellow {
+
+class expr_t;
+
+/* How much work each node of an expression tree did over one or more
+   evaluations.  A context carrying a profile records into it as it goes;
+   explain() then prints the counts next to the nodes. */
+class profile_t final {
+  public:
+
+  /* The clock we use to time nodes. */
+  using clock_t = std::chrono::steady_clock;
+
+  /* The counts we keep for a single node. */
+  struct node_profile_t {
+
+    /* Start with nothing counted. */
+    node_profile_t() noexcept
+        : calls(0), ns(0), matches(0), short_circuits(0) {}
+
+    /* The number of times the node was evaluated. */
+    std::uint64_t calls;
+
+    /* The total time spent evaluating the node and everything beneath it,
+       in nanoseconds. */
+    std::uint64_t ns;
+
+    /* The number of those times the node matched. */
+    std::uint64_t matches;
+
+    /* The number of times the node skipped its second operand. */
+    std::uint64_t short_circuits;
+
+  };  // profile_t::node_profile_t
+
+  /* Start with no counts. */
+  profile_t() {}
+
+  /* The counts for the given node, or null if it was never evaluated. */
+  const node_profile_t *get(const expr_t *expr) const {
+    auto iter = nodes.find(expr);
+    return (iter != nodes.end()) ? &iter->second : nullptr;
+  }
+
+  /* Count one evaluation of the given node. */
+  void record(
+      const expr_t *expr, bool is_match, clock_t::duration elapsed) {
+    auto &counts = nodes[expr];
+    ++counts.calls;
+    counts.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        elapsed).count();
+    if (is_match) {
+      ++counts.matches;
+    }
+  }
+
+  /* Count one short-circuit of the given node. */
+  void record_short_circuit(const expr_t *expr) {
+    ++nodes[expr].short_circuits;
+  }
+
+  private:
+
+  /* The counts for each node evaluated so far. */
+  std::unordered_map<const expr_t *, node_profile_t> nodes;
+
+};  // profile_t
+
+}  // qmellow
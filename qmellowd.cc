@@ -0,0 +1,502 @@
+/* A daemon which keeps a corpus scanned in memory and answers queries
+   against it over a Unix-domain socket.  See frame.h for the protocol.
+
+     qmellowd [--threads=N] [--cache=N] [--sketches-only]
+         [--stats=stats.txt] socket_path corpus_dir
+
+   The corpus is watched with inotify, so the index stays fresh as files
+   change.  Queries from every connection share one pool of --threads
+   worker threads.  Compiled queries are cached by their text.  Each query
+   first tests every file's sketch and skips the files it rules out.  With
+   --sketches-only, we keep only the sketches in memory and read a file
+   again when its sketch can't rule it out.
+
+   A query which asks only which files match is evaluated a batch of files
+   at a time (see batch_t).  The leaf columns it computes are kept, so
+   later queries sharing its leaves can skip matching them, until the
+   corpus changes.
+
+   Other queries count how often and how fast each of their leaves
+   matches, and reorder their ands and ors as they go (see
+   shared_planner_t).  The counts are pooled over every query, by leaf, so
+   a new query starts from what others learned.  With --stats, the pool
+   starts from the statistics at the given path, if there are any, and is
+   written back there every so often. */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "context.h"
+#include "batch.h"
+#include "bitmap.h"
+#include "error.h"
+#include "expr.h"
+#include "frame.h"
+#include "index.h"
+#include "lexer.h"
+#include "metrics.h"
+#include "parallel.h"
+#include "parser.h"
+#include "plan.h"
+#include "prefilter.h"
+#include "stats.h"
+#include "watch.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* Leaf statistics pooled over every query, by leaf description.  Given a
+   path, we start from the statistics there, if there are any, and write
+   ours back there every so often.  This is thread-safe. */
+class stats_pool_t final {
+  public:
+
+  /* Start from the statistics at the given path, unless it's empty. */
+  explicit stats_pool_t(const string &path)
+      : path(path), last_save(clock_t::now()) {
+    if (path.empty()) {
+      return;
+    }
+    ifstream strm(path);
+    if (strm) {
+      totals = stats_t::read_totals(strm);
+    }
+  }
+
+  /* The statistics so far. */
+  stats_t::totals_t get() const {
+    lock_guard<mutex> lock(mutex_);
+    return totals;
+  }
+
+  /* Add what the given statistics counted to ours, and save them if it's
+     been a while. */
+  void add(const stats_t &stats) {
+    lock_guard<mutex> lock(mutex_);
+    stats.add_to(totals);
+    if (!path.empty() && clock_t::now() - last_save >= save_interval) {
+      save();
+      last_save = clock_t::now();
+    }
+  }
+
+  private:
+
+  /* The clock we time saves by. */
+  using clock_t = chrono::steady_clock;
+
+  /* The least time between saves. */
+  static constexpr chrono::seconds save_interval{60};
+
+  /* Write our statistics beside our path, then move them over it, so a
+     reader never sees half of them.  The caller holds the lock.  Failures
+     are logged, not thrown, as the statistics are only a hint. */
+  void save() const {
+    auto temp_path = path + ".tmp";
+    {
+      ofstream strm(temp_path);
+      stats_t::write_totals(strm, totals);
+      if (!strm) {
+        cerr << "could not write \"" << temp_path << '"' << endl;
+        return;
+      }
+    }
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+      cerr
+          << "could not rename \"" << temp_path << "\": "
+          << strerror(errno) << endl;
+    }
+  }
+
+  /* See constructor. */
+  string path;
+
+  /* Covers the members below. */
+  mutable mutex mutex_;
+
+  /* The statistics so far. */
+  stats_t::totals_t totals;
+
+  /* When we last saved. */
+  clock_t::time_point last_save;
+
+};  // stats_pool_t
+
+constexpr chrono::seconds stats_pool_t::save_interval;
+
+/* A query, compiled, along with its prefilter and planner. */
+struct compiled_t {
+
+  /* Compile the given query and plan it from the given statistics.  Syntax
+     errors are thrown. */
+  compiled_t(const string &text, const stats_t::totals_t &prior)
+      : expr(parser_t::parse(lexer_t::lex(text).data())),
+        prefilter(expr.get()), planner({ expr.get() }, prior) {}
+
+  /* The query itself. */
+  unique_ptr<expr_t> expr;
+
+  /* Rules out files by their sketches. */
+  prefilter_t prefilter;
+
+  /* Replans the query as it's evaluated.  Queries are shared, but this is
+     thread-safe. */
+  mutable shared_planner_t planner;
+
+};  // compiled_t
+
+/* Compiled queries, keyed by their source text.  When we're full, we start
+   over, which is crude but keeps memory bounded. */
+class query_cache_t final {
+  public:
+
+  /* Hold at most the given number of queries, planning new ones from the
+     given statistics. */
+  query_cache_t(size_t capacity, const stats_pool_t &stats)
+      : capacity(capacity ? capacity : 1), stats(stats) {}
+
+  /* The compiled form of the given query, compiling it if we must.  Syntax
+     errors are thrown. */
+  shared_ptr<const compiled_t> get(const string &text) {
+    {
+      lock_guard<mutex> lock(mutex_);
+      auto iter = queries.find(text);
+      if (iter != queries.end()) {
+        return iter->second;
+      }
+    }
+    auto query = make_shared<const compiled_t>(text, stats.get());
+    lock_guard<mutex> lock(mutex_);
+    if (queries.size() >= capacity) {
+      queries.clear();
+    }
+    queries[text] = query;
+    return query;
+  }
+
+  private:
+
+  /* See constructor. */
+  size_t capacity;
+
+  /* See constructor. */
+  const stats_pool_t &stats;
+
+  /* Covers queries. */
+  mutex mutex_;
+
+  /* The queries we've compiled. */
+  map<string, shared_ptr<const compiled_t>> queries;
+
+};  // query_cache_t
+
+/* The number of files we evaluate between bursts of output. */
+const size_t block_size = 256;
+
+/* Evaluate a query against every file in the index, on the given pool,
+   writing a match frame for each match and finally an end frame.  We work
+   through the files a block at a time, so output starts early and memory
+   stays bounded, and write each block's frames together.  A
+   file whose sketch rules it out is never looked at, nor, if the index
+   doesn't keep files, read.  Each file gives at most limit matches, the
+   first in order.  After each block, what we counted of the query's
+   leaves goes to its planner and to the pool. */
+void answer(
+    int fd, const compiled_t &query, const index_t &index,
+    stats_pool_t &stats, pool_t &pool, size_t limit) {
+  frame_writer_t out(fd);
+  auto entries = index.get_snapshot();
+  size_t matching_file_count = 0;
+  atomic<size_t> skipped_file_count(0);
+  bool use_prefilter = !query.prefilter.is_trivial();
+  vector<result_t> results;
+  for (size_t start = 0; start < entries.size(); start += block_size) {
+    auto end = min(start + block_size, entries.size());
+    results.assign(end - start, result_t());
+    vector<stats_t> file_stats(end - start);
+    pool.run(end - start, [&](size_t i) {
+      const auto &entry = entries[start + i];
+      if (use_prefilter && !query.prefilter.may_match(*entry.sketch)) {
+        ++skipped_file_count;
+        QMELLOW_METRICS_ADD(files_skipped, 1);
+        return;
+      }
+      shared_ptr<const file_t> file;
+      try {
+        file = index_t::load(entry);
+      } catch (const runtime_error &) {
+        return;
+      }
+      context_t context(&file_stats[i], nullptr, limit);
+      results[i] = query.expr->eval(*file, context);
+      results[i].expand();
+    });
+    vector<stats_t> block_stats(1);
+    for (const auto &item: file_stats) {
+      block_stats[0].add(item);
+    }
+    stats.add(block_stats[0]);
+    query.planner.fold(block_stats);
+    for (size_t i = 0; i < results.size(); ++i) {
+      if (!results[i].is_match()) {
+        continue;
+      }
+      ++matching_file_count;
+      for (const auto &match: results[i].get_matches()) {
+        ostringstream strm;
+        strm
+            << "M\t" << entries[start + i].path << '\t'
+            << match.get_line_number() << '\t' << match.get_cause_desc()
+            << '\t' << match.get_line_text();
+        out.write(strm.str());
+      }
+    }
+    out.flush();
+  }
+  ostringstream strm;
+  strm
+      << "E\t" << matching_file_count << '\t' << entries.size() << '\t'
+      << skipped_file_count;
+  out.write(strm.str());
+  out.flush();
+}
+
+/* The number of files we evaluate together when asked only which files
+   match. */
+const size_t batch_size = 4096;
+
+/* Evaluate a query against every file in the index, a batch at a time, on
+   the given pool, writing a file frame for each matching file and finally
+   an end frame.
+   Files are read, if the index doesn't keep them, only when a leaf must be
+   matched against them. */
+void answer_files(
+    int fd, const compiled_t &query, const index_t &index,
+    leaf_tables_t &tables, pool_t &pool) {
+  size_t generation;
+  auto entries = index.get_snapshot(generation);
+  auto batch_count = (entries.size() + batch_size - 1) / batch_size;
+  atomic<size_t> skipped_file_count(0);
+  bool use_prefilter = !query.prefilter.is_trivial();
+  vector<bitmap_t> results(batch_count);
+  pool.run(batch_count, [&](size_t b) {
+    auto start = b * batch_size;
+    auto size = min(batch_size, entries.size() - start);
+    bitmap_t candidates(size);
+    for (size_t i = 0; i < size; ++i) {
+      if (!use_prefilter
+          || query.prefilter.may_match(*entries[start + i].sketch)) {
+        candidates.set(i);
+      }
+    }
+    auto skipped = size - candidates.count();
+    skipped_file_count += skipped;
+    QMELLOW_METRICS_ADD(files_skipped, skipped);
+    vector<shared_ptr<const file_t>> files(size);
+    bitmap_t unreadable(size);
+    batch_t batch(
+        size,
+        [&](size_t i) -> const file_t & {
+          auto &file = files[i];
+          if (!file) {
+            try {
+              file = index_t::load(entries[start + i]);
+            } catch (const runtime_error &) {
+              unreadable.set(i);
+              file = make_shared<file_t>();
+            }
+          }
+          return *file;
+        },
+        tables.take(generation, b));
+    results[b] = batch.eval(query.expr.get(), candidates);
+    if (unreadable.is_empty()) {
+      tables.put(generation, b, batch.release_columns());
+    } else {
+      results[b].subtract(unreadable);
+    }
+  });
+  frame_writer_t out(fd);
+  size_t matching_file_count = 0;
+  for (size_t b = 0; b < batch_count; ++b) {
+    results[b].for_each([&](size_t i) {
+      ++matching_file_count;
+      out.write("F\t" + entries[b * batch_size + i].path);
+    });
+  }
+  ostringstream strm;
+  strm
+      << "E\t" << matching_file_count << '\t' << entries.size() << '\t'
+      << skipped_file_count;
+  out.write(strm.str());
+  out.flush();
+}
+
+/* If the query starts with the letter N, a positive count, and a tab,
+   strip them off and return the count; otherwise, return no limit. */
+size_t take_limit(string &query) {
+  if (query.size() < 3 || query[0] != 'N' || !isdigit(query[1])) {
+    return result_t::get_no_limit();
+  }
+  char *end;
+  auto limit = strtoul(query.c_str() + 1, &end, 10);
+  if (*end != '\t' || limit == 0) {
+    return result_t::get_no_limit();
+  }
+  query.erase(0, end + 1 - query.c_str());
+  return limit;
+}
+
+/* Serve a single connection until the client hangs up. */
+void serve(
+    int fd, query_cache_t &cache, leaf_tables_t &tables,
+    stats_pool_t &stats, const index_t &index, pool_t &pool) {
+  try {
+    string query;
+    while (read_frame(fd, query)) {
+      bool files_only = (query.compare(0, 2, "L\t") == 0);
+      if (files_only) {
+        query.erase(0, 2);
+      }
+      auto limit = take_limit(query);
+      shared_ptr<const compiled_t> compiled;
+      try {
+        compiled = cache.get(query);
+      } catch (const qmellow::error_t &ex) {
+        write_frame(fd, string("X\t") + ex.what());
+        continue;
+      }
+      if (files_only) {
+        answer_files(fd, *compiled, index, tables, pool);
+      } else {
+        answer(fd, *compiled, index, stats, pool, limit);
+      }
+    }
+  } catch (const exception &ex) {
+    cerr << "connection: " << ex.what() << endl;
+  }
+  close(fd);
+}
+
+/* Listen on a Unix-domain socket at the given path, replacing any socket
+   already there. */
+int listen_at(const string &path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw runtime_error("socket path is too long");
+  }
+  strcpy(addr.sun_path, path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw runtime_error(string("could not make socket: ") + strerror(errno));
+  }
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+      || listen(fd, 64) != 0) {
+    throw runtime_error(
+        "could not listen at \"" + path + "\": " + strerror(errno));
+  }
+  return fd;
+}
+
+/* Write the usage message and exit. */
+void usage() {
+  cerr
+      << "usage: qmellowd [--threads=N] [--cache=N] [--sketches-only] "
+      << "[--stats=stats.txt] socket_path corpus_dir\n";
+  exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  size_t thread_count = 0, cache_size = 1000;
+  bool keep_files = true;
+  string stats_path;
+  vector<string> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, 10, "--threads=") == 0) {
+      thread_count = strtoul(arg.c_str() + 10, nullptr, 10);
+    } else if (arg.compare(0, 8, "--cache=") == 0) {
+      cache_size = strtoul(arg.c_str() + 8, nullptr, 10);
+    } else if (arg == "--sketches-only") {
+      keep_files = false;
+    } else if (arg.compare(0, 8, "--stats=") == 0) {
+      stats_path = arg.substr(8);
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage();
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.size() != 2) {
+    usage();
+  }
+  try {
+    watcher_t watcher(args[1]);
+    index_t index(args[1], thread_count, keep_files);
+    stats_pool_t stats(stats_path);
+    query_cache_t cache(cache_size, stats);
+    leaf_tables_t tables(65536);
+    pool_t pool(thread_count);
+    int listen_fd = listen_at(args[0]);
+    cerr
+        << "qmellowd: indexed " << index.get_snapshot().size()
+        << " files; listening at " << args[0] << endl;
+    for (;;) {
+      pollfd items[2] = {
+        { listen_fd, POLLIN, 0 }, { watcher.get_fd(), POLLIN, 0 }
+      };
+      if (poll(items, 2, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw runtime_error(string("could not poll: ") + strerror(errno));
+      }
+      if (items[1].revents) {
+        vector<string> paths;
+        watcher.read_changes(paths);
+        if (watcher.check_overflow()) {
+          index.rescan();
+        } else {
+          index.update(paths);
+        }
+      }
+      if (items[0].revents) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) {
+          thread(
+              serve, fd, ref(cache), ref(tables), ref(stats), cref(index),
+              ref(pool)).detach();
+        }
+      }
+    }
+  } catch (const exception &ex) {
+    cerr << "error: " << ex.what() << endl;
+    return 1;
+  }
+}
@@ -0,0 +1,96 @@
+/* Generates native evaluators for the rules of a rule pack, or checks a
+   build of them against the interpreter.
+
+     qmellowgen rule_pack > rules.cc
+     qmellowgen --check=rules.so [--limit=N] rule_pack corpus_dir
+
+   The first form writes C++ source to stdout (see codegen_t), to be built
+   into a shared object as its opening comment says.  The second loads the
+   shared object (see native_pack_t) and evaluates every rule on every file
+   of the corpus both ways, with no limit and, if given, with the given
+   one, stopping at the first file on which they differ.
+
+   Exits with 0 on success, 1 if the evaluators differ from the
+   interpreter, and 2 on error. */
+
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "codegen.h"
+#include "file.h"
+#include "native.h"
+#include "pack.h"
+#include "result.h"
+#include "utils.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* Write the usage message and exit. */
+void usage() {
+  cerr
+      << "usage: qmellowgen rule_pack\n"
+      << "       qmellowgen --check=rules.so [--limit=N] "
+      << "rule_pack corpus_dir\n";
+  exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  string check_path;
+  size_t limit = result_t::get_no_limit();
+  vector<string> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, 8, "--check=") == 0) {
+      check_path = arg.substr(8);
+    } else if (arg.compare(0, 8, "--limit=") == 0) {
+      limit = strtoul(arg.c_str() + 8, nullptr, 10);
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage();
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.size() != (check_path.empty() ? 1u : 2u) || limit == 0) {
+    usage();
+  }
+  try {
+    auto pack = pack_t::load(args[0]);
+    if (check_path.empty()) {
+      codegen_t::generate(cout, pack);
+      cout.flush();
+      if (!cout) {
+        throw runtime_error("could not write the evaluators");
+      }
+      return 0;
+    }
+    native_pack_t native(pack, check_path);
+    vector<string> paths;
+    list_files(args[1], paths);
+    for (const auto &path: paths) {
+      file_t file(read_whole_file(path));
+      try {
+        native.check(file);
+        if (limit != result_t::get_no_limit()) {
+          native.check(file, limit);
+        }
+      } catch (const exception &ex) {
+        cerr << path << ": " << ex.what() << endl;
+        return 1;
+      }
+    }
+    cerr
+        << "checked " << pack.get_rules().size() << " rules on "
+        << paths.size() << " files\n";
+    return 0;
+  } catch (const exception &ex) {
+    cerr << "error: " << ex.what() << endl;
+    return 2;
+  }
+}
@@ -0,0 +1,106 @@
+/* Sends a query to a running qmellowd and writes the matches, one per line,
+   in the form path:line: cause: text.  With -l, writes only the paths of
+   the matching files, one per line.  With -n, writes at most count
+   matches per file, the first in order.
+
+     qmellowq [-l] [-n count] socket_path query
+
+   Exits with 0 if any file matched, 1 if none did, and 2 on error. */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "frame.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* Connect to the daemon listening at the given path. */
+int connect_to(const string &path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw runtime_error("socket path is too long");
+  }
+  strcpy(addr.sun_path, path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0
+      || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))
+          != 0) {
+    throw runtime_error(
+        "could not connect to \"" + path + "\": " + strerror(errno));
+  }
+  return fd;
+}
+
+/* Split off the next tab-separated field of the payload. */
+string next_field(const string &payload, size_t &cursor) {
+  auto end = payload.find('\t', cursor);
+  if (end == string::npos) {
+    end = payload.size();
+  }
+  string field = payload.substr(cursor, end - cursor);
+  cursor = min(end + 1, payload.size());
+  return field;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bool files_only = false;
+  string limit;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-l") == 0) {
+      files_only = true;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc
+        && strtoul(argv[i + 1], nullptr, 10) > 0) {
+      limit = "N" + to_string(strtoul(argv[++i], nullptr, 10)) + "\t";
+    } else {
+      break;
+    }
+  }
+  if (argc - i != 2) {
+    cerr << "usage: qmellowq [-l] [-n count] socket_path query\n";
+    return 2;
+  }
+  char **args = argv + i;
+  try {
+    int fd = connect_to(args[0]);
+    write_frame(fd, (files_only ? "L\t" : "") + limit + string(args[1]));
+    string payload;
+    while (read_frame(fd, payload)) {
+      size_t cursor = 0;
+      auto kind = next_field(payload, cursor);
+      if (kind == "M") {
+        auto path = next_field(payload, cursor);
+        auto line_number = next_field(payload, cursor);
+        auto cause = next_field(payload, cursor);
+        cout
+            << path << ':' << line_number << ": " << cause << ": "
+            << payload.substr(cursor) << '\n';
+      } else if (kind == "F") {
+        cout << payload.substr(cursor) << '\n';
+      } else if (kind == "E") {
+        auto matching = next_field(payload, cursor);
+        return (matching != "0") ? 0 : 1;
+      } else if (kind == "X") {
+        cerr << "error: " << payload.substr(cursor) << endl;
+        return 2;
+      }
+    }
+    throw runtime_error("daemon hung up");
+  } catch (const exception &ex) {
+    cerr << "error: " << ex.what() << endl;
+    return 2;
+  }
+}
@@ -0,0 +1,86 @@
+/* Sweeps a rule pack over a corpus and writes every match, in one order
+   whatever the scheduling: by path, then by rule, then by sub-file, line,
+   and cause.  The sweep is split across worker processes (see
+   sharded_sweep_t), whose sorted outputs are merged.
+
+     qmellowsweep [--shards=N] [--threads=N] [--format=jsonl|binary]
+         rule_pack corpus_dir
+
+   There's one shard by default.  --threads is per shard, and defaults to
+   one per hardware thread, shared among the shards.  Matches are written
+   to stdout as JSON lines, by default, or binary records; see sink.h.
+
+   Exits with 0 if anything matched, 1 if nothing did, and 2 on error. */
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "pack.h"
+#include "parallel.h"
+#include "shard.h"
+#include "sink.h"
+#include "utils.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* Write the usage message and exit. */
+void usage() {
+  cerr
+      << "usage: qmellowsweep [--shards=N] [--threads=N] "
+      << "[--format=jsonl|binary] rule_pack corpus_dir\n";
+  exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  size_t shard_count = 1, thread_count = 0;
+  string format = "jsonl";
+  vector<string> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, 9, "--shards=") == 0) {
+      shard_count = strtoul(arg.c_str() + 9, nullptr, 10);
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      thread_count = strtoul(arg.c_str() + 10, nullptr, 10);
+    } else if (arg == "--format=jsonl" || arg == "--format=binary") {
+      format = arg.substr(9);
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage();
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.size() != 2 || shard_count == 0) {
+    usage();
+  }
+  if (!thread_count) {
+    thread_count = max<size_t>(get_thread_count(0) / shard_count, 1);
+  }
+  try {
+    auto pack = pack_t::load(args[0]);
+    vector<string> paths;
+    list_files(args[1], paths);
+    unique_ptr<sink_t> sink;
+    if (format == "binary") {
+      sink = make_unique<binary_sink_t>(cout);
+    } else {
+      sink = make_unique<json_lines_sink_t>(cout);
+    }
+    auto match_count =
+        sharded_sweep_t(pack, shard_count, thread_count).run(paths, *sink);
+    cout.flush();
+    if (!cout) {
+      throw runtime_error("could not write matches");
+    }
+    return match_count ? 0 : 1;
+  } catch (const exception &ex) {
+    cerr << "error: " << ex.what() << endl;
+    return 2;
+  }
+}
@@ -0,0 +1,110 @@
+/* Watches a corpus and reports, as files change, the matches of a rule pack
+   which appear and go away.
+
+     qmellowwatch [--threads=N] [--quiet-start] rule_pack corpus_dir
+
+   Each match is written as a line of the form +path:line: rule: text when
+   it appears and -path:line: rule: text when it goes away.  If the match
+   is in an include, the path is written as page>include.  We start by
+   reporting every match as appearing, unless --quiet-start is given.  After
+   each batch of changes, a summary goes to stderr. */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "live.h"
+#include "match.h"
+#include "pack.h"
+#include "watch.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* Write the usage message and exit. */
+void usage() {
+  cerr
+      << "usage: qmellowwatch [--threads=N] [--quiet-start] rule_pack "
+      << "corpus_dir\n";
+  exit(2);
+}
+
+/* Write a single appearing or disappearing match. */
+void write_delta(
+    bool added, const string &path, const pack_t::rule_t &rule,
+    const match_t &match) {
+  cout
+      << (added ? '+' : '-') << path;
+  if (!match.get_sub_file_path().empty()) {
+    cout << '>' << match.get_sub_file_path();
+  }
+  cout
+      << ':' << match.get_line_number() << ": " << rule.get_text() << ": "
+      << match.get_line_text() << '\n';
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  size_t thread_count = 0;
+  bool quiet_start = false;
+  vector<string> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, 10, "--threads=") == 0) {
+      thread_count = strtoul(arg.c_str() + 10, nullptr, 10);
+    } else if (arg == "--quiet-start") {
+      quiet_start = true;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage();
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.size() != 2) {
+    usage();
+  }
+  try {
+    auto pack = pack_t::load(args[0]);
+    live_t live(pack, args[1], thread_count);
+    watcher_t watcher(live.get_root());
+    live.rescan(
+        [&](bool added, const string &path, const pack_t::rule_t &rule,
+            const match_t &match) {
+          if (!quiet_start) {
+            write_delta(added, path, rule, match);
+          }
+        });
+    cout.flush();
+    cerr << "qmellowwatch: watching " << live.get_file_count() << " files\n";
+    for (;;) {
+      vector<string> paths;
+      if (!watcher.wait(-1, paths)) {
+        continue;
+      }
+      auto start = chrono::steady_clock::now();
+      size_t delta_count = 0;
+      auto on_delta =
+          [&](bool added, const string &path, const pack_t::rule_t &rule,
+              const match_t &match) {
+            write_delta(added, path, rule, match);
+            ++delta_count;
+          };
+      auto eval_count = watcher.check_overflow()
+          ? live.rescan(on_delta) : live.update(paths, on_delta);
+      cout.flush();
+      cerr
+          << "qmellowwatch: " << paths.size() << " changed, " << eval_count
+          << " re-evaluated, " << delta_count << " deltas in "
+          << chrono::duration_cast<chrono::microseconds>(
+              chrono::steady_clock::now() - start).count()
+          << " us\n";
+    }
+  } catch (const exception &ex) {
+    cerr << "error: " << ex.what() << endl;
+    return 1;
+  }
+}
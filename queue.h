@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace qmellow {
+
+/* A bounded, lock-free, multi-producer, multi-consumer queue, after Dmitry
+   Vyukov's.  Each cell carries a sequence number which tells producers and
+   consumers whose turn it is, so a push or pop costs one compare-and-swap
+   when uncontended.  The capacity is rounded up to a power of two. */
+template <typename elem_t>
+class queue_t final {
+  public:
+
+  /* Start empty, able to hold at least the given number of elements. */
+  explicit queue_t(std::size_t capacity)
+      : cells(round_up(capacity)), mask(cells.size() - 1), head(0),
+        tail(0) {
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /* Not copyable. */
+  queue_t(const queue_t &) = delete;
+  queue_t &operator=(const queue_t &) = delete;
+
+  /* The number of elements we can hold. */
+  std::size_t get_capacity() const noexcept {
+    return cells.size();
+  }
+
+  /* Add an element, moving from it, unless we're full.  Returns false if
+     we were full, in which case the element is left alone. */
+  bool try_push(elem_t &elem) {
+    auto pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      auto &cell = cells[pos & mask];
+      auto seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          cell.elem = std::move(elem);
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /* Remove the oldest element, unless we're empty.  Returns false if we
+     were empty. */
+  bool try_pop(elem_t &elem) {
+    auto pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      auto &cell = cells[pos & mask];
+      auto seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+      if (diff == 0) {
+        if (head.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          elem = std::move(cell.elem);
+          cell.seq.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /* Add an element, waiting for room if we're full. */
+  void push(elem_t &elem) {
+    for (backoff_t backoff; !try_push(elem); backoff.wait()) {}
+  }
+
+  /* Waits politely for another thread to make progress: spinning at first,
+     then yielding, then sleeping. */
+  class backoff_t final {
+    public:
+
+    /* Start impatient. */
+    backoff_t() noexcept
+        : count(0) {}
+
+    /* Wait a little, and a little longer each time. */
+    void wait() {
+      ++count;
+      if (count < 64) {
+        return;
+      }
+      if (count < 128) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+
+    private:
+
+    /* The number of times we've waited. */
+    std::size_t count;
+
+  };  // queue_t::backoff_t
+
+  private:
+
+  /* A slot for a single element. */
+  struct cell_t {
+
+    /* Do-little. */
+    cell_t()
+        : seq(0) {}
+
+    /* Whose turn it is.  See the class comment. */
+    std::atomic<std::size_t> seq;
+
+    /* The element, if one has been pushed here and not yet popped. */
+    elem_t elem;
+
+  };  // queue_t::cell_t
+
+  /* The smallest power of two which is not less than n (and at least 2). */
+  static std::size_t round_up(std::size_t n) noexcept {
+    std::size_t size = 2;
+    while (size < n) {
+      size *= 2;
+    }
+    return size;
+  }
+
+  /* Our cells. */
+  std::vector<cell_t> cells;
+
+  /* The size of cells, less one. */
+  std::size_t mask;
+
+  /* Keeps head off the cache line of the fields above. */
+  char pad0[64];
+
+  /* The positions of the next pop and next push, padded apart, so
+     producers and consumers don't contend over a cache line. */
+  std::atomic<std::size_t> head;
+  char pad1[64];
+  std::atomic<std::size_t> tail;
+
+};  // queue_t
+
+}  // qmellow
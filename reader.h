@@ -0,0 +1,477 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "queue.h"
+#include "trace.h"
+#include "utils.h"
+
+namespace qmellow {
+
+/* Reads a list of files on a stage of its own, so that the threads which
+   evaluate them never wait on the disk.  We keep many reads in flight at
+   once using io_uring, or, where io_uring isn't available, a few threads
+   doing blocking preads.  Filled buffers are handed to the consumers
+   through a bounded lock-free queue, in whatever order the reads finish.
+   Buffers come from a fixed pool, to which consumers return them when
+   they're done, so memory stays bounded and allocations are few; when the
+   pool is empty, reading waits for the consumers to catch up. */
+class reader_t final {
+  public:
+
+  /* A file we've read, or failed to. */
+  struct item_t {
+
+    /* The file's position in the list of paths. */
+    std::size_t index;
+
+    /* True iff. we read the file. */
+    bool ok;
+
+    /* The file's contents, in a buffer from our pool, if ok.  Pass this
+       to recycle() when done with it. */
+    std::string text;
+
+  };  // reader_t::item_t
+
+  /* Start reading the files at the given paths, keeping up to the given
+     number of reads in flight and the given number of buffers in the pool
+     (zero meaning twice the number of reads).  If use_uring is false, or
+     io_uring isn't available, we fall back on preads.  The paths must
+     outlive us. */
+  explicit reader_t(
+      const std::vector<std::string> &paths, std::size_t depth = 32,
+      std::size_t buffer_count = 0, bool use_uring = true)
+      : paths(paths), depth(std::max<std::size_t>(depth, 1)),
+        buffer_count(buffer_count ? buffer_count : 2 * this->depth),
+        free_buffers(this->buffer_count),
+        items(this->buffer_count + 1), claim_count(0), next_index(0),
+        stopping(false), backend("pread") {
+    for (std::size_t i = 0; i < this->buffer_count; ++i) {
+      std::string buffer;
+      free_buffers.try_push(buffer);
+    }
+    if (use_uring) {
+      try {
+        ring = make_unique<uring_t>(static_cast<unsigned>(this->depth));
+      } catch (const std::runtime_error &) {}
+    }
+    if (ring) {
+      backend = ring->is_using_readv() ? "io_uring-readv" : "io_uring";
+      threads.emplace_back([this]() { read_with_uring(); });
+    } else {
+      for (std::size_t i = 0; i < std::min<std::size_t>(this->depth, 8);
+          ++i) {
+        threads.emplace_back([this]() { read_with_pread(); });
+      }
+    }
+  }
+
+  /* Stop reading, even if the consumers didn't take everything. */
+  ~reader_t() {
+    stopping.store(true);
+    for (auto &thread: threads) {
+      thread.join();
+    }
+  }
+
+  /* Not copyable. */
+  reader_t(const reader_t &) = delete;
+  reader_t &operator=(const reader_t &) = delete;
+
+  /* The way we're reading: "io_uring", "io_uring-readv" on kernels too old
+     for plain reads on a ring, or "pread". */
+  const char *get_backend() const noexcept {
+    return backend;
+  }
+
+  /* Take the next file to be read, waiting for it if need be.  Returns
+     false when every file has been taken.  This is thread-safe. */
+  bool pop(item_t &item) {
+    if (claim_count.fetch_add(1) >= paths.size()) {
+      return false;
+    }
+    for (queue_t<item_t>::backoff_t backoff; !items.try_pop(item);
+        backoff.wait()) {}
+    return true;
+  }
+
+  /* Return the buffer of an item to the pool.  This is thread-safe. */
+  void recycle(std::string &&buffer) {
+    buffer.clear();
+    free_buffers.try_push(buffer);
+  }
+
+  private:
+
+  /* A minimal io_uring, driven by raw system calls, since we don't want to
+     depend on liburing.  Only the reading thread touches it. */
+  class uring_t final {
+    public:
+
+    /* Make a ring with room for the given number of entries. */
+    explicit uring_t(unsigned entries)
+        : use_readv(false), unsubmitted(0) {
+      std::memset(&params, 0, sizeof(params));
+      fd = static_cast<int>(
+          syscall(__NR_io_uring_setup, entries, &params));
+      if (fd < 0) {
+        throw std::runtime_error("could not set up io_uring");
+      }
+      sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cq_size =
+          params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+      }
+      sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+      cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP)
+          ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+      sqes = static_cast<io_uring_sqe *>(map(
+          params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+      if (!is_supported(IORING_OP_READ)) {
+        use_readv = true;
+        iovecs.resize(params.sq_entries);
+      }
+    }
+
+    /* Tear down the ring. */
+    ~uring_t() {
+      munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+      if (cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+      }
+      munmap(sq_ptr, sq_size);
+      close(fd);
+    }
+
+    /* True if the kernel predates plain reads on a ring (5.6), so we queue
+       vectored reads, which every kernel with io_uring has. */
+    bool is_using_readv() const noexcept {
+      return use_readv;
+    }
+
+    /* Queue a read of the given range of a file into the given memory.
+       The caller keeps no more reads in flight than the ring has entries,
+       and names each by a user_data below that number which no other read
+       in flight has. */
+    void queue_read(
+        int file_fd, char *data, std::size_t size, std::uint64_t offset,
+        std::uint64_t user_data) {
+      auto *tail = get_sq(params.sq_off.tail);
+      auto mask = *get_sq(params.sq_off.ring_mask);
+      auto pos = __atomic_load_n(tail, __ATOMIC_RELAXED);
+      auto index = pos & mask;
+      auto &sqe = sqes[index];
+      std::memset(&sqe, 0, sizeof(sqe));
+      size = std::min<std::size_t>(size, 1u << 30);
+      sqe.fd = file_fd;
+      if (use_readv) {
+        auto &vec = iovecs[user_data];
+        vec.iov_base = data;
+        vec.iov_len = size;
+        sqe.opcode = IORING_OP_READV;
+        sqe.addr = reinterpret_cast<std::uint64_t>(&vec);
+        sqe.len = 1;
+      } else {
+        sqe.opcode = IORING_OP_READ;
+        sqe.addr = reinterpret_cast<std::uint64_t>(data);
+        sqe.len = static_cast<std::uint32_t>(size);
+      }
+      sqe.off = offset;
+      sqe.user_data = user_data;
+      get_sq(params.sq_off.array)[index] = index;
+      __atomic_store_n(tail, pos + 1, __ATOMIC_RELEASE);
+      ++unsubmitted;
+    }
+
+    /* Submit the queued reads and wait for at least one to finish. */
+    void submit_and_wait() {
+      for (;;) {
+        auto result = syscall(
+            __NR_io_uring_enter, fd, unsubmitted, 1,
+            IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (result >= 0) {
+          unsubmitted -= static_cast<unsigned>(result);
+          return;
+        }
+        if (errno != EINTR) {
+          throw std::runtime_error("could not enter io_uring");
+        }
+      }
+    }
+
+    /* Call fn(user_data, result) for each finished read. */
+    template <typename fn_t>
+    void reap(const fn_t &fn) {
+      auto *head = get_cq(params.cq_off.head);
+      auto *tail = get_cq(params.cq_off.tail);
+      auto mask = *get_cq(params.cq_off.ring_mask);
+      auto *cqes = reinterpret_cast<io_uring_cqe *>(
+          static_cast<char *>(cq_ptr) + params.cq_off.cqes);
+      auto pos = __atomic_load_n(head, __ATOMIC_RELAXED);
+      while (pos != __atomic_load_n(tail, __ATOMIC_ACQUIRE)) {
+        const auto &cqe = cqes[pos & mask];
+        fn(cqe.user_data, cqe.res);
+        __atomic_store_n(head, ++pos, __ATOMIC_RELEASE);
+      }
+    }
+
+    private:
+
+    /* True if the kernel says it supports the given operation.  Kernels
+       before 5.6 can't say, and support nothing newer than readv. */
+    bool is_supported(unsigned op) const {
+      std::vector<char> buffer(
+          sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+      auto *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+      if (syscall(
+              __NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+              256) < 0) {
+        return false;
+      }
+      return op <= probe->last_op
+          && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    /* Map a region of the ring. */
+    void *map(std::size_t size, std::uint64_t offset) {
+      void *ptr = mmap(
+          nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+          fd, offset);
+      if (ptr == MAP_FAILED) {
+        throw std::runtime_error("could not map io_uring");
+      }
+      return ptr;
+    }
+
+    /* A field of the submission ring. */
+    unsigned *get_sq(std::uint32_t offset) const noexcept {
+      return reinterpret_cast<unsigned *>(
+          static_cast<char *>(sq_ptr) + offset);
+    }
+
+    /* A field of the completion ring. */
+    unsigned *get_cq(std::uint32_t offset) const noexcept {
+      return reinterpret_cast<unsigned *>(
+          static_cast<char *>(cq_ptr) + offset);
+    }
+
+    /* What the kernel told us about the ring. */
+    io_uring_params params;
+
+    /* The ring itself. */
+    int fd;
+
+    /* The mapped submission and completion rings, which may be one and
+       the same, and their sizes. */
+    void *sq_ptr, *cq_ptr;
+    std::size_t sq_size, cq_size;
+
+    /* The mapped submission entries. */
+    io_uring_sqe *sqes;
+
+    /* See accessor. */
+    bool use_readv;
+
+    /* Where each vectored read in flight goes, by user_data. */
+    std::vector<iovec> iovecs;
+
+    /* The number of reads queued but not yet submitted. */
+    unsigned unsubmitted;
+
+  };  // reader_t::uring_t
+
+  /* A read in flight. */
+  struct slot_t {
+
+    /* The file we're reading. */
+    int fd;
+
+    /* What we've read so far. */
+    item_t item;
+
+    /* The number of bytes read so far. */
+    std::size_t offset;
+
+  };  // reader_t::slot_t
+
+  /* Open the file at the given index and size a buffer for it.  Returns -1
+     if the file couldn't be opened, in which case the item has been
+     reported.  Otherwise, the item holds a buffer of the file's size. */
+  int open_file(std::size_t index, item_t &item) {
+    item.index = index;
+    item.ok = false;
+    int fd = open(paths[index].c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      put(item);
+      return -1;
+    }
+    for (queue_t<std::string>::backoff_t backoff;
+        !free_buffers.try_pop(item.text) && !stopping.load();
+        backoff.wait()) {}
+    item.text.resize(static_cast<std::size_t>(info.st_size));
+    return fd;
+  }
+
+  /* Close a file and report it. */
+  void finish_file(int fd, item_t &item, bool ok, std::size_t size) {
+    close(fd);
+    item.ok = ok;
+    if (ok) {
+      item.text.resize(size);
+      QMELLOW_METRICS_ADD(bytes_read, size);
+    } else {
+      recycle(std::move(item.text));
+    }
+    put(item);
+  }
+
+  /* Hand an item to the consumers, waiting for room unless we're
+     stopping. */
+  void put(item_t &item) {
+    for (queue_t<item_t>::backoff_t backoff;
+        !items.try_push(item) && !stopping.load(); backoff.wait()) {}
+  }
+
+  /* The reading loop, with io_uring.  If we're stopped, we still wait for
+     the reads in flight to land before we free their buffers. */
+  void read_with_uring() {
+    std::vector<slot_t> slots(depth);
+    std::vector<std::size_t> free_slots;
+    for (std::size_t i = depth; i > 0; --i) {
+      free_slots.push_back(i - 1);
+    }
+    std::size_t next = 0;
+    for (;;) {
+      while (!free_slots.empty() && next < paths.size()
+          && !stopping.load()) {
+        QMELLOW_TRACE_SPAN_ARG("open", next);
+        auto &slot = slots[free_slots.back()];
+        slot.fd = open_file(next++, slot.item);
+        if (slot.fd < 0) {
+          continue;
+        }
+        slot.offset = 0;
+        if (slot.item.text.empty()) {
+          finish_file(slot.fd, slot.item, true, 0);
+          continue;
+        }
+        ring->queue_read(
+            slot.fd, &slot.item.text[0], slot.item.text.size(), 0,
+            free_slots.back());
+        free_slots.pop_back();
+      }
+      if (free_slots.size() == depth) {
+        break;
+      }
+      ring->submit_and_wait();
+      ring->reap([&](std::uint64_t i, std::int32_t result) {
+        auto &slot = slots[i];
+        if (result > 0) {
+          slot.offset += result;
+          if (slot.offset < slot.item.text.size() && !stopping.load()) {
+            ring->queue_read(
+                slot.fd, &slot.item.text[slot.offset],
+                slot.item.text.size() - slot.offset, slot.offset, i);
+            return;
+          }
+        }
+        finish_file(
+            slot.fd, slot.item, result >= 0 && !stopping.load(),
+            slot.offset);
+        free_slots.push_back(i);
+      });
+    }
+  }
+
+  /* The reading loop, with blocking preads.  Several threads run this,
+     taking paths in turn. */
+  void read_with_pread() {
+    for (;;) {
+      auto index = next_index++;
+      if (index >= paths.size() || stopping.load()) {
+        break;
+      }
+      QMELLOW_TRACE_SPAN_ARG("load", index);
+      item_t item;
+      int fd = open_file(index, item);
+      if (fd < 0) {
+        continue;
+      }
+      std::size_t offset = 0;
+      bool ok = true;
+      while (offset < item.text.size()) {
+        auto result = pread(
+            fd, &item.text[offset], item.text.size() - offset, offset);
+        if (result < 0 && errno == EINTR) {
+          continue;
+        }
+        if (result <= 0) {
+          ok = (result == 0);
+          break;
+        }
+        offset += result;
+      }
+      finish_file(fd, item, ok, offset);
+    }
+  }
+
+  /* See constructor. */
+  const std::vector<std::string> &paths;
+
+  /* The maximum number of reads in flight. */
+  std::size_t depth;
+
+  /* The number of buffers in our pool. */
+  std::size_t buffer_count;
+
+  /* The pool of buffers not in use. */
+  queue_t<std::string> free_buffers;
+
+  /* The files we've read and the consumers haven't yet taken. */
+  queue_t<item_t> items;
+
+  /* The number of calls to pop(), which is how consumers know when every
+     file has been taken. */
+  std::atomic<std::size_t> claim_count;
+
+  /* The next path for the pread threads to take. */
+  std::atomic<std::size_t> next_index;
+
+  /* Set when we're destroyed, to stop the reading threads. */
+  std::atomic<bool> stopping;
+
+  /* See accessor. */
+  const char *backend;
+
+  /* Our ring, if we're using io_uring. */
+  std::unique_ptr<uring_t> ring;
+
+  /* The threads doing the reading. */
+  std::vector<std::thread> threads;
+
+};  // reader_t
+
+}  // qmellow
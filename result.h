@@ -1,26 +1,84 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <set>
+#include <stdexcept>
+#include <string>
 #include <utility>
+#include <vector>
+#include "lineset.h"
 #include "match.h"
+#include "metrics.h"
 
 namespace qmellow {
 
-/* The result of evaluating an expression. */
+/* The result of evaluating an expression.
+
+   A result keeps its matches in one of two ways, and may have some of
+   each.  Matches which are few for their cause are kept as match_t objects
+   in a set.  Where a cause matched many lines of a file, we keep only the
+   line numbers, compressed (see line_set_t), along with the file to look
+   up their text in; combining such results is then a matter of merging
+   bitmaps, and the match_t objects are only made when someone asks for
+   them.  Leaves choose between the two by how many lines they matched.
+
+   A result with line numbers refers to the file it came from, so it must
+   be expanded, with expand(), before that file goes away.  Reading a
+   result never changes it, so a result may be read by many threads at
+   once: get_matches() requires an expanded result, and for_each_match()
+   makes the matches of the lines as it goes.
+
+   Copies of a result share its matches and lines, which are never changed
+   while they're shared; whoever changes a copy, by adding to it or
+   expanding it, first gets a body of its own.  Copying a result, as the
+   memo table and the operators do, is thus cheap, and copies may be read
+   and changed by different threads.
+
+   A result may have a limit: the most matches anyone wants of it.  Leaves
+   find matches in order (see match_t), subject first and then sub-files by
+   path, and stop once their result is full, and the and- and or-operators
+   keep only the first matches of their union, up to the limit.  The first
+   matches of a combination are always among the first matches of its
+   parts, so the matches we keep are exactly those we'd keep by evaluating
+   in full and then cutting the result short.  Success is unaffected, as a
+   result with any match at all is full enough to tell.  A result with a
+   limit keeps all its matches as match_t objects, since there are never
+   many of them. */
 class result_t final {
   public:
 
   /* Convenience. */
   using matches_t = std::set<match_t>;
 
-  /* Start out as a no-match result. */
+  /* Start out as a no-match result, with no limit. */
   result_t() noexcept
-      : success(false) {}
+      : success(false), limit(get_no_limit()) {}
+
+  /* Start out as a no-match result, with the given limit, which must be at
+     least 1. */
+  explicit result_t(std::size_t limit) noexcept
+      : success(false), limit(limit) {}
+
+  /* The limit of a result which keeps every match. */
+  static std::size_t get_no_limit() noexcept {
+    return static_cast<std::size_t>(-1);
+  }
+
+  /* The fewest lines a cause must match in a file for us to keep them
+     compressed.  Below this, match_t objects are cheaper. */
+  static std::size_t get_min_compressed_count() noexcept {
+    return 64;
+  }
 
   /* The logical negation of the result. */
   result_t operator!() const {
-    return result_t(!success, matches);
+    result_t result(*this);
+    result.success = !success;
+    return result;
   }
 
   /* The logical-and of this result and that one. */
@@ -41,12 +99,130 @@ class result_t final {
      we weren't already. */
   void add(match_t &&match) {
     success = true;
-    matches.insert(std::move(match));
+    get_body().matches.insert(std::move(match));
+  }
+
+  /* Add a match of the given cause on the given line of the given source,
+     which is the sub-file at the given path (or the subject, if the path is
+     empty), keeping only its line number for now, unless we have a limit.
+     This will make us a match, if we weren't already. */
+  void add_line(
+      const match_t::cause_t *cause, const std::string &sub_file_path,
+      const match_t::source_t *source, int line_number) {
+    success = true;
+    auto &own = get_body();
+    if (limit != get_no_limit()) {
+      own.matches.insert(match_t(
+          cause, sub_file_path, line_number,
+          source->get_line_text(line_number)));
+      return;
+    }
+    auto &lines = own.lines;
+    if (lines.empty() || lines.back().cause != cause
+        || lines.back().source != source) {
+      lines.push_back(lines_t(cause, sub_file_path, source));
+    }
+    lines.back().line_numbers.add(static_cast<std::uint32_t>(line_number));
+  }
+
+  /* Keep compressed only the line numbers of causes which matched many
+     lines, and expand the rest.  Leaves call this when they're done adding
+     lines. */
+  void choose_representation() {
+    if (!body || body->lines.empty()) {
+      return;
+    }
+    auto &own = get_body();
+    auto &lines = own.lines;
+    std::sort(lines.begin(), lines.end());
+    std::vector<lines_t> kept;
+    for (auto &elem: lines) {
+      if (!kept.empty() && !(kept.back() < elem)) {
+        kept.back().line_numbers |= elem.line_numbers;
+      } else {
+        kept.push_back(std::move(elem));
+      }
+    }
+    lines.clear();
+    for (auto &elem: kept) {
+      if (elem.line_numbers.count() >= get_min_compressed_count()) {
+        lines.push_back(std::move(elem));
+      } else {
+        elem.expand_into(own.matches);
+      }
+    }
+  }
+
+  /* Make match_t objects of any line numbers we keep. */
+  void expand() {
+    if (!body || body->lines.empty()) {
+      return;
+    }
+    auto &own = get_body();
+    for (const auto &elem: own.lines) {
+      elem.expand_into(own.matches);
+    }
+    own.lines.clear();
+  }
+
+  /* True iff. we keep no line numbers, only match_t objects. */
+  bool is_expanded() const noexcept {
+    return !body || body->lines.empty();
+  }
+
+  /* The individual reasons for our success or failure as a match.  We
+     must be expanded; otherwise, use for_each_match(). */
+  const matches_t &get_matches() const {
+    if (!is_expanded()) {
+      throw std::logic_error("matches of a result which isn't expanded");
+    }
+    return peek_body().matches;
+  }
+
+  /* Call fn(match) for each of our matches, in order.  Unlike
+     get_matches(), this doesn't expand: the matches of the lines we keep
+     compressed are made one at a time and let go of once fn returns, so a
+     result with many of them can be written out without holding them all
+     at once. */
+  template <typename fn_t>
+  void for_each_match(const fn_t &fn) const {
+    const auto &matches = peek_body().matches;
+    std::vector<cursor_t> cursors;
+    for (const auto &elem: peek_body().lines) {
+      cursors.push_back(cursor_t(elem));
+    }
+    auto next = matches.begin();
+    for (;;) {
+      cursor_t *least = nullptr;
+      for (auto &cursor: cursors) {
+        if (!cursor.is_done()
+            && (!least || cursor.get_match() < least->get_match())) {
+          least = &cursor;
+        }
+      }
+      if (next != matches.end()
+          && (!least || !(least->get_match() < *next))) {
+        if (least && !(*next < least->get_match())) {
+          least->advance();
+        }
+        fn(*next++);
+      } else if (least) {
+        fn(least->get_match());
+        least->advance();
+      } else {
+        break;
+      }
+    }
   }
 
-  /* The individual reasons for our success or failure as a match. */
-  const matches_t &get_matches() const noexcept {
-    return matches;
+  /* The number of our matches, without expanding. */
+  std::size_t get_match_count() const noexcept {
+    const auto &own = peek_body();
+    auto count = own.matches.size();
+    for (const auto &elem: own.lines) {
+      count += elem.line_numbers.count();
+    }
+    return count;
   }
 
   /* True iff. we're a match. */
@@ -54,28 +230,236 @@ class result_t final {
     return success;
   }
 
+  /* See accessor. */
+  std::size_t get_limit() const noexcept {
+    return limit;
+  }
+
+  /* True iff. we have as many matches as our limit.  Whoever is adding
+     matches in order can stop. */
+  bool is_full() const noexcept {
+    return peek_body().matches.size() >= limit;
+  }
+
   private:
 
-  /* Used by the not-operator. */
-  result_t(bool success, const matches_t &matches)
-      : success(success), matches(matches) {}
+  /* The lines one cause matched in one file. */
+  struct lines_t {
+
+    /* Match nothing yet. */
+    lines_t(
+        const match_t::cause_t *cause, const std::string &sub_file_path,
+        const match_t::source_t *source)
+        : cause(cause), sub_file_path(sub_file_path), source(source) {}
+
+    /* Order by sub-file, then by cause, as match_t does. */
+    bool operator<(const lines_t &that) const {
+      int diff = sub_file_path.compare(that.sub_file_path);
+      return diff < 0
+          || (diff == 0 && match_t::is_before(cause, that.cause));
+    }
+
+    /* Add a match_t for each of our lines to the given set. */
+    void expand_into(matches_t &matches) const {
+      line_numbers.for_each([&](std::uint32_t line_number) {
+        matches.insert(match_t(
+            cause, sub_file_path, static_cast<int>(line_number),
+            source->get_line_text(static_cast<int>(line_number))));
+      });
+    }
 
-  /* Used by the and- and or-operators. */
+    /* The cause of the matches. */
+    const match_t::cause_t *cause;
+
+    /* The sub-file they're in, or empty if they're in the subject. */
+    std::string sub_file_path;
+
+    /* The file they're in. */
+    const match_t::source_t *source;
+
+    /* The lines matched. */
+    line_set_t line_numbers;
+
+  };  // result_t::lines_t
+
+  /* Walks the lines of a lines_t in order, making the match of each in
+     turn.  Used by for_each_match(). */
+  class cursor_t final {
+    public:
+
+    /* Start at the first line, of which there must be one. */
+    explicit cursor_t(const lines_t &elem)
+        : elem(&elem), line_numbers(get_line_numbers(elem)), next(1),
+          match(make_match(elem, line_numbers.front())) {}
+
+    /* Move on to the next line. */
+    void advance() {
+      if (next < line_numbers.size()) {
+        match = make_match(*elem, line_numbers[next]);
+      }
+      ++next;
+    }
+
+    /* The match of the current line. */
+    const match_t &get_match() const noexcept {
+      return match;
+    }
+
+    /* True iff. we've moved past the last line. */
+    bool is_done() const noexcept {
+      return next > line_numbers.size();
+    }
+
+    private:
+
+    /* The line numbers of the given lines_t, in order. */
+    static std::vector<std::uint32_t> get_line_numbers(const lines_t &elem) {
+      std::vector<std::uint32_t> line_numbers;
+      line_numbers.reserve(elem.line_numbers.count());
+      elem.line_numbers.for_each([&](std::uint32_t line_number) {
+        line_numbers.push_back(line_number);
+      });
+      return line_numbers;
+    }
+
+    /* The match of the given line of the given lines_t. */
+    static match_t make_match(const lines_t &elem, std::uint32_t line_number) {
+      auto n = static_cast<int>(line_number);
+      return match_t(
+          elem.cause, elem.sub_file_path, n, elem.source->get_line_text(n));
+    }
+
+    /* What we walk. */
+    const lines_t *elem;
+
+    /* The line numbers of elem, in order. */
+    std::vector<std::uint32_t> line_numbers;
+
+    /* The index in line_numbers of the line after the current one. */
+    std::size_t next;
+
+    /* See accessor. */
+    match_t match;
+
+  };  // result_t::cursor_t
+
+  /* Our matches and lines. */
+  struct body_t {
+
+    /* See get_matches(). */
+    matches_t matches;
+
+    /* The lines we keep compressed, sorted, with at most one element per
+       sub-file and cause. */
+    std::vector<lines_t> lines;
+
+  };  // result_t::body_t
+
+  /* Used by the and- and or-operators.  We take the lesser limit. */
   result_t(bool success, const result_t &lhs, const result_t &rhs)
-      : success(success) {
+      : success(success), limit(std::min(lhs.limit, rhs.limit)) {
     /* Our matches will be the union of the sets of matches provided by
-       the left- and right-hand sides. */
+       the left- and right-hand sides, and our lines the union of theirs,
+       merged cause by cause.  With a limit, we keep no lines, so we expand
+       both sides and stop the union once we're full. */
+    const auto &lhs_body = lhs.peek_body();
+    const auto &rhs_body = rhs.peek_body();
+    if (&lhs_body == &rhs_body && lhs.limit == rhs.limit) {
+      body = lhs.body;
+      return;
+    }
+    if (lhs_body.matches.empty() && lhs_body.lines.empty()
+        && rhs.limit <= lhs.limit) {
+      body = rhs.body;
+      return;
+    }
+    if (rhs_body.matches.empty() && rhs_body.lines.empty()
+        && lhs.limit <= rhs.limit) {
+      body = lhs.body;
+      return;
+    }
+    auto &own = get_body();
+    auto &matches = own.matches;
+    auto &lines = own.lines;
+    if (limit != get_no_limit()) {
+      result_t lhs_expanded(lhs), rhs_expanded(rhs);
+      lhs_expanded.expand();
+      rhs_expanded.expand();
+      const auto &lhs_matches = lhs_expanded.peek_body().matches;
+      const auto &rhs_matches = rhs_expanded.peek_body().matches;
+      auto left = lhs_matches.begin();
+      auto right = rhs_matches.begin();
+      auto left_end = lhs_matches.end();
+      auto right_end = rhs_matches.end();
+      while (matches.size() < limit
+          && (left != left_end || right != right_end)) {
+        if (right == right_end || (left != left_end && *left < *right)) {
+          matches.insert(matches.end(), *left++);
+        } else if (left == left_end || *right < *left) {
+          matches.insert(matches.end(), *right++);
+        } else {
+          matches.insert(matches.end(), *left++);
+          ++right;
+        }
+      }
+      QMELLOW_METRICS_RECORD(merge_size, matches.size());
+      return;
+    }
     std::set_union(
-        lhs.matches.begin(), lhs.matches.end(),
-        rhs.matches.begin(), rhs.matches.end(),
+        lhs_body.matches.begin(), lhs_body.matches.end(),
+        rhs_body.matches.begin(), rhs_body.matches.end(),
         std::inserter(matches, matches.begin()));
+    auto left = lhs_body.lines.begin();
+    auto right = rhs_body.lines.begin();
+    auto left_end = lhs_body.lines.end();
+    auto right_end = rhs_body.lines.end();
+    while (left != left_end || right != right_end) {
+      if (right == right_end || (left != left_end && *left < *right)) {
+        lines.push_back(*left++);
+      } else if (left == left_end || *right < *left) {
+        lines.push_back(*right++);
+      } else {
+        lines.push_back(*left++);
+        lines.back().line_numbers |= (right++)->line_numbers;
+      }
+    }
+    QMELLOW_METRICS_RECORD(merge_size, matches.size() + lines.size());
   }
 
   /* See accessor. */
   bool success;
 
   /* See accessor. */
-  matches_t matches;
+  std::size_t limit;
+
+  /* The body of a result with no matches or lines. */
+  static const body_t &get_no_body() noexcept {
+    static const body_t none;
+    return none;
+  }
+
+  /* Our body, to read. */
+  const body_t &peek_body() const noexcept {
+    return body ? *body : get_no_body();
+  }
+
+  /* Our body, to change, made our own first if it's shared.  A body we
+     find no one else holding may have been let go of by another thread
+     just now, so we fence, to see whatever that thread did to it first. */
+  body_t &get_body() {
+    if (!body) {
+      body = std::make_shared<body_t>();
+    } else if (body.use_count() > 1) {
+      body = std::make_shared<body_t>(*body);
+    } else {
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *body;
+  }
+
+  /* Our matches and lines, shared with our copies, or null if we have
+     neither. */
+  std::shared_ptr<body_t> body;
 
 };  // result_t
 
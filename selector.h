@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "symbols.h"
+
+namespace qmellow {
+
+/* What a leaf looks for, put so a file can say where in it the leaf's
+   matches are: either which elements it selects or at which offsets its
+   text appears.  Containment (see inside_t) needs this, since it's about
+   where matches are, not just which lines they're on. */
+struct selector_t {
+
+  /* The kinds of things we select. */
+  enum kind_t {
+
+    /* Anchors, by the path of their href. */
+    anchor,
+
+    /* Stylesheet links, by the path of their href. */
+    css,
+
+    /* Images, by the path of their src. */
+    image,
+
+    /* Scripts, by the path of their src. */
+    js,
+
+    /* Elements, by id. */
+    id,
+
+    /* Elements with all of the given class names. */
+    class_names,
+
+    /* Text, as written. */
+    exact_text,
+
+    /* Text, without regard to case.  The text is kept folded (see
+       file_t::fold_text()). */
+    folded_text
+
+  };
+
+  /* Select nothing in particular. */
+  selector_t()
+      : kind(anchor), is_direct(false) {}
+
+  /* Select things of the given kind by the given texts. */
+  selector_t(kind_t kind, std::vector<std::string> &&texts)
+      : kind(kind), texts(std::move(texts)), is_direct(false) {
+    if (is_element()) {
+      for (const auto &text: this->texts) {
+        symbols.push_back(refs.intern(text));
+      }
+    }
+  }
+
+  /* True iff. we select elements, rather than text. */
+  bool is_element() const noexcept {
+    return kind != exact_text && kind != folded_text;
+  }
+
+  /* See kind_t. */
+  kind_t kind;
+
+  /* The class names, if kind is class_names; otherwise, the one path, id,
+     or text. */
+  std::vector<std::string> texts;
+
+  /* The texts as symbols, if we select elements; otherwise, empty. */
+  std::vector<symbol_table_t::symbol_t> symbols;
+
+  /* Keeps our symbols interned. */
+  symbol_table_t::refs_t refs;
+
+  /* Used in containment chains: true iff. what the selector before us in
+     the chain selects must be directly inside what we select, rather than
+     anywhere within it. */
+  bool is_direct;
+
+};  // selector_t
+
+}  // qmellow
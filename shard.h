@@ -0,0 +1,562 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <queue>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "match.h"
+#include "pack.h"
+#include "sink.h"
+#include "sweep.h"
+
+namespace qmellow {
+
+/* A match as binary_sink_t writes it, read back. */
+struct shard_record_t {
+
+  /* An empty record. */
+  shard_record_t()
+      : rule_index(0), line_number(0), cause_id(0) {}
+
+  /* The order of a sharded sweep's output: by path, then by rule, then by
+     sub-file, line, and cause, as match_t orders. */
+  bool operator<(const shard_record_t &that) const {
+    int diff = path.compare(that.path);
+    if (diff) {
+      return diff < 0;
+    }
+    if (rule_index != that.rule_index) {
+      return rule_index < that.rule_index;
+    }
+    diff = sub_file_path.compare(that.sub_file_path);
+    if (diff) {
+      return diff < 0;
+    }
+    return line_number < that.line_number
+        || (line_number == that.line_number && cause_id < that.cause_id);
+  }
+
+  /* Decode the record at the cursor, moving the cursor past it.  Returns
+     false, leaving the cursor alone, if the record doesn't end before the
+     given end. */
+  bool decode(const char *&cursor, const char *end) {
+    auto next = cursor;
+    std::uint64_t n;
+    if (!decode_string(next, end, path) || !decode_varint(next, end, n)) {
+      return false;
+    }
+    rule_index = static_cast<std::size_t>(n);
+    if (!decode_string(next, end, sub_file_path)
+        || !decode_varint(next, end, n)) {
+      return false;
+    }
+    line_number = static_cast<int>(n);
+    if (!decode_varint(next, end, n)) {
+      return false;
+    }
+    cause_id = static_cast<std::size_t>(n);
+    if (!decode_string(next, end, cause_desc)
+        || !decode_string(next, end, line_text)) {
+      return false;
+    }
+    cursor = next;
+    return true;
+  }
+
+  /* Append the record to the buffer, as binary_sink_t would. */
+  void encode(std::string &buffer) const {
+    binary_sink_t::add_string(buffer, path);
+    binary_sink_t::add_varint(buffer, rule_index);
+    binary_sink_t::add_string(buffer, sub_file_path);
+    binary_sink_t::add_varint(
+        buffer, static_cast<std::uint64_t>(line_number));
+    binary_sink_t::add_varint(buffer, cause_id);
+    binary_sink_t::add_string(buffer, cause_desc);
+    binary_sink_t::add_string(buffer, line_text);
+  }
+
+  /* Decode a varint at the cursor, moving the cursor past it.  Returns
+     false if it doesn't end before the given end. */
+  static bool decode_varint(
+      const char *&cursor, const char *end, std::uint64_t &n) {
+    n = 0;
+    for (int shift = 0; cursor < end && shift < 64; shift += 7) {
+      auto byte = static_cast<unsigned char>(*cursor++);
+      n |= std::uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Decode a string at the cursor, like decode_varint(). */
+  static bool decode_string(
+      const char *&cursor, const char *end, std::string &text) {
+    std::uint64_t size;
+    if (!decode_varint(cursor, end, size)
+        || size > static_cast<std::uint64_t>(end - cursor)) {
+      return false;
+    }
+    text.assign(cursor, static_cast<std::size_t>(size));
+    cursor += size;
+    return true;
+  }
+
+  /* See match_t. */
+  std::string path;
+
+  /* The rule's position in the pack. */
+  std::size_t rule_index;
+
+  /* See match_t. */
+  std::string sub_file_path;
+
+  /* See match_t. */
+  int line_number;
+
+  /* See match_t::get_cause_id(). */
+  std::size_t cause_id;
+
+  /* See match_t. */
+  std::string cause_desc;
+
+  /* See match_t. */
+  std::string line_text;
+
+};  // shard_record_t
+
+/* Evaluates every rule of a pack against every file of a corpus, like
+   sweep_t, but split across a number of worker processes, each sweeping a
+   share of the files, so a sweep can use more memory than one process
+   may.  Each worker sorts its matches and streams them back to us over a
+   pipe, and we merge the streams, so the output is in one order, however
+   many workers there are and however their threads were scheduled: by
+   path, then by rule, then as match_t orders.  Outputs of the same sweep
+   can thus be compared byte for byte.
+
+   A worker sorts no more than a run of its matches in memory at once,
+   spilling each sorted run to a temporary file and merging the runs as it
+   streams them back, so its memory stays bounded however much it
+   matches.
+
+   The workers are forked, so we must be run before the process starts any
+   threads of its own. */
+class sharded_sweep_t final {
+  public:
+
+  /* The size of a run, in bytes of encoded matches, unless we're told
+     otherwise. */
+  static std::size_t get_default_run_size() noexcept {
+    return std::size_t(1) << 24;
+  }
+
+  /* Sweep with the given pack, split across the given number of worker
+     processes (at least one), each using the given number of threads to
+     evaluate (zero meaning one per hardware thread) and sorting runs of
+     the given size. */
+  sharded_sweep_t(
+      const pack_t &pack, std::size_t shard_count,
+      std::size_t thread_count = 0,
+      std::size_t run_size = get_default_run_size())
+      : pack(pack), shard_count(std::max<std::size_t>(shard_count, 1)),
+        thread_count(thread_count), run_size(run_size) {}
+
+  /* Evaluate every rule against the files at the given paths, writing the
+     matches, in order, into the given sink, and return how many there
+     were.  A worker which fails is an error, thrown once the rest are
+     done. */
+  std::size_t run(std::vector<std::string> paths, sink_t &sink) const {
+    std::sort(paths.begin(), paths.end());
+    std::vector<int> fds;
+    std::vector<pid_t> pids;
+    for (std::size_t shard = 0; shard < shard_count; ++shard) {
+      int pipe_fds[2];
+      if (pipe(pipe_fds) != 0) {
+        throw std::runtime_error(
+            std::string("could not make pipe: ") + std::strerror(errno));
+      }
+      auto pid = fork();
+      if (pid < 0) {
+        throw std::runtime_error(
+            std::string("could not fork: ") + std::strerror(errno));
+      }
+      if (pid == 0) {
+        close(pipe_fds[0]);
+        for (auto fd: fds) {
+          close(fd);
+        }
+        int status = 0;
+        try {
+          run_shard(paths, shard, pipe_fds[1]);
+        } catch (const std::exception &) {
+          status = 1;
+        }
+        _exit(status);
+      }
+      close(pipe_fds[1]);
+      fds.push_back(pipe_fds[0]);
+      pids.push_back(pid);
+    }
+    std::size_t match_count = 0;
+    std::string error;
+    try {
+      match_count = merge(fds, sink);
+    } catch (const std::exception &ex) {
+      error = ex.what();
+    }
+    for (auto fd: fds) {
+      close(fd);
+    }
+    for (auto pid: pids) {
+      int status;
+      if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+          || WEXITSTATUS(status) != 0) {
+        if (error.empty()) {
+          error = "a worker process failed";
+        }
+      }
+    }
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+    return match_count;
+  }
+
+  private:
+
+  /* Reads records from a worker's pipe, a buffer at a time. */
+  class reader_t final {
+    public:
+
+    /* Read from the given pipe. */
+    explicit reader_t(int fd)
+        : fd(fd), offset(0) {}
+
+    /* Read the next record.  Returns false at the end of the stream. */
+    bool read(shard_record_t &record) {
+      for (;;) {
+        const char *cursor = buffer.data() + offset;
+        if (record.decode(cursor, buffer.data() + buffer.size())) {
+          offset = cursor - buffer.data();
+          return true;
+        }
+        buffer.erase(0, offset);
+        offset = 0;
+        auto size = buffer.size();
+        buffer.resize(size + get_read_size());
+        auto n = ::read(fd, &buffer[size], get_read_size());
+        if (n < 0 && errno == EINTR) {
+          buffer.resize(size);
+          continue;
+        }
+        if (n < 0) {
+          throw std::runtime_error(
+              std::string("could not read from worker: ")
+              + std::strerror(errno));
+        }
+        buffer.resize(size + n);
+        if (n == 0) {
+          if (!buffer.empty()) {
+            throw std::runtime_error("worker stream ended inside a record");
+          }
+          return false;
+        }
+      }
+    }
+
+    private:
+
+    /* The most we read at once. */
+    static std::size_t get_read_size() noexcept {
+      return 1 << 16;
+    }
+
+    /* See constructor. */
+    int fd;
+
+    /* Bytes read but not yet decoded start at offset. */
+    std::string buffer;
+
+    /* See buffer. */
+    std::size_t offset;
+
+  };  // sharded_sweep_t::reader_t
+
+  /* Sorts the records a worker's sweep writes, a run at a time.  A
+     binary_sink_t writes into us as the buffer of its stream.  Once the
+     records we hold come to the run size, we sort them and spill them to a
+     temporary file, and at the end we merge the spilled runs. */
+  class runs_t final
+      : public std::streambuf {
+    public:
+
+    /* Hold runs of the given size. */
+    explicit runs_t(std::size_t run_size)
+        : run_size(run_size), run_bytes(0) {}
+
+    /* Remove our files. */
+    ~runs_t() {
+      for (auto *file: files) {
+        std::fclose(file);
+      }
+    }
+
+    /* Not copyable. */
+    runs_t(const runs_t &) = delete;
+    runs_t &operator=(const runs_t &) = delete;
+
+    /* Write every record we were given, in order, to the given pipe. */
+    void finish(int fd) {
+      if (!pending.empty()) {
+        throw std::runtime_error("sweep ended inside a record");
+      }
+      if (files.empty()) {
+        std::sort(records.begin(), records.end());
+        write_records(fd, records);
+        return;
+      }
+      spill();
+      std::vector<reader_t> readers;
+      for (auto *file: files) {
+        if (lseek(fileno(file), 0, SEEK_SET) != 0) {
+          throw std::runtime_error(
+              std::string("could not rewind run: ") + std::strerror(errno));
+        }
+        readers.push_back(reader_t(fileno(file)));
+      }
+      std::string buffer;
+      merge_records(readers, [&](const shard_record_t &record) {
+        record.encode(buffer);
+        if (buffer.size() >= sink_t::get_buffer_size()) {
+          write_all(fd, buffer);
+          buffer.clear();
+        }
+      });
+      write_all(fd, buffer);
+    }
+
+    protected:
+
+    /* Take the given bytes, which hold records, though perhaps not whole
+       ones at either end. */
+    virtual std::streamsize xsputn(
+        const char *data, std::streamsize size) override {
+      pending.append(data, static_cast<std::size_t>(size));
+      const char *start = pending.data();
+      const char *cursor = start;
+      const char *end = start + pending.size();
+      shard_record_t record;
+      while (record.decode(cursor, end)) {
+        records.push_back(std::move(record));
+        run_bytes += static_cast<std::size_t>(cursor - start);
+        start = cursor;
+        if (run_bytes >= run_size) {
+          spill();
+        }
+      }
+      pending.erase(0, static_cast<std::size_t>(start - pending.data()));
+      return size;
+    }
+
+    /* Take a single byte. */
+    virtual int_type overflow(int_type c) override {
+      if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        char byte = traits_type::to_char_type(c);
+        xsputn(&byte, 1);
+      }
+      return traits_type::not_eof(c);
+    }
+
+    private:
+
+    /* Sort the records we hold into a run in a file of its own. */
+    void spill() {
+      std::sort(records.begin(), records.end());
+      auto *file = std::tmpfile();
+      if (!file) {
+        throw std::runtime_error(
+            std::string("could not make a file for a run: ")
+            + std::strerror(errno));
+      }
+      files.push_back(file);
+      write_records(fileno(file), records);
+      records.clear();
+      run_bytes = 0;
+    }
+
+    /* See constructor. */
+    std::size_t run_size;
+
+    /* Bytes given to us which don't yet make a whole record. */
+    std::string pending;
+
+    /* The records of the run we're making. */
+    std::vector<shard_record_t> records;
+
+    /* The encoded size of those records. */
+    std::size_t run_bytes;
+
+    /* The runs we've spilled. */
+    std::vector<std::FILE *> files;
+
+  };  // sharded_sweep_t::runs_t
+
+  /* Stands in for the cause of a record as we pass it to the sink. */
+  class record_cause_t final
+      : public match_t::cause_t {
+    public:
+
+    /* Stand in for the cause of the given record. */
+    explicit record_cause_t(const shard_record_t &record)
+        : desc(record.cause_desc) {
+      set_id(record.cause_id);
+    }
+
+    /* See base class. */
+    virtual const std::string &get_desc() const override {
+      return desc;
+    }
+
+    private:
+
+    /* See accessor. */
+    const std::string &desc;
+
+  };  // sharded_sweep_t::record_cause_t
+
+  /* Sweep the given shard of the paths, which are every shard_count-th
+     one, and write the matches to the given pipe, in order, as binary
+     records.  This runs in the worker. */
+  void run_shard(
+      const std::vector<std::string> &paths, std::size_t shard,
+      int fd) const {
+    std::vector<std::string> shard_paths;
+    for (auto i = shard; i < paths.size(); i += shard_count) {
+      shard_paths.push_back(paths[i]);
+    }
+    runs_t runs(run_size);
+    std::ostream strm(&runs);
+    {
+      binary_sink_t sink(strm);
+      sweep_t(pack, thread_count).run_into(shard_paths, sink);
+    }
+    if (!strm) {
+      throw std::runtime_error("could not sort the shard's matches");
+    }
+    runs.finish(fd);
+    close(fd);
+  }
+
+  /* Merge the sorted streams of records coming from the given pipes into
+     the sink, and return how many there were. */
+  std::size_t merge(const std::vector<int> &fds, sink_t &sink) const {
+    std::vector<reader_t> readers;
+    for (auto fd: fds) {
+      readers.push_back(reader_t(fd));
+    }
+    const auto &rules = pack.get_rules();
+    sink_t::writer_t writer(sink);
+    std::size_t match_count = 0;
+    merge_records(readers, [&](const shard_record_t &record) {
+      if (record.rule_index >= rules.size()) {
+        throw std::runtime_error("worker sent a bad record");
+      }
+      record_cause_t cause(record);
+      writer.put(
+          record.path, record.rule_index, rules[record.rule_index],
+          match_t(
+              &cause, record.sub_file_path, record.line_number,
+              record.line_text));
+      writer.end_file();
+      ++match_count;
+    });
+    writer.flush();
+    return match_count;
+  }
+
+  /* Call fn(record) for each record the given readers read, each from a
+     sorted stream, in order. */
+  template <typename fn_t>
+  static void merge_records(std::vector<reader_t> &readers, const fn_t &fn) {
+    std::vector<shard_record_t> heads(readers.size());
+    auto is_after = [&heads](std::size_t lhs, std::size_t rhs) {
+      return heads[rhs] < heads[lhs];
+    };
+    std::priority_queue<
+        std::size_t, std::vector<std::size_t>, decltype(is_after)>
+        queue(is_after);
+    for (std::size_t i = 0; i < readers.size(); ++i) {
+      if (readers[i].read(heads[i])) {
+        queue.push(i);
+      }
+    }
+    while (!queue.empty()) {
+      auto i = queue.top();
+      queue.pop();
+      fn(heads[i]);
+      if (readers[i].read(heads[i])) {
+        queue.push(i);
+      }
+    }
+  }
+
+  /* Write the given records to the given file, a buffer at a time. */
+  static void write_records(
+      int fd, const std::vector<shard_record_t> &records) {
+    std::string buffer;
+    for (const auto &record: records) {
+      record.encode(buffer);
+      if (buffer.size() >= sink_t::get_buffer_size()) {
+        write_all(fd, buffer);
+        buffer.clear();
+      }
+    }
+    write_all(fd, buffer);
+  }
+
+  /* Write all of the given bytes to the given pipe or file. */
+  static void write_all(int fd, const std::string &bytes) {
+    const char *cursor = bytes.data();
+    std::size_t left = bytes.size();
+    while (left) {
+      auto n = write(fd, cursor, left);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error(
+            std::string("could not write to pipe: ") + std::strerror(errno));
+      }
+      cursor += n;
+      left -= n;
+    }
+  }
+
+  /* See constructor. */
+  const pack_t &pack;
+
+  /* See constructor. */
+  std::size_t shard_count;
+
+  /* See constructor. */
+  std::size_t thread_count;
+
+  /* See constructor. */
+  std::size_t run_size;
+
+};  // sharded_sweep_t
+
+}  // qmellow
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include "match.h"
+#include "pack.h"
+
+namespace qmellow {
+
+/* Where a sweep writes its matches as it finds them, rather than keeping
+   them until the end.  Each worker thread writes through a writer_t of its
+   own, which encodes matches into a buffer and hands the buffer to the
+   sink between files, once it's grown past get_buffer_size().  The
+   matches of a file thus come out together, and the sink's lock is taken
+   once per buffer rather than once per match.  A file whose matches alone
+   outgrow get_max_buffer_size() is written out in pieces as they come, so
+   the memory held for output is bounded by that much per thread, however
+   many matches there are, at the cost of other threads' matches maybe
+   coming between the pieces.
+
+   Subclasses say how a match is encoded. */
+class sink_t {
+  public:
+
+  /* One thread's way into the sink.  Not thread-safe; each thread makes
+     its own. */
+  class writer_t final {
+    public:
+
+    /* Write into the given sink. */
+    explicit writer_t(sink_t &sink)
+        : sink(sink) {}
+
+    /* Encode a match of the given rule, which is the given one of the pack,
+       in the file at the given path. */
+    void put(
+        const std::string &path, std::size_t rule_index,
+        const pack_t::rule_t &rule, const match_t &match) {
+      sink.encode(buffer, path, rule_index, rule, match);
+      if (buffer.size() >= get_max_buffer_size()) {
+        flush();
+      }
+    }
+
+    /* Say we're done with a file.  If we've buffered enough, we write it
+       out now. */
+    void end_file() {
+      if (buffer.size() >= get_buffer_size()) {
+        flush();
+      }
+    }
+
+    /* Write out whatever we've buffered.  Call this when done, as we don't
+       flush on destruction. */
+    void flush() {
+      if (!buffer.empty()) {
+        sink.write(buffer);
+        buffer.clear();
+      }
+    }
+
+    private:
+
+    /* See constructor. */
+    sink_t &sink;
+
+    /* Encoded matches not yet written. */
+    std::string buffer;
+
+  };  // sink_t::writer_t
+
+  /* The size past which a writer hands its buffer to the sink. */
+  static std::size_t get_buffer_size() noexcept {
+    return 1 << 16;
+  }
+
+  /* The size past which a writer hands its buffer to the sink even in the
+     middle of a file. */
+  static std::size_t get_max_buffer_size() noexcept {
+    return 1 << 22;
+  }
+
+  /* Do-little. */
+  virtual ~sink_t() {}
+
+  protected:
+
+  /* Write to the given stream, which must outlive us. */
+  explicit sink_t(std::ostream &strm)
+      : strm(strm) {}
+
+  /* Override to append the encoding of a match to the buffer.  This is
+     called from many threads at once, each with its own buffer. */
+  virtual void encode(
+      std::string &buffer, const std::string &path, std::size_t rule_index,
+      const pack_t::rule_t &rule, const match_t &match) const = 0;
+
+  private:
+
+  /* Write a writer's buffer to the stream.  Writers run on worker threads,
+     so we don't throw if the stream fails; the caller should check it once
+     the sweep is done. */
+  void write(const std::string &buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    strm.write(buffer.data(), buffer.size());
+  }
+
+  /* Covers strm. */
+  std::mutex mutex;
+
+  /* See constructor. */
+  std::ostream &strm;
+
+};  // sink_t
+
+/* Writes each match as a line of JSON, an object of the form:
+
+     {"path":...,"rule":...,"sub_file":...,"line":...,"cause":...,
+      "text":...}
+
+   where rule is the text of the rule, sub_file is empty for a match in the
+   file itself, and the rest are as in match_t.  Strings are written as
+   they are, apart from JSON's escapes, so text which isn't UTF-8 stays
+   that way. */
+class json_lines_sink_t final
+    : public sink_t {
+  public:
+
+  /* Write to the given stream, which must outlive us. */
+  explicit json_lines_sink_t(std::ostream &strm)
+      : sink_t(strm) {}
+
+  private:
+
+  /* See base class. */
+  virtual void encode(
+      std::string &buffer, const std::string &path, std::size_t,
+      const pack_t::rule_t &rule, const match_t &match) const override {
+    buffer += "{\"path\":";
+    add_string(buffer, path);
+    buffer += ",\"rule\":";
+    add_string(buffer, rule.get_text());
+    buffer += ",\"sub_file\":";
+    add_string(buffer, match.get_sub_file_path());
+    buffer += ",\"line\":";
+    buffer += std::to_string(match.get_line_number());
+    buffer += ",\"cause\":";
+    add_string(buffer, match.get_cause_desc());
+    buffer += ",\"text\":";
+    add_string(buffer, match.get_line_text());
+    buffer += "}\n";
+  }
+
+  /* Append the given text to the buffer as a JSON string. */
+  static void add_string(std::string &buffer, const std::string &text) {
+    static const char *hex = "0123456789abcdef";
+    buffer += '"';
+    for (auto c: text) {
+      switch (c) {
+        case '"': buffer += "\\\""; break;
+        case '\\': buffer += "\\\\"; break;
+        case '\n': buffer += "\\n"; break;
+        case '\r': buffer += "\\r"; break;
+        case '\t': buffer += "\\t"; break;
+        default: {
+          if (static_cast<unsigned char>(c) < 0x20) {
+            buffer += "\\u00";
+            buffer += hex[c >> 4];
+            buffer += hex[c & 15];
+          } else {
+            buffer += c;
+          }
+        }
+      }  // switch
+    }
+    buffer += '"';
+  }
+
+};  // json_lines_sink_t
+
+/* Writes each match as a compact binary record:
+
+     <path> <rule index> <sub-file> <line number> <cause id> <cause> <text>
+
+   where the rule index counts from 0 in the pack, the cause id is that of
+   match_t::get_cause_id(), numbers are unsigned LEB128 varints, and strings
+   are a varint size followed by that many bytes.  Records follow one
+   another with nothing between.  A record has all it takes to put it in
+   order (see shard_record_t). */
+class binary_sink_t final
+    : public sink_t {
+  public:
+
+  /* Write to the given stream, which must outlive us. */
+  explicit binary_sink_t(std::ostream &strm)
+      : sink_t(strm) {}
+
+  /* Append the given number to the buffer as a varint. */
+  static void add_varint(std::string &buffer, std::uint64_t n) {
+    while (n >= 0x80) {
+      buffer += static_cast<char>((n & 0x7f) | 0x80);
+      n >>= 7;
+    }
+    buffer += static_cast<char>(n);
+  }
+
+  /* Append the given text to the buffer, size first. */
+  static void add_string(std::string &buffer, const std::string &text) {
+    add_varint(buffer, text.size());
+    buffer += text;
+  }
+
+  private:
+
+  /* See base class. */
+  virtual void encode(
+      std::string &buffer, const std::string &path, std::size_t rule_index,
+      const pack_t::rule_t &, const match_t &match) const override {
+    add_string(buffer, path);
+    add_varint(buffer, rule_index);
+    add_string(buffer, match.get_sub_file_path());
+    add_varint(buffer, static_cast<std::uint64_t>(match.get_line_number()));
+    add_varint(buffer, match.get_cause_id());
+    add_string(buffer, match.get_cause_desc());
+    add_string(buffer, match.get_line_text());
+  }
+
+};  // binary_sink_t
+
+}  // qmellow
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "hash.h"
+
+namespace qmellow {
+
+/* A small, fixed-size summary of a file: a Bloom filter over its ids, class
+   names, asset paths, and the trigrams of its text, both as written and
+   folded to lower case.  A sketch can say for certain that a file lacks
+   something, but only that it may have something.  Testing a sketch is far
+   cheaper than scanning the file, so queries test it first and skip files
+   which can't match (see prefilter_t). */
+class sketch_t final {
+  public:
+
+  /* The kinds of things we summarize.  Each kind is hashed apart from the
+     others, so an id never passes for a class name. */
+  enum kind_t {
+    id, class_name, anchor, css, image, js, exact_text, folded_text
+  };
+
+  /* The number of bits in a sketch. */
+  static std::size_t get_bit_count() noexcept {
+    return 32768;
+  }
+
+  /* The bits a query needs to find set, computed once, ahead of time. */
+  class probe_t final {
+    public:
+
+    /* Needs nothing. */
+    probe_t() {}
+
+    /* Require the given key of the given kind. */
+    void add(kind_t kind, const char *data, std::size_t size) {
+      add_bits(get_key(kind, data, size));
+    }
+
+    /* Convenience. */
+    void add(kind_t kind, const std::string &key) {
+      add(kind, key.data(), key.size());
+    }
+
+    /* Require every trigram of the given text.  Returns false, requiring
+       nothing, if the text is too short to have trigrams. */
+    bool add_text(kind_t kind, const std::string &text) {
+      if (text.size() < 3) {
+        return false;
+      }
+      for (std::size_t i = 0; i + 3 <= text.size(); ++i) {
+        add_bits(get_trigram_key(kind, &text[i]));
+      }
+      return true;
+    }
+
+    /* True iff. we require nothing. */
+    bool is_empty() const noexcept {
+      return bits.empty();
+    }
+
+    private:
+
+    /* Require the bits of the given key. */
+    void add_bits(std::uint64_t key) {
+      std::uint32_t indices[2];
+      get_bits(key, indices);
+      bits.push_back(indices[0]);
+      bits.push_back(indices[1]);
+    }
+
+    /* The indices of the bits we require. */
+    std::vector<std::uint32_t> bits;
+
+    /* Tests the bits. */
+    friend class sketch_t;
+
+  };  // sketch_t::probe_t
+
+  /* An empty sketch, which rules everything out. */
+  sketch_t() noexcept {
+    std::memset(words, 0, sizeof(words));
+  }
+
+  /* Add the given key of the given kind. */
+  void add(kind_t kind, const char *data, std::size_t size) noexcept {
+    set_bits(get_key(kind, data, size));
+  }
+
+  /* Convenience. */
+  void add(kind_t kind, const std::string &key) noexcept {
+    add(kind, key.data(), key.size());
+  }
+
+  /* Add every trigram of the given text. */
+  void add_text(kind_t kind, const std::string &text) noexcept {
+    for (std::size_t i = 0; i + 3 <= text.size(); ++i) {
+      set_bits(get_trigram_key(kind, &text[i]));
+    }
+  }
+
+  /* False iff. the summarized file certainly lacks something the probe
+     requires. */
+  bool may_contain(const probe_t &probe) const noexcept {
+    for (auto bit: probe.bits) {
+      if (!(words[bit / 64] & (std::uint64_t(1) << (bit % 64)))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /* The fraction of our bits which are set.  The closer to 1, the less we
+     can rule out. */
+  double get_fill() const noexcept {
+    std::size_t count = 0;
+    for (auto word: words) {
+      count += __builtin_popcountll(word);
+    }
+    return static_cast<double>(count) / get_bit_count();
+  }
+
+  private:
+
+  /* The key of a whole item. */
+  static std::uint64_t get_key(
+      kind_t kind, const char *data, std::size_t size) noexcept {
+    return hash_bytes(data, size, kind);
+  }
+
+  /* The key of the trigram starting at the given character.  Hashing a
+     whole item for every position would be too slow, so we pack the three
+     bytes and the kind into a word and mix it. */
+  static std::uint64_t get_trigram_key(
+      kind_t kind, const char *data) noexcept {
+    std::uint64_t x =
+        (std::uint64_t(kind) << 24)
+        | (std::uint64_t(static_cast<unsigned char>(data[0])) << 16)
+        | (std::uint64_t(static_cast<unsigned char>(data[1])) << 8)
+        | std::uint64_t(static_cast<unsigned char>(data[2]));
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  /* The two bits which stand for a key. */
+  static void get_bits(std::uint64_t key, std::uint32_t indices[2]) noexcept {
+    auto mask = static_cast<std::uint32_t>(get_bit_count() - 1);
+    indices[0] = static_cast<std::uint32_t>(key) & mask;
+    indices[1] = static_cast<std::uint32_t>(key >> 32) & mask;
+  }
+
+  /* Set the bits which stand for a key. */
+  void set_bits(std::uint64_t key) noexcept {
+    std::uint32_t indices[2];
+    get_bits(key, indices);
+    for (auto bit: indices) {
+      words[bit / 64] |= std::uint64_t(1) << (bit % 64);
+    }
+  }
+
+  /* Our bits. */
+  std::uint64_t words[32768 / 64];
+
+};  // sketch_t
+
+}  // qmellow
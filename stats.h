@@ -0,0 +1,206 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace qmellow {
+
+/* How often each leaf of a program has been evaluated, how often it matched,
+   and how long it took.  We gather these during a corpus sweep and the
+   planner uses them to decide the order in which to evaluate the operands
+   of ands and ors.  Statistics can be written out at the end of one run and
+   read back in at the start of the next, so the next run starts out
+   already tuned.
+
+   This isn't thread-safe.  Threads evaluating the same program each count
+   into statistics of their own, which are then added together (see
+   shared_planner_t). */
+class stats_t final {
+  public:
+
+  /* The clock we use to time leaves. */
+  using clock_t = std::chrono::steady_clock;
+
+  /* The counts we keep for a single leaf. */
+  struct leaf_stats_t {
+
+    /* Start with nothing counted. */
+    leaf_stats_t() noexcept
+        : calls(0), hits(0), ns(0) {}
+
+    /* The number of times the leaf was evaluated. */
+    std::uint64_t calls;
+
+    /* The number of those times the leaf matched. */
+    std::uint64_t hits;
+
+    /* The total time spent evaluating the leaf, in nanoseconds. */
+    std::uint64_t ns;
+
+    /* Add the given counts to ours. */
+    void add(const leaf_stats_t &that) noexcept {
+      calls += that.calls;
+      hits += that.hits;
+      ns += that.ns;
+    }
+
+  };  // stats_t::leaf_stats_t
+
+  /* Statistics keyed by leaf description, as they're written out. */
+  using totals_t = std::map<std::string, leaf_stats_t>;
+
+  /* Start with no statistics. */
+  stats_t()
+      : prior(std::make_shared<const totals_t>()) {}
+
+  /* Start from the given statistics of a previous run. */
+  explicit stats_t(std::shared_ptr<const totals_t> prior)
+      : prior(std::move(prior)) {}
+
+  /* The statistics of the leaf with the given id and description: what
+     we've counted, plus what we read for a leaf with this description
+     from a previous run, if anything. */
+  leaf_stats_t get(std::size_t id, const std::string &desc) {
+    const auto &slot = bind(id, desc);
+    auto counts = slot.prior;
+    counts.add(slot.counts);
+    return counts;
+  }
+
+  /* Count one evaluation of the leaf with the given id and description. */
+  void record(
+      std::size_t id, const std::string &desc, bool is_hit,
+      clock_t::duration elapsed) {
+    auto &counts = bind(id, desc).counts;
+    ++counts.calls;
+    if (is_hit) {
+      ++counts.hits;
+    }
+    counts.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        elapsed).count();
+  }
+
+  /* Add the counts of the given statistics, which must be of the same
+     program, to ours. */
+  void add(const stats_t &that) {
+    for (std::size_t id = 0; id < that.slots.size(); ++id) {
+      const auto &slot = that.slots[id];
+      if (!slot.desc.empty()) {
+        bind(id, slot.desc).counts.add(slot.counts);
+      }
+    }
+  }
+
+  /* Forget what we've counted, but not what we read. */
+  void clear() noexcept {
+    for (auto &slot: slots) {
+      slot.counts = leaf_stats_t();
+    }
+  }
+
+  /* Add what we've counted, but not what we read, to the given totals. */
+  void add_to(totals_t &totals) const {
+    for (const auto &slot: slots) {
+      if (!slot.desc.empty()) {
+        totals[slot.desc].add(slot.counts);
+      }
+    }
+  }
+
+  /* Read statistics written by write(), below.  These become the starting
+     points for leaves we haven't seen yet. */
+  void read(std::istream &strm) {
+    prior = std::make_shared<const totals_t>(read_totals(strm));
+  }
+
+  /* Write our statistics, one leaf per line, in a form read() can read. */
+  void write(std::ostream &strm) const {
+    auto totals = *prior;
+    add_to(totals);
+    write_totals(strm, totals);
+  }
+
+  /* Read totals written by write_totals(). */
+  static totals_t read_totals(std::istream &strm) {
+    totals_t totals;
+    std::string line;
+    while (std::getline(strm, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      std::istringstream line_strm(line);
+      leaf_stats_t counts;
+      line_strm >> counts.calls >> counts.hits >> counts.ns;
+      std::string desc;
+      if (!line_strm || line_strm.get() != ' '
+          || !std::getline(line_strm, desc) || desc.empty()) {
+        std::ostringstream msg;
+        msg << "bad statistics line \"" << line << '"';
+        throw std::runtime_error(msg.str());
+      }
+      totals[desc] = counts;
+    }
+    return totals;
+  }
+
+  /* Write the given totals, one leaf per line. */
+  static void write_totals(std::ostream &strm, const totals_t &totals) {
+    for (const auto &item: totals) {
+      strm
+          << item.second.calls << ' ' << item.second.hits << ' '
+          << item.second.ns << ' ' << item.first << '\n';
+    }
+  }
+
+  private:
+
+  /* The statistics of a leaf of the current program. */
+  struct slot_t {
+
+    /* The description of the leaf.  Empty if the slot is unused. */
+    std::string desc;
+
+    /* What we read for the leaf, if anything. */
+    leaf_stats_t prior;
+
+    /* What we've counted. */
+    leaf_stats_t counts;
+
+  };  // stats_t::slot_t
+
+  /* Return the slot for the given leaf, creating it if necessary. */
+  slot_t &bind(std::size_t id, const std::string &desc) {
+    if (id >= slots.size()) {
+      slots.resize(id + 1);
+    }
+    auto &slot = slots[id];
+    if (slot.desc.empty()) {
+      slot.desc = desc;
+      auto iter = prior->find(desc);
+      if (iter != prior->end()) {
+        slot.prior = iter->second;
+      }
+    }
+    return slot;
+  }
+
+  /* Statistics of the leaves of the current program, indexed by canonical
+     leaf id. */
+  std::vector<slot_t> slots;
+
+  /* Statistics read from a previous run.  Never null. */
+  std::shared_ptr<const totals_t> prior;
+
+};  // stats_t
+
+}  // qmellow
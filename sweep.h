@@ -0,0 +1,596 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "context.h"
+#include "decompress.h"
+#include "file.h"
+#include "hash.h"
+#include "metrics.h"
+#include "native.h"
+#include "pack.h"
+#include "parallel.h"
+#include "plan.h"
+#include "reader.h"
+#include "result.h"
+#include "sink.h"
+#include "trace.h"
+#include "utils.h"
+
+namespace qmellow {
+
+/* Evaluates every rule of a pack against every file of a corpus.  Files are
+   read on a stage of their own (see reader_t) and evaluated by a pool of
+   worker threads as they arrive.  Compressed files are decompressed by the
+   workers (see decompressor_t).  Files with the same contents are evaluated
+   only once, and the results reported for each, so long as there's room to
+   keep them (see contents_t).  Given a planner, the workers count how
+   often and how fast each leaf matches, and the planner reorders the rules'
+   ands and ors as the counts come in (see shared_planner_t).
+
+   Results are reported as each file is done, from the worker thread which
+   did it: either to a callback, or, match by match, into a sink (see
+   sink_t), which writes them out as the sweep goes. */
+class sweep_t final {
+  public:
+
+  /* The clock we use to time files. */
+  using clock_t = std::chrono::steady_clock;
+
+  /* What a sweep did. */
+  class report_t final {
+    public:
+
+    /* Start with nothing counted. */
+    report_t() noexcept
+        : file_count(0), duplicate_count(0), error_count(0), byte_count(0),
+          match_count(0), elapsed(0), read_backend("") {}
+
+    /* The latency, in nanoseconds, below which the given fraction (between
+       0 and 1) of files were done. */
+    std::uint64_t get_percentile_ns(double fraction) const {
+      if (latencies_ns.empty()) {
+        return 0;
+      }
+      auto sorted = latencies_ns;
+      auto n = static_cast<std::size_t>(fraction * (sorted.size() - 1));
+      std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+      return sorted[n];
+    }
+
+    /* The number of files swept, duplicates included. */
+    std::size_t file_count;
+
+    /* The number of files whose contents were the same as those of a file
+       swept before them, and so weren't evaluated again. */
+    std::size_t duplicate_count;
+
+    /* The number of files which couldn't be read or decompressed. */
+    std::size_t error_count;
+
+    /* The total size of the files swept, in bytes, after decompression. */
+    std::uint64_t byte_count;
+
+    /* The number of (file, rule) pairs which matched. */
+    std::size_t match_count;
+
+    /* The wall-clock time the sweep took. */
+    clock_t::duration elapsed;
+
+    /* The time it took to scan and evaluate each distinct file, in
+       nanoseconds, in no particular order.  Reading happens on its own
+       stage, so isn't included. */
+    std::vector<std::uint64_t> latencies_ns;
+
+    /* How the files were read.  See reader_t::get_backend(). */
+    const char *read_backend;
+
+  };  // sweep_t::report_t
+
+  /* The rules which matched a file's contents, by index, and their
+     results. */
+  using matches_t = std::vector<std::pair<std::size_t, result_t>>;
+
+  /* The distinct contents seen during a run, so that files with the same
+     contents are evaluated only once.  Contents are looked up by their hash
+     and size, but reuse another file's results only if their bytes are the
+     same, so a collision costs an evaluation, never a wrong answer.  The
+     bytes and matches of distinct contents are kept until the run ends, but
+     only up to a budget of bytes and one of matches in all (see the
+     constructor), so memory stays bounded
+     however big the corpus and however much a sweep matches; a file whose
+     twin we couldn't keep is evaluated again.  This is thread-safe. */
+  class contents_t final {
+    public:
+
+    /* Identifies contents, though not for certain. */
+    using key_t = std::pair<std::uint64_t, std::size_t>;
+
+    /* What claim() found. */
+    enum claim_t {
+
+      /* New contents, for the caller to evaluate and then pass to
+         reserve() and finish(). */
+      first,
+
+      /* Contents we can't share results for, for the caller to evaluate
+         on its own. */
+      alone,
+
+      /* Contents evaluated before, whose results we gave back. */
+      reused,
+
+      /* Contents still being evaluated, whose results will go to the
+         path. */
+      waiting
+
+    };  // sweep_t::contents_t::claim_t
+
+    /* The most bytes of contents we keep by default, over all contents. */
+    static std::size_t get_default_max_kept_byte_count() noexcept {
+      return std::size_t(1) << 27;
+    }
+
+    /* The most matches we keep by default, over all contents. */
+    static std::size_t get_default_max_kept_match_count() noexcept {
+      return 1 << 20;
+    }
+
+    /* Start with nothing seen, keeping at most the given numbers of bytes
+       and of matches, over all contents. */
+    explicit contents_t(
+        std::size_t max_kept_byte_count = get_default_max_kept_byte_count(),
+        std::size_t max_kept_match_count =
+            get_default_max_kept_match_count())
+        : max_kept_byte_count(max_kept_byte_count),
+          max_kept_match_count(max_kept_match_count), kept_byte_count(0),
+          kept_match_count(0) {}
+
+    /* Look up the given contents, with the given key, found at the given
+       path.  If we haven't seen them before, we keep a copy of them, if
+       there's room, and they're the caller's to evaluate first.  If we
+       have, but didn't keep them, or kept different contents with the same
+       key, they're the caller's to evaluate alone.  Otherwise, if they've
+       been evaluated, we point matches at their results; if they're still
+       being evaluated, the path is put on a waiting list, for whoever is
+       evaluating them to finish. */
+    claim_t claim(
+        const key_t &key, const std::string &text, const std::string *path,
+        std::shared_ptr<const matches_t> &matches) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto iter = entries.find(key);
+      if (iter == entries.end()) {
+        if (kept_byte_count + text.size() > max_kept_byte_count) {
+          return alone;
+        }
+        kept_byte_count += text.size();
+        entries[key].text = text;
+        return first;
+      }
+      auto &entry = iter->second;
+      if ((entry.is_done && !entry.matches) || entry.text != text) {
+        return alone;
+      }
+      if (entry.matches) {
+        matches = entry.matches;
+        return reused;
+      }
+      entry.waiting.push_back(path);
+      return waiting;
+    }
+
+    /* True iff. we should keep the given number of matches of contents we
+       claimed first: there's room.  If so, the room is taken, and the
+       caller should pass its matches, expanded, to finish(). */
+    bool reserve(std::size_t match_count) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (kept_match_count + match_count > max_kept_match_count) {
+        return false;
+      }
+      kept_match_count += match_count;
+      return true;
+    }
+
+    /* Record the results of contents we claimed first, or null if we're
+       not keeping them, in which case we let go of their bytes too, and
+       return the paths which were waiting for them. */
+    std::vector<const std::string *> finish(
+        const key_t &key, const std::shared_ptr<const matches_t> &matches) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto &entry = entries[key];
+      entry.matches = matches;
+      entry.is_done = true;
+      if (!matches) {
+        kept_byte_count -= entry.text.size();
+        std::string().swap(entry.text);
+      }
+      return std::move(entry.waiting);
+    }
+
+    private:
+
+    /* What we know of some contents. */
+    struct entry_t {
+
+      /* Not done yet. */
+      entry_t()
+          : is_done(false) {}
+
+      /* The contents, unless we've let go of them. */
+      std::string text;
+
+      /* The results, or null if still being evaluated or not kept. */
+      std::shared_ptr<const matches_t> matches;
+
+      /* True iff. the contents have been evaluated. */
+      bool is_done;
+
+      /* The paths of files waiting on the results. */
+      std::vector<const std::string *> waiting;
+
+    };  // sweep_t::contents_t::entry_t
+
+    /* Hashes a key.  The first part is already a good hash. */
+    struct key_hash_t {
+
+      /* See class comment. */
+      std::size_t operator()(const key_t &key) const noexcept {
+        return static_cast<std::size_t>(key.first);
+      }
+
+    };  // sweep_t::contents_t::key_hash_t
+
+    /* See constructor. */
+    std::size_t max_kept_byte_count, max_kept_match_count;
+
+    /* Covers the rest. */
+    std::mutex mutex;
+
+    /* Everything we've seen. */
+    std::unordered_map<key_t, entry_t, key_hash_t> entries;
+
+    /* The number of bytes and of matches kept, over all entries. */
+    std::size_t kept_byte_count, kept_match_count;
+
+  };  // sweep_t::contents_t
+
+  /* Sweep with the given pack, using the given number of threads to
+     evaluate (zero meaning one per hardware thread) and keeping up to the
+     given number of reads in flight.  If use_uring is false, we read with
+     preads even where io_uring is available. */
+  explicit sweep_t(
+      const pack_t &pack, std::size_t thread_count = 0,
+      std::size_t read_depth = 32, bool use_uring = true)
+      : pack(pack), thread_count(get_thread_count(thread_count)),
+        read_depth(read_depth), use_uring(use_uring), native(nullptr),
+        planner(nullptr),
+        max_kept_byte_count(contents_t::get_default_max_kept_byte_count()),
+        max_kept_match_count(
+            contents_t::get_default_max_kept_match_count()) {}
+
+  /* Evaluate the rules with the given generated evaluators, which must be
+     of our pack, rather than interpreting them, or interpret them again if
+     null.  The evaluators must outlive our runs. */
+  void set_native(const native_pack_t *native) noexcept {
+    this->native = native;
+  }
+
+  /* Gather statistics into the given planner, which must plan our pack's
+     rules, in order, and outlive our runs, or stop if null.  Generated
+     evaluators keep the plan they were generated with, so we gather
+     nothing while we have them. */
+  void set_planner(shared_planner_t *planner) noexcept {
+    this->planner = planner;
+  }
+
+  /* Keep at most the given numbers of bytes and of matches of distinct
+     contents for files with the same contents to reuse (see
+     contents_t). */
+  void set_max_kept(
+      std::size_t byte_count, std::size_t match_count) noexcept {
+    max_kept_byte_count = byte_count;
+    max_kept_match_count = match_count;
+  }
+
+  /* Evaluate every rule against the files at the given paths.  For each
+     (file, rule) pair which matches, we call
+     on_match(path, rule, result).  This is called from the worker threads,
+     so it must be thread-safe.  The result is good only for the duration
+     of the call. */
+  template <typename on_match_t>
+  report_t run(
+      const std::vector<std::string> &paths,
+      const on_match_t &on_match) const {
+    return run_workers(paths, [&]() {
+      return callback_emitter_t<on_match_t>(pack, on_match);
+    });
+  }
+
+  /* Evaluate every rule against the files at the given paths, writing each
+     match into the given sink, file by file, as we go.  The matches of a
+     (file, rule) pair are written in order (see match_t), one at a time,
+     without expanding the result. */
+  report_t run_into(
+      const std::vector<std::string> &paths, sink_t &sink) const {
+    return run_workers(paths, [&]() {
+      return sink_emitter_t(pack, sink);
+    });
+  }
+
+  private:
+
+  /* Passes each result to a callback.  See run(). */
+  template <typename on_match_t>
+  class callback_emitter_t final {
+    public:
+
+    /* Cache the arguments. */
+    callback_emitter_t(const pack_t &pack, const on_match_t &on_match)
+        : pack(pack), on_match(on_match) {}
+
+    /* Report that the given rule, by index, matched the file at the given
+       path, with the given result. */
+    void emit(
+        const std::string &path, std::size_t rule_index,
+        const result_t &result) {
+      on_match(path, pack.get_rules()[rule_index], result);
+    }
+
+    /* Do-nothing. */
+    void end_file() {}
+
+    /* Do-nothing. */
+    void finish() {}
+
+    private:
+
+    /* See constructor. */
+    const pack_t &pack;
+
+    /* See constructor. */
+    const on_match_t &on_match;
+
+  };  // sweep_t::callback_emitter_t
+
+  /* Writes each match of each result into a sink, through a writer of
+     its own.  Each worker thread has one.  See run(). */
+  class sink_emitter_t final {
+    public:
+
+    /* Cache the pack and start a writer. */
+    sink_emitter_t(const pack_t &pack, sink_t &sink)
+        : pack(pack), writer(sink) {}
+
+    /* See callback_emitter_t. */
+    void emit(
+        const std::string &path, std::size_t rule_index,
+        const result_t &result) {
+      const auto &rule = pack.get_rules()[rule_index];
+      result.for_each_match([&](const match_t &match) {
+        writer.put(path, rule_index, rule, match);
+      });
+    }
+
+    /* Let the writer flush between files. */
+    void end_file() {
+      writer.end_file();
+    }
+
+    /* Flush what's left. */
+    void finish() {
+      writer.flush();
+    }
+
+    private:
+
+    /* See constructor. */
+    const pack_t &pack;
+
+    /* Our way into the sink. */
+    sink_t::writer_t writer;
+
+  };  // sweep_t::sink_emitter_t
+
+  /* Evaluate every rule against the files at the given paths.  Each worker
+     thread calls make_emitter() for an emitter of its own, like those
+     above, to which to report results. */
+  template <typename make_emitter_t>
+  report_t run_workers(
+      const std::vector<std::string> &paths,
+      const make_emitter_t &make_emitter) const {
+    std::mutex mutex;
+    report_t report;
+    contents_t contents(max_kept_byte_count, max_kept_match_count);
+    auto start = clock_t::now();
+    reader_t reader(
+        paths, read_depth, read_depth + 2 * thread_count, use_uring);
+    report.read_backend = reader.get_backend();
+    parallel_for(thread_count, thread_count, [&](std::size_t) {
+      report_t local;
+      decompressor_t decompressor;
+      std::string scratch;
+      reader_t::item_t item;
+      auto emitter = make_emitter();
+      std::unique_ptr<shared_planner_t::local_t> stats;
+      if (planner && !native) {
+        stats = make_unique<shared_planner_t::local_t>(*planner);
+      }
+      while (reader.pop(item)) {
+        sweep_item(
+            paths, reader, decompressor, contents, item, scratch, local,
+            stats.get(), emitter);
+        emitter.end_file();
+      }
+      emitter.finish();
+      if (stats) {
+        stats->flush();
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      merge(report, local);
+    });
+    report.elapsed = clock_t::now() - start;
+    return report;
+  }
+
+  /* Fold the counts of one file into the whole sweep's report. */
+  static void merge(report_t &report, const report_t &local) {
+    report.file_count += local.file_count;
+    report.duplicate_count += local.duplicate_count;
+    report.error_count += local.error_count;
+    report.byte_count += local.byte_count;
+    report.match_count += local.match_count;
+    report.latencies_ns.insert(
+        report.latencies_ns.end(),
+        local.latencies_ns.begin(), local.latencies_ns.end());
+  }
+
+  /* Sweep a file handed to us by the reader, decompressing it into our
+     scratch buffer if it's compressed, and give its buffer back.  If we've
+     seen the same contents before, we reuse their results instead of
+     evaluating them again.  If stats isn't null, leaf evaluations are
+     counted into it. */
+  template <typename emitter_t>
+  void sweep_item(
+      const std::vector<std::string> &paths, reader_t &reader,
+      decompressor_t &decompressor, contents_t &contents,
+      reader_t::item_t &item, std::string &scratch, report_t &report,
+      shared_planner_t::local_t *stats, emitter_t &emitter) const {
+    if (!item.ok) {
+      ++report.error_count;
+      return;
+    }
+    const auto &path = paths[item.index];
+    auto *text = &item.text;
+    try {
+      QMELLOW_TRACE_SPAN_ARG("decompress", item.index);
+      if (decompressor.decompress(item.text, scratch)) {
+        text = &scratch;
+      }
+    } catch (const std::runtime_error &) {
+      ++report.error_count;
+      reader.recycle(std::move(item.text));
+      return;
+    }
+    ++report.file_count;
+    report.byte_count += text->size();
+    contents_t::key_t key;
+    {
+      QMELLOW_TRACE_SPAN_ARG("hash", item.index);
+      key = contents_t::key_t(hash_bytes(*text), text->size());
+    }
+    std::shared_ptr<const matches_t> matches;
+    auto claim = contents.claim(key, *text, &path, matches);
+    if (claim == contents_t::first || claim == contents_t::alone) {
+      file_t file;
+      auto new_matches = std::make_shared<matches_t>();
+      sweep_file(
+          item.index, std::move(*text), file, *new_matches, report, stats);
+      if (claim == contents_t::first) {
+        std::size_t match_count = 0;
+        for (const auto &match: *new_matches) {
+          match_count += match.second.get_match_count();
+        }
+        if (contents.reserve(match_count)) {
+          for (auto &match: *new_matches) {
+            match.second.expand();
+          }
+          matches = new_matches;
+        }
+        for (const auto *waiting: contents.finish(key, matches)) {
+          emit(*waiting, *new_matches, report, emitter);
+        }
+      }
+      emit(path, *new_matches, report, emitter);
+      *text = file.release_text();
+    } else {
+      ++report.duplicate_count;
+      QMELLOW_METRICS_ADD(files_deduplicated, 1);
+      if (matches) {
+        emit(path, *matches, report, emitter);
+      }
+    }
+    reader.recycle(std::move(item.text));
+  }
+
+  /* Report the matches of a file. */
+  template <typename emitter_t>
+  void emit(
+      const std::string &path, const matches_t &matches, report_t &report,
+      emitter_t &emitter) const {
+    for (const auto &match: matches) {
+      QMELLOW_TRACE_SPAN_ARG("output", match.first);
+      ++report.match_count;
+      emitter.emit(path, match.first, match.second);
+    }
+  }
+
+  /* Scan the given text into the given file and evaluate every rule
+     against it, appending the rules which match to matches.  Their results
+     refer to the file, so are good only as long as it is, unless expanded.
+     The index is the file's position in the sweep, which we give as the
+     argument of its trace span.  If stats isn't null, leaf evaluations are
+     counted into it. */
+  void sweep_file(
+      std::size_t index, std::string &&text, file_t &file,
+      matches_t &matches, report_t &report,
+      shared_planner_t::local_t *stats) const {
+    (void)index;
+    QMELLOW_TRACE_SPAN_ARG("file", index);
+    auto start = clock_t::now();
+    {
+      QMELLOW_TRACE_SPAN("extract");
+      file = file_t(std::move(text));
+    }
+    const auto &rules = pack.get_rules();
+    for (std::size_t i = 0; i < rules.size(); ++i) {
+      QMELLOW_TRACE_SPAN_ARG("eval", i);
+      context_t context(stats ? stats->get_stats(i) : nullptr);
+      auto result = native
+          ? native->eval(i, file, context)
+          : rules[i].get_expr()->eval(file, context);
+      if (result.is_match()) {
+        matches.emplace_back(i, std::move(result));
+      }
+    }
+    if (stats) {
+      stats->end_file();
+    }
+    QMELLOW_METRICS_ADD(files_evaluated, 1);
+    report.latencies_ns.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            clock_t::now() - start).count());
+  }
+
+  /* See constructor. */
+  const pack_t &pack;
+
+  /* See constructor. */
+  std::size_t thread_count;
+
+  /* See constructor. */
+  std::size_t read_depth;
+
+  /* See constructor. */
+  bool use_uring;
+
+  /* See set_native(). */
+  const native_pack_t *native;
+
+  /* See set_planner(). */
+  shared_planner_t *planner;
+
+  /* See set_max_kept(). */
+  std::size_t max_kept_byte_count, max_kept_match_count;
+
+};  // sweep_t
+
+}  // qmellow
@@ -0,0 +1,249 @@
+/* Sweeps a rule pack over a corpus and reports how fast it went, as a single
+   line of JSON.
+
+     sweepbench [--threads=N] [--read-depth=N] [--io=uring|pread]
+         [--metrics=json|prometheus] [--trace=trace.json]
+         [--output=matches] [--format=jsonl|binary] [--native=rules.so]
+         [--plan] [--stats=stats.txt] [--explain | --analyze]
+         corpus_dir [rule_pack]
+
+   Without a rule pack, we make up a pack of 50 rules of 8 leaves, drawn from
+   the same vocabulary as gencorpus's default.  With --metrics, the engine's
+   metrics are written after the report; they are all zero unless we were
+   built with QMELLOW_METRICS defined.  With --trace, a Chrome trace of the
+   sweep is written to the given path; it is empty unless we were built with
+   QMELLOW_TRACE defined.  sweepbench-instrumented is built with both.
+   --read-depth and --io control the read stage; see reader_t.  With
+   --output, the matches are written to the given path as the sweep goes,
+   in the given format, which is JSON lines by default; see sink.h.  With
+   --native, the rules are evaluated by the given shared object, built from
+   what qmellowgen generated for the same pack, rather than interpreted.
+   With --plan, the rules' ands and ors are reordered as the sweep goes,
+   from how often and how fast their leaves match (see shared_planner_t).
+   --stats implies --plan, and starts from the statistics at the given
+   path, if there are any, and writes them back, updated, at the end.
+   With --explain, each rule's plan (see explain()) is written after the
+   report, as the sweep left it.  With --analyze, there's no sweep: each
+   rule is interpreted on every file, one at a time, and its plan is
+   written annotated with the work each node did (see explain_analyze()),
+   planned from the statistics of --stats, if given. */
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "context.h"
+#include "decompress.h"
+#include "explain.h"
+#include "file.h"
+#include "metrics.h"
+#include "native.h"
+#include "pack.h"
+#include "plan.h"
+#include "profile.h"
+#include "sink.h"
+#include "stats.h"
+#include "sweep.h"
+#include "synth.h"
+#include "trace.h"
+#include "utils.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* Write the usage message and exit. */
+void usage() {
+  cerr
+      << "usage: sweepbench [--threads=N] [--read-depth=N] "
+      << "[--io=uring|pread] [--metrics=json|prometheus] "
+      << "[--trace=trace.json] [--output=matches] [--format=jsonl|binary] "
+      << "[--native=rules.so] [--plan] [--stats=stats.txt] "
+      << "[--explain | --analyze] corpus_dir [rule_pack]\n";
+  exit(2);
+}
+
+/* A made-up rule pack. */
+string make_rule_pack() {
+  synth_t synth(1);
+  string text;
+  for (int i = 0; i < 50; ++i) {
+    text += synth.make_rule(8, 100);
+    text += '\n';
+  }
+  return text;
+}
+
+/* Write each rule's plan, annotated from the profile, if any. */
+void explain_rules(const pack_t &pack, const profile_t *profile) {
+  const auto &rules = pack.get_rules();
+  for (size_t i = 0; i < rules.size(); ++i) {
+    cout << "rule " << i << ": " << rules[i].get_text() << '\n';
+    explainer_t(cout, profile).explain(rules[i].get_expr());
+  }
+}
+
+/* Interpret every rule on every file at the given paths, one at a time,
+   then write each rule's plan annotated with the work its nodes did. */
+void analyze(const pack_t &pack, const vector<string> &paths) {
+  profile_t profile;
+  decompressor_t decompressor;
+  for (const auto &path: paths) {
+    file_t file(decompressor.load(path));
+    for (const auto &rule: pack.get_rules()) {
+      context_t context(nullptr, &profile);
+      rule.get_expr()->eval(file, context);
+    }
+  }
+  explain_rules(pack, &profile);
+}
+
+/* Our peak resident set size, in kilobytes. */
+long get_peak_rss_kb() {
+  rusage usage;
+  return (getrusage(RUSAGE_SELF, &usage) == 0) ? usage.ru_maxrss : 0;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  size_t thread_count = 0, read_depth = 32;
+  bool use_uring = true, use_planner = false, use_explain = false,
+      use_analyze = false;
+  string metrics_format, trace_path, output_path, output_format = "jsonl",
+      native_path, stats_path;
+  vector<string> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, 10, "--threads=") == 0) {
+      thread_count = strtoul(arg.c_str() + 10, nullptr, 10);
+    } else if (arg.compare(0, 13, "--read-depth=") == 0) {
+      read_depth = strtoul(arg.c_str() + 13, nullptr, 10);
+    } else if (arg == "--io=uring" || arg == "--io=pread") {
+      use_uring = (arg == "--io=uring");
+    } else if (arg == "--metrics=json" || arg == "--metrics=prometheus") {
+      metrics_format = arg.substr(10);
+    } else if (arg.compare(0, 8, "--trace=") == 0) {
+      trace_path = arg.substr(8);
+    } else if (arg.compare(0, 9, "--output=") == 0) {
+      output_path = arg.substr(9);
+    } else if (arg == "--format=jsonl" || arg == "--format=binary") {
+      output_format = arg.substr(9);
+    } else if (arg.compare(0, 9, "--native=") == 0) {
+      native_path = arg.substr(9);
+    } else if (arg == "--plan") {
+      use_planner = true;
+    } else if (arg.compare(0, 8, "--stats=") == 0) {
+      stats_path = arg.substr(8);
+      use_planner = true;
+    } else if (arg == "--explain") {
+      use_explain = true;
+    } else if (arg == "--analyze") {
+      use_analyze = true;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage();
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.empty() || args.size() > 2 || (use_explain && use_analyze)) {
+    usage();
+  }
+  try {
+    pack_t pack((args.size() > 1)
+        ? read_whole_file(args[1]) : make_rule_pack());
+    vector<string> paths;
+    list_files(args[0], paths);
+    sweep_t sweep(pack, thread_count, read_depth, use_uring);
+    unique_ptr<native_pack_t> native;
+    if (!native_path.empty()) {
+      native = make_unique<native_pack_t>(pack, native_path);
+      sweep.set_native(native.get());
+    }
+    unique_ptr<shared_planner_t> planner;
+    if (use_planner) {
+      stats_t::totals_t prior;
+      ifstream strm(stats_path);
+      if (strm) {
+        prior = stats_t::read_totals(strm);
+      }
+      vector<const expr_t *> exprs;
+      for (const auto &rule: pack.get_rules()) {
+        exprs.push_back(rule.get_expr());
+      }
+      planner = make_unique<shared_planner_t>(move(exprs), prior);
+      sweep.set_planner(planner.get());
+    }
+    if (use_analyze) {
+      analyze(pack, paths);
+      return 0;
+    }
+    tracer_t::get().set_enabled(!trace_path.empty());
+    sweep_t::report_t report;
+    if (output_path.empty()) {
+      report = sweep.run(
+          paths,
+          [](const string &, const pack_t::rule_t &, const result_t &) {});
+    } else {
+      ofstream strm(output_path, ios::binary);
+      unique_ptr<sink_t> sink;
+      if (output_format == "binary") {
+        sink = make_unique<binary_sink_t>(strm);
+      } else {
+        sink = make_unique<json_lines_sink_t>(strm);
+      }
+      report = sweep.run_into(paths, *sink);
+      strm.flush();
+      if (!strm) {
+        throw runtime_error("could not write \"" + output_path + '"');
+      }
+    }
+    double sec = chrono::duration<double>(report.elapsed).count();
+    cout
+        << "{\"files\":" << report.file_count
+        << ",\"duplicates\":" << report.duplicate_count
+        << ",\"errors\":" << report.error_count
+        << ",\"bytes\":" << report.byte_count
+        << ",\"rules\":" << pack.get_rules().size()
+        << ",\"matches\":" << report.match_count
+        << ",\"sec\":" << sec
+        << ",\"pages_per_sec\":" << report.file_count / sec
+        << ",\"mb_per_sec\":" << report.byte_count / sec / 1e6
+        << ",\"p50_us\":" << report.get_percentile_ns(0.5) / 1e3
+        << ",\"p99_us\":" << report.get_percentile_ns(0.99) / 1e3
+        << ",\"peak_rss_kb\":" << get_peak_rss_kb()
+        << ",\"io\":\"" << report.read_backend << '"'
+        << "}\n";
+    if (metrics_format == "json") {
+      metrics_t::get().write_json(cout);
+    } else if (metrics_format == "prometheus") {
+      metrics_t::get().write_prometheus(cout);
+    }
+    if (use_explain) {
+      explain_rules(pack, nullptr);
+    }
+    if (!stats_path.empty()) {
+      ofstream strm(stats_path);
+      stats_t::write_totals(strm, planner->get_totals());
+      if (!strm) {
+        throw runtime_error("could not write \"" + stats_path + '"');
+      }
+    }
+    if (!trace_path.empty()) {
+      ofstream strm(trace_path);
+      tracer_t::get().write_chrome_trace(strm);
+      if (!strm) {
+        throw runtime_error("could not write \"" + trace_path + '"');
+      }
+    }
+  } catch (const exception &ex) {
+    cerr << "error: " << ex.what() << endl;
+    return 1;
+  }
+  return 0;
+}
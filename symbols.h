@@ -0,0 +1,384 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "hash.h"
+
+namespace qmellow {
+
+/* The strings we match by identity, such as tag names, ids, class names, and
+   asset paths, interned into symbols: small integers which stand for the
+   same string everywhere in the process.  Every file scanned and every
+   query compiled shares the one table (see get()), so a file keeps four
+   bytes per name rather than a copy of it, and a leaf matches an element by
+   comparing integers.
+
+   Each symbol counts the references to it, and is forgotten some time after
+   the last goes, its number then standing for the next new string.  Files
+   and queries hold their references in a refs_t, so a long-running process
+   which scans ever-new files, such as the daemon, keeps only the strings of
+   the files and queries it still has.  A symbol with no references is kept
+   for a while, in case it's soon wanted again, but a shard forgets all of
+   its idle symbols once they're more than half of it.
+
+   Many threads intern at once, as files are scanned in parallel.  The table
+   is split into shards by hash, each with its own lock, so they rarely
+   contend.  Looking up the text of a symbol takes no lock at all. */
+class symbol_table_t final {
+  public:
+
+  /* An interned string. */
+  using symbol_t = std::uint32_t;
+
+  /* Stands for no string at all. */
+  static symbol_t get_no_symbol() noexcept {
+    return 0;
+  }
+
+  /* References to symbols, held by something which uses them, such as a
+     scanned document or a compiled leaf.  Intern through one of these and
+     the symbols stay interned for as long as it's around.  A copy holds
+     references of its own. */
+  class refs_t final {
+    public:
+
+    /* Hold nothing. */
+    refs_t() noexcept {}
+
+    /* Hold what that holds. */
+    refs_t(const refs_t &that)
+        : symbols(that.symbols) {
+      for (auto symbol: symbols) {
+        get().retain(symbol);
+      }
+    }
+
+    /* Take over what that holds. */
+    refs_t(refs_t &&that) noexcept
+        : symbols(std::move(that.symbols)) {
+      that.symbols.clear();
+    }
+
+    /* Let go of everything. */
+    ~refs_t() {
+      for (auto symbol: symbols) {
+        get().release(symbol);
+      }
+    }
+
+    /* Hold what that holds, instead of what we do. */
+    refs_t &operator=(refs_t that) noexcept {
+      symbols.swap(that.symbols);
+      return *this;
+    }
+
+    /* The symbol for the given string, interned, which we then hold. */
+    symbol_t intern(const char *data, std::size_t size, std::uint64_t hash) {
+      symbols.push_back(get().intern(data, size, hash));
+      return symbols.back();
+    }
+
+    /* Convenience. */
+    symbol_t intern(const std::string &text) {
+      return intern(
+          text.data(), text.size(), hash_bytes(text.data(), text.size()));
+    }
+
+    private:
+
+    /* What we hold, once each per time we interned it. */
+    std::vector<symbol_t> symbols;
+
+  };  // symbol_table_t::refs_t
+
+  /* The table which everyone shares. */
+  static symbol_table_t &get() {
+    static symbol_table_t table;
+    return table;
+  }
+
+  /* The symbol for the given string, interning it if need be, with a
+     reference to it which the caller holds until it calls release().  A
+     reference never released makes the symbol permanent, which suits
+     statics.  The string's hash must be the one hash_bytes() gives. */
+  symbol_t intern(const char *data, std::size_t size, std::uint64_t hash) {
+    auto &shard = shards[hash % get_shard_count()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.count * 2 >= shard.slots.size()) {
+      grow(shard);
+    }
+    auto mask = shard.slots.size() - 1;
+    for (auto i = (hash / get_shard_count()) & mask; ; i = (i + 1) & mask) {
+      auto &symbol = shard.slots[i];
+      if (symbol == get_no_symbol()) {
+        symbol = add(shard, data, size, hash);
+        ++shard.count;
+        return symbol;
+      }
+      if (is_symbol(symbol, data, size)) {
+        if (get_entry(symbol).ref_count++ == 0) {
+          --shard.idle_count;
+        }
+        return symbol;
+      }
+    }
+  }
+
+  /* Convenience. */
+  symbol_t intern(const char *data, std::size_t size) {
+    return intern(data, size, hash_bytes(data, size));
+  }
+
+  /* Convenience. */
+  symbol_t intern(const std::string &text) {
+    return intern(text.data(), text.size());
+  }
+
+  /* Take another reference to the given symbol, which the caller must
+     already hold one to. */
+  void retain(symbol_t symbol) {
+    auto &entry = get_entry(symbol);
+    auto &shard = shards[entry.hash % get_shard_count()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    ++entry.ref_count;
+  }
+
+  /* Give back a reference to the given symbol. */
+  void release(symbol_t symbol) {
+    auto &entry = get_entry(symbol);
+    auto &shard = shards[entry.hash % get_shard_count()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (--entry.ref_count == 0
+        && ++shard.idle_count > std::max(
+            get_min_idle_count(), shard.count / 2)) {
+      forget_idle(shard);
+    }
+  }
+
+  /* The text of the given symbol, which mustn't be no symbol, and to which
+     the caller must hold a reference. */
+  const std::string &get_text(symbol_t symbol) const noexcept {
+    return get_entry(symbol).text;
+  }
+
+  /* The number of strings interned and not yet forgotten. */
+  std::size_t get_size() {
+    std::size_t size = 0;
+    for (auto &shard: shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      size += shard.count;
+    }
+    return size;
+  }
+
+  /* True iff. the given symbol has the given text. */
+  bool is_symbol(
+      symbol_t symbol, const char *data, std::size_t size) const noexcept {
+    const auto &text = get_text(symbol);
+    return text.size() == size && std::memcmp(text.data(), data, size) == 0;
+  }
+
+  private:
+
+  /* The number of shards. */
+  static std::size_t get_shard_count() noexcept {
+    return 64;
+  }
+
+  /* The most symbols a shard keeps without references, however small it
+     is. */
+  static std::size_t get_min_idle_count() noexcept {
+    return 256;
+  }
+
+  /* The log base 2 of the number of texts in the first chunk of storage.
+     Each chunk after is twice the size of the one before. */
+  static int get_first_chunk_bits() noexcept {
+    return 10;
+  }
+
+  /* The most chunks of storage we'll have, which is enough for every
+     symbol. */
+  static std::size_t get_max_chunk_count() noexcept {
+    return 23;
+  }
+
+  /* Find which chunk of storage the text of the given symbol is in, and
+     where in it. */
+  static void locate(
+      symbol_t symbol, std::size_t &index, std::size_t &offset) noexcept {
+    auto n = std::uint64_t(symbol) + (1 << get_first_chunk_bits());
+    auto bit = 63 - __builtin_clzll(n);
+    index = bit - get_first_chunk_bits();
+    offset = static_cast<std::size_t>(n - (std::uint64_t(1) << bit));
+  }
+
+  /* What we keep of a symbol. */
+  struct entry_t {
+
+    /* Unused. */
+    entry_t() noexcept
+        : hash(0), ref_count(0) {}
+
+    /* The string the symbol stands for. */
+    std::string text;
+
+    /* The string's hash, which says which shard the symbol is in. */
+    std::uint64_t hash;
+
+    /* The number of references to the symbol.  Guarded by the lock of its
+       shard. */
+    std::size_t ref_count;
+
+  };  // symbol_table_t::entry_t
+
+  /* A part of the table, with the symbols whose hashes fall to it. */
+  struct shard_t {
+
+    /* Empty. */
+    shard_t()
+        : count(0), idle_count(0) {}
+
+    /* Guards the rest, and the reference counts of our symbols. */
+    std::mutex mutex;
+
+    /* The hash table of our symbols, with open addressing.  Empty slots hold
+       no symbol. */
+    std::vector<symbol_t> slots;
+
+    /* The number of symbols in slots, and how many of those have no
+       references. */
+    std::size_t count, idle_count;
+
+    /* Symbols we've forgotten, which we give to new strings before making
+       new ones. */
+    std::vector<symbol_t> free_symbols;
+
+  };  // symbol_table_t::shard_t
+
+  /* Empty, but for the placeholder for no symbol. */
+  symbol_table_t()
+      : shards(get_shard_count()), chunks(get_max_chunk_count()),
+        next_symbol(1) {
+    for (auto &chunk: chunks) {
+      chunk.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  /* Not copyable. */
+  symbol_table_t(const symbol_table_t &) = delete;
+
+  /* Not copyable. */
+  symbol_table_t &operator=(const symbol_table_t &) = delete;
+
+  /* Free our storage. */
+  ~symbol_table_t() {
+    for (auto &chunk: chunks) {
+      delete[] chunk.load(std::memory_order_relaxed);
+    }
+  }
+
+  /* Store the given text, with the given hash, under a new symbol, with one
+     reference, and return it.  The shard's lock must be held, and its table
+     will publish the symbol. */
+  symbol_t add(
+      shard_t &shard, const char *data, std::size_t size,
+      std::uint64_t hash) {
+    symbol_t symbol;
+    if (!shard.free_symbols.empty()) {
+      symbol = shard.free_symbols.back();
+      shard.free_symbols.pop_back();
+    } else {
+      symbol = next_symbol.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::size_t index, offset;
+    locate(symbol, index, offset);
+    auto &entry = get_chunk(index)[offset];
+    entry.text.assign(data, size);
+    entry.hash = hash;
+    entry.ref_count = 1;
+    return symbol;
+  }
+
+  /* What we keep of the given symbol. */
+  entry_t &get_entry(symbol_t symbol) const noexcept {
+    std::size_t index, offset;
+    locate(symbol, index, offset);
+    return chunks[index].load(std::memory_order_acquire)[offset];
+  }
+
+  /* The given chunk of storage, made if need be. */
+  entry_t *get_chunk(std::size_t index) {
+    auto *chunk = chunks[index].load(std::memory_order_acquire);
+    if (!chunk) {
+      std::lock_guard<std::mutex> lock(chunk_mutex);
+      chunk = chunks[index].load(std::memory_order_acquire);
+      if (!chunk) {
+        chunk = new entry_t[std::size_t(1) << (
+            get_first_chunk_bits() + index)];
+        chunks[index].store(chunk, std::memory_order_release);
+      }
+    }
+    return chunk;
+  }
+
+  /* Double the shard's hash table, or start it, and rehash. */
+  void grow(shard_t &shard) {
+    rehash(shard, std::max<std::size_t>(shard.slots.size() * 2, 64));
+  }
+
+  /* Forget the shard's symbols which have no references, and free their
+     numbers.  The shard's lock must be held. */
+  void forget_idle(shard_t &shard) {
+    for (auto &symbol: shard.slots) {
+      if (symbol != get_no_symbol() && get_entry(symbol).ref_count == 0) {
+        std::string().swap(get_entry(symbol).text);
+        shard.free_symbols.push_back(symbol);
+        symbol = get_no_symbol();
+      }
+    }
+    shard.count -= shard.idle_count;
+    shard.idle_count = 0;
+    rehash(shard, shard.slots.size());
+  }
+
+  /* Remake the shard's hash table with the given number of slots. */
+  void rehash(shard_t &shard, std::size_t slot_count) {
+    std::vector<symbol_t> old_slots(slot_count, get_no_symbol());
+    old_slots.swap(shard.slots);
+    auto mask = shard.slots.size() - 1;
+    for (auto symbol: old_slots) {
+      if (symbol == get_no_symbol()) {
+        continue;
+      }
+      auto i = (get_entry(symbol).hash / get_shard_count()) & mask;
+      while (shard.slots[i] != get_no_symbol()) {
+        i = (i + 1) & mask;
+      }
+      shard.slots[i] = symbol;
+    }
+  }
+
+  /* See shard_t. */
+  std::vector<shard_t> shards;
+
+  /* What we keep of the symbols, in chunks, so that adding one never moves
+     another.  A null chunk hasn't been made yet. */
+  std::vector<std::atomic<entry_t *>> chunks;
+
+  /* The symbol the next text we add will get. */
+  std::atomic<symbol_t> next_symbol;
+
+  /* Taken while making a chunk, so it's made only once. */
+  std::mutex chunk_mutex;
+
+};  // symbol_table_t
+
+}  // qmellow
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+namespace qmellow {
+
+/* Makes synthetic HTML and rule packs for benchmarking.  Everything comes
+   from our own pseudo-random generator, so the same seed gives the same
+   output on every platform.  The HTML and the rules draw their names from
+   the same vocabulary, so rules do match some of the HTML. */
+class synth_t final {
+  public:
+
+  /* Controls the shape of generated HTML. */
+  struct html_params_t {
+
+    /* Defaults suit a typical page. */
+    html_params_t() noexcept
+        : line_count(200), vocab_size(100), class_density(0.3),
+          id_density(0.05), asset_density(0.05), include_density(0.01) {}
+
+    /* The number of lines of body content. */
+    std::size_t line_count;
+
+    /* The number of distinct words, class names, ids, and assets to draw
+       from. */
+    std::size_t vocab_size;
+
+    /* The chance that a line's element has class names. */
+    double class_density;
+
+    /* The chance that a line's element has an id. */
+    double id_density;
+
+    /* The chance that a line refers to an asset (CSS, JS, or image) or
+       another page. */
+    double asset_density;
+
+    /* The chance that a line is a server-side include. */
+    double include_density;
+
+  };  // synth_t::html_params_t
+
+  /* Seed the generator.  A zero seed is replaced, as xorshift can't use
+     it. */
+  explicit synth_t(std::uint64_t seed)
+      : state(seed ? seed : 0x9e3779b97f4a7c15ULL) {}
+
+  /* The next pseudo-random 64-bit number. */
+  std::uint64_t next() noexcept {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+
+  /* A pseudo-random number in [0, n). */
+  std::size_t below(std::size_t n) noexcept {
+    return n ? static_cast<std::size_t>(next() % n) : 0;
+  }
+
+  /* A pseudo-random number in [0, 1). */
+  double uniform() noexcept {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  /* A pseudo-random number from a log-normal distribution with the given
+     median and shape.  Page sizes are roughly log-normal. */
+  double lognormal(double median, double sigma) noexcept {
+    double u = 1 - uniform(), v = uniform();
+    double z = std::sqrt(-2 * std::log(u)) * std::cos(6.283185307179586 * v);
+    return median * std::exp(sigma * z);
+  }
+
+  /* Make a page of HTML. */
+  std::string make_html(const html_params_t &params) {
+    std::ostringstream strm;
+    strm
+        << "<!DOCTYPE html>\n<html>\n<head>\n"
+        << "<title>" << make_word(params) << "</title>\n"
+        << "<link rel=\"stylesheet\" href=\"" << make_asset(params, "css")
+        << "\">\n"
+        << "<script src=\"" << make_asset(params, "js")
+        << "\"></script>\n"
+        << "</head>\n<body>\n";
+    for (std::size_t i = 0; i < params.line_count; ++i) {
+      if (uniform() < params.include_density) {
+        strm
+            << "<!--#include virtual=\"/inc/i" << below(params.vocab_size)
+            << ".html\" -->\n";
+        continue;
+      }
+      if (uniform() < params.asset_density) {
+        write_asset_line(strm, params);
+        continue;
+      }
+      strm << "<div";
+      if (uniform() < params.id_density) {
+        strm << " id=\"d" << below(params.vocab_size) << '"';
+      }
+      if (uniform() < params.class_density) {
+        strm << " class=\"c" << below(params.vocab_size);
+        if (next() & 1) {
+          strm << " c" << below(params.vocab_size);
+        }
+        strm << '"';
+      }
+      strm << '>';
+      for (std::size_t n = 3 + below(8); n; --n) {
+        strm << make_word(params) << ' ';
+      }
+      strm << "</div>\n";
+    }
+    strm << "</body>\n</html>\n";
+    return strm.str();
+  }
+
+  /* Make a rule with the given number of leaves, joined at random by ands
+     and ors, with the occasional not. */
+  std::string make_rule(std::size_t leaf_count, std::size_t vocab_size) {
+    std::ostringstream strm;
+    write_rule(strm, leaf_count ? leaf_count : 1, vocab_size);
+    return strm.str();
+  }
+
+  private:
+
+  /* A word from the vocabulary, sometimes capitalized. */
+  std::string make_word(const html_params_t &params) {
+    std::ostringstream strm;
+    strm << ((next() & 3) ? "word" : "Word") << below(params.vocab_size);
+    return strm.str();
+  }
+
+  /* The path of an asset with the given extension. */
+  std::string make_asset(const html_params_t &params, const char *ext) {
+    std::ostringstream strm;
+    strm << "/static/s" << below(params.vocab_size) << '.' << ext;
+    return strm.str();
+  }
+
+  /* Write a line referring to a CSS, JS, or image asset, or to another
+     page. */
+  void write_asset_line(std::ostream &strm, const html_params_t &params) {
+    static const char *const image_exts[] = { "png", "jpg", "svg", "gif" };
+    switch (below(4)) {
+      case 0: {
+        strm
+            << "<link rel=\"stylesheet\" href=\""
+            << make_asset(params, "css") << "\">\n";
+        break;
+      }
+      case 1: {
+        strm
+            << "<script src=\"" << make_asset(params, "js")
+            << "\"></script>\n";
+        break;
+      }
+      case 2: {
+        strm
+            << "<img src=\"" << make_asset(params, image_exts[below(4)])
+            << "\" alt=\"" << make_word(params) << "\">\n";
+        break;
+      }
+      default: {
+        strm
+            << "<a href=\"/pages/p" << below(params.vocab_size)
+            << ".html\">" << make_word(params) << "</a>\n";
+      }
+    }  // switch
+  }
+
+  /* Write a single leaf of a rule. */
+  void write_leaf(std::ostream &strm, std::size_t vocab_size) {
+    static const char *const exts[] = {
+      "css", "js", "png", "jpg", "svg", "gif", "html"
+    };
+    auto k = below(vocab_size);
+    switch (below(6)) {
+      case 0: strm << "'word" << k << '\''; break;
+      case 1: strm << "\"Word" << k << '"'; break;
+      case 2: strm << ".c" << k; break;
+      case 3: strm << "#d" << k; break;
+      case 4: strm << "/static/s" << k << '.' << exts[below(6)]; break;
+      default: strm << "/pages/p" << k << '.' << exts[6]; break;
+    }  // switch
+  }
+
+  /* Write a rule with the given number of leaves. */
+  void write_rule(
+      std::ostream &strm, std::size_t leaf_count, std::size_t vocab_size) {
+    if (leaf_count == 1) {
+      if (below(8) == 0) {
+        strm << "not ";
+      }
+      write_leaf(strm, vocab_size);
+      return;
+    }
+    auto left_count = 1 + below(leaf_count - 1);
+    strm << '(';
+    write_rule(strm, left_count, vocab_size);
+    strm << ((next() & 1) ? " and " : " or ");
+    write_rule(strm, leaf_count - left_count, vocab_size);
+    strm << ')';
+  }
+
+  /* The state of our xorshift generator. */
+  std::uint64_t state;
+
+};  // synth_t
+
+}  // qmellow
@@ -0,0 +1,1500 @@
+/* Checks of the behaviour that's easiest to get subtly wrong.  Each check
+   writes a line saying whether it passed, and we exit with 1 if any
+   didn't.  Give a substring as the only argument to run only the checks
+   whose names contain it.  Most checks compare two ways of getting the
+   same answer on synthetic pages (see synth_t), so they need no data of
+   their own. */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <zlib.h>
+#include "batch.h"
+#include "bitmap.h"
+#include "codegen.h"
+#include "context.h"
+#include "decompress.h"
+#include "dfa.h"
+#include "dsl.h"
+#include "error.h"
+#include "explain.h"
+#include "expr.h"
+#include "file.h"
+#include "live.h"
+#include "match.h"
+#include "native.h"
+#include "pack.h"
+#include "parallel.h"
+#include "plan.h"
+#include "prefilter.h"
+#include "result.h"
+#include "shard.h"
+#include "sink.h"
+#include "sketch.h"
+#include "stats.h"
+#include "sweep.h"
+#include "symbols.h"
+#include "synth.h"
+
+using namespace std;
+using namespace qmellow;
+
+namespace {
+
+/* The number of checks which failed. */
+int failure_count = 0;
+
+/* Run the given check, unless the filter rules it out, and report how it
+   went.  A check fails by throwing. */
+template <typename fn_t>
+void check(const char *filter, const string &name, const fn_t &fn) {
+  if (filter && name.find(filter) == string::npos) {
+    return;
+  }
+  try {
+    fn();
+    cout << "ok " << name << endl;
+  } catch (const exception &ex) {
+    ++failure_count;
+    cout << "FAIL " << name << ": " << ex.what() << endl;
+  }
+}
+
+/* Throw with the given message unless the condition holds. */
+void expect(bool condition, const string &msg) {
+  if (!condition) {
+    throw runtime_error(msg);
+  }
+}
+
+/* A result, written out: whether it matched and, if it did, each match.
+   Causes are written by description, so results of different trees of
+   the same expression compare equal. */
+string describe(const result_t &result) {
+  if (!result.is_match()) {
+    return "no match";
+  }
+  ostringstream strm;
+  strm << "match";
+  result.for_each_match([&](const match_t &match) {
+    strm
+        << "; " << match.get_sub_file_path() << ':'
+        << match.get_line_number() << ": " << match.get_cause_desc();
+  });
+  return strm.str();
+}
+
+/* The numbers of the lines a result matched, in order and without
+   repeats, or "no match". */
+string describe_lines(const result_t &result) {
+  if (!result.is_match()) {
+    return "no match";
+  }
+  set<size_t> lines;
+  result.for_each_match([&](const match_t &match) {
+    lines.insert(match.get_line_number());
+  });
+  string text;
+  for (auto line: lines) {
+    text += (text.empty() ? "" : ",") + to_string(line);
+  }
+  return text;
+}
+
+/* A rule pack of the given number of made-up rules. */
+string make_rules(synth_t &synth, size_t count, size_t leaf_count) {
+  string text;
+  for (size_t i = 0; i < count; ++i) {
+    text += synth.make_rule(leaf_count, 20);
+    text += '\n';
+  }
+  return text;
+}
+
+/* Some made-up pages, small enough that rules both match and don't. */
+vector<string> make_pages(synth_t &synth, size_t count) {
+  synth_t::html_params_t params;
+  params.line_count = 40;
+  params.vocab_size = 20;
+  vector<string> pages;
+  for (size_t i = 0; i < count; ++i) {
+    pages.push_back(synth.make_html(params));
+  }
+  return pages;
+}
+
+/* Evaluate the given expression on the given file in a fresh context. */
+result_t eval(
+    const expr_t *expr, const file_t &file,
+    size_t limit = result_t::get_no_limit(), stats_t *stats = nullptr) {
+  context_t context(stats, nullptr, limit);
+  return expr->eval(file, context);
+}
+
+/* Planning reorders ands and ors and lets them short-circuit, but must
+   leave every successful result as it was.  We plan from statistics made
+   up to push operands both ways, and from those counted on the pages. */
+void check_planning(const char *filter) {
+  check(filter, "plan/successes-unchanged", []() {
+    synth_t synth(27);
+    pack_t pack(make_rules(synth, 40, 6));
+    auto pages = make_pages(synth, 20);
+    vector<vector<string>> expected;
+    for (const auto &page: pages) {
+      file_t file{string(page)};
+      expected.emplace_back();
+      for (const auto &rule: pack.get_rules()) {
+        expected.back().push_back(describe(eval(rule.get_expr(), file)));
+      }
+    }
+    for (int round = 0; round < 3; ++round) {
+      vector<const expr_t *> exprs;
+      for (const auto &rule: pack.get_rules()) {
+        exprs.push_back(rule.get_expr());
+      }
+      stats_t::totals_t prior;
+      synth_t noise(round + 1);
+      for (size_t i = 0; i < 20; ++i) {
+        auto &counts = prior["'word" + to_string(i) + "'"];
+        counts.calls = 100;
+        counts.hits = noise.below(101);
+        counts.ns = 100 * (1 + noise.below(1000));
+      }
+      shared_planner_t planner(exprs, prior, 1);
+      shared_planner_t::local_t local(planner);
+      for (size_t f = 0; f < pages.size(); ++f) {
+        file_t file{string(pages[f])};
+        const auto &rules = pack.get_rules();
+        for (size_t r = 0; r < rules.size(); ++r) {
+          auto result = eval(
+              rules[r].get_expr(), file, result_t::get_no_limit(),
+              local.get_stats(r));
+          if (result.is_match() || expected[f][r] != "no match") {
+            expect(
+                describe(result) == expected[f][r],
+                "planned rule " + rules[r].get_text() + " changed on page "
+                + to_string(f));
+          }
+        }
+        local.end_file();
+      }
+      local.flush();
+    }
+  });
+  check(filter, "plan/stats-round-trip", []() {
+    synth_t synth(28);
+    pack_t pack(make_rules(synth, 5, 4));
+    auto pages = make_pages(synth, 5);
+    vector<const expr_t *> exprs;
+    for (const auto &rule: pack.get_rules()) {
+      exprs.push_back(rule.get_expr());
+    }
+    shared_planner_t planner(exprs);
+    shared_planner_t::local_t first(planner), second(planner);
+    for (size_t f = 0; f < pages.size(); ++f) {
+      file_t file{string(pages[f])};
+      auto &local = (f % 2) ? first : second;
+      for (size_t r = 0; r < exprs.size(); ++r) {
+        eval(exprs[r], file, result_t::get_no_limit(), local.get_stats(r));
+      }
+    }
+    first.flush();
+    second.flush();
+    auto totals = planner.get_totals();
+    ostringstream out;
+    stats_t::write_totals(out, totals);
+    istringstream in(out.str());
+    auto read = stats_t::read_totals(in);
+    expect(read.size() == totals.size(), "lost leaves writing statistics");
+    uint64_t calls = 0;
+    for (const auto &item: read) {
+      expect(
+          item.second.hits <= item.second.calls,
+          item.first + " hit more often than it was called");
+      calls += item.second.calls;
+    }
+    expect(calls > 0, "counted nothing");
+    shared_planner_t again(exprs, read);
+    auto totals_again = again.get_totals();
+    expect(
+        totals_again.size() == read.size()
+            && totals_again.begin()->second.calls
+                == read.begin()->second.calls,
+        "statistics read back aren't where we start from");
+  });
+  check(filter, "plan/replanned-while-evaluating", []() {
+    pack_t pack("'alpha' and 'beta'\n");
+    const auto *expr = pack.get_rules()[0].get_expr();
+    const auto *infix = dynamic_cast<const infix_t *>(expr);
+    expect(infix != nullptr, "the rule isn't an and");
+    const vector<string> texts { "<p>alpha</p>\n", "<p>beta</p>\n" };
+    atomic<bool> is_done(false);
+    atomic<size_t> wrong_count(0);
+    thread replanner([&]() {
+      for (unsigned i = 0; !is_done; ++i) {
+        infix->set_plan(infix_t::plan_t((i & 1) != 0, (i & 2) != 0));
+      }
+    });
+    vector<thread> evaluators;
+    for (size_t t = 0; t < 4; ++t) {
+      evaluators.emplace_back([&, t]() {
+        file_t file{string(texts[t % texts.size()])};
+        for (size_t i = 0; i < 500000; ++i) {
+          if (eval(expr, file).is_match()) {
+            ++wrong_count;
+          }
+        }
+      });
+    }
+    for (auto &evaluator: evaluators) {
+      evaluator.join();
+    }
+    is_done = true;
+    replanner.join();
+    expect(
+        wrong_count == 0,
+        "matched " + to_string(wrong_count) + " times without both words");
+  });
+}
+
+/* A leaf which occurs more than once is matched once per evaluation, and
+   its result reused.  Copies of a result share its matches until one is
+   changed, so expanding copies on several threads leaves the original, and
+   each other, alone. */
+void check_memo(const char *filter) {
+  check(filter, "memo/shared-results", []() {
+    string text;
+    for (int i = 0; i < 100; ++i) {
+      text += "<p>foo bar</p>\n";
+    }
+    file_t file{move(text)};
+    pack_t pack("'foo' and ('bar' or 'foo')\n");
+    stats_t stats;
+    auto result = eval(
+        pack.get_rules()[0].get_expr(), file, result_t::get_no_limit(),
+        &stats);
+    stats_t::totals_t totals;
+    stats.add_to(totals);
+    expect(
+        totals["'foo'"].calls == 1 && totals["'bar'"].calls == 1,
+        "a leaf was matched more than once");
+    expect(!result.is_expanded(), "many matches weren't kept compressed");
+    auto expected = describe(result);
+    vector<result_t> copies(4, result);
+    vector<thread> threads;
+    for (auto &copy: copies) {
+      threads.emplace_back([&copy]() {
+        copy.expand();
+      });
+    }
+    for (auto &elem: threads) {
+      elem.join();
+    }
+    expect(!result.is_expanded(), "expanding a copy changed the original");
+    for (const auto &copy: copies) {
+      expect(
+          copy.is_expanded() && describe(copy) == expected
+              && copy.get_matches().size() == 200,
+          "a copy expanded wrongly");
+    }
+  });
+}
+
+/* Batch evaluation must find just the files the interpreter matches,
+   among whichever candidates it's given, whether its leaves' columns are
+   fresh or were left in leaf_tables_t by other queries of the same batch.
+   Columns of an older generation of the index were built over other
+   files, so must never be used for a newer one, nor a newer one's for an
+   older. */
+void check_batching(const char *filter) {
+  check(filter, "batch/same-as-interpreter", []() {
+    synth_t synth(39);
+    vector<unique_ptr<pack_t>> queries;
+    for (size_t i = 0; i < 40; ++i) {
+      queries.emplace_back(new pack_t(synth.make_rule(4, 20)));
+    }
+    vector<vector<string>> generations { make_pages(synth, 300) };
+    generations.push_back(generations[0]);
+    for (size_t i = 0; i < generations[1].size(); i += 4) {
+      generations[1][i] = make_pages(synth, 1)[0];
+    }
+    generations[1].resize(270);
+    const size_t batch_size = 64;
+    for (size_t capacity: { 65536, 50 }) {
+      leaf_tables_t tables(capacity);
+      size_t loaded_count = 0;
+      /* Run every query on every batch of the given generation, checking
+         each against the interpreter. */
+      auto run_all = [&](size_t generation) {
+        const auto &pages = generations[generation - 1];
+        for (size_t q = 0; q < queries.size(); ++q) {
+          const auto *expr = queries[q]->get_rules()[0].get_expr();
+          for (size_t start = 0; start < pages.size(); start += batch_size) {
+            auto b = start / batch_size;
+            auto size = min(batch_size, pages.size() - start);
+            vector<unique_ptr<file_t>> files(size);
+            batch_t batch(
+                size,
+                [&](size_t i) -> const file_t & {
+                  if (!files[i]) {
+                    ++loaded_count;
+                    files[i].reset(new file_t(string(pages[start + i])));
+                  }
+                  return *files[i];
+                },
+                tables.take(generation, b));
+            bitmap_t candidates(size);
+            for (size_t i = 0; i < size; ++i) {
+              if ((i + q) % 3 || q % 2) {
+                candidates.set(i);
+              }
+            }
+            auto matched = batch.eval(expr, candidates);
+            tables.put(generation, b, batch.release_columns());
+            for (size_t i = 0; i < size; ++i) {
+              file_t file{string(pages[start + i])};
+              bool expected =
+                  candidates.test(i) && eval(expr, file).is_match();
+              expect(
+                  matched.test(i) == expected,
+                  "generation " + to_string(generation) + ", file "
+                  + to_string(start + i) + ": batch and interpreter "
+                  + "differ on " + queries[q]->get_rules()[0].get_text());
+            }
+          }
+        }
+      };
+      run_all(1);
+      loaded_count = 0;
+      run_all(1);
+      expect(
+          capacity < 1000 || loaded_count == 0,
+          "kept columns weren't reused");
+      run_all(2);
+      run_all(1);
+      run_all(2);
+    }
+  });
+}
+
+/* Explaining writes a plan as it will be evaluated, noting shared leaves
+   and short-circuits, and analyzing adds the work each node did.  Times
+   vary, so we blank them out. */
+void check_explaining(const char *filter) {
+  check(filter, "explain/annotations", []() {
+    pack_t pack("'foo' and ('bar' or 'foo')\n");
+    const auto *expr = pack.get_rules()[0].get_expr();
+    dynamic_cast<const infix_t *>(expr)->set_plan(
+        infix_t::plan_t(false, true));
+    ostringstream plan;
+    explain(plan, expr);
+    expect(
+        plan.str() ==
+            "and (short-circuit)\n"
+            "  'foo' [leaf 0]\n"
+            "  or\n"
+            "    'bar' [leaf 1]\n"
+            "    'foo' [leaf 0, shared]\n",
+        "explained as:\n" + plan.str());
+    vector<file_t> files;
+    for (const char *text: { "<p>foo bar</p>\n", "<p>baz</p>\n",
+        "<p>foo</p>\n" }) {
+      files.emplace_back(string(text));
+    }
+    auto analyze = [expr](
+        vector<file_t>::const_iterator begin,
+        vector<file_t>::const_iterator end) {
+      ostringstream strm;
+      explain_analyze(strm, expr, begin, end);
+      return regex_replace(strm.str(), regex("ns [0-9]+"), "ns _");
+    };
+    auto all = analyze(files.begin(), files.end());
+    expect(
+        all ==
+            "and (short-circuit)  -- calls 3, ns _, matches 2, "
+            "short-circuits 1\n"
+            "  'foo' [leaf 0]  -- calls 3, ns _, matches 2\n"
+            "  or  -- calls 2, ns _, matches 2\n"
+            "    'bar' [leaf 1]  -- calls 2, ns _, matches 1\n"
+            "    'foo' [leaf 0, shared]  -- calls 2, ns _, matches 2\n",
+        "analyzed as:\n" + all);
+    auto none = analyze(files.begin() + 1, files.begin() + 2);
+    expect(
+        none ==
+            "and (short-circuit)  -- calls 1, ns _, matches 0, "
+            "short-circuits 1\n"
+            "  'foo' [leaf 0]  -- calls 1, ns _, matches 0\n"
+            "  or  -- never evaluated\n"
+            "    'bar' [leaf 1]  -- never evaluated\n"
+            "    'foo' [leaf 0, shared]  -- never evaluated\n",
+        "analyzed as:\n" + none);
+  });
+}
+
+/* Containment keeps the matches of a leaf which fall within the elements
+   a selector picks out, or, directly, which are children of them.  The
+   containment words are keywords only after a leaf, so they may still be
+   used as names. */
+void check_containment(const char *filter) {
+  check(filter, "contain/matches", []() {
+    file_t file{string(
+        "<div class=\"a\">\n"
+        "<p>foo</p>\n"
+        "</div>\n"
+        "<p>foo</p>\n"
+        "<div class=\"b\"><span class=\"a\">bar</span></div>\n"
+        "<div id=\"inside\">foo</div>\n")};
+    const vector<pair<string, string>> cases {
+      { "'foo'", "2,4,6" },
+      { "'foo' inside .a", "2" },
+      { "'foo' directly inside .a", "no match" },
+      { "'foo' directly inside #inside", "6" },
+      { "'bar' inside .b", "5" },
+      { "'bar' directly inside .b", "no match" },
+      { "'bar' directly inside .a inside .b", "5" },
+      { "'bar' inside .a directly inside .b", "5" },
+      { "'bar' inside .b inside .a", "no match" },
+      { "not 'foo' inside .a", "no match" },
+    };
+    for (const auto &item: cases) {
+      pack_t pack(item.first);
+      auto lines = describe_lines(eval(pack.get_rules()[0].get_expr(), file));
+      expect(
+          lines == item.second,
+          item.first + " matched " + lines + ", not " + item.second);
+    }
+  });
+  check(filter, "contain/keywords-as-names", []() {
+    for (const char *text: {
+        "#inside", ".directly", ".inside.directly", "/inside/directly.css",
+        "#inside inside .directly", "'a' directly inside #directly" }) {
+      pack_t pack(text);
+      expect(pack.get_rules().size() == 1, string("didn't parse ") + text);
+    }
+    for (const char *text: { "'a' directly .b", "'a' inside", "#a inside" }) {
+      bool threw = false;
+      try {
+        pack_t pack(text);
+      } catch (const qmellow::error_t &) {
+        threw = true;
+      }
+      expect(threw, string("parsed ") + text);
+    }
+  });
+}
+
+/* A sketch may only rule out a file which certainly doesn't match, so a
+   prefilter must pass every file the interpreter matches, counting the
+   matches of its sub-files, whose sketches are folded into its own.  It
+   should also rule some files out, or it's no use. */
+void check_sketching(const char *filter) {
+  check(filter, "sketch/no-false-negatives", []() {
+    synth_t synth(38);
+    pack_t pack(make_rules(synth, 300, 4));
+    auto pages = make_pages(synth, 60);
+    vector<shared_ptr<file_t>> files;
+    for (const auto &page: pages) {
+      files.push_back(make_shared<file_t>(string(page)));
+    }
+    for (size_t i = 0; i < files.size(); i += 3) {
+      files[i]->set_sub_files({
+        { "/inc/a.html", files[(i + 1) % files.size()] },
+        { "/inc/b.html", files[(i + 2) % files.size()] } });
+    }
+    size_t match_count = 0, ruled_out_count = 0;
+    for (const auto &file: files) {
+      sketch_t sketch;
+      file->add_to_sketch(sketch);
+      for (const auto &rule: pack.get_rules()) {
+        prefilter_t prefilter(rule.get_expr());
+        bool may_match = prefilter.may_match(sketch);
+        if (eval(rule.get_expr(), *file).is_match()) {
+          ++match_count;
+          expect(may_match, "ruled out a match of " + rule.get_text());
+        } else if (!may_match) {
+          ++ruled_out_count;
+        }
+      }
+    }
+    expect(match_count > 0, "nothing matched");
+    expect(ruled_out_count > 0, "nothing was ruled out");
+  });
+}
+
+/* The lazy DFA must match the lines std::regex does, whether it finishes
+   them in the DFA or, for patterns with too many states, by simulating the
+   NFA.  Lines end at a newline or at a carriage return and newline, so '$'
+   holds before the carriage return. */
+void check_regex(const char *filter) {
+  check(filter, "regex/same-as-std-regex", []() {
+    const vector<string> patterns {
+      "ab+c?", "^a.b", "b$", "^$", "\\d+x", "(ab|ba){2,3}", "[^a-c ]+_",
+      "\\w\\s\\w", "(x|1)b|_", "(xb|a)$", "a(b|c)*d?$", "(a|b)*a(a|b){12}$",
+    };
+    synth_t synth(43);
+    /* Short lines of mixed text, and long ones of a's and b's, on which
+       the last pattern needs more states than we make.  Each is given by
+       its alphabet and its longest line. */
+    const vector<pair<string, size_t>> corpora {
+      { "ababcx1_ ", 24 }, { "ab", 200 }
+    };
+    for (const auto &params: corpora) {
+      vector<string> lines;
+      string text;
+      for (size_t i = 0; i < 400; ++i) {
+        string line;
+        auto size = synth.below(params.second);
+        for (size_t j = 0; j < size; ++j) {
+          line += params.first[synth.below(params.first.size())];
+        }
+        lines.push_back(line);
+        text += line + (synth.below(2) ? "\r\n" : "\n");
+      }
+      for (const auto &pattern: patterns) {
+        dfa_t dfa(pattern, pos_t());
+        regex expected_re(pattern);
+        set<size_t> expected, actual;
+        for (size_t i = 0; i < lines.size(); ++i) {
+          if (regex_search(lines[i], expected_re)) {
+            expected.insert(i);
+          }
+        }
+        dfa.for_each_matching_line(text, [&](size_t offset) {
+          actual.insert(count(text.begin(), text.begin() + offset, '\n'));
+          return true;
+        });
+        expect(actual == expected, "`" + pattern + "` matched other lines");
+      }
+    }
+  });
+}
+
+/* The symbol table forgets the names of files which are gone, so a process
+   which scans ever-new files doesn't grow without bound, but keeps those of
+   the rules still compiled. */
+void check_symbols(const char *filter) {
+  check(filter, "symbols/unused-are-forgotten", []() {
+    auto &table = symbol_table_t::get();
+    pack_t pack("#kept\n.also.kept\n");
+    auto before = table.get_size();
+    for (size_t i = 0; i < 50000; ++i) {
+      auto n = to_string(i);
+      file_t file{"<div id=\"id" + n + "\" class=\"c" + n + "\">x</div>\n"};
+    }
+    auto growth = table.get_size() - before;
+    expect(growth < 20000, "kept " + to_string(growth) + " unused symbols");
+    file_t file{string("<p id=\"kept\" class=\"kept also\">x</p>\n")};
+    file_t other{string("<p id=\"id49999\" class=\"c49999\">x</p>\n")};
+    for (const auto &rule: pack.get_rules()) {
+      expect(
+          eval(rule.get_expr(), file).is_match(),
+          rule.get_text() + " lost its symbols");
+      expect(
+          !eval(rule.get_expr(), other).is_match(),
+          rule.get_text() + " matched a name reusing its symbol");
+    }
+  });
+}
+
+/* A directory of our own beneath /tmp, removed, with the files we wrote in
+   it, when we're done. */
+class temp_dir_t final {
+  public:
+
+  /* Make the directory. */
+  temp_dir_t() {
+    char templ[] = "/tmp/qmellow-tests-XXXXXX";
+    if (!mkdtemp(templ)) {
+      throw runtime_error("can't make a temporary directory");
+    }
+    path = templ;
+  }
+
+  /* Remove the directory and the files we wrote. */
+  ~temp_dir_t() {
+    for (const auto &name: names) {
+      std::remove((path + '/' + name).c_str());
+    }
+    rmdir(path.c_str());
+  }
+
+  temp_dir_t(const temp_dir_t &) = delete;
+  temp_dir_t &operator=(const temp_dir_t &) = delete;
+
+  /* The directory's path. */
+  const string &get_path() const noexcept {
+    return path;
+  }
+
+  /* The path of a file of the given name, which something else will
+     write, to be removed with ours. */
+  string add(const string &name) {
+    names.insert(name);
+    return path + '/' + name;
+  }
+
+  /* Write the file of the given name and return its path. */
+  string write(const string &name, const string &text) {
+    string file_path = path + '/' + name;
+    ofstream(file_path) << text;
+    names.insert(name);
+    return file_path;
+  }
+
+  private:
+
+  /* See accessor. */
+  string path;
+
+  /* The files we wrote. */
+  set<string> names;
+
+};  // temp_dir_t
+
+/* A match reported by live_t, written out. */
+string describe_delta(
+    const string &path, const pack_t::rule_t &rule, const match_t &match) {
+  return
+      path + '>' + match.get_sub_file_path() + ':'
+      + to_string(match.get_line_number()) + ": " + rule.get_text() + ": "
+      + match.get_cause_desc();
+}
+
+/* Watching must report a match as appearing when its rule starts matching
+   and as going away when it stops, and never report one for a rule which
+   doesn't match, even when the rule's result holds matches, as a not's
+   does.  We apply the deltas to the set of matches reported so far and
+   check it against the rules evaluated afresh after every change. */
+void check_watching(const char *filter) {
+  check(filter, "watch/negated-and-flipping-rules", []() {
+    pack_t pack(
+        "not 'foo'\n"
+        "'foo' and not 'bar'\n"
+        "not ('foo' or 'baz')\n"
+        "'foo' or 'bar'\n");
+    const vector<vector<string>> steps {
+      { "<p>foo</p>\n", "<p>bar</p>\n" },
+      { "<p>foo</p>\n<p>bar</p>\n", "<p>bar</p>\n" },
+      { "<p>foo</p>\n", "<p>baz</p>\n" },
+      { "<p>qux</p>\n", "<p>foo</p>\n" },
+      { "<p>foo</p>\n", "<p>qux</p>\n" },
+    };
+    const vector<string> names { "a.html", "b.html" };
+    temp_dir_t dir;
+    live_t live(pack, dir.get_path(), 1);
+    set<string> reported;
+    auto on_delta = [&](
+        bool added, const string &path, const pack_t::rule_t &rule,
+        const match_t &match) {
+      auto delta = describe_delta(path, rule, match);
+      if (added) {
+        expect(reported.insert(delta).second, "added twice: " + delta);
+      } else {
+        expect(reported.erase(delta) == 1, "removed unseen: " + delta);
+      }
+    };
+    for (size_t step = 0; step < steps.size(); ++step) {
+      vector<string> paths;
+      for (size_t i = 0; i < names.size(); ++i) {
+        paths.push_back(dir.write(names[i], steps[step][i]));
+      }
+      if (step == 0) {
+        live.rescan(on_delta);
+      } else {
+        live.update(paths, on_delta);
+      }
+      set<string> expected;
+      for (size_t i = 0; i < names.size(); ++i) {
+        file_t file{string(steps[step][i])};
+        for (const auto &rule: pack.get_rules()) {
+          auto result = eval(rule.get_expr(), file);
+          if (result.is_match()) {
+            result.for_each_match([&](const match_t &match) {
+              expected.insert(describe_delta(paths[i], rule, match));
+            });
+          }
+        }
+      }
+      expect(
+          reported == expected,
+          "reported matches differ after step " + to_string(step));
+    }
+  });
+}
+
+/* Loops run on a pool take turns, so a short loop run while a long one is
+   going is done after an index or two of the long one, not all of it. */
+void check_pool(const char *filter) {
+  check(filter, "pool/loops-take-turns", []() {
+    pool_t pool(1);
+    atomic<bool> is_started(false);
+    atomic<size_t> long_done_count(0);
+    size_t long_done_when_short_was = 0;
+    thread short_runner([&]() {
+      while (!is_started) {
+        this_thread::yield();
+      }
+      pool.run(1, [](size_t) {});
+      long_done_when_short_was = long_done_count;
+    });
+    pool.run(200, [&](size_t) {
+      is_started = true;
+      this_thread::sleep_for(chrono::milliseconds(1));
+      ++long_done_count;
+    });
+    short_runner.join();
+    expect(
+        long_done_when_short_was < 100,
+        "the short loop waited for " + to_string(long_done_when_short_was)
+        + " calls of the long one");
+  });
+}
+
+/* Read back the JSON string which is the value of the given key in the
+   given line of JSON, undoing its escapes, or throw if there isn't one. */
+string read_json_string(const string &line, const string &key) {
+  auto pos = line.find('"' + key + "\":\"");
+  expect(pos != string::npos, "no " + key + " in " + line);
+  string text;
+  for (pos += key.size() + 4; pos < line.size(); ++pos) {
+    auto c = line[pos];
+    if (c == '"') {
+      return text;
+    }
+    expect(static_cast<unsigned char>(c) >= 0x20, "raw control in " + key);
+    if (c != '\\') {
+      text += c;
+      continue;
+    }
+    expect(++pos < line.size(), "escape at the end of " + key);
+    switch (line[pos]) {
+      case 'n': text += '\n'; break;
+      case 'r': text += '\r'; break;
+      case 't': text += '\t'; break;
+      case 'u': {
+        expect(
+            line.compare(pos + 1, 2, "00") == 0, "wide \\u in " + key);
+        text += static_cast<char>(stoi(line.substr(pos + 3, 2), nullptr, 16));
+        pos += 4;
+        break;
+      }
+      default: text += line[pos];
+    }
+  }
+  throw runtime_error("unterminated " + key);
+}
+
+/* Sinks must write each match so it can be read back as it was: JSON
+   lines escaping what JSON says to and passing other bytes through, and
+   binary records decoding, through shard_record_t, to the very fields
+   written.  A writer must also write out a file's matches as it goes once
+   they outgrow its cap, rather than hold them all until the file ends. */
+void check_sinks(const char *filter) {
+  /* Lines holding each sort of byte a sink must take care with, and a
+     rule matching each of them, whose own text needs escaping too. */
+  const string page =
+      "<p>quote \"in quotes\" and back\\slash</p>\n"
+      "<p>quote\ttab \x01\x1f controls \x7f\xc3\xa9\xff high</p>\n"
+      "<p>quote\rcr</p>\n";
+  const string rules = "'quote'\n'back\\\\slash' or \"\\\"absent\"\n";
+  /* Every match of every rule on the page, at a path long enough to need
+     a varint of more than a byte for its size. */
+  auto for_each_match = [&](
+      const pack_t &pack,
+      const function<void (
+          const string &, size_t, const pack_t::rule_t &,
+          const match_t &)> &fn) {
+    file_t file{string(page)};
+    auto path = "/" + string(200, 'd') + "/page.html";
+    for (size_t i = 0; i < pack.get_rules().size(); ++i) {
+      const auto &rule = pack.get_rules()[i];
+      auto result = eval(rule.get_expr(), file);
+      expect(result.is_match(), "rule " + to_string(i) + " didn't match");
+      result.for_each_match([&](const match_t &match) {
+        fn(path, i, rule, match);
+      });
+    }
+  };
+  check(filter, "sink/json-escaping", [&]() {
+    pack_t pack(rules);
+    ostringstream strm;
+    json_lines_sink_t sink(strm);
+    sink_t::writer_t writer(sink);
+    vector<string> expected;
+    for_each_match(pack, [&](
+        const string &path, size_t rule_index, const pack_t::rule_t &rule,
+        const match_t &match) {
+      writer.put(path, rule_index, rule, match);
+      expected.push_back(
+          path + '|' + rule.get_text() + '|' + match.get_cause_desc() + '|'
+          + match.get_line_text());
+    });
+    writer.end_file();
+    writer.flush();
+    istringstream lines(strm.str());
+    vector<string> actual;
+    for (string line; getline(lines, line); ) {
+      actual.push_back(
+          read_json_string(line, "path") + '|'
+          + read_json_string(line, "rule") + '|'
+          + read_json_string(line, "cause") + '|'
+          + read_json_string(line, "text"));
+    }
+    expect(actual.size() == 4, to_string(actual.size()) + " lines written");
+    expect(actual == expected, "matches read back differ");
+  });
+  check(filter, "sink/binary-round-trip", [&]() {
+    pack_t pack(rules);
+    ostringstream strm;
+    binary_sink_t sink(strm);
+    sink_t::writer_t writer(sink);
+    vector<string> expected;
+    for_each_match(pack, [&](
+        const string &path, size_t rule_index, const pack_t::rule_t &rule,
+        const match_t &match) {
+      writer.put(path, rule_index, rule, match);
+      expected.push_back(
+          path + '|' + to_string(rule_index) + '|'
+          + match.get_sub_file_path() + '|'
+          + to_string(match.get_line_number()) + '|'
+          + to_string(match.get_cause_id()) + '|' + match.get_cause_desc()
+          + '|' + match.get_line_text());
+    });
+    writer.flush();
+    auto bytes = strm.str();
+    auto cursor = bytes.data(), end = cursor + bytes.size();
+    vector<string> actual;
+    for (shard_record_t record; cursor < end; ) {
+      expect(
+          record.decode(cursor, end),
+          "undecodable record at " + to_string(cursor - bytes.data()));
+      actual.push_back(
+          record.path + '|' + to_string(record.rule_index) + '|'
+          + record.sub_file_path + '|' + to_string(record.line_number) + '|'
+          + to_string(record.cause_id) + '|' + record.cause_desc + '|'
+          + record.line_text);
+    }
+    expect(actual == expected, "records read back differ");
+    auto last = bytes.data() + bytes.size() - 1;
+    shard_record_t record;
+    expect(
+        !record.decode(last, end) && last == end - 1,
+        "decoded a truncated record");
+  });
+  check(filter, "sink/bounded-buffer", [&]() {
+    pack_t pack(rules);
+    ostringstream strm;
+    binary_sink_t sink(strm);
+    sink_t::writer_t writer(sink);
+    size_t put_size = 0;
+    while (put_size < 3 * sink_t::get_max_buffer_size()) {
+      for_each_match(pack, [&](
+          const string &path, size_t rule_index,
+          const pack_t::rule_t &rule, const match_t &match) {
+        writer.put(path, rule_index, rule, match);
+        shard_record_t record;
+        record.path = path;
+        record.rule_index = rule_index;
+        record.sub_file_path = match.get_sub_file_path();
+        record.line_number = match.get_line_number();
+        record.cause_id = match.get_cause_id();
+        record.cause_desc = match.get_cause_desc();
+        record.line_text = match.get_line_text();
+        string bytes;
+        record.encode(bytes);
+        put_size += bytes.size();
+        auto held = put_size - static_cast<size_t>(strm.tellp());
+        expect(
+            held < sink_t::get_max_buffer_size(),
+            "holding " + to_string(held) + " bytes of one file");
+      });
+    }
+    writer.end_file();
+    writer.flush();
+    expect(
+        static_cast<size_t>(strm.tellp()) == put_size,
+        "wrote " + to_string(strm.tellp()) + " bytes of "
+        + to_string(put_size));
+  });
+}
+
+/* The given text, compressed as a gzip member. */
+string gzip(const string &text) {
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit2(
+          &strm, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8,
+          Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw runtime_error("could not initialize zlib");
+  }
+  string out(deflateBound(&strm, text.size()), '\0');
+  strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+  strm.avail_in = static_cast<uInt>(text.size());
+  strm.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  strm.avail_out = static_cast<uInt>(out.size());
+  auto result = deflate(&strm, Z_FINISH);
+  out.resize(out.size() - strm.avail_out);
+  deflateEnd(&strm);
+  expect(result == Z_STREAM_END, "could not gzip");
+  return out;
+}
+
+/* True iff. decompressing the given input throws. */
+bool does_throw(decompressor_t &decompressor, const string &in) {
+  string out;
+  try {
+    decompressor.decompress(in, out);
+  } catch (const runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+/* Decompression must take several gzip members one after another, as
+   gzip does, must throw on input cut short, even between members, and
+   must throw rather than decompress past its cap, even into a buffer
+   which already has room. */
+void check_decompressing(const char *filter) {
+  synth_t synth(36);
+  string first, second;
+  for (const auto &page: make_pages(synth, 80)) {
+    (first.size() < 100000 ? first : second) += page;
+  }
+  check(filter, "decompress/gzip-members", [&]() {
+    decompressor_t decompressor;
+    string out = "left alone";
+    expect(
+        !decompressor.decompress(first, out) && out == "left alone",
+        "decompressed plain text");
+    expect(
+        decompressor.decompress(gzip(first) + gzip(second), out)
+            && out == first + second,
+        "two members didn't give their texts, in order");
+    expect(
+        decompressor.decompress(gzip(second), out) && out == second,
+        "reusing the decompressor and buffer changed the output");
+    expect(
+        decompressor.decompress(gzip(""), out) && out.empty(),
+        "an empty member didn't give empty text");
+  });
+  check(filter, "decompress/truncated-gzip", [&]() {
+    decompressor_t decompressor;
+    auto whole = gzip(first);
+    for (size_t size = 2; size < whole.size(); size += 97) {
+      expect(
+          does_throw(decompressor, whole.substr(0, size)),
+          "took " + to_string(size) + " bytes of " + to_string(whole.size()));
+    }
+    expect(
+        does_throw(decompressor, whole.substr(0, whole.size() - 1)),
+        "took all but the last byte");
+    expect(
+        does_throw(decompressor, whole + gzip(second).substr(0, 20)),
+        "took a truncated second member");
+    auto corrupt = whole;
+    corrupt[corrupt.size() / 2] ^= 0x55;
+    expect(does_throw(decompressor, corrupt), "took corrupt data");
+    string out;
+    expect(
+        decompressor.decompress(whole, out) && out == first,
+        "failures spoiled the decompressor");
+  });
+  check(filter, "decompress/size-cap", [&]() {
+    auto max_size = first.size() + 1000;
+    decompressor_t decompressor(max_size);
+    string out;
+    expect(
+        decompressor.decompress(gzip(first), out) && out == first,
+        "text under the cap didn't decompress");
+    expect(
+        does_throw(decompressor, gzip(first + second)),
+        "decompressed past the cap");
+    string roomy;
+    roomy.reserve(4 * max_size);
+    bool threw = false;
+    try {
+      decompressor.decompress(gzip(first + second), roomy);
+    } catch (const runtime_error &) {
+      threw = true;
+    }
+    expect(threw, "decompressed past the cap into a roomy buffer");
+    expect(
+        does_throw(decompressor, gzip(first) + gzip(second)),
+        "decompressed past the cap over two members");
+    expect(
+        does_throw(decompressor, gzip(string(1 << 26, 'a'))),
+        "decompressed a bomb");
+  });
+}
+
+/* A sharded sweep must write the same bytes however many workers share
+   it and however small their sorted runs are, so that spilling runs to
+   files and merging them changes nothing but memory use. */
+void check_sharding(const char *filter) {
+  check(filter, "shard/stable-order", []() {
+    synth_t synth(47);
+    pack_t pack(make_rules(synth, 20, 3));
+    auto pages = make_pages(synth, 60);
+    temp_dir_t dir;
+    vector<string> paths;
+    for (size_t i = 0; i < pages.size(); ++i) {
+      paths.push_back(dir.write(to_string(i) + ".html", pages[i]));
+    }
+    auto sweep = [&](size_t shard_count, size_t run_size) {
+      ostringstream strm;
+      binary_sink_t sink(strm);
+      sharded_sweep_t(pack, shard_count, 2, run_size).run(paths, sink);
+      return strm.str();
+    };
+    auto expected = sweep(1, sharded_sweep_t::get_default_run_size());
+    expect(!expected.empty(), "nothing matched");
+    for (auto shard_count: { 1, 3 }) {
+      for (auto run_size: { 1, 300, 5000 }) {
+        expect(
+            sweep(shard_count, run_size) == expected,
+            "output differs with " + to_string(shard_count)
+            + " shards and runs of " + to_string(run_size));
+      }
+    }
+  });
+}
+
+/* What a sweep of the given paths reported, match by match, one line per
+   match, sorted.  Its report goes in the given one. */
+vector<string> describe_sweep(
+    const sweep_t &sweep, const vector<string> &paths,
+    sweep_t::report_t &report) {
+  mutex mutex_;
+  vector<string> lines;
+  report = sweep.run(paths, [&](
+      const string &path, const pack_t::rule_t &rule,
+      const result_t &result) {
+    auto line = path + " | " + rule.get_text() + " | " + describe(result);
+    lock_guard<mutex> lock(mutex_);
+    lines.push_back(move(line));
+  });
+  sort(lines.begin(), lines.end());
+  return lines;
+}
+
+/* The matches the interpreter finds in the given pages, at the given
+   paths, as describe_sweep() writes them. */
+vector<string> describe_pages(
+    const pack_t &pack, const vector<string> &paths,
+    const vector<string> &pages) {
+  vector<string> lines;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    file_t file{string(pages[i])};
+    for (const auto &rule: pack.get_rules()) {
+      auto result = eval(rule.get_expr(), file);
+      if (result.is_match()) {
+        lines.push_back(
+            paths[i] + " | " + rule.get_text() + " | " + describe(result));
+      }
+    }
+  }
+  sort(lines.begin(), lines.end());
+  return lines;
+}
+
+/* A sweep evaluates files with the same contents once, but must report
+   each of them as the interpreter would, whether their twin was compressed
+   or not, whether it was done or still being evaluated, and whether or not
+   there was room to keep it.  Contents which only share a hash and size
+   with others must never reuse their results.  Reading with io_uring must
+   report just what reading with preads does, through buffers recycled
+   between files of very different sizes. */
+void check_sweeping(const char *filter) {
+  synth_t synth(37);
+  pack_t pack(make_rules(synth, 30, 3));
+  auto distinct_pages = make_pages(synth, 12);
+  temp_dir_t dir;
+  vector<string> paths, pages;
+  for (size_t copy = 0; copy < 6; ++copy) {
+    for (size_t i = 0; i < distinct_pages.size(); ++i) {
+      const auto &page = distinct_pages[i];
+      auto name = to_string(copy) + '-' + to_string(i) + ".html";
+      paths.push_back(
+          copy % 3 == 2
+              ? dir.write(name + ".gz", gzip(page)) : dir.write(name, page));
+      pages.push_back(page);
+    }
+  }
+  auto expected = describe_pages(pack, paths, pages);
+  expect(expected.size() > distinct_pages.size(), "too little matched");
+  /* Sweep with the given budgets, expecting the given number of
+     duplicates, or any if it's the greatest size_t. */
+  auto sweep_with = [&](
+      size_t byte_count, size_t match_count, size_t duplicate_count) {
+    sweep_t sweep(pack, 3, 4);
+    sweep.set_max_kept(byte_count, match_count);
+    sweep_t::report_t report;
+    auto what = "keeping " + to_string(byte_count) + " bytes and "
+        + to_string(match_count) + " matches ";
+    expect(
+        describe_sweep(sweep, paths, report) == expected,
+        what + "reported other matches");
+    size_t byte_total = 0;
+    for (const auto &page: pages) {
+      byte_total += page.size();
+    }
+    expect(
+        report.file_count == paths.size() && report.error_count == 0
+            && report.byte_count == byte_total
+            && report.match_count == expected.size(),
+        what + "miscounted");
+    expect(
+        duplicate_count == static_cast<size_t>(-1)
+            || report.duplicate_count == duplicate_count,
+        what + "counted " + to_string(report.duplicate_count)
+        + " duplicates, not " + to_string(duplicate_count));
+  };
+  check(filter, "sweep/dedup-fan-out", [&]() {
+    sweep_with(
+        sweep_t::contents_t::get_default_max_kept_byte_count(),
+        sweep_t::contents_t::get_default_max_kept_match_count(),
+        paths.size() - distinct_pages.size());
+  });
+  check(filter, "sweep/dedup-over-budget", [&]() {
+    sweep_with(0, 1 << 20, 0);
+    sweep_with(3 * distinct_pages[0].size(), 1 << 20, -1);
+    sweep_with(1 << 27, 0, -1);
+    sweep_with(1 << 27, 5, -1);
+  });
+  check(filter, "sweep/dedup-collisions", []() {
+    using contents_t = sweep_t::contents_t;
+    contents_t contents(10, 10);
+    contents_t::key_t key(42, 3);
+    string first = "abc", second = "abd", a = "a", b = "b";
+    shared_ptr<const sweep_t::matches_t> matches;
+    expect(
+        contents.claim(key, first, &a, matches) == contents_t::first,
+        "new contents weren't first");
+    expect(
+        contents.claim(key, second, &b, matches) == contents_t::alone,
+        "colliding contents weren't alone");
+    expect(
+        contents.claim(key, first, &b, matches) == contents_t::waiting,
+        "the same contents didn't wait");
+    expect(contents.reserve(10), "no room for matches under the budget");
+    auto kept = make_shared<sweep_t::matches_t>();
+    auto waiting = contents.finish(key, kept);
+    expect(
+        waiting.size() == 1 && waiting[0] == &b,
+        "the waiting path wasn't handed back");
+    expect(
+        contents.claim(key, second, &b, matches) == contents_t::alone
+            && !matches,
+        "colliding contents reused results");
+    expect(
+        contents.claim(key, first, &b, matches) == contents_t::reused
+            && matches == kept,
+        "the same contents didn't reuse results");
+    expect(!contents.reserve(1), "room for matches over the budget");
+    expect(
+        contents.claim(contents_t::key_t(43, 8), "too long", &a, matches)
+            == contents_t::alone,
+        "kept bytes over the budget");
+  });
+  check(filter, "sweep/uring-same-as-pread", [&]() {
+    temp_dir_t dir;
+    vector<string> paths, pages;
+    auto add = [&](const string &name, const string &page, bool is_gzip) {
+      paths.push_back(dir.write(name, is_gzip ? gzip(page) : page));
+      pages.push_back(page);
+    };
+    string big;
+    while (big.size() < (3 << 20)) {
+      big += distinct_pages[big.size() % distinct_pages.size()];
+    }
+    add("empty.html", "", false);
+    for (size_t i = 0; i < 30; ++i) {
+      const auto &page = distinct_pages[i % distinct_pages.size()];
+      add(to_string(i) + ".html", page, i % 7 == 3);
+      if (i == 10 || i == 20) {
+        add("big" + to_string(i) + ".html", big, i == 20);
+      }
+    }
+    auto expected = describe_pages(pack, paths, pages);
+    paths.push_back(dir.add("missing.html"));
+    for (size_t read_depth: { 1, 3 }) {
+      sweep_t::report_t reports[2];
+      vector<string> lines[2];
+      for (bool use_uring: { false, true }) {
+        sweep_t sweep(pack, 2, read_depth, use_uring);
+        lines[use_uring] = describe_sweep(sweep, paths, reports[use_uring]);
+        expect(
+            lines[use_uring] == expected,
+            string(reports[use_uring].read_backend)
+            + " reported other matches with a depth of "
+            + to_string(read_depth));
+      }
+      const auto &pread = reports[0], &uring = reports[1];
+      expect(
+          string(pread.read_backend) == "pread",
+          string("read with ") + pread.read_backend + " when told not to");
+      expect(
+          uring.file_count == pread.file_count
+              && uring.duplicate_count == pread.duplicate_count
+              && uring.error_count == 1 && pread.error_count == 1
+              && uring.byte_count == pread.byte_count
+              && uring.match_count == pread.match_count,
+          string(uring.read_backend) + " and pread counted differently");
+    }
+  });
+}
+
+/* Generate the native evaluators of the given pack into the given
+   directory and build them, with the given extra flags, as qmellowgen's
+   source says to, and return the shared object's path. */
+string build_native(
+    temp_dir_t &dir, const pack_t &pack, const string &name,
+    const string &flags = "") {
+  ostringstream strm;
+  codegen_t::generate(strm, pack);
+  auto source = dir.write(name + ".cc", strm.str());
+  auto object = dir.add(name + ".so");
+  string include_dir = __FILE__;
+  auto slash = include_dir.rfind('/');
+  include_dir = (slash == string::npos) ? "." : include_dir.substr(0, slash);
+  auto command =
+      "g++ -std=c++11 -O2 -fPIC -shared " + flags + " -I" + include_dir
+      + " -o " + object + ' ' + source;
+  if (system(command.c_str()) != 0) {
+    throw runtime_error("could not build " + source);
+  }
+  return object;
+}
+
+/* Native evaluators must give what the interpreter gives, match for match,
+   with and without limits, and mustn't load into a program built with
+   other features than theirs, whose inline code would disagree with
+   theirs. */
+void check_native(const char *filter) {
+  check(filter, "native/same-as-interpreter", []() {
+    synth_t synth(48);
+    pack_t pack(make_rules(synth, 12, 3));
+    temp_dir_t dir;
+    native_pack_t native(pack, build_native(dir, pack, "rules"));
+    for (const auto &page: make_pages(synth, 40)) {
+      file_t file{string(page)};
+      native.check(file);
+      native.check(file, 1);
+      native.check(file, 3);
+    }
+  });
+  check(filter, "native/other-features-rejected", []() {
+    pack_t pack("'word1' and .c2\n");
+    temp_dir_t dir;
+    auto path = build_native(
+        dir, pack, "rules", "-DQMELLOW_METRICS -DQMELLOW_TRACE");
+    try {
+      native_pack_t native(pack, path);
+    } catch (const runtime_error &ex) {
+      expect(
+          string(ex.what()).find("other headers or flags") != string::npos,
+          string("rejected for the wrong reason: ") + ex.what());
+      return;
+    }
+    throw runtime_error("loaded a module built with other features");
+  });
+}
+
+/* Throw unless the query gives what the interpreter gives for the given
+   text on every page, with no limit and with a small one. */
+template <typename root_t>
+void expect_same_as_text(
+    const dsl::query_t<root_t> &query, const string &text,
+    const vector<string> &pages) {
+  pack_t pack(text);
+  const auto *expr = pack.get_rules()[0].get_expr();
+  for (size_t i = 0; i < pages.size(); ++i) {
+    file_t file{string(pages[i])};
+    for (auto limit: { result_t::get_no_limit(), size_t(2) }) {
+      context_t context(nullptr, nullptr, limit);
+      auto actual = describe(query.eval(file, context));
+      auto expected = describe(eval(expr, file, limit));
+      expect(
+          actual == expected,
+          text + " on page " + to_string(i) + " gave " + actual
+          + ", not " + expected);
+    }
+  }
+}
+
+/* A query written with the DSL must give what the interpreter gives for
+   its text, match for match and cause for cause. */
+void check_dsl(const char *filter) {
+  check(filter, "dsl/same-as-interpreter", []() {
+    using namespace qmellow::dsl;
+    synth_t synth(49);
+    auto pages = make_pages(synth, 40);
+    expect_same_as_text(
+        make_query(
+            (text("Word7") || itext("word8")) && !classes({ "c7" })
+            && css("/static/s7.css")),
+        "(\"Word7\" or 'word8') and not .c7 and /static/s7.css", pages);
+    expect_same_as_text(
+        make_query(
+            id("d3") || (js("/static/s2.js") && image("/static/s4.png"))
+            || anchor("/pages/p5.html")),
+        "#d3 or (/static/s2.js and /static/s4.png) or /pages/p5.html",
+        pages);
+    expect_same_as_text(
+        make_query(
+            (dsl::regex("[Ww]ord1[0-2]") || itext("word5"))
+            && !css("/static/s3.css")),
+        "(`[Ww]ord1[0-2]` or 'word5') and not /static/s3.css", pages);
+    expect_same_as_text(
+        make_query(classes({ "c1", "c2" }) || (itext("word3") && !id("d9"))),
+        ".c1.c2 or ('word3' and not #d9)", pages);
+  });
+}
+
+/* The matches of a result, each written out as describe() writes it. */
+vector<string> describe_matches(const result_t &result) {
+  vector<string> matches;
+  result.for_each_match([&](const match_t &match) {
+    matches.push_back(
+        match.get_sub_file_path() + ':' + to_string(match.get_line_number())
+        + ": " + match.get_cause_desc());
+  });
+  return matches;
+}
+
+/* A limit must never change whether a rule matches, and a rule which does
+   must keep the first of the matches it would have without the limit, in
+   order, as many as the limit allows. */
+void check_limits(const char *filter) {
+  check(filter, "limit/first-matches-kept", []() {
+    synth_t synth(45);
+    auto rules = make_rules(synth, 40, 3);
+    rules +=
+        "'word1' inside .c2\n"
+        "`[Ww]ord1[0-4]` or /static/s3.css\n"
+        "not ('word2' and .c3)\n";
+    pack_t pack(rules);
+    for (const auto &page: make_pages(synth, 20)) {
+      file_t file{string(page)};
+      for (const auto &rule: pack.get_rules()) {
+        auto full = eval(rule.get_expr(), file);
+        auto all_matches = describe_matches(full);
+        for (size_t limit: { 1, 2, 5 }) {
+          auto limited = eval(rule.get_expr(), file, limit);
+          expect(
+              limited.is_match() == full.is_match(),
+              rule.get_text() + " changed success with a limit of "
+              + to_string(limit));
+          if (!full.is_match()) {
+            continue;
+          }
+          vector<string> first(
+              all_matches.begin(),
+              all_matches.begin() + min(limit, all_matches.size()));
+          expect(
+              describe_matches(limited) == first,
+              rule.get_text() + " kept other matches with a limit of "
+              + to_string(limit));
+        }
+      }
+    }
+  });
+}
+
+/* Case-insensitive strings must match with Unicode's simple case folding,
+   one character to one, and report the lines and elements of their
+   matches in the text as it was, even after characters which fold to ones
+   of another size in UTF-8.  Strings may hold any printable ASCII and the
+   escapes \n, \r and \t. */
+void check_folding(const char *filter) {
+  check(filter, "fold/unicode-simple-folding", []() {
+    string kelvins;
+    for (int i = 0; i < 20; ++i) {
+      kelvins += "\u212a";
+    }
+    file_t file{
+        "<div class=\"x\">" + kelvins + "</div>\n"
+        "<div class=\"y\"><p>word</p></div>\n"
+        "<p>\u1e9e and ss</p>\n"
+        "<p>\u03a3\u0391\u03a3 \u03c2</p>\n"
+        "<p>\u011e\u00dcNE\u015e I \u0131 \u0130</p>\n"
+        "<p>A{B} a|b a~b tab\there</p>\n"
+        "<p>cr\rhere</p>\n"};
+    const vector<pair<string, string>> cases {
+      { "'WORD'", "2" },
+      { "'word' inside .y", "2" },
+      { "'word' inside .x", "no match" },
+      { "'kkk'", "1" },
+      { "'\u00df'", "3" },
+      { "'and ss'", "3" },
+      { "'\u00dfs'", "no match" },
+      { "'\u03c3\u03b1\u03c2'", "4" },
+      { "'\u03c3 \u03c3'", "4" },
+      { "\"\u03c3\"", "no match" },
+      { "'\u011f\u00fcne\u015f'", "5" },
+      { "'\u015f i'", "5" },
+      { "'i \u0131 i'", "no match" },
+      { "'a{b}'", "6" },
+      { "'A|B'", "6" },
+      { "'a~b'", "6" },
+      { "'tab\\there'", "6" },
+      { "\"cr\\rhere\"", "7" },
+      { "'cr\\there'", "no match" },
+    };
+    for (const auto &item: cases) {
+      pack_t pack(item.first);
+      auto lines = describe_lines(eval(pack.get_rules()[0].get_expr(), file));
+      expect(
+          lines == item.second,
+          item.first + " matched " + lines + ", not " + item.second);
+    }
+  });
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const char *filter = (argc > 1) ? argv[1] : nullptr;
+  check_planning(filter);
+  check_memo(filter);
+  check_batching(filter);
+  check_explaining(filter);
+  check_containment(filter);
+  check_sketching(filter);
+  check_regex(filter);
+  check_symbols(filter);
+  check_watching(filter);
+  check_pool(filter);
+  check_sinks(filter);
+  check_decompressing(filter);
+  check_sharding(filter);
+  check_sweeping(filter);
+  check_native(filter);
+  check_dsl(filter);
+  check_limits(filter);
+  check_folding(filter);
+  if (failure_count) {
+    cout << failure_count << " checks failed" << endl;
+    return 1;
+  }
+  return 0;
+}
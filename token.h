@@ -13,12 +13,15 @@ namespace qmellow {
 class token_t final {
   public:
 
-  /* Tokens come in various kinds. */
+  /* Tokens come in various kinds.  The lexer never makes inside_kwd or
+     directly_kwd, leaving those words as names for the parser to take as
+     keywords where it expects them; the kinds are here to describe what it
+     expected. */
   enum kind_t {
     end, hash, dot, slash, name,
     open_paren, close_paren,
-    single_string, double_string,
-    and_kwd, or_kwd, not_kwd
+    single_string, double_string, regex,
+    and_kwd, or_kwd, not_kwd, inside_kwd, directly_kwd
   };
 
   /* Cache the position and kind and set the text to the empty string. */
@@ -58,9 +61,12 @@ class token_t final {
       case close_paren: desc = "')'"; break;
       case single_string: desc = "a single-quoted string"; break;
       case double_string: desc = "a double-quoted string"; break;
+      case regex: desc = "a regular expression"; break;
       case and_kwd: desc = "'and'"; break;
       case or_kwd: desc = "'or'"; break;
       case not_kwd: desc = "'not'"; break;
+      case inside_kwd: desc = "'inside'"; break;
+      case directly_kwd: desc = "'directly'"; break;
     }
     return desc;
   }
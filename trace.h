@@ -0,0 +1,272 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+namespace qmellow {
+
+/* Records timed spans, per thread, for export as a Chrome trace, which
+   chrome://tracing and Perfetto can open as a timeline.  Each thread writes
+   into a ring buffer of its own, with no locks; the exporter drains the
+   rings.  A thread whose ring is full drops spans rather than wait, and the
+   drops are counted.  Rings are allocated whole, on each thread's first
+   span, so recording never allocates after that and never throws; a
+   thread which can't get a ring drops its spans too.
+
+   The engine records through the QMELLOW_TRACE_* macros, below.  Unless
+   QMELLOW_TRACE is defined, those macros expand to nothing.  Even then,
+   nothing is recorded until the tracer is enabled. */
+class tracer_t final {
+  public:
+
+  /* The clock we time with. */
+  using clock_t = std::chrono::steady_clock;
+
+  /* The one and only tracer. */
+  static tracer_t &get() {
+    static tracer_t tracer;
+    return tracer;
+  }
+
+  /* Start or stop recording. */
+  void set_enabled(bool enabled) noexcept {
+    this->enabled.store(enabled, std::memory_order_relaxed);
+  }
+
+  /* True iff. we're recording. */
+  bool is_enabled() const noexcept {
+    return enabled.load(std::memory_order_relaxed);
+  }
+
+  /* Record a span on the calling thread.  The name must outlive the
+     tracer.  If arg isn't negative, it's exported as the span's argument. */
+  void record(
+      const char *name, clock_t::time_point start, clock_t::time_point end,
+      std::int64_t arg = -1) noexcept {
+    auto *ring = get_ring();
+    if (!ring) {
+      ringless_drop_count.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    ring->push(event_t {
+        name, get_ns(start), get_ns(end) - get_ns(start), arg });
+  }
+
+  /* Drain every thread's ring and write the spans as a Chrome trace.  This
+     may be called while threads are still recording; spans recorded after
+     we've drained a ring will wait for the next call. */
+  void write_chrome_trace(std::ostream &strm) {
+    strm << "{\"traceEvents\":[\n";
+    const char *sep = "";
+    std::uint64_t dropped =
+        ringless_drop_count.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &ring: rings) {
+      strm
+          << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+          << "\"tid\":" << ring->get_tid() << ",\"args\":{\"name\":\""
+          << "thread " << ring->get_tid() << "\"}}";
+      sep = ",\n";
+      event_t event;
+      while (ring->pop(event)) {
+        strm
+            << sep << "{\"name\":\"" << event.name
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->get_tid()
+            << ",\"ts\":" << event.start_ns / 1000.0
+            << ",\"dur\":" << event.dur_ns / 1000.0;
+        if (event.arg >= 0) {
+          strm << ",\"args\":{\"arg\":" << event.arg << '}';
+        }
+        strm << '}';
+      }
+      dropped += ring->get_drop_count();
+    }
+    strm
+        << "\n],\"otherData\":{\"dropped_spans\":" << dropped << "}}\n";
+  }
+
+  /* Times its own lifetime as a span. */
+  class span_t final {
+    public:
+
+    /* Start timing, if the tracer is enabled. */
+    explicit span_t(const char *name, std::int64_t arg = -1) noexcept
+        : name(tracer_t::get().is_enabled() ? name : nullptr), arg(arg) {
+      if (this->name) {
+        start = clock_t::now();
+      }
+    }
+
+    /* Stop timing and record. */
+    ~span_t() {
+      if (name) {
+        tracer_t::get().record(name, start, clock_t::now(), arg);
+      }
+    }
+
+    private:
+
+    /* See constructor.  Null if we're not recording. */
+    const char *name;
+
+    /* See constructor. */
+    std::int64_t arg;
+
+    /* When we started. */
+    clock_t::time_point start;
+
+  };  // tracer_t::span_t
+
+  private:
+
+  /* A single recorded span. */
+  struct event_t {
+
+    /* See record(). */
+    const char *name;
+
+    /* When the span started, relative to our epoch, and how long it
+       lasted. */
+    std::uint64_t start_ns, dur_ns;
+
+    /* See record(). */
+    std::int64_t arg;
+
+  };  // tracer_t::event_t
+
+  /* A single-producer, single-consumer ring of events.  The producer is
+     the thread which owns the ring; the consumer is the exporter. */
+  class ring_t final {
+    public:
+
+    /* Start empty. */
+    explicit ring_t(std::size_t tid)
+        : tid(tid), head(0), tail(0), drop_count(0),
+          events(get_capacity()) {}
+
+    /* Add an event, or drop it if we're full.  Producer only. */
+    void push(const event_t &event) noexcept {
+      auto h = head.load(std::memory_order_relaxed);
+      if (h - tail.load(std::memory_order_acquire) >= get_capacity()) {
+        drop_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      events[h % get_capacity()] = event;
+      head.store(h + 1, std::memory_order_release);
+    }
+
+    /* Remove the oldest event, returning false if we're empty.  Consumer
+       only. */
+    bool pop(event_t &event) noexcept {
+      auto t = tail.load(std::memory_order_relaxed);
+      if (t == head.load(std::memory_order_acquire)) {
+        return false;
+      }
+      event = events[t % get_capacity()];
+      tail.store(t + 1, std::memory_order_release);
+      return true;
+    }
+
+    /* The number of events we've dropped. */
+    std::uint64_t get_drop_count() const noexcept {
+      return drop_count.load(std::memory_order_relaxed);
+    }
+
+    /* The id of the thread which owns us, in order of arrival. */
+    std::size_t get_tid() const noexcept {
+      return tid;
+    }
+
+    private:
+
+    /* The number of events a ring holds. */
+    static std::size_t get_capacity() noexcept {
+      return 1 << 16;
+    }
+
+    /* See accessor. */
+    std::size_t tid;
+
+    /* The total numbers of events ever pushed and popped. */
+    std::atomic<std::uint64_t> head, tail;
+
+    /* See accessor. */
+    std::atomic<std::uint64_t> drop_count;
+
+    /* The events themselves. */
+    std::vector<event_t> events;
+
+  };  // tracer_t::ring_t
+
+  /* Start disabled, with our epoch at now. */
+  tracer_t()
+      : enabled(false), epoch(clock_t::now()), ringless_drop_count(0) {}
+
+  /* The time since our epoch, in nanoseconds. */
+  std::uint64_t get_ns(clock_t::time_point time) const noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        time - epoch).count();
+  }
+
+  /* The ring of the calling thread, made and registered on the thread's
+     first call, or null if we couldn't make it, in which case the next
+     call tries again.  Rings outlive their threads, so their spans can be
+     exported after the threads have finished. */
+  ring_t *get_ring() noexcept {
+    static thread_local ring_t *ring = nullptr;
+    if (!ring) {
+      try {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_ptr<ring_t> new_ring(new ring_t(rings.size()));
+        rings.push_back(std::move(new_ring));
+        ring = rings.back().get();
+      } catch (...) {
+        return nullptr;
+      }
+    }
+    return ring;
+  }
+
+  /* See accessor. */
+  std::atomic<bool> enabled;
+
+  /* The time from which we measure. */
+  clock_t::time_point epoch;
+
+  /* Covers rings. */
+  std::mutex mutex;
+
+  /* The rings of every thread which has ever recorded. */
+  std::vector<std::unique_ptr<ring_t>> rings;
+
+  /* The number of spans dropped because their threads had no rings. */
+  std::atomic<std::uint64_t> ringless_drop_count;
+
+};  // tracer_t
+
+}  // qmellow
+
+#ifdef QMELLOW_TRACE
+
+/* Record the rest of the enclosing scope as a span with the given name. */
+#define QMELLOW_TRACE_SPAN(name) \
+    ::qmellow::tracer_t::span_t qmellow_trace_span(name)
+
+/* Record the rest of the enclosing scope as a span with the given name and
+   numeric argument. */
+#define QMELLOW_TRACE_SPAN_ARG(name, arg) \
+    ::qmellow::tracer_t::span_t qmellow_trace_span(name, (arg))
+
+#else
+
+#define QMELLOW_TRACE_SPAN(name)
+#define QMELLOW_TRACE_SPAN_ARG(name, arg)
+
+#endif
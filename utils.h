@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <dirent.h>
 #include <fstream>
 #include <stdexcept>
 #include <streambuf>
@@ -7,6 +9,9 @@
 #include <sstream>
 #include <memory>
 #include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include "metrics.h"
 
 namespace qmellow {
 
@@ -30,6 +35,7 @@ inline std::string read_whole_file(const std::string &path) {
     text.assign(
         std::istreambuf_iterator<char>(strm),
         std::istreambuf_iterator<char>());
+    QMELLOW_METRICS_ADD(bytes_read, text.size());
     return std::move(text);
 
   } catch (...) {
@@ -39,4 +45,37 @@ inline std::string read_whole_file(const std::string &path) {
   }
 }
 
+/* Append to paths the path of every regular file beneath the given
+   directory, recursively.  Entries whose names begin with a dot are skipped.
+   The paths are sorted, so the order doesn't depend on the file system. */
+inline void list_files(
+    const std::string &dir, std::vector<std::string> &paths) {
+  DIR *handle = opendir(dir.c_str());
+  if (!handle) {
+    std::ostringstream strm;
+    strm << "could not list \"" << dir << '"';
+    throw std::runtime_error(strm.str());
+  }
+  std::vector<std::string> names;
+  while (dirent *entry = readdir(handle)) {
+    if (entry->d_name[0] != '.') {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(handle);
+  std::sort(names.begin(), names.end());
+  for (const auto &name: names) {
+    std::string path = dir + '/' + name;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+      continue;
+    }
+    if (S_ISDIR(info.st_mode)) {
+      list_files(path, paths);
+    } else if (S_ISREG(info.st_mode)) {
+      paths.push_back(std::move(path));
+    }
+  }
+}
+
 }  // qmellow
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace qmellow {
+
+/* Watches a directory tree for changes, using inotify.  New directories are
+   watched as they appear.  We report the paths of files which were created,
+   written and closed, moved, or deleted; it's up to the caller to stat them
+   to find out which.  When a directory goes away, we report the directory's
+   own path, which stands for everything that was beneath it. */
+class watcher_t final {
+  public:
+
+  /* Start watching the tree beneath the given directory. */
+  explicit watcher_t(const std::string &root)
+      : fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), overflowed(false) {
+    if (fd < 0) {
+      throw_errno("could not start watching", root);
+    }
+    std::vector<std::string> ignored;
+    watch_tree(root, ignored);
+  }
+
+  /* Stop watching. */
+  ~watcher_t() {
+    close(fd);
+  }
+
+  /* Not copyable. */
+  watcher_t(const watcher_t &) = delete;
+  watcher_t &operator=(const watcher_t &) = delete;
+
+  /* The file descriptor which becomes readable when there are changes, for
+     callers who want to poll it alongside others. */
+  int get_fd() const noexcept {
+    return fd;
+  }
+
+  /* Wait up to the given number of milliseconds (-1 meaning forever) for
+     changes, then append to paths the path of each file which changed.  If
+     a directory appeared, the files within it are reported too.  Returns
+     false if nothing changed. */
+  bool wait(int timeout_ms, std::vector<std::string> &paths) {
+    pollfd item = { fd, POLLIN, 0 };
+    int ready = poll(&item, 1, timeout_ms);
+    if (ready < 0 && errno != EINTR) {
+      throw_errno("could not wait for changes", "");
+    }
+    return (ready > 0) ? read_changes(paths) : false;
+  }
+
+  /* Append to paths the path of each file which changed, without waiting.
+     Returns false if nothing changed. */
+  bool read_changes(std::vector<std::string> &paths) {
+    auto old_size = paths.size();
+    alignas(inotify_event) char buf[16384];
+    for (;;) {
+      auto size = read(fd, buf, sizeof(buf));
+      if (size < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN) {
+          break;
+        }
+        throw_errno("could not read changes", "");
+      }
+      for (char *cursor = buf; cursor < buf + size; ) {
+        auto *event = reinterpret_cast<inotify_event *>(cursor);
+        cursor += sizeof(inotify_event) + event->len;
+        on_event(*event, paths);
+      }
+    }
+    return paths.size() > old_size || overflowed;
+  }
+
+  /* True iff. the kernel dropped events since we were last asked.  If so,
+     the caller can't trust the paths we reported and should rescan. */
+  bool check_overflow() noexcept {
+    bool result = overflowed;
+    overflowed = false;
+    return result;
+  }
+
+  private:
+
+  /* Throw an error describing the current errno. */
+  static void throw_errno(const char *msg, const std::string &path) {
+    std::ostringstream strm;
+    strm << msg;
+    if (!path.empty()) {
+      strm << " \"" << path << '"';
+    }
+    strm << ": " << std::strerror(errno);
+    throw std::runtime_error(strm.str());
+  }
+
+  /* Watch the given directory and every directory beneath it, appending the
+     files we find to paths. */
+  void watch_tree(const std::string &dir, std::vector<std::string> &paths) {
+    int wd = inotify_add_watch(
+        fd, dir.c_str(),
+        IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_ONLYDIR);
+    if (wd < 0) {
+      return;
+    }
+    dirs[wd] = dir;
+    DIR *handle = opendir(dir.c_str());
+    if (!handle) {
+      return;
+    }
+    std::vector<std::string> names;
+    while (dirent *entry = readdir(handle)) {
+      if (entry->d_name[0] != '.') {
+        names.push_back(entry->d_name);
+      }
+    }
+    closedir(handle);
+    for (const auto &name: names) {
+      std::string path = dir + '/' + name;
+      struct stat info;
+      if (stat(path.c_str(), &info) != 0) {
+        continue;
+      }
+      if (S_ISDIR(info.st_mode)) {
+        watch_tree(path, paths);
+      } else if (S_ISREG(info.st_mode)) {
+        paths.push_back(std::move(path));
+      }
+    }
+  }
+
+  /* Handle a single event. */
+  void on_event(const inotify_event &event, std::vector<std::string> &paths) {
+    if (event.mask & IN_Q_OVERFLOW) {
+      overflowed = true;
+      return;
+    }
+    if (event.mask & IN_IGNORED) {
+      dirs.erase(event.wd);
+      return;
+    }
+    auto iter = dirs.find(event.wd);
+    if (iter == dirs.end() || !event.len || event.name[0] == '.') {
+      return;
+    }
+    std::string path = iter->second + '/' + event.name;
+    if (event.mask & IN_ISDIR) {
+      if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+        watch_tree(path, paths);
+      } else if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+        paths.push_back(std::move(path));
+      }
+      return;
+    }
+    paths.push_back(std::move(path));
+  }
+
+  /* Our inotify instance. */
+  int fd;
+
+  /* The directories we're watching, by watch descriptor. */
+  std::map<int, std::string> dirs;
+
+  /* See check_overflow(). */
+  bool overflowed;
+
+};  // watcher_t
+
+}  // qmellow